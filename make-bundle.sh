@@ -73,7 +73,7 @@ copyDeps() {
 }
 
 # Check for requiremnets.
-for CMD in zip unzip xz gpg; do
+for CMD in xz gpg; do
   if ! which "$CMD" > /dev/null; then
     echo "Please install $CMD" >&2
     fail ${LINENO}
@@ -156,7 +156,7 @@ fi
 # Extract bin/mongo and bin/mongod from the old sandstorm bundle, and place them in bundle/.
 tar xf $OLD_BUNDLE_PATH --transform=s/^${OLD_BUNDLE_BASE}/bundle/ $OLD_MONGO_FILES
 
-cp $(which zip unzip xz gpg) bundle/bin
+cp $(which xz gpg) bundle/bin
 
 # Older installs might be symlinking /usr/local/bin/spk to
 # /opt/sandstorm/latest/bin/spk, while newer installs link it to
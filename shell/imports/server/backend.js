@@ -54,6 +54,35 @@ class SandstormBackend {
     return this._backendCap;
   }
 
+  sendGrainOwners() {
+    // Tells the backend who owns every grain, so that it can attribute storage to users. Until it
+    // has heard about all of them, getUserStorageUsage() is unimplemented, and we sum the grain
+    // sizes in our own database instead. Must be run in a Meteor context.
+
+    const BATCH_SIZE = 1000;
+    let batch = [];
+    const send = (isLast) => {
+      waitPromise(this._backendCap.setGrainOwners(batch, isLast));
+      batch = [];
+    };
+
+    try {
+      Grains.find({}, { fields: { userId: 1 } }).forEach((grain) => {
+        batch.push({ grainId: grain._id, ownerId: grain.userId });
+        if (batch.length >= BATCH_SIZE) {
+          send(false);
+        }
+      });
+
+      send(true);
+      storageUsageUnimplemented = false;
+    } catch (err) {
+      if (err.kjType !== "unimplemented") {
+        console.error("error sending grain owners to backend:", err.stack);
+      }
+    }
+  }
+
   deleteUser(userId) {
     return waitPromise(this._backendCap.deleteUser(userId));
   }
@@ -85,31 +114,35 @@ class SandstormBackend {
     });
   }
 
-  maybeRetryUseGrain(grainId, cb, retryCount, err) {
+  maybeRetryUseGrain(grainId, cb, background, retryCount, err) {
     if (shouldRestartGrain(err, retryCount)) {
       return inMeteor(() => {
-        return cb(this.continueGrain(grainId).supervisor)
-            .catch(this.maybeRetryUseGrain.bind(this, grainId, cb, retryCount + 1));
+        return cb(this.continueGrain(grainId, background).supervisor)
+            .catch(this.maybeRetryUseGrain.bind(this, grainId, cb, background, retryCount + 1));
       });
     } else {
       throw err;
     }
   }
 
-  useGrain(grainId, cb) {
+  useGrain(grainId, cb, background) {
     // This will open a grain for you, handling restarts if needed, and call the passed function with
     // the supervisor capability as the only parameter. The callback must return a promise that used
     // the supervisor, so that we can check if a disconnect error occurred, and retry if possible.
-    // This function returns the same promise that your callback returns.
+    // This function returns the same promise that your callback returns. Pass `background` as true
+    // only if no user is waiting on the result; see continueGrain().
     //
     // This function is NOT expected to be run in a meteor context.
     return inMeteor(() => {
-      return cb(this.continueGrain(grainId).supervisor)
-        .catch(this.maybeRetryUseGrain.bind(this, grainId, cb, 0));
+      return cb(this.continueGrain(grainId, background).supervisor)
+        .catch(this.maybeRetryUseGrain.bind(this, grainId, cb, background, 0));
     });
   }
 
-  continueGrain(grainId) {
+  continueGrain(grainId, background) {
+    // Starts the grain if it isn't running. `background` should be true if no user is waiting on
+    // it, so that it yields to grains that users are opening.
+
     const grain = Grains.findOne(grainId);
     if (!grain) {
       throw new Meteor.Error(404, "Grain Not Found", "Grain ID: " + grainId);
@@ -142,12 +175,13 @@ class SandstormBackend {
     }
 
     const result = this.startGrainInternal(
-        packageId, grainId, grain.userId, manifest.continueCommand, false, isDev, mountProc);
+        packageId, grainId, grain.userId, manifest.continueCommand, false, isDev, mountProc,
+        background);
     result.packageSalt = isDev ? pkg._id : grain.packageSalt;
     return result;
   }
 
-  startGrainInternal(packageId, grainId, ownerId, command, isNew, isDev, mountProc) {
+  startGrainInternal(packageId, grainId, ownerId, command, isNew, isDev, mountProc, background) {
     // Starts the grain supervisor.  Must be executed in a Meteor context.  Blocks until grain is
     // started. Returns a promise for an object containing two fields: `owner` (the ID of the owning
     // user) and `supervisor` (the supervisor capability).
@@ -176,7 +210,8 @@ class SandstormBackend {
       delete command.executablePath;
     }
 
-    return this._backendCap.startGrain(ownerId, grainId, packageId, command, isNew, isDev, mountProc);
+    return this._backendCap.startGrain(ownerId, grainId, packageId, command, isNew, isDev, mountProc,
+                                       !!background);
   }
 
   updateLastActive(grainId, userId, identityId) {
@@ -50,20 +50,20 @@ Meteor.methods({
       throw new Meteor.Error(403, "Unauthorized", "User is not the owner of this grain");
     }
 
-    this.unblock();
-
+    // The backup itself is made when the token is downloaded, streaming straight to the client,
+    // so that we never have to store it. We remember who asked, since the grain may change hands
+    // before then.
     const token = {
       _id: Random.id(),
       timestamp: new Date(),
       name: grain.title,
+      grainId: grainId,
+      userId: this.userId,
     };
 
     // TODO(soon): does the grain need to be offline?
 
-    const grainInfo = _.pick(grain, "appId", "appVersion", "title");
-
     FileTokens.insert(token);
-    waitPromise(globalBackend.cap().backupGrain(token._id, this.userId, grainId, grainInfo));
 
     return token._id;
   },
@@ -225,7 +225,43 @@ Router.map(function () {
         },
       };
 
-      waitPromise(globalBackend.cap().downloadBackup(this.params.tokenId, stream));
+      if (token.grainId) {
+        // Each download makes a whole new backup, so the token is good for one download only.
+        // Claim it before starting, so that repeated or concurrent requests get nothing.
+        if (FileTokens.remove({ _id: token._id }) === 0) {
+          response.writeHead(404, { "Content-Type": "text/plain" });
+          return response.end("File does not exist");
+        }
+
+        const grain = Grains.findOne(token.grainId);
+        if (!grain) {
+          response.writeHead(404, { "Content-Type": "text/plain" });
+          return response.end("Grain does not exist");
+        }
+
+        if (!token.userId || grain.userId !== token.userId) {
+          // The grain has been transferred since the token was made.
+          response.writeHead(403, { "Content-Type": "text/plain" });
+          return response.end("User is not the owner of this grain");
+        }
+
+        const grainInfo = _.pick(grain, "appId", "appVersion", "title");
+        try {
+          waitPromise(globalBackend.cap().backupGrainToStream(
+              grain.userId, grain._id, grainInfo, stream));
+        } catch (err) {
+          if (!started) throw err;
+
+          // We've already sent part of the zip, so the only way left to tell the client that it's
+          // broken is to cut the connection.
+          console.error("backup failed partway through download:", err.stack);
+          response.destroy();
+          cleanupToken(this.params.tokenId);
+          return;
+        }
+      } else {
+        waitPromise(globalBackend.cap().downloadBackup(this.params.tokenId, stream));
+      }
 
       if (!sawEnd) {
         console.error("backend failed to call done() when downloading backup");
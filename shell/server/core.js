@@ -592,7 +592,7 @@ function dropInternal(db, sturdyRef, ownerPattern) {
   } else if (token.objectId) {
     waitPromise(globalBackend.useGrain(token.grainId, (supervisor) => {
       return supervisor.drop(token.objectId);
-    }));
+    }, true));
 
     db.removeApiTokens({ _id: hashedSturdyRef });
   } else {
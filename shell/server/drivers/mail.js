@@ -138,7 +138,7 @@ Meteor.startup(function () {
                 const grain = Grains.findOne({ publicId: publicId }, { fields: {} });
                 if (grain) {
                   grainId = grain._id;
-                  return globalBackend.continueGrain(grainId, retryCount > 0);
+                  return globalBackend.continueGrain(grainId, true);
                 } else {
                   // TODO(someday): We really ought to rig things up so that the 'RCPT TO' SMTP command
                   // fails in this case, by adding an onRcptTo() callback.
@@ -188,6 +188,7 @@ globalBackend = new SandstormBackend(globalDb, sandstormBackend);
 Meteor.onConnection((connection) => {
   connection.sandstormBackend = globalBackend;
 });
+Meteor.startup(() => { globalBackend.sendGrainOwners(); });
 
 // We've observed a problem in production where occasionally the front-end stops talking to the
 // back-end. It happens very rarely -- like once a month -- and we've been unable to reproduce it
@@ -207,6 +208,7 @@ Meteor.setInterval(() => {
     sandstormBackendConnection = Capnp.connect(backendAddress, sandstormCoreFactory);
     sandstormBackend = sandstormBackendConnection.restore(null, Backend);
     globalBackend._backendCap = sandstormBackend;
+    globalBackend.sendGrainOwners();
   }
 
   const debugLog = !backendHealthy;
@@ -1642,7 +1644,7 @@ class Proxy {
     if (shouldRestartGrain(error, retryCount)) {
       this.resetConnection();
       return inMeteor(() => {
-        this.supervisor = globalBackend.continueGrain(this.grainId).supervisor;
+        this.supervisor = globalBackend.continueGrain(this.grainId, this.isApi).supervisor;
       });
     } else {
       throw error;
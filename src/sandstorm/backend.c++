@@ -18,40 +18,120 @@
 #include <kj/debug.h>
 #include "util.h"
 #include "spk.h"
+#include "copy-tree.h"
+#include "package-store.h"
 #include <capnp/serialize.h>
 #include <capnp/serialize-async.h>
+#include <capnp/schema.h>
 #include <stdio.h>  // rename()
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
 
 namespace sandstorm {
 
+static constexpr const char INCREMENTAL_BACKUP_DIR[] = "/var/sandstorm/incremental-backups";
+// The store of incremental backups; see chunk-store.h.
+
+static constexpr const char PACKAGE_STORE_DIR[] = "/var/sandstorm/package-store";
+// Content-addressed store of files shared between installed packages; see package-store.h.
+
+static constexpr uint BLOCKING_THREADS = 4;
+// Size of the backend's thread pool. Bulk jobs never take the last thread, so one is always free
+// for quick jobs.
+
+static constexpr uint CLONE_THREADS = 3;
+// Pool threads used to copy one grain in cloneGrain(), when idle.
+
 static kj::StringPtr validateId(kj::StringPtr id) {
   KJ_REQUIRE(id.size() >= 8 && !id.startsWith(".") && id.findFirst('/') == nullptr, id);
   return id;
 }
 
-static void tryRecursivelyDelete(kj::StringPtr path) {
-  KJ_REQUIRE(!path.endsWith("/"),
-      "refusing to recursively delete directory name with trailing / to reduce risk of "
-      "catastrophic empty-string bugs");
-  static uint counter = 0;
-  auto tmpPath = kj::str("/var/sandstorm/tmp/deleting.", time(nullptr), ".", counter++);
+static kj::Promise<void> onSuccess(kj::UnixEventPort& eventPort, Subprocess&& process) {
+  auto heap = kj::heap<Subprocess>(kj::mv(process));
+  auto promise = heap->onSuccess(eventPort);
+  return promise.attach(kj::mv(heap));
+}
 
-  while (rename(path.cStr(), tmpPath.cStr()) < 0) {
+static bool unlinkIfExists(kj::StringPtr path) {
+  // Returns false if the file didn't exist.
+
+  while (unlink(path.cStr()) < 0) {
     int error = errno;
     if (error == ENOENT) {
-      return;
+      return false;
     } else if (error != EINTR) {
-      KJ_FAIL_SYSCALL("rename(path, tmpPath)", error, path, tmpPath);
+      KJ_FAIL_SYSCALL("unlink", error, path);
     }
   }
+  return true;
+}
+
+struct PackageInfo {
+  kj::String appId;
+  kj::Own<capnp::MessageReader> manifest;  // root is spk::Manifest
+  kj::Maybe<kj::String> authorPgpKeyFingerprint;
+};
+
+static kj::Maybe<kj::Own<PackageInfo>> readPackage(kj::StringPtr path,
+                                                   kj::Maybe<uid_t> sandboxUid) {
+  // Reads an installed package's manifest and app ID, and checks its signature. Returns null if
+  // the package isn't installed. This blocks (checking the signature runs gpg), so call it on the
+  // thread pool.
+
+  KJ_IF_MAYBE(file, raiiOpenIfExists(kj::str(path, "/sandstorm-manifest"), O_RDONLY)) {
+    auto info = kj::heap<PackageInfo>();
+    capnp::ReaderOptions manifestLimits;
+    manifestLimits.traversalLimitInWords = spk::Manifest::SIZE_LIMIT_IN_WORDS;
+    info->manifest = kj::heap<capnp::StreamFdMessageReader>(kj::mv(*file), manifestLimits);
+    info->appId = trim(sandstorm::readAll(kj::str(path, ".appid")));
+    info->authorPgpKeyFingerprint = checkPgpSignature(
+        info->appId, info->manifest->getRoot<spk::Manifest>().getMetadata(), sandboxUid);
+    return kj::mv(info);
+  } else {
+    return nullptr;
+  }
+}
 
-  recursivelyDelete(tmpPath);
+template <typename Context>
+static void returnPackage(Context& context, PackageInfo& info) {
+  auto manifest = info.manifest->getRoot<spk::Manifest>();
+  capnp::MessageSize sizeHint = manifest.totalSize();
+  sizeHint.wordCount += 8 + info.appId.size() / sizeof(capnp::word);
+  auto results = context.getResults(sizeHint);
+  results.setAppId(info.appId);
+  results.setManifest(manifest);
+  KJ_IF_MAYBE(fp, info.authorPgpKeyFingerprint) {
+    results.setAuthorPgpKeyFingerprint(*fp);
+  }
 }
 
-BackendImpl::BackendImpl(kj::LowLevelAsyncIoProvider& ioProvider, kj::Network& network,
-  SandstormCoreFactory::Client&& sandstormCoreFactory, kj::Maybe<uid_t> sandboxUid)
-    : ioProvider(ioProvider), network(network), coreFactory(kj::mv(sandstormCoreFactory)),
-      sandboxUid(sandboxUid), tasks(*this) {}
+BackendImpl::BackendImpl(kj::LowLevelAsyncIoProvider& ioProvider, kj::UnixEventPort& eventPort,
+  kj::Network& network, kj::Timer& timer, SandstormCoreFactory::Client&& sandstormCoreFactory,
+  kj::Maybe<uid_t> sandboxUid, uint supervisorPoolSize, uint maxConcurrentStarts)
+    : ioProvider(ioProvider), eventPort(eventPort), network(network), timer(timer),
+      coreFactory(kj::mv(sandstormCoreFactory)), sandboxUid(sandboxUid),
+      blockingPool(ioProvider, BLOCKING_THREADS),
+      reaper(blockingPool, timer, "/var/sandstorm/tmp"),
+      usageIndex(blockingPool, timer, "/var/sandstorm/grains", "/var/sandstorm/grain-usage"),
+      chunkCollector(blockingPool, timer, INCREMENTAL_BACKUP_DIR),
+      tasks(*this), supervisorPoolSize(supervisorPoolSize),
+      maxConcurrentStarts(maxConcurrentStarts) {
+  if (supervisorPoolSize > 0) {
+    tasks.add(kj::evalLater([this]() { refillSupervisorPool(); }));
+  }
+  if (access(INCREMENTAL_BACKUP_DIR, F_OK) == 0) {
+    // Clean up after any incremental backups that were interrupted by a restart.
+    chunkCollector.collectSoon();
+  }
+  if (access(PACKAGE_STORE_DIR, F_OK) == 0) {
+    // A collection scheduled by deletePackage() doesn't survive a restart, and the reaper picks
+    // up any deletions the restart interrupted.
+    collectPackageGarbageLater();
+  }
+  tasks.add(logSupervisorStats());
+}
 
 void BackendImpl::taskFailed(kj::Exception&& exception) {
   KJ_LOG(ERROR, exception);
@@ -60,22 +140,29 @@ void BackendImpl::taskFailed(kj::Exception&& exception) {
 // =======================================================================================
 
 kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
-    kj::StringPtr grainId, kj::StringPtr packageId,
+    kj::StringPtr ownerId, kj::StringPtr grainId, kj::StringPtr packageId,
     spk::Manifest::Command::Reader command, bool isNew, bool devMode, bool mountProc,
-    bool isRetry) {
+    bool background, bool isRetry) {
   auto iter = supervisors.find(grainId);
   if (iter != supervisors.end()) {
     KJ_REQUIRE(!isNew, "new grain matched existing grainId");
 
+    if (!background) {
+      // If the grain is still waiting for its turn to start, someone is waiting on it now.
+      for (auto& start: startQueue) {
+        if (start.grainId == grainId) {
+          start.background = false;
+        }
+      }
+    }
+
     // Supervisor for this grain is already running. Join that.
     return iter->second.promise.addBranch()
         .then([=](Supervisor::Client&& client) mutable {
       // We should send a keepAlive() to make sure the supervisor is still up. We should also
       // send a new SandstormCore capability in case the front-end has restarted.
-      auto coreReq = coreFactory.getSandstormCoreRequest();
-      coreReq.setGrainId(grainId);
       auto keepAliveReq = client.keepAliveRequest();
-      keepAliveReq.setCore(coreReq.send().getCore());
+      keepAliveReq.setCore(newSandstormCore(grainId));
       auto promise = keepAliveReq.send();
       return promise.then([KJ_MVCAP(client)](auto) mutable -> kj::Promise<Supervisor::Client> {
         // Success.
@@ -88,7 +175,8 @@ kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
           // re-run.
           KJ_ASSERT(!isRetry, "retry supervisor startup logic failed");
           return kj::evalLater([=]() mutable {
-            return bootGrain(grainId, packageId, command, isNew, devMode, mountProc, true);
+            return bootGrain(ownerId, grainId, packageId, command, isNew, devMode, mountProc,
+                             background, true);
           });
         } else {
           return kj::mv(exception);
@@ -97,17 +185,20 @@ kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
     });
   }
 
-  // Grain is not currently running, so let's start it.
-  kj::Own<kj::AsyncInputStream> stdoutPipe;
-  kj::Vector<kj::String> argv;
-
-  argv.add(kj::heapString("supervisor"));
-
-  KJ_IF_MAYBE(u, sandboxUid) {
-    argv.add(kj::heapString("--uid"));
-    argv.add(kj::str(*u));
+  auto cloning = cloningGrains.find(grainId);
+  if (cloning != cloningGrains.end()) {
+    // Wait for cloneGrain() to finish copying the grain's files.
+    return cloning->second.done.addBranch().then([=]() mutable {
+      return bootGrain(ownerId, grainId, packageId, command, isNew, devMode, mountProc,
+                       background, isRetry);
+    });
   }
 
+  // Grain is not currently running, so let's start it. `command` belongs to the request, which
+  // might be canceled while we wait for a slot, so build the arguments now.
+  usageIndex.grainStarted(grainId, ownerId);
+  kj::Vector<kj::String> argv;
+
   if (isNew) {
     argv.add(kj::heapString("-n"));
   }
@@ -136,62 +227,273 @@ kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
     argv.add(kj::heapString(arg));
   }
 
-  Subprocess::Options options(KJ_MAP(a, argv) -> const kj::StringPtr { return a; });
-  options.executable = "/sandstorm";
+  auto finalPromise = waitForStartSlot(grainId, background)
+      .then([this,KJ_MVCAP(argv),devMode,grainId = kj::heapString(grainId)]
+            (kj::Own<StartSlot>&& slot) mutable {
+    return launchSupervisor(kj::mv(grainId), argv.releaseAsArray(), devMode)
+        .attach(kj::mv(slot));
+  }).fork();
 
-  if (sandboxUid != nullptr) {
-    // Supervisor must run as root since user namespaces are not available.
-    options.uid = uid_t(0);
+  // Add the promise to our map.
+  StartingGrain startingGrain = {
+    kj::heapString(grainId),
+    kj::mv(finalPromise)
+  };
+  kj::StringPtr grainIdPtr = startingGrain.grainId;
+  auto result = startingGrain.promise.addBranch();
+  KJ_ASSERT(supervisors.insert(std::make_pair(grainIdPtr, kj::mv(startingGrain))).second);
+
+  return result;
+}
+
+kj::Promise<Supervisor::Client> BackendImpl::launchSupervisor(
+    kj::String grainId, kj::Array<kj::String> argv, bool devMode) {
+  auto startTime = timer.now();
+  auto args = KJ_MAP(a, argv) -> const kj::StringPtr { return a; };
+
+  // Use a pre-started supervisor if we have one. Dev mode changes the sandbox setup that those
+  // have already done, so it always starts from scratch.
+  kj::Maybe<SupervisorProcess> pooled;
+  if (!devMode) {
+    pooled = takePooledSupervisor(args);
+    if (pooled == nullptr && supervisorPoolSize > 0) ++poolMisses;
   }
+  bool isPooled = pooled != nullptr;
 
-  int pipefds[2];
-  KJ_SYSCALL(pipe2(pipefds, O_CLOEXEC));
-  kj::AutoCloseFd stdoutOut(pipefds[1]);
-  stdoutPipe = ioProvider.wrapInputFd(pipefds[0],
-      kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
-      kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
-  options.stdout = stdoutOut;
-  Subprocess process(kj::mv(options));
+  SupervisorProcess supervisor = isPooled ? kj::mv(KJ_ASSERT_NONNULL(pooled))
+                                          : startSupervisor("supervisor", args, false);
+  auto stdoutPipe = kj::mv(supervisor.stdout);
+  auto process = kj::mv(supervisor.process);
 
   // Wait until supervisor prints something on stdout, indicating that it is ready.
   static byte dummy[256];
-  auto promise = stdoutPipe->read(dummy, 1, sizeof(dummy));
+  auto promise = stdoutPipe->read(dummy, 1, sizeof(dummy))
+      .then([this,isPooled,startTime](size_t n) {
+    (isPooled ? pooledStarts : coldStarts).add(timer.now() - startTime);
+    statsChanged = true;
+    return n;
+  });
 
   // Meanwhile parse the socket address.
   auto addressPromise =
       network.parseAddress(kj::str("unix:/var/sandstorm/grains/", grainId, "/socket"));
 
   // When both of those are done, connect to the address.
-  auto finalPromise = promise
+  return promise
       .then([this,KJ_MVCAP(addressPromise)](size_t n) mutable {
     return kj::mv(addressPromise);
   }).then([](kj::Own<kj::NetworkAddress>&& address) {
     return address->connect();
-  }).then([this,KJ_MVCAP(stdoutPipe),KJ_MVCAP(process),grainId = kj::heapString(grainId)]
+  }).then([this,KJ_MVCAP(stdoutPipe),KJ_MVCAP(process),KJ_MVCAP(grainId)]
           (kj::Own<kj::AsyncIoStream>&& connection) mutable {
     // Connected. Create the RunningGrain and fulfill promises.
     auto ignorePromise = ignoreAll(*stdoutPipe);
     tasks.add(ignorePromise.attach(kj::mv(stdoutPipe)));
 
-    auto coreRequest = coreFactory.getSandstormCoreRequest();
-    coreRequest.setGrainId(grainId);
-    auto core = coreRequest.send().getCore();
+    auto core = newSandstormCore(grainId);
     auto grain = kj::heap<RunningGrain>(*this, kj::mv(grainId), kj::mv(connection), kj::mv(core));
     auto client = grain->getSupervisor();
     tasks.add(grain->onDisconnect().attach(kj::mv(grain), kj::mv(process)));
     return client;
-  }).fork();
+  });
+}
 
-  // Add the promise to our map.
-  StartingGrain startingGrain = {
-    kj::heapString(grainId),
-    kj::mv(finalPromise)
-  };
-  kj::StringPtr grainIdPtr = startingGrain.grainId;
-  auto result = startingGrain.promise.addBranch();
-  KJ_ASSERT(supervisors.insert(std::make_pair(grainIdPtr, kj::mv(startingGrain))).second);
+kj::Promise<kj::Own<BackendImpl::StartSlot>> BackendImpl::waitForStartSlot(
+    kj::StringPtr grainId, bool background) {
+  // Starting a grain sets up a sandbox and launches the app, which is heavy on both CPU and disk.
+  // After a restart, or when lots of users show up at once, starting everything at once would
+  // make every grain slow, so we only start a few at a time.
 
-  return result;
+  startQueueDepth.add(startQueue.size());
+  statsChanged = true;
+
+  if (maxConcurrentStarts == 0 || startsInProgress < maxConcurrentStarts) {
+    // If there's a free slot, nothing is queued.
+    ++startsInProgress;
+    return kj::heap<StartSlot>(*this);
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<kj::Own<StartSlot>>();
+  startQueue.push_back({ kj::heapString(grainId), background, timer.now(),
+                         kj::mv(paf.fulfiller) });
+  return kj::mv(paf.promise);
+}
+
+void BackendImpl::admitQueuedStarts() {
+  while (maxConcurrentStarts == 0 || startsInProgress < maxConcurrentStarts) {
+    auto iter = std::find_if(startQueue.begin(), startQueue.end(),
+        [](const QueuedStart& start) { return !start.background; });
+    if (iter == startQueue.end()) {
+      iter = startQueue.begin();
+      if (iter == startQueue.end()) return;
+    }
+
+    QueuedStart start = kj::mv(*iter);
+    startQueue.erase(iter);
+
+    // Skip starts whose promises were dropped.
+    if (start.fulfiller->isWaiting()) {
+      startWaits.add(timer.now() - start.queuedTime);
+      ++startsInProgress;
+      start.fulfiller->fulfill(kj::heap<StartSlot>(*this));
+    }
+  }
+}
+
+BackendImpl::StartSlot::~StartSlot() noexcept(false) {
+  --backend.startsInProgress;
+  backend.admitQueuedStarts();
+}
+
+BackendImpl::SupervisorProcess BackendImpl::startSupervisor(
+    kj::StringPtr programName, kj::ArrayPtr<const kj::StringPtr> args, bool pooled) {
+  // Starts `/sandstorm <programName> [--uid <uid>] <args>`. If `pooled`, the supervisor's stdin
+  // is a pipe on which it will be sent its assignment.
+
+  kj::Vector<kj::StringPtr> argv;
+  argv.add(programName);
+
+  kj::String uidStr;
+  KJ_IF_MAYBE(u, sandboxUid) {
+    uidStr = kj::str(*u);
+    argv.add("--uid");
+    argv.add(uidStr);
+  }
+
+  argv.addAll(args);
+
+  Subprocess::Options options(argv.asPtr());
+  options.executable = "/sandstorm";
+
+  if (sandboxUid != nullptr) {
+    // Supervisor must run as root since user namespaces are not available.
+    options.uid = uid_t(0);
+  }
+
+  int pipefds[2];
+  KJ_SYSCALL(pipe2(pipefds, O_CLOEXEC));
+  kj::AutoCloseFd stdoutOut(pipefds[1]);
+  auto stdoutPipe = ioProvider.wrapInputFd(pipefds[0],
+      kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+      kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
+  options.stdout = stdoutOut;
+
+  kj::AutoCloseFd stdinIn;
+  kj::AutoCloseFd assignmentPipe;
+  if (pooled) {
+    // The write end is non-blocking so that a wedged supervisor can't block the backend. The
+    // assignment is far smaller than a pipe buffer, so it never needs to wait anyway.
+    KJ_SYSCALL(pipe2(pipefds, O_CLOEXEC));
+    stdinIn = kj::AutoCloseFd(pipefds[0]);
+    assignmentPipe = kj::AutoCloseFd(pipefds[1]);
+    KJ_SYSCALL(fcntl(assignmentPipe, F_SETFL, O_NONBLOCK));
+    options.stdin = stdinIn;
+  }
+
+  return { Subprocess(kj::mv(options)), kj::mv(stdoutPipe), kj::mv(assignmentPipe) };
+}
+
+kj::Maybe<BackendImpl::SupervisorProcess> BackendImpl::takePooledSupervisor(
+    kj::ArrayPtr<const kj::StringPtr> args) {
+  // Hands `args` to a pre-started supervisor and returns it, or returns null if none is
+  // available.
+
+  kj::Vector<char> assignment;
+  for (auto arg: args) {
+    assignment.addAll(arg.begin(), arg.end() + 1);  // including NUL terminator
+  }
+
+  if (supervisorPool.size() > 0) {
+    // Start replacements once this grain is on its way.
+    tasks.add(kj::evalLater([this]() { refillSupervisorPool(); }));
+  }
+
+  while (supervisorPool.size() > 0) {
+    SupervisorProcess supervisor = kj::mv(supervisorPool.back());
+    supervisorPool.removeLast();
+
+    // A supervisor that died while waiting has closed its end of the pipe, so the write fails
+    // with EPIPE. (SIGPIPE is ignored by the event loop.)
+    ssize_t n = write(supervisor.assignmentPipe, assignment.begin(), assignment.size());
+    if (n == assignment.size()) {
+      // Closing the pipe tells the supervisor the assignment is complete.
+      supervisor.assignmentPipe = nullptr;
+      return kj::mv(supervisor);
+    } else if (n < 0 && errno != EPIPE && errno != EAGAIN) {
+      KJ_LOG(ERROR, "couldn't send assignment to pre-started supervisor", strerror(errno));
+    }
+
+    // Otherwise try the next one. The Subprocess destructor kills this one.
+  }
+
+  return nullptr;
+}
+
+void BackendImpl::refillSupervisorPool() {
+  while (supervisorPool.size() < supervisorPoolSize) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      supervisorPool.add(startSupervisor("supervisor-pool", nullptr, true));
+    })) {
+      // Grains will just start the slow way.
+      KJ_LOG(ERROR, "couldn't pre-start supervisor", *exception);
+      return;
+    }
+  }
+}
+
+void BackendImpl::Histogram::add(uint64_t value) {
+  uint i = 0;
+  while (value > 0 && i < HISTOGRAM_BUCKETS - 1) {
+    value >>= 1;
+    ++i;
+  }
+  ++buckets[i];
+}
+
+kj::String BackendImpl::Histogram::toString(kj::StringPtr unit) const {
+  kj::Vector<kj::String> parts;
+  for (uint i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (buckets[i] == 0) continue;
+    if (i == HISTOGRAM_BUCKETS - 1) {
+      parts.add(kj::str(">=", uint64_t(1) << (i - 1), unit, ": ", buckets[i]));
+    } else {
+      parts.add(kj::str("<", uint64_t(1) << i, unit, ": ", buckets[i]));
+    }
+  }
+  return kj::strArray(parts, ", ");
+}
+
+void BackendImpl::SupervisorStartStats::add(kj::Duration time) {
+  ++count;
+  totalTime += time;
+  maxTime = kj::max(maxTime, time);
+  histogram.add(time / kj::MILLISECONDS);
+}
+
+kj::Promise<void> BackendImpl::logSupervisorStats() {
+  return timer.afterDelay(1 * kj::HOURS).then([this]() {
+    if (statsChanged) {
+      statsChanged = false;
+
+      auto summarize = [](const SupervisorStartStats& stats) {
+        if (stats.count == 0) return kj::str("none");
+        return kj::str(stats.count, " starts, ", stats.totalTime / stats.count / kj::MILLISECONDS,
+                       "ms average, ", stats.maxTime / kj::MILLISECONDS, "ms max (",
+                       stats.histogram.toString("ms"), ")");
+      };
+
+      uint eligible = pooledStarts.count + poolMisses;
+      KJ_LOG(INFO, "supervisor startup since launch",
+          kj::str("pool size ", supervisorPoolSize,
+                  "; hit rate ", eligible == 0 ? 0 : pooledStarts.count * 100 / eligible, "%"),
+          kj::str("pre-started: ", summarize(pooledStarts)),
+          kj::str("cold: ", summarize(coldStarts)),
+          kj::str("max concurrent: ", maxConcurrentStarts,
+                  "; waited for a slot: ", summarize(startWaits)),
+          kj::str("queue depth: ", startQueueDepth.toString("")));
+    }
+    return logSupervisorStats();
+  });
 }
 
 kj::Promise<void> BackendImpl::ignoreAll(kj::AsyncInputStream& input) {
@@ -228,18 +530,59 @@ BackendImpl::RunningGrain::RunningGrain(
       stream(kj::mv(stream)), client(*this->stream, kj::mv(core)) {}
 
 BackendImpl::RunningGrain::~RunningGrain() noexcept(false) {
+  backend.usageIndex.grainStopped(grainId);
   backend.supervisors.erase(grainId);
 }
 
+class BackendImpl::SizeReportingCore final: public capnp::Capability::Server {
+  // A SandstormCore which forwards all calls to the one from the front-end, noting the sizes
+  // reported by the grain's supervisor along the way.
+
+public:
+  SizeReportingCore(GrainUsageIndex& usageIndex, kj::String grainId, SandstormCore::Client core)
+      : usageIndex(usageIndex), grainId(kj::mv(grainId)), core(kj::mv(core)),
+        reportGrainSizeOrdinal(capnp::Schema::from<SandstormCore>()
+            .getMethodByName("reportGrainSize").getOrdinal()) {}
+
+  kj::Promise<void> dispatchCall(
+      uint64_t interfaceId, uint16_t methodId,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
+    capnp::AnyPointer::Reader params = context.getParams();
+    if (interfaceId == capnp::typeId<SandstormCore>() && methodId == reportGrainSizeOrdinal) {
+      usageIndex.reportSize(grainId,
+          params.getAs<SandstormCore::ReportGrainSizeParams>().getBytes());
+    }
+
+    auto req = core.typelessRequest(interfaceId, methodId, params.targetSize());
+    req.set(params);
+    return context.tailCall(kj::mv(req));
+  }
+
+private:
+  GrainUsageIndex& usageIndex;
+  kj::String grainId;
+  capnp::Capability::Client core;
+  uint16_t reportGrainSizeOrdinal;
+};
+
+SandstormCore::Client BackendImpl::newSandstormCore(kj::StringPtr grainId) {
+  auto coreReq = coreFactory.getSandstormCoreRequest();
+  coreReq.setGrainId(grainId);
+  return capnp::Capability::Client(kj::heap<SizeReportingCore>(
+      usageIndex, kj::heapString(grainId), coreReq.send().getCore()))
+      .castAs<SandstormCore>();
+}
+
 kj::Promise<void> BackendImpl::ping(PingContext context) {
   return kj::READY_NOW;
 }
 
 kj::Promise<void> BackendImpl::startGrain(StartGrainContext context) {
   auto params = context.getParams();
-  return bootGrain(validateId(params.getGrainId()),
+  return bootGrain(params.getOwnerId(), validateId(params.getGrainId()),
                    validateId(params.getPackageId()), params.getCommand(),
-                   params.getIsNew(), params.getDevMode(), params.getMountProc(), false)
+                   params.getIsNew(), params.getDevMode(), params.getMountProc(),
+                   params.getBackground(), false)
       .then([context](Supervisor::Client client) mutable {
     context.getResults().setSupervisor(kj::mv(client));
   });
@@ -249,14 +592,13 @@ kj::Promise<void> BackendImpl::getGrain(GetGrainContext context) {
   auto grainId = context.getParams().getGrainId();
   auto iter = supervisors.find(validateId(grainId));
   if (iter != supervisors.end()) {
+    usageIndex.setOwner(grainId, context.getParams().getOwnerId());
     return iter->second.promise.addBranch()
         .then([this,context,grainId](Supervisor::Client client) mutable {
       // We should send a keepAlive() to make sure the supervisor is still up. We should also
       // send a new SandstormCore capability in case the front-end has restarted.
-      auto coreReq = coreFactory.getSandstormCoreRequest();
-      coreReq.setGrainId(grainId);
       auto keepAliveReq = client.keepAliveRequest();
-      keepAliveReq.setCore(coreReq.send().getCore());
+      keepAliveReq.setCore(newSandstormCore(grainId));
       return keepAliveReq.send()
           .then([context,KJ_MVCAP(client)](auto&&) mutable -> kj::Promise<void> {
         context.getResults().setSupervisor(kj::mv(client));
@@ -277,6 +619,15 @@ kj::Promise<void> BackendImpl::getGrain(GetGrainContext context) {
 
 kj::Promise<void> BackendImpl::deleteGrain(DeleteGrainContext context) {
   auto grainId = validateId(context.getParams().getGrainId());
+
+  auto cloning = cloningGrains.find(grainId);
+  if (cloning != cloningGrains.end()) {
+    // Don't pull the files out from under the copy.
+    return cloning->second.done.addBranch().then([this,context]() mutable {
+      return deleteGrain(context);
+    });
+  }
+
   auto iter = supervisors.find(grainId);
   kj::Promise<void> shutdownPromise = nullptr;
   if (iter != supervisors.end()) {
@@ -296,18 +647,87 @@ kj::Promise<void> BackendImpl::deleteGrain(DeleteGrainContext context) {
     shutdownPromise = kj::READY_NOW;
   }
 
-  return shutdownPromise.then([grainId]() {
-    tryRecursivelyDelete(kj::str("/var/sandstorm/grains/", grainId));
+  return shutdownPromise.then([this,grainId]() {
+    reaper.remove(kj::str("/var/sandstorm/grains/", grainId));
+    usageIndex.grainDeleted(grainId);
   });
 }
 
 kj::Promise<void> BackendImpl::transferGrain(TransferGrainContext context) {
-  // Nothing to do: Grains aren't stored by owner.
+  // Grains aren't stored by owner, so we only need to update the storage usage index.
+  auto params = context.getParams();
+  usageIndex.setOwner(validateId(params.getGrainId()), params.getNewOwnerId());
   return kj::READY_NOW;
 }
 
+kj::Promise<void> BackendImpl::cloneGrain(CloneGrainContext context) {
+  auto params = context.getParams();
+  auto grainId = validateId(params.getGrainId());
+  auto newGrainId = kj::heapString(validateId(params.getNewGrainId()));
+
+  auto cloning = cloningGrains.find(grainId);
+  if (cloning != cloningGrains.end()) {
+    // Copy one at a time, so that it's clear when the grain may start again.
+    return cloning->second.done.addBranch().then([this,context]() mutable {
+      return cloneGrain(context);
+    });
+  }
+
+  // A running grain could change its files while we copy them.
+  KJ_REQUIRE(supervisors.find(grainId) == supervisors.end(),
+             "grain must be shut down before it can be cloned", grainId);
+
+  usageIndex.setOwner(grainId, params.getOwnerId());
+  usageIndex.setOwner(newGrainId, params.getNewOwnerId());
+
+  auto grainDir = kj::str("/var/sandstorm/grains/", grainId);
+  auto newGrainDir = kj::str("/var/sandstorm/grains/", newGrainId);
+  KJ_SYSCALL(mkdir(newGrainDir.cStr(), 0777), newGrainDir);
+
+  auto from = kj::str(grainDir, "/sandbox");
+  auto to = kj::str(newGrainDir, "/sandbox");
+  kj::Promise<void> copying = nullptr;
+  KJ_IF_MAYBE(u, sandboxUid) {
+    // Under the setuid sandbox, the grain's files belong to the sandbox user, who may be the only
+    // one able to read them, and who must own the copies, so copy them as that user, much like
+    // `spk unpack`.
+    auto threads = kj::str(CLONE_THREADS);
+    Subprocess::Options options({"copy-tree", "--threads", threads, from, to});
+    options.uid = *u;
+    options.executable = "/proc/self/exe";
+    copying = onSuccess(eventPort, Subprocess(kj::mv(options)));
+  } else {
+    copying = blockingPool.runBulk([KJ_MVCAP(from),KJ_MVCAP(to)]() {
+      copyTree(from, to, CLONE_THREADS);
+    });
+  }
+  auto copy = copying.fork();
+
+  // Keep the grain from starting until the copy is over, even if this call is canceled, since the
+  // copy carries on regardless.
+  CloningGrain entry {
+    kj::heapString(grainId),
+    copy.addBranch().catch_([](kj::Exception&&) {}).fork()
+  };
+  kj::StringPtr key = entry.grainId;
+  auto& done = cloningGrains.insert(std::make_pair(key, kj::mv(entry))).first->second.done;
+  tasks.add(done.addBranch().then([this,key]() {
+    cloningGrains.erase(cloningGrains.find(key));
+  }));
+  context.releaseParams();
+
+  return copy.addBranch().catch_([this,KJ_MVCAP(newGrainId),KJ_MVCAP(newGrainDir)](
+      kj::Exception&& exception) {
+    // Don't leave half a grain behind.
+    reaper.remove(newGrainDir);
+    usageIndex.grainDeleted(newGrainId);
+    kj::throwRecoverableException(kj::mv(exception));
+  });
+}
+
 kj::Promise<void> BackendImpl::deleteUser(DeleteUserContext context) {
-  // Nothing to do: We store no per-user data in the back-end.
+  // Nothing to do: We store no per-user data in the back-end, other than storage usage totals,
+  // which go away as the user's grains are deleted.
   return kj::READY_NOW;
 }
 
@@ -318,6 +738,8 @@ public:
   PackageUploadStreamImpl(BackendImpl& backend, Pipe inPipe = Pipe::make(),
                           Pipe outPipe = Pipe::make())
       : sandboxUid(backend.sandboxUid),
+        pool(backend.blockingPool),
+        reaper(backend.reaper),
         inputWriteFd(kj::mv(inPipe.writeEnd)),
         outputReadFd(kj::mv(outPipe.readEnd)),
         inputWriteEnd(backend.ioProvider.wrapOutputFd(inputWriteFd,
@@ -328,9 +750,7 @@ public:
         unpackProcess(startProcess(kj::mv(inPipe.readEnd), kj::mv(outPipe.writeEnd), tmpdir,
                                    backend.sandboxUid)) {}
   ~PackageUploadStreamImpl() noexcept(false) {
-    if (access(tmpdir.cStr(), F_OK) >= 0) {
-      recursivelyDelete(tmpdir);
-    }
+    reaper.remove(tmpdir);
   }
 
 protected:
@@ -369,40 +789,50 @@ protected:
 
       auto packageId = validateId(context.getParams().getPackageId());
       auto finalName = kj::str("/var/sandstorm/apps/", packageId);
-      bool exists = access(finalName.cStr(), F_OK) >= 0;
-      if (!exists) {
-        // Write app ID file.
-        kj::FdOutputStream(
-            raiiOpen(kj::str(finalName, ".appid"), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC))
-            .write(text.begin(), text.size());
-
-        // Move directory into place.
-        KJ_SYSCALL(rename(tmpdir.cStr(), finalName.cStr()));
-      }
-      KJ_ON_SCOPE_FAILURE(if (!exists) { tryRecursivelyDelete(finalName); });
-
-      capnp::ReaderOptions manifestLimits;
-      manifestLimits.traversalLimitInWords = spk::Manifest::SIZE_LIMIT_IN_WORDS;
-      capnp::StreamFdMessageReader reader(raiiOpen(
-          kj::str(finalName, "/sandstorm-manifest"), O_RDONLY), manifestLimits);
-      auto manifest = reader.getRoot<spk::Manifest>();
-
-      capnp::MessageSize sizeHint = manifest.totalSize();
-      sizeHint.wordCount += 8 + text.size() / sizeof(capnp::word);
-      auto results = context.getResults(sizeHint);
-      results.setAppId(trim(text));
-      results.setManifest(manifest);
-      KJ_IF_MAYBE(fp, checkPgpSignature(results.getAppId(), manifest.getMetadata(), sandboxUid)) {
-        results.setAuthorPgpKeyFingerprint(*fp);
-      }
-    }, [this](kj::Exception&& e) {
-      kj::runCatchingExceptions([&]() { recursivelyDelete(tmpdir); });
-      kj::throwRecoverableException(kj::mv(e));
+      return pool.run([KJ_MVCAP(finalName),KJ_MVCAP(text),tmpdir = kj::heapString(tmpdir),
+                       sandboxUid = sandboxUid]() -> kj::Own<PackageInfo> {
+        bool exists = access(finalName.cStr(), F_OK) >= 0;
+        if (!exists) {
+          // Share files with the packages already installed. This only saves space, and the
+          // tree is intact even if it fails partway, so carry on regardless.
+          //
+          // Not under the setuid sandbox, though: there, `spk unpack` ran as the sandbox user,
+          // who owns the files, and the kernel's protected_hardlinks setting forbids us from
+          // linking to files we don't own, so every file would fail.
+          if (sandboxUid == nullptr) {
+            KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+              addToPackageStore(PACKAGE_STORE_DIR, tmpdir);
+            })) {
+              KJ_LOG(ERROR, "couldn't add package to package store", *exception);
+            }
+          }
+
+          // Write app ID file.
+          kj::FdOutputStream(
+              raiiOpen(kj::str(finalName, ".appid"), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC))
+              .write(text.begin(), text.size());
+
+          // Move directory into place.
+          KJ_SYSCALL(rename(tmpdir.cStr(), finalName.cStr()));
+        }
+        // On failure, move the directory back, to be deleted along with this stream.
+        KJ_ON_SCOPE_FAILURE(if (!exists) { rename(finalName.cStr(), tmpdir.cStr()); });
+
+        auto info = readPackage(finalName, sandboxUid);
+        return kj::mv(KJ_REQUIRE_NONNULL(info, "package has no manifest"));
+      });
+    }, [this](kj::Exception&& e) -> kj::Promise<kj::Own<PackageInfo>> {
+      kj::runCatchingExceptions([&]() { reaper.remove(tmpdir); });
+      return kj::mv(e);
+    }).then([context](kj::Own<PackageInfo>&& info) mutable {
+      returnPackage(context, *info);
     });
   }
 
 private:
   kj::Maybe<uid_t> sandboxUid;
+  ThreadPool& pool;
+  Reaper& reaper;
   kj::AutoCloseFd inputWriteFd;
   kj::AutoCloseFd outputReadFd;
   kj::Maybe<kj::Own<kj::AsyncOutputStream>> inputWriteEnd;
@@ -437,43 +867,41 @@ kj::Promise<void> BackendImpl::installPackage(InstallPackageContext context)  {
 kj::Promise<void> BackendImpl::tryGetPackage(TryGetPackageContext context) {
   auto path = kj::str("/var/sandstorm/apps/", validateId(context.getParams().getPackageId()));
 
-  KJ_IF_MAYBE(file, raiiOpenIfExists(kj::str(path, "/sandstorm-manifest"), O_RDONLY)) {
-    capnp::ReaderOptions manifestLimits;
-    manifestLimits.traversalLimitInWords = spk::Manifest::SIZE_LIMIT_IN_WORDS;
-    capnp::StreamFdMessageReader reader(kj::mv(*file), manifestLimits);
-    auto manifest = reader.getRoot<spk::Manifest>();
-
-    kj::String appid = sandstorm::readAll(kj::str(path, ".appid"));
-
-    capnp::MessageSize sizeHint = manifest.totalSize();
-    sizeHint.wordCount += 8 + appid.size() / sizeof(capnp::word);
-    auto results = context.getResults(sizeHint);
-    results.setAppId(trim(appid));
-    results.setManifest(manifest);
-    KJ_IF_MAYBE(fp, checkPgpSignature(results.getAppId(), manifest.getMetadata(), sandboxUid)) {
-      results.setAuthorPgpKeyFingerprint(*fp);
+  return blockingPool.run([KJ_MVCAP(path),sandboxUid = sandboxUid]() {
+    return readPackage(path, sandboxUid);
+  }).then([context](kj::Maybe<kj::Own<PackageInfo>>&& info) mutable {
+    KJ_IF_MAYBE(i, info) {
+      returnPackage(context, **i);
     }
-  }
+  });
+}
+
+kj::Promise<void> BackendImpl::deletePackage(DeletePackageContext context) {
+  reaper.remove(kj::str("/var/sandstorm/apps/", validateId(context.getParams().getPackageId())));
+
+  // Files only this package had can go once the reaper has deleted it.
+  collectPackageGarbageLater();
 
   return kj::READY_NOW;
 }
 
-kj::Promise<void> BackendImpl::deletePackage(DeletePackageContext context) {
-  auto path = kj::str("/var/sandstorm/apps/", validateId(context.getParams().getPackageId()));
-  if (access(path.cStr(), F_OK) >= 0) {
-    tryRecursivelyDelete(path);
+void BackendImpl::collectPackageGarbageLater() {
+  // Waiting also lets us clean up after several deletions at once.
+  if (!packageGarbageScheduled) {
+    packageGarbageScheduled = true;
+    tasks.add(timer.afterDelay(10 * kj::MINUTES).then([this]() {
+      packageGarbageScheduled = false;
+      return blockingPool.runBulk([]() { collectPackageGarbage(PACKAGE_STORE_DIR); });
+    }));
   }
-  return kj::READY_NOW;
 }
 
 // =======================================================================================
 
-kj::Promise<void> BackendImpl::backupGrain(BackupGrainContext context) {
-  auto params = context.getParams();
-
-  auto path = kj::str("/var/sandstorm/backups/", params.getBackupId());
-  recursivelyCreateParent(path);
-  auto grainDir = kj::str("/var/sandstorm/grains/", params.getGrainId());
+BackendImpl::BackupProcess BackendImpl::startBackup(
+    kj::StringPtr path, kj::StringPtr grainId, GrainInfo::Reader info, int stdoutFd,
+    kj::ArrayPtr<const kj::StringPtr> options) {
+  auto grainDir = kj::str("/var/sandstorm/grains/", grainId);
 
   // Similar to the supervisor, the "backup" command sets up its own sandbox, and for that to work
   // we need to pass along root privileges to it.
@@ -485,6 +913,7 @@ kj::Promise<void> BackendImpl::backupGrain(BackupGrainContext context) {
     ownUid = kj::str(*u);
     argv.add(ownUid);
   }
+  argv.addAll(options);
   argv.add(path);
   argv.add(grainDir);
 
@@ -493,31 +922,98 @@ kj::Promise<void> BackendImpl::backupGrain(BackupGrainContext context) {
   processOptions.executable = "/proc/self/exe";
   auto inPipe = Pipe::make();
   processOptions.stdin = inPipe.readEnd;
+  processOptions.stdout = stdoutFd;
   Subprocess process(kj::mv(processOptions));
   inPipe.readEnd = nullptr;
 
-  auto metadata = params.getInfo();
-  auto metadataMsg = kj::heap<capnp::MallocMessageBuilder>(metadata.totalSize().wordCount + 4);
-  metadataMsg->setRoot(metadata);
-  context.releaseParams();
+  auto metadataMsg = kj::heap<capnp::MallocMessageBuilder>(info.totalSize().wordCount + 4);
+  metadataMsg->setRoot(info);
   auto metadataStreamFd = kj::mv(inPipe.writeEnd);
   auto output = ioProvider.wrapOutputFd(
       metadataStreamFd, kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
   auto promise = capnp::writeMessage(*output, *metadataMsg);
 
-  return promise.attach(kj::mv(metadataMsg), kj::mv(metadataStreamFd), kj::mv(output))
-      .then([KJ_MVCAP(process)]() mutable {
-    // TODO(cleanup): We should probably use a SubprocessSet to wait asynchronously, but that
-    //   means we need to use SubprocessSet everywhere...
-    process.waitForSuccess();
+  return {
+    kj::mv(process),
+    promise.attach(kj::mv(metadataMsg), kj::mv(metadataStreamFd), kj::mv(output))
+  };
+}
+
+kj::Promise<void> BackendImpl::backupGrain(BackupGrainContext context) {
+  auto params = context.getParams();
+
+  if (params.getIncremental()) {
+    return chunkCollector.startUsing()
+        .then([this,context](kj::Own<ChunkGarbageCollector::Use>&& use) mutable {
+      return backupGrainIncrementally(context).attach(kj::mv(use));
+    });
+  }
+
+  auto path = kj::str("/var/sandstorm/backups/", params.getBackupId());
+  recursivelyCreateParent(path);
+
+  auto backup = startBackup(path, params.getGrainId(), params.getInfo());
+  context.releaseParams();
+
+  auto exited = onSuccess(eventPort, kj::mv(backup.process));
+  return backup.metadataWritten.then([KJ_MVCAP(exited)]() mutable { return kj::mv(exited); });
+}
+
+kj::Promise<void> BackendImpl::backupGrainIncrementally(BackupGrainContext context) {
+  auto params = context.getParams();
+  auto grainId = kj::heapString(validateId(params.getGrainId()));
+  auto backupId = kj::heapString(validateId(params.getBackupId()));
+
+  // The backup process gets its own directory to write in, and only read access to the rest.
+  auto incomingPath = kj::str(INCREMENTAL_BACKUP_DIR, "/incoming/", backupId);
+  auto latestPath = kj::str(INCREMENTAL_BACKUP_DIR, "/latest/", grainId);
+  recursivelyCreateParent(incomingPath);
+
+  kj::Vector<kj::StringPtr> options;
+  options.add("--chunks");
+  options.add(INCREMENTAL_BACKUP_DIR);
+  if (access(latestPath.cStr(), F_OK) == 0) {
+    options.add("--previous");
+    options.add(latestPath);
+  }
+
+  auto backup = startBackup(incomingPath, grainId, params.getInfo(), STDOUT_FILENO, options);
+  context.releaseParams();
+
+  auto exited = onSuccess(eventPort, kj::mv(backup.process));
+  return backup.metadataWritten.then([KJ_MVCAP(exited)]() mutable { return kj::mv(exited); })
+      .then([this,KJ_MVCAP(backupId),KJ_MVCAP(grainId)]() mutable {
+    return blockingPool.run([KJ_MVCAP(backupId),KJ_MVCAP(grainId)]() {
+      commitIncrementalBackup(INCREMENTAL_BACKUP_DIR, backupId, grainId);
+    });
+  }).catch_([this](kj::Exception&& exception) {
+    // Clean up the incoming directory, and any chunks that only it used.
+    chunkCollector.collectSoon();
+    kj::throwRecoverableException(kj::mv(exception));
   });
 }
 
 kj::Promise<void> BackendImpl::restoreGrain(RestoreGrainContext context) {
+  auto backupId = context.getParams().getBackupId();
+
+  auto manifestPath = kj::str(INCREMENTAL_BACKUP_DIR, "/manifests/", backupId);
+  if (access(manifestPath.cStr(), F_OK) == 0) {
+    return chunkCollector.startUsing()
+        .then([this,context,KJ_MVCAP(manifestPath)](
+            kj::Own<ChunkGarbageCollector::Use>&& use) mutable {
+      return restoreGrainFrom(context, manifestPath, true).attach(kj::mv(use));
+    });
+  }
+
+  return restoreGrainFrom(context, kj::str("/var/sandstorm/backups/", backupId), false);
+}
+
+kj::Promise<void> BackendImpl::restoreGrainFrom(
+    RestoreGrainContext context, kj::StringPtr path, bool incremental) {
   auto params = context.getParams();
 
-  auto path = kj::str("/var/sandstorm/backups/", params.getBackupId());
   auto grainDir = kj::str("/var/sandstorm/grains/", params.getGrainId());
+  usageIndex.setOwner(validateId(params.getGrainId()), params.getOwnerId());
 
   // Similar to the supervisor, the "backup" command sets up its own sandbox, and for that to work
   // we need to pass along root privileges to it.
@@ -530,6 +1026,10 @@ kj::Promise<void> BackendImpl::restoreGrain(RestoreGrainContext context) {
     argv.add(ownUid);
   }
   argv.add("-r");
+  if (incremental) {
+    argv.add("--chunks");
+    argv.add(INCREMENTAL_BACKUP_DIR);
+  }
   argv.add(path);
   argv.add(grainDir);
 
@@ -548,8 +1048,12 @@ kj::Promise<void> BackendImpl::restoreGrain(RestoreGrainContext context) {
   auto asyncInput = ioProvider.wrapInputFd(input, kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
 
   auto promise = capnp::readMessage(*asyncInput);
-  return promise.attach(kj::mv(input), kj::mv(asyncInput), kj::mv(process))
-      .then([context](kj::Own<capnp::MessageReader>&& message) mutable {
+  auto exited = onSuccess(eventPort, kj::mv(process));
+  return promise.attach(kj::mv(input), kj::mv(asyncInput))
+      .then([KJ_MVCAP(exited)](kj::Own<capnp::MessageReader>&& message) mutable {
+    // The metadata comes last, but make sure the restore really finished.
+    return exited.then([KJ_MVCAP(message)]() mutable { return kj::mv(message); });
+  }).then([context](kj::Own<capnp::MessageReader>&& message) mutable {
     auto metadata = message->getRoot<GrainInfo>();
     context.getResults(capnp::MessageSize { metadata.totalSize().wordCount + 4, 0 })
         .setInfo(metadata);
@@ -619,65 +1123,118 @@ kj::Promise<void> BackendImpl::downloadBackup(DownloadBackupContext context) {
   auto params = context.getParams();
   auto path = kj::str("/var/sandstorm/backups/", params.getBackupId());
   auto stream = params.getStream();
+
+  if (access(path.cStr(), F_OK) < 0 &&
+      access(kj::str(INCREMENTAL_BACKUP_DIR, "/manifests/", params.getBackupId()).cStr(),
+             F_OK) == 0) {
+    KJ_FAIL_REQUIRE("incremental backups can't be downloaded; use backupGrainToStream() to "
+                    "export the grain instead");
+  }
   context.releaseParams();
 
   auto fd = raiiOpen(path, O_RDONLY | O_CLOEXEC);
   struct stat stats;
   KJ_SYSCALL(fstat(fd, &stats));
-  auto expectReq = stream.expectSizeRequest();
-  expectReq.setSize(stats.st_size);
-  auto expectPromise = expectReq.send();
 
   auto file = kj::heap<kj::FdInputStream>(kj::mv(fd));
 
-  auto promise = pump(*file, kj::mv(stream));
-  return promise.attach(kj::mv(file), kj::mv(expectPromise));
+  PumpOptions options;
+  options.expectedSize = stats.st_size;
+  auto promise = pump(*file, kj::mv(stream), options);
+  return promise.attach(kj::mv(file));
 }
 
 kj::Promise<void> BackendImpl::deleteBackup(DeleteBackupContext context) {
-  auto path = kj::str("/var/sandstorm/backups/", context.getParams().getBackupId());
-  while (unlink(path.cStr()) < 0) {
-    int error = errno;
-    if (error == ENOENT) {
-      break;
-    } else if (error != EINTR) {
-      KJ_FAIL_SYSCALL("unlink", error, path);
-    }
+  auto backupId = context.getParams().getBackupId();
+  unlinkIfExists(kj::str("/var/sandstorm/backups/", backupId));
+  if (unlinkIfExists(kj::str(INCREMENTAL_BACKUP_DIR, "/manifests/", backupId))) {
+    // The backup's chunks may now be garbage.
+    chunkCollector.collectSoon();
   }
   return kj::READY_NOW;
 }
 
-// =======================================================================================
+class BackendImpl::BackupOutputStream final: public kj::AsyncInputStream {
+  // Reads the zip written to stdout by a `backup` process. EOF is reported only once the process
+  // has exited successfully, so that pump() doesn't call `done()` on a backup that failed halfway
+  // through.
 
-static uint64_t recursivelyCountSize(kj::StringPtr path) {
-  KJ_REQUIRE(!path.endsWith("/"),
-      "refusing to recursively traverse directory name with trailing / to reduce risk of "
-      "catastrophic empty-string bugs");
+public:
+  BackupOutputStream(kj::UnixEventPort& eventPort, kj::Own<kj::AsyncInputStream> inner,
+                     Subprocess process)
+      : eventPort(eventPort), inner(kj::mv(inner)), process(kj::mv(process)) {}
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return inner->tryRead(buffer, minBytes, maxBytes).then([this,minBytes](size_t n)
+        -> kj::Promise<size_t> {
+      if (n < minBytes) {
+        return process.onSuccess(eventPort).then([n]() { return n; });
+      }
+      return n;
+    });
+  }
 
-  struct stat stats;
-  KJ_SYSCALL(lstat(path.cStr(), &stats));
+private:
+  kj::UnixEventPort& eventPort;
+  kj::Own<kj::AsyncInputStream> inner;
+  Subprocess process;
+};
 
-  // Count blocks, not length, because what we care about is allocated space.
-  uint64_t total = stats.st_blocks * 512;
+kj::Promise<void> BackendImpl::backupGrainToStream(BackupGrainToStreamContext context) {
+  auto params = context.getParams();
+  auto grainId = validateId(params.getGrainId());
+  usageIndex.setOwner(grainId, params.getOwnerId());
+  auto stream = params.getStream();
 
-  if (S_ISDIR(stats.st_mode)) {
-    for (auto& file: listDirectory(path)) {
-      total += recursivelyCountSize(kj::str(path, '/', file));
-    }
-  } else if (stats.st_nlink != 0) {
-    // Don't overcount hard links. (Note that st_nlink can in fact be zero in cases where we are
-    // racing with directory modifications, so we check for that to avoid divide-by-zero crashes.)
-    total /= stats.st_nlink;
+  auto outPipe = Pipe::make();
+  auto backup = startBackup("-", grainId, params.getInfo(), outPipe.writeEnd);
+  outPipe.writeEnd = nullptr;
+  context.releaseParams();
+
+  auto input = kj::heap<BackupOutputStream>(eventPort,
+      ioProvider.wrapInputFd(outPipe.readEnd.release(),
+          kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+          kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC),
+      kj::mv(backup.process));
+
+  // We can't know the size in advance, so the front-end will have to send it chunked.
+  auto promise = pump(*input, kj::mv(stream));
+  return kj::joinPromises(kj::arr(
+      kj::mv(backup.metadataWritten), promise.attach(kj::mv(input))));
+}
+
+// =======================================================================================
+
+kj::Promise<void> BackendImpl::getUserStorageUsage(GetUserStorageUsageContext context) {
+  if (!usageIndex.areAllOwnersKnown()) {
+    // We'd miss any grains we haven't been told about, and undercount.
+    KJ_UNIMPLEMENTED("grain owners not yet known; front-end must call setGrainOwners()");
   }
 
-  return total;
+  return usageIndex.getUserUsage(context.getParams().getUserId())
+      .then([context](uint64_t size) mutable {
+    context.getResults(capnp::MessageSize { 4, 0 }).setSize(size);
+  });
 }
 
-kj::Promise<void> BackendImpl::getGrainStorageUsage(GetGrainStorageUsageContext context) {
-  context.getResults(capnp::MessageSize { 4, 0 }).setSize(recursivelyCountSize(
-      kj::str("/var/sandstorm/grains/", validateId(context.getParams().getGrainId()))));
+kj::Promise<void> BackendImpl::setGrainOwners(SetGrainOwnersContext context) {
+  auto params = context.getParams();
+  for (auto grain: params.getGrains()) {
+    usageIndex.setOwner(validateId(grain.getGrainId()), grain.getOwnerId());
+  }
+  if (params.getIsLast()) {
+    usageIndex.setAllOwnersKnown();
+  }
   return kj::READY_NOW;
 }
 
+kj::Promise<void> BackendImpl::getGrainStorageUsage(GetGrainStorageUsageContext context) {
+  auto params = context.getParams();
+  return usageIndex.getUsage(validateId(params.getGrainId()), params.getOwnerId())
+      .then([context](uint64_t size) mutable {
+    context.getResults(capnp::MessageSize { 4, 0 }).setSize(size);
+  });
+}
+
 } // namespace sandstorm
 
@@ -19,10 +19,16 @@
 
 #include <sandstorm/backend.capnp.h>
 #include <map>
+#include <deque>
 #include <kj/async-io.h>
 #include <capnp/rpc-twoparty.h>
 #include <kj/one-of.h>
 #include <kj/vector.h>
+#include "util.h"
+#include "grain-usage.h"
+#include "chunk-store.h"
+#include "thread-pool.h"
+#include "reaper.h"
 
 namespace kj {
   class InputStream;
@@ -32,9 +38,19 @@ namespace sandstorm {
 
 class BackendImpl: public Backend::Server, private kj::TaskSet::ErrorHandler {
 public:
-  BackendImpl(kj::LowLevelAsyncIoProvider& ioProvider, kj::Network& network,
+  BackendImpl(kj::LowLevelAsyncIoProvider& ioProvider, kj::UnixEventPort& eventPort,
+              kj::Network& network, kj::Timer& timer,
               SandstormCoreFactory::Client&& sandstormCoreFactory,
-              kj::Maybe<uid_t> sandboxUid);
+              kj::Maybe<uid_t> sandboxUid, uint supervisorPoolSize = 0,
+              uint maxConcurrentStarts = 0);
+  // The process must have called kj::UnixEventPort::captureChildExit() before starting any
+  // threads, as the backend waits for its `backup` children asynchronously.
+  //
+  // `supervisorPoolSize` is the number of pre-started supervisors to keep ready for grains that
+  // aren't in dev mode. See SupervisorMain::getPoolMain().
+  //
+  // `maxConcurrentStarts` is the number of grains that may be starting up at once; the rest wait
+  // their turn. 0 means no limit.
 
 protected:
   kj::Promise<void> ping(PingContext context) override;
@@ -42,6 +58,7 @@ protected:
   kj::Promise<void> getGrain(GetGrainContext context) override;
   kj::Promise<void> deleteGrain(DeleteGrainContext context) override;
   kj::Promise<void> transferGrain(TransferGrainContext context) override;
+  kj::Promise<void> cloneGrain(CloneGrainContext context) override;
   kj::Promise<void> deleteUser(DeleteUserContext context) override;
   kj::Promise<void> installPackage(InstallPackageContext context) override;
   kj::Promise<void> tryGetPackage(TryGetPackageContext context) override;
@@ -51,15 +68,108 @@ protected:
   kj::Promise<void> uploadBackup(UploadBackupContext context) override;
   kj::Promise<void> downloadBackup(DownloadBackupContext context) override;
   kj::Promise<void> deleteBackup(DeleteBackupContext context) override;
+  kj::Promise<void> backupGrainToStream(BackupGrainToStreamContext context) override;
+  kj::Promise<void> getUserStorageUsage(GetUserStorageUsageContext context) override;
+  kj::Promise<void> setGrainOwners(SetGrainOwnersContext context) override;
   kj::Promise<void> getGrainStorageUsage(GetGrainStorageUsageContext context) override;
 
 private:
   kj::LowLevelAsyncIoProvider& ioProvider;
+  kj::UnixEventPort& eventPort;
   kj::Network& network;
+  kj::Timer& timer;
   SandstormCoreFactory::Client coreFactory;
   kj::Maybe<uid_t> sandboxUid;   // if not using user namespaces
+
+  ThreadPool blockingPool;
+  // Runs filesystem work that could take a while, like deleting or copying a grain, so that it
+  // doesn't hold up requests for other grains.
+
+  Reaper reaper;
+  // Deletes grains and packages in the background.
+
+  GrainUsageIndex usageIndex;
+  // Declared before `tasks` since RunningGrains, which live in `tasks`, report to it when they
+  // go away.
+
+  ChunkGarbageCollector chunkCollector;
+  // Cleans up the incremental backup store.
+
+  bool packageGarbageScheduled = false;
+  // collectPackageGarbageLater() has scheduled collectPackageGarbage().
+
   kj::TaskSet tasks;
 
+  struct SupervisorProcess {
+    Subprocess process;
+    kj::Own<kj::AsyncInputStream> stdout;
+    // The supervisor writes to stdout once it is listening on its socket.
+
+    kj::AutoCloseFd assignmentPipe;
+    // For pre-started supervisors, the write end of the pipe on which it expects its arguments.
+  };
+
+  uint supervisorPoolSize;
+  kj::Vector<SupervisorProcess> supervisorPool;
+  // Pre-started supervisors waiting for a grain.
+
+  static constexpr uint HISTOGRAM_BUCKETS = 16;
+
+  struct Histogram {
+    uint buckets[HISTOGRAM_BUCKETS] = {};
+    // Counts of values that are 0, 1, 2-3, 4-7, and so on by powers of two. The last bucket
+    // also counts everything bigger.
+
+    void add(uint64_t value);
+    kj::String toString(kj::StringPtr unit) const;
+  };
+
+  struct SupervisorStartStats {
+    uint count = 0;
+    kj::Duration totalTime = 0 * kj::NANOSECONDS;
+    kj::Duration maxTime = 0 * kj::NANOSECONDS;
+    Histogram histogram;  // in milliseconds
+
+    void add(kj::Duration time);
+  };
+  SupervisorStartStats pooledStarts;
+  SupervisorStartStats coldStarts;
+  // Time from the grain's turn to start coming up until the supervisor is listening.
+
+  SupervisorStartStats startWaits;
+  // Time that starts which had to queue spent waiting for their turn.
+
+  Histogram startQueueDepth;
+  // For each start, the number of starts that were already waiting ahead of it.
+
+  uint poolMisses = 0;  // cold starts that wanted a pre-started supervisor but found none
+  bool statsChanged = false;
+
+  class StartSlot {
+    // One of the `maxConcurrentStarts` slots, held while a grain starts up.
+
+  public:
+    explicit StartSlot(BackendImpl& backend): backend(backend) {}
+    ~StartSlot() noexcept(false);
+    KJ_DISALLOW_COPY(StartSlot);
+
+  private:
+    BackendImpl& backend;
+  };
+
+  struct QueuedStart {
+    kj::String grainId;
+    bool background;
+    kj::TimePoint queuedTime;
+    kj::Own<kj::PromiseFulfiller<kj::Own<StartSlot>>> fulfiller;
+  };
+
+  uint maxConcurrentStarts;
+  uint startsInProgress = 0;  // StartSlots in existence
+  std::deque<QueuedStart> startQueue;
+  // Starts waiting for a slot. Interactive starts go before background ones; otherwise, it's
+  // first come, first served.
+
   class RunningGrain {
   public:
     RunningGrain(BackendImpl& backend, kj::String grainId, kj::Own<kj::AsyncIoStream> stream,
@@ -88,12 +198,61 @@ private:
 
   std::map<kj::StringPtr, StartingGrain> supervisors;
 
+  struct CloningGrain {
+    kj::String grainId;
+    kj::ForkedPromise<void> done;  // resolves, and never rejects, when the copy is over
+  };
+
+  std::map<kj::StringPtr, CloningGrain> cloningGrains;
+  // Grains that cloneGrain() is copying. They can't start or be deleted until it's done, so that
+  // their files don't change under the copy.
+
   class PackageUploadStreamImpl;
   class FileUploadStream;
+  class BackupOutputStream;
+  class SizeReportingCore;
+
+  kj::Promise<Supervisor::Client> bootGrain(kj::StringPtr ownerId, kj::StringPtr grainId,
+      kj::StringPtr packageId, spk::Manifest::Command::Reader command, bool isNew, bool devMode,
+      bool mountProce, bool background, bool isRetry);
+  kj::Promise<Supervisor::Client> launchSupervisor(kj::String grainId,
+                                                   kj::Array<kj::String> argv, bool devMode);
+  // bootGrain() coalesces requests to start the same grain and waits for a StartSlot, then calls
+  // launchSupervisor() to actually start it.
+
+  kj::Promise<kj::Own<StartSlot>> waitForStartSlot(kj::StringPtr grainId, bool background);
+  void admitQueuedStarts();
+
+  struct BackupProcess {
+    Subprocess process;
+    kj::Promise<void> metadataWritten;
+  };
+
+  BackupProcess startBackup(kj::StringPtr path, kj::StringPtr grainId, GrainInfo::Reader info,
+                            int stdoutFd = STDOUT_FILENO,
+                            kj::ArrayPtr<const kj::StringPtr> options = nullptr);
+  // Starts the `backup` command to back up the grain to `path` ("-" for stdout), and feeds it the
+  // grain's metadata. `options` are extra flags for the command.
+
+  kj::Promise<void> backupGrainIncrementally(BackupGrainContext context);
+  kj::Promise<void> restoreGrainFrom(RestoreGrainContext context, kj::StringPtr path,
+                                     bool incremental);
+  // Implementation of backupGrain() and restoreGrain(). Incremental backups and restores must
+  // hold a ChunkGarbageCollector::Use while they run.
+
+  void collectPackageGarbageLater();
+  // Runs collectPackageGarbage() on the package store in a while, once the reaper has had time to
+  // delete any packages being deleted, unless that's already scheduled.
+
+  SandstormCore::Client newSandstormCore(kj::StringPtr grainId);
+  // Gets a SandstormCore for the grain from the front-end, wrapped so that we see the grain's size
+  // reports.
 
-  kj::Promise<Supervisor::Client> bootGrain(kj::StringPtr grainId, kj::StringPtr packageId,
-      spk::Manifest::Command::Reader command, bool isNew, bool devMode, bool mountProce,
-      bool isRetry);
+  SupervisorProcess startSupervisor(kj::StringPtr programName,
+                                    kj::ArrayPtr<const kj::StringPtr> args, bool pooled);
+  kj::Maybe<SupervisorProcess> takePooledSupervisor(kj::ArrayPtr<const kj::StringPtr> args);
+  void refillSupervisorPool();
+  kj::Promise<void> logSupervisorStats();
 
   static kj::Promise<void> ignoreAll(kj::AsyncInputStream& input);
   static kj::Promise<kj::String> readAll(kj::AsyncInputStream& input,
@@ -15,9 +15,15 @@
 // limitations under the License.
 
 #include "backup.h"
+#include "chunk-store.h"
 #include "util.h"
 #include "version.h"
+#include <sandstorm/backend.capnp.h>
+#include <capnp/serialize.h>
 #include <kj/debug.h>
+#include <kj/thread.h>
+#include <kj/vector.h>
+#include <map>
 #include <sched.h>
 #include <sys/mount.h>
 #include <sys/syscall.h>
@@ -33,6 +39,18 @@
 
 namespace sandstorm {
 
+static constexpr int MAX_THREADS = 4;
+// Most threads used to compress or extract one backup. Backups are interactive, so we want them
+// to be fast, but not at the expense of every grain on the server.
+
+static uint chooseThreadCount() {
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+    return 1;
+  }
+  return kj::max(1, kj::min(CPU_COUNT(&cpus), MAX_THREADS));
+}
+
 BackupMain::BackupMain(kj::ProcessContext& context): context(context) {}
 
 kj::MainFunc BackupMain::getMain() {
@@ -40,14 +58,23 @@ kj::MainFunc BackupMain::getMain() {
                          "Backs up the grain directory in <grain> to <file>, reading the grain "
                          "metadata struct on stdin. Or, restores the backup in <file>, "
                          "unpacking it to <grain>, and writing the metadata to stdout. In "
-                         "backup mode, <file> can be `-` to write the data to stdout.")
+                         "backup mode, <file> can be `-` to write the data to stdout. With "
+                         "--chunks, <file> is an incremental backup's manifest instead of a zip, "
+                         "except that when backing up, it's a new directory in which to leave "
+                         "the manifest and any chunks the store lacks.")
       .addOptionWithArg({"uid"}, KJ_BIND_METHOD(*this, setUid), "<uid>",
                         "Use setuid sandbox rather than userns. Must start as root, but swiches "
                         "to <uid> to run the app.")
       .addOption({'r', "restore"}, KJ_BIND_METHOD(*this, setRestore),
                  "Restore a backup, rather than create a backup.")
       .addOptionWithArg({"root"}, KJ_BIND_METHOD(*this, setRoot), "<root>",
-                 "Set the \"root directory\" to map in, which contains the zip/unzip binaries.")
+                 "Set the \"root directory\" to map in as the sandbox's root.")
+      .addOptionWithArg({"chunks"}, KJ_BIND_METHOD(*this, setChunks), "<dir>",
+                 "Make or restore an incremental backup, whose file contents are kept in the "
+                 "chunk store <dir>. See chunk-store.h.")
+      .addOptionWithArg({"previous"}, KJ_BIND_METHOD(*this, setPrevious), "<manifest>",
+                 "When making an incremental backup, assume that files whose size and times "
+                 "match those in the backup <manifest> are unchanged, without reading them.")
       .expectArg("<file>", KJ_BIND_METHOD(*this, setFile))
       .expectArg("<grain>", KJ_BIND_METHOD(*this, run))
       .build();
@@ -68,6 +95,16 @@ bool BackupMain::setRoot(kj::StringPtr arg) {
   return true;
 }
 
+bool BackupMain::setChunks(kj::StringPtr arg) {
+  chunksDir = arg;
+  return true;
+}
+
+bool BackupMain::setPrevious(kj::StringPtr arg) {
+  previousManifest = arg;
+  return true;
+}
+
 bool BackupMain::setUid(kj::StringPtr arg) {
   KJ_IF_MAYBE(u, parseUInt(arg, 10)) {
     if (getuid() != 0) {
@@ -108,13 +145,35 @@ void BackupMain::bind(kj::StringPtr src, kj::StringPtr dst, unsigned long flags)
 bool BackupMain::run(kj::StringPtr grainDir) {
   // Enable no_new_privs so that once we drop privileges we can never regain them through e.g.
   // execing a suid-root binary, as a backup measure. This is a backup measure in case someone
-  // finds an arbitrary code execution exploit in zip/unzip; it's not needed otherwise.
+  // finds an arbitrary code execution exploit in our zip code; it's not needed otherwise.
   KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
 
+  // Count CPUs while we can still see them.
+  threadCount = chooseThreadCount();
+
   // Create files / directories before we potentially change the UID, so that they are created
   // with the right owner.
+  kj::AutoCloseFd restoreManifest;
+  kj::Maybe<kj::AutoCloseFd> previousManifestFd;
+  if (chunksDir != nullptr) {
+    // There's nothing to bind in until the first backup adds a chunk.
+    auto chunks = kj::str(chunksDir, "/chunks");
+    if (mkdir(chunks.cStr(), 0770) < 0) {
+      int error = errno;
+      if (error != EEXIST) KJ_FAIL_SYSCALL("mkdir", error, chunks);
+    }
+  }
   if (restore) {
     KJ_SYSCALL(mkdir(kj::str(grainDir, "/sandbox").cStr(), 0770));
+    if (chunksDir != nullptr) {
+      restoreManifest = raiiOpen(filename, O_RDONLY | O_CLOEXEC);
+    }
+  } else if (chunksDir != nullptr) {
+    KJ_SYSCALL(mkdir(filename.cStr(), 0770), filename);
+    KJ_SYSCALL(mkdir(kj::str(filename, "/chunks").cStr(), 0770), filename);
+    if (previousManifest != nullptr) {
+      previousManifestFd = raiiOpen(previousManifest, O_RDONLY | O_CLOEXEC);
+    }
   } else if (filename != "-") {
     // Instead of binding into mount tree later, just open the file and we'll compress to stdout.
     KJ_SYSCALL(dup2(raiiOpen(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC), STDOUT_FILENO));
@@ -126,17 +185,18 @@ bool BackupMain::run(kj::StringPtr grainDir) {
 
     KJ_SYSCALL(unshare(CLONE_NEWUSER | CLONE_NEWNS |
         // Unshare other stuff; like no_new_privs, this is only to defend against hypothetical
-        // arbitrary code execution bugs in zip/unzip.
-        CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWPID | CLONE_NEWUTS));
+        // arbitrary code execution bugs in the zip code. (Not CLONE_NEWPID: it would only apply
+        // to child processes, which we don't start, and the kernel refuses to create threads
+        // while it's pending.)
+        CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWUTS));
     writeSetgroupsIfPresent("deny\n");
     writeUserNSMap("uid", kj::str("1000 ", uid, " 1\n"));
     writeUserNSMap("gid", kj::str("1000 ", gid, " 1\n"));
   } else {
     KJ_SYSCALL(seteuid(0));
     KJ_SYSCALL(unshare(CLONE_NEWNS |
-        // Unshare other stuff; like no_new_privs, this is only to defend against hypothetical
-        // arbitrary code execution bugs in zip/unzip.
-        CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWPID | CLONE_NEWUTS));
+        // Unshare other stuff, as above.
+        CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWUTS));
   }
 
   // To really unshare the mount namespace, we also have to make sure all mounts are private.
@@ -171,8 +231,22 @@ bool BackupMain::run(kj::StringPtr grainDir) {
     bind(kj::str(grainDir, "/log"), "/tmp/tmp/log", MS_RDONLY | MS_NOEXEC | MS_NOSUID | MS_NODEV);
   }
 
+  // Bind in the chunk store's chunks, read-only: a backup may add chunks only in its own
+  // directory, and the backend checks them before they join the store.
+  if (chunksDir != nullptr) {
+    KJ_SYSCALL(mkdir("/tmp/tmp/store", 0777));
+    KJ_SYSCALL(mkdir("/tmp/tmp/store/chunks", 0777));
+    bind(kj::str(chunksDir, "/chunks"), "/tmp/tmp/store/chunks",
+         MS_NODEV | MS_NOSUID | MS_NOEXEC | MS_RDONLY);
+
+    if (!restore) {
+      KJ_SYSCALL(mkdir("/tmp/tmp/new", 0777));
+      bind(filename, "/tmp/tmp/new", MS_NODEV | MS_NOSUID | MS_NOEXEC);
+    }
+  }
+
   // Bind in the file.
-  if (restore) {
+  if (restore && chunksDir == nullptr) {
     KJ_SYSCALL(mknod("/tmp/tmp/file.zip", S_IFREG | 0666, 0));
     KJ_SYSCALL(mount(filename.cStr(), "/tmp/tmp/file.zip", nullptr, MS_BIND, nullptr));
   }
@@ -192,7 +266,7 @@ bool BackupMain::run(kj::StringPtr grainDir) {
   }
 
   // TODO(security): We could seccomp this pretty tightly, but that would only be necessary to
-  //   defend against *both* zip/unzip *and* the Linux kernel having bugs at the same time. It's
+  //   defend against *both* the zip code *and* the Linux kernel having bugs at the same time. It's
   //   fairly involved to set up, so maybe not worthwhile, unless we could factor the code out of
   //   supervisor.c++...
 
@@ -214,30 +288,25 @@ bool BackupMain::run(kj::StringPtr grainDir) {
     umask(0007);
   }
 
-  // TODO(someday): Find a zip library that doesn't suck and use it instead of shelling out
-  //   to zip/unzip.
   if (restore) {
-    Subprocess({"unzip", "-q", "file.zip", "data/*", "metadata"}).waitForSuccess();
-
-    // Read metadata file to stdout.
-    kj::FdInputStream in(raiiOpen("metadata", O_RDONLY | O_CLOEXEC));
-    kj::FdOutputStream out(STDOUT_FILENO);
-    pump(in, out);
+    if (chunksDir == nullptr) {
+      extractZip(ZipReader(raiiOpen("file.zip", O_RDONLY | O_CLOEXEC)));
+    } else {
+      extractManifest(restoreManifest);
+    }
+  } else if (chunksDir != nullptr) {
+    writeManifest(kj::mv(previousManifestFd));
   } else {
-    Subprocess::Options zipOptions({"zip", "-qy@", "-"});
-    auto inPipe = Pipe::make();
-    zipOptions.stdin = inPipe.readEnd;
-    Subprocess zip(kj::mv(zipOptions));
-    inPipe.readEnd = nullptr;
-
-    {
-      kj::FdOutputStream out(kj::mv(inPipe.writeEnd));
-      for (auto& entry: listDirectory(".")) {
-        findFilesToZip(entry, out);
-      }
+    // The zip code writes headers in small pieces, so buffer them. (File contents are written in
+    // big chunks, which go straight through.)
+    kj::FdOutputStream rawOut(STDOUT_FILENO);
+    kj::BufferedOutputStreamWrapper out(rawOut);
+    ZipWriter zip(out, threadCount);
+    for (auto& entry: listDirectory(".")) {
+      addToZip(zip, entry);
     }
-
-    zip.waitForSuccess();
+    zip.finish();
+    out.flush();
   }
 
   return true;
@@ -250,44 +319,467 @@ void BackupMain::pump(kj::InputStream& in, kj::OutputStream& out) {
   }
 }
 
-bool BackupMain::findFilesToZip(kj::StringPtr path, kj::OutputStream& out) {
+void BackupMain::addToZip(ZipWriter& zip, kj::StringPtr path) {
   struct stat stats;
-  KJ_SYSCALL(lstat(path.cStr(), &stats));
-  if (S_ISREG(stats.st_mode) || S_ISLNK(stats.st_mode)) {
-    // Regular file or link can be zipped; write to file stream.
-    // If the path contains a newline, we cannot correctly pass it to `zip` since `zip` expects
-    // one file per line. For security reasons, we must detect and filter out these files.
-    // Hopefully this never happens legitimately?
-    if (path.findFirst('\n') == nullptr) {
-      kj::ArrayPtr<const byte> pieces[2];
-      pieces[0] = path.asBytes();
-      pieces[1] = kj::StringPtr("\n").asBytes();
-      out.write(pieces);
-      return true;
-    } else {
-      KJ_LOG(ERROR, "tried to backup file containing newlines", path);
-      return false;
-    }
+  KJ_SYSCALL(lstat(path.cStr(), &stats), path);
+  if (S_ISREG(stats.st_mode)) {
+    zip.addFile(path, raiiOpen(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC), stats);
+  } else if (S_ISLNK(stats.st_mode)) {
+    char target[PATH_MAX];
+    ssize_t n;
+    KJ_SYSCALL(n = readlink(path.cStr(), target, sizeof(target) - 1), path);
+    target[n] = '\0';
+    zip.addSymlink(path, target, stats);
   } else if (S_ISDIR(stats.st_mode)) {
-    // Subdirectory; enumerate contents.
-    bool packedAny = false;
+    zip.addDirectory(path, stats);
     for (auto& entry: listDirectory(path)) {
-      if (findFilesToZip(kj::str(path, '/', entry), out)) {
-        packedAny = true;
+      addToZip(zip, kj::str(path, '/', entry));
+    }
+  }
+  // Sockets, FIFOs, and devices can't be backed up, so we skip them, like `zip` did.
+}
+
+// =======================================================================================
+// Restore
+
+static bool isSafePath(kj::StringPtr name) {
+  // Checks that extracting an entry with the given name will put it under the current directory
+  // and nowhere else: no absolute paths, no `..`, no `.` or empty components which would let two
+  // different names refer to the same file. A trailing slash (marking a directory) is OK.
+
+  if (name.size() == 0 || name[0] == '/') return false;
+
+  size_t start = 0;
+  for (size_t i = 0; i <= name.size(); i++) {
+    if (i == name.size() || name[i] == '/') {
+      size_t length = i - start;
+      if (length == 0) {
+        if (i < name.size()) return false;
+      } else if (name[start] == '.' &&
+                 (length == 1 || (length == 2 && name[start + 1] == '.'))) {
+        return false;
       }
+      start = i + 1;
+    } else if (name[i] == '\0') {
+      return false;
     }
+  }
+  return true;
+}
+
+static kj::String withoutTrailingSlash(kj::StringPtr name) {
+  return name.endsWith("/") ? kj::heapString(name.begin(), name.size() - 1) : kj::heapString(name);
+}
+
+static kj::String parentOf(kj::StringPtr path) {
+  KJ_IF_MAYBE(slash, path.findLast('/')) {
+    return kj::heapString(path.begin(), *slash);
+  } else {
+    return kj::heapString(".");
+  }
+}
 
-    if (!packedAny) {
-      // Empty directory. Need to make sure it gets into the zip.
-      kj::ArrayPtr<const byte> pieces[2];
-      pieces[0] = path.asBytes();
-      pieces[1] = kj::StringPtr("\n").asBytes();
-      out.write(pieces);
+static void makeDirectories(kj::StringPtr path) {
+  // Like `mkdir -p`. Throws if anything along the way exists but is not a directory -- including
+  // a symlink, so make sure not to create any of those before calling this.
+
+  for (size_t i = 1; i <= path.size(); i++) {
+    if (i < path.size() && path[i] != '/') continue;
+
+    auto prefix = kj::heapString(path.begin(), i);
+    while (mkdir(prefix.cStr(), 0777) < 0) {
+      int error = errno;
+      if (error == EEXIST) {
+        struct stat stats;
+        KJ_SYSCALL(lstat(prefix.cStr(), &stats), prefix);
+        KJ_REQUIRE(S_ISDIR(stats.st_mode), "backup has a directory inside a non-directory", path);
+        break;
+      } else if (error != EINTR) {
+        KJ_FAIL_SYSCALL("mkdir", error, prefix);
+      }
     }
-    return true;
+  }
+}
+
+static void requireNoSymlinks(kj::StringPtr path) {
+  // Checks that every component of `path` is a real directory, so that creating something inside
+  // it can't follow a symlink out of the grain.
+
+  for (size_t i = 1; i <= path.size(); i++) {
+    if (i < path.size() && path[i] != '/') continue;
+
+    auto prefix = kj::heapString(path.begin(), i);
+    struct stat stats;
+    KJ_SYSCALL(lstat(prefix.cStr(), &stats), prefix);
+    KJ_REQUIRE(S_ISDIR(stats.st_mode), "backup has an entry inside a non-directory", path);
+  }
+}
+
+static void setModificationTime(int fd, kj::StringPtr path, int64_t time) {
+  // Sets the mtime (in nanoseconds) of `fd`, or of `path` (without following symlinks) if `fd` is
+  // -1.
+
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1].tv_sec = time / 1000000000;
+  times[1].tv_nsec = time % 1000000000;
+  if (times[1].tv_nsec < 0) {
+    times[1].tv_nsec += 1000000000;
+    --times[1].tv_sec;
+  }
+
+  if (fd < 0) {
+    KJ_SYSCALL(utimensat(AT_FDCWD, path.cStr(), times, AT_SYMLINK_NOFOLLOW), path);
   } else {
-    return false;
+    KJ_SYSCALL(futimens(fd, times), path);
+  }
+}
+
+class SymlinkTargetStream final: public kj::OutputStream {
+  // Collects the content of a symlink entry, which is its target.
+
+public:
+  void write(const void* buffer, size_t size) override {
+    KJ_REQUIRE(chars.size() + size < PATH_MAX, "symlink target in backup is too long");
+    auto bytes = reinterpret_cast<const char*>(buffer);
+    KJ_REQUIRE(memchr(bytes, '\0', size) == nullptr, "symlink target in backup contains NUL");
+    chars.addAll(bytes, bytes + size);
+  }
+
+  kj::String finish() {
+    chars.add('\0');
+    return kj::String(chars.releaseAsArray());
   }
+
+private:
+  kj::Vector<char> chars;
+};
+
+struct BackupMain::ExtractEntry {
+  kj::StringPtr name;
+  // Path relative to the grain directory, e.g. "data/foo". May end with '/' for a directory.
+
+  mode_t mode;
+  int64_t modificationTime;  // nanoseconds since the epoch
+
+  kj::Function<void(kj::OutputStream&)> readContent;
+  // Writes a file's content or a symlink's target. Called at most once, possibly from another
+  // thread.
+};
+
+void BackupMain::extractTree(kj::ArrayPtr<ExtractEntry> entries) {
+  // Extracts the entries under `data/`, as `unzip` would, except that we never let an entry
+  // write outside of `data`, even via a symlink created by an earlier entry. To ensure this, we
+  // create all directories, then all regular files, and only then symlinks.
+
+  kj::Vector<ExtractEntry*> directories;
+  kj::Vector<ExtractEntry*> files;
+  kj::Vector<ExtractEntry*> symlinks;
+
+  for (auto& entry: entries) {
+    if (entry.name != "data" && !entry.name.startsWith("data/")) continue;
+    KJ_REQUIRE(isSafePath(entry.name), "backup contains an unsafe path", entry.name);
+
+    if (entry.name.endsWith("/") || S_ISDIR(entry.mode)) {
+      directories.add(&entry);
+    } else if (S_ISLNK(entry.mode)) {
+      symlinks.add(&entry);
+    } else if (S_ISREG(entry.mode)) {
+      files.add(&entry);
+    }
+    // Anything else is an odd thing to find in a backup; skip it.
+  }
+
+  for (auto entry: directories) {
+    makeDirectories(withoutTrailingSlash(entry->name));
+  }
+  for (auto entry: files) {
+    makeDirectories(parentOf(entry->name));
+  }
+  for (auto entry: symlinks) {
+    makeDirectories(parentOf(entry->name));
+  }
+
+  // Extract files on several threads, since a typical grain's storage is dominated by
+  // compressed data that takes a while to inflate.
+  {
+    struct ExtractState {
+      size_t next = 0;
+      kj::Maybe<kj::Exception> error;
+    };
+    kj::MutexGuarded<ExtractState> state;
+
+    auto extractFiles = [&]() {
+      for (;;) {
+        ExtractEntry* entry;
+        {
+          auto lock = state.lockExclusive();
+          if (lock->next == files.size() || lock->error != nullptr) return;
+          entry = files[lock->next++];
+        }
+
+        KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+          auto fd = raiiOpen(entry->name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                             entry->mode & 0777);
+          kj::FdOutputStream out(fd.get());
+          entry->readContent(out);
+          setModificationTime(fd, entry->name, entry->modificationTime);
+        })) {
+          auto lock = state.lockExclusive();
+          if (lock->error == nullptr) {
+            lock->error = kj::mv(*exception);
+          }
+        }
+      }
+    };
+
+    {
+      kj::Vector<kj::Own<kj::Thread>> helpers;
+      for (uint i = 1; i < threadCount && i < files.size(); i++) {
+        helpers.add(kj::heap<kj::Thread>([&]() { extractFiles(); }));
+      }
+      extractFiles();
+    }  // joins helpers
+
+    auto lock = state.lockExclusive();
+    KJ_IF_MAYBE(exception, lock->error) {
+      kj::throwFatalException(kj::mv(*exception));
+    }
+  }
+
+  for (auto entry: symlinks) {
+    requireNoSymlinks(parentOf(entry->name));
+    SymlinkTargetStream target;
+    entry->readContent(target);
+    KJ_SYSCALL(symlink(target.finish().cStr(), entry->name.cStr()), entry->name);
+    setModificationTime(-1, entry->name, entry->modificationTime);
+  }
+
+  // Set directory permissions and times last, since creating their contents would change the
+  // times, and the permissions might not allow it. Parents come before children, so go
+  // backwards.
+  for (size_t i = directories.size(); i > 0; i--) {
+    auto& entry = *directories[i - 1];
+    auto path = withoutTrailingSlash(entry.name);
+    // Unlike open() and mkdir(), chmod() ignores the umask, so apply it ourselves.
+    KJ_SYSCALL(chmod(path.cStr(), entry.mode & 0777 & ~0007), path);
+    setModificationTime(-1, path, entry.modificationTime);
+  }
+}
+
+void BackupMain::extractZip(const ZipReader& zip) {
+  kj::Vector<ExtractEntry> entries(zip.getEntries().size());
+  for (auto& entry: zip.getEntries()) {
+    mode_t mode = entry.name.endsWith("/") ? 0777 : 0666;
+    auto unixMode = entry.getUnixMode();
+    KJ_IF_MAYBE(m, unixMode) {
+      mode = *m;
+    }
+    if ((mode & S_IFMT) == 0) {
+      mode |= entry.name.endsWith("/") ? S_IFDIR : S_IFREG;
+    }
+
+    entries.add(ExtractEntry {
+      entry.name, mode, entry.modificationTime * 1000000000,
+      [&zip,&entry](kj::OutputStream& out) { zip.read(entry, out); }
+    });
+  }
+  extractTree(entries.asPtr());
+
+  // Write metadata to stdout.
+  const ZipReader::Entry* metadata = nullptr;
+  for (auto& entry: zip.getEntries()) {
+    if (entry.name == "metadata") {
+      metadata = &entry;
+    }
+  }
+  KJ_REQUIRE(metadata != nullptr, "backup has no metadata");
+  kj::FdOutputStream out(STDOUT_FILENO);
+  zip.read(*metadata, out);
+}
+
+void BackupMain::extractManifest(int manifestFd) {
+  ChunkStore store("store");
+
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = kj::maxValue;
+  capnp::StreamFdMessageReader message(manifestFd, options);
+  auto manifest = message.getRoot<BackupManifest>();
+
+  struct ChunkRef {
+    kj::ArrayPtr<const kj::byte> hash;
+    uint32_t size;
+  };
+
+  auto files = manifest.getFiles();
+  kj::Vector<ExtractEntry> entries(files.size());
+  for (auto file: files) {
+    // Copy out everything the extraction threads need, as Cap'n Proto readers don't like being
+    // shared between threads.
+    kj::Function<void(kj::OutputStream&)> readContent;
+    switch (file.which()) {
+      case BackupManifest::File::DIRECTORY:
+        readContent = [](kj::OutputStream& out) {};
+        break;
+      case BackupManifest::File::SYMLINK: {
+        kj::StringPtr target = file.getSymlink();
+        readContent = [target](kj::OutputStream& out) { out.write(target.begin(), target.size()); };
+        break;
+      }
+      case BackupManifest::File::REGULAR: {
+        auto chunkList = file.getRegular();
+        auto refs = kj::heapArray<ChunkRef>(chunkList.size());
+        for (uint i = 0; i < chunkList.size(); i++) {
+          refs[i].hash = chunkList[i].getHash();
+          refs[i].size = chunkList[i].getSize();
+        }
+        readContent = [&store,chunks = kj::mv(refs)](kj::OutputStream& out) {
+          for (auto& chunk: chunks) {
+            store.read(chunk.hash, chunk.size, out);
+          }
+        };
+        break;
+      }
+    }
+
+    entries.add(ExtractEntry {
+      file.getPath(), file.getMode(), file.getModificationTime(), kj::mv(readContent)
+    });
+  }
+  extractTree(entries.asPtr());
+
+  auto metadata = manifest.getMetadata();
+  kj::FdOutputStream(STDOUT_FILENO).write(metadata.begin(), metadata.size());
+}
+
+// =======================================================================================
+// Incremental backup
+
+static int64_t toNanoseconds(const struct timespec& time) {
+  return time.tv_sec * int64_t(1000000000) + time.tv_nsec;
+}
+
+struct BackupMain::LocalFile {
+  kj::String path;
+  struct stat stats;
+};
+
+void BackupMain::listTree(kj::String path, kj::Vector<LocalFile>& files) {
+  struct stat stats;
+  KJ_SYSCALL(lstat(path.cStr(), &stats), path);
+  if (S_ISDIR(stats.st_mode)) {
+    auto children = listDirectory(path);
+    files.add(LocalFile { kj::mv(path), stats });
+    auto& parent = files.back().path;
+    for (auto& child: children) {
+      listTree(kj::str(parent, '/', child), files);
+    }
+  } else if (S_ISREG(stats.st_mode) || S_ISLNK(stats.st_mode)) {
+    files.add(LocalFile { kj::mv(path), stats });
+  }
+  // Sockets, FIFOs, and devices can't be backed up, so we skip them, like `zip` did.
+}
+
+void BackupMain::writeManifest(kj::Maybe<kj::AutoCloseFd> previousManifestFd) {
+  ChunkStore store("store", "new/chunks");
+
+  // Index the previous backup's files by path, so that we can skip reading those which haven't
+  // changed.
+  kj::Maybe<kj::Own<capnp::StreamFdMessageReader>> previous;
+  std::map<kj::StringPtr, BackupManifest::File::Reader> previousFiles;
+  KJ_IF_MAYBE(fd, previousManifestFd) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      capnp::ReaderOptions options;
+      options.traversalLimitInWords = kj::maxValue;
+      auto reader = kj::heap<capnp::StreamFdMessageReader>(fd->get(), options);
+      for (auto file: reader->getRoot<BackupManifest>().getFiles()) {
+        previousFiles.insert(std::make_pair(kj::StringPtr(file.getPath()), file));
+      }
+      previous = kj::mv(reader);
+    })) {
+      KJ_LOG(WARNING, "couldn't read previous backup; reading all files", *exception);
+      previousFiles.clear();
+    }
+  }
+
+  kj::Vector<LocalFile> files;
+  for (auto& entry: listDirectory(".")) {
+    if (entry == "metadata" || entry == "store" || entry == "new") continue;  // not the grain's
+    listTree(kj::mv(entry), files);
+  }
+
+  capnp::MallocMessageBuilder message;
+  auto manifest = message.initRoot<BackupManifest>();
+  auto metadata = readAllBytes(raiiOpen("metadata", O_RDONLY | O_CLOEXEC));
+  manifest.setMetadata(capnp::Data::Reader(metadata.begin(), metadata.size()));
+
+  Chunker chunker;
+  struct NewChunk {
+    kj::Array<kj::byte> hash;
+    uint32_t size;
+  };
+  kj::Vector<NewChunk> newChunks;
+
+  auto list = manifest.initFiles(files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    auto& file = files[i];
+    auto builder = list[i];
+    builder.setPath(file.path);
+    builder.setMode(file.stats.st_mode);
+    builder.setModificationTime(toNanoseconds(file.stats.st_mtim));
+    builder.setChangeTime(toNanoseconds(file.stats.st_ctim));
+    builder.setSize(file.stats.st_size);
+
+    if (S_ISDIR(file.stats.st_mode)) {
+      builder.setDirectory();
+    } else if (S_ISLNK(file.stats.st_mode)) {
+      char target[PATH_MAX];
+      ssize_t n;
+      KJ_SYSCALL(n = readlink(file.path.cStr(), target, sizeof(target)), file.path);
+      builder.setSymlink(capnp::Text::Reader(target, n));
+    } else {
+      auto iter = previousFiles.find(file.path);
+      if (iter != previousFiles.end()) {
+        auto old = iter->second;
+        if (old.isRegular() && old.getSize() == builder.getSize() &&
+            old.getModificationTime() == builder.getModificationTime() &&
+            old.getChangeTime() == builder.getChangeTime()) {
+          bool allPresent = true;
+          for (auto chunk: old.getRegular()) {
+            if (!store.contains(chunk.getHash())) {
+              allPresent = false;
+              break;
+            }
+          }
+          if (allPresent) {
+            builder.setRegular(old.getRegular());
+            continue;
+          }
+        }
+      }
+
+      auto fd = raiiOpen(file.path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      chunker.reset(fd);
+      for (;;) {
+        auto chunk = chunker.next();
+        if (chunk.size() == 0) break;
+        newChunks.add(NewChunk { store.add(chunk), static_cast<uint32_t>(chunk.size()) });
+      }
+
+      auto chunks = builder.initRegular(newChunks.size());
+      for (size_t j = 0; j < newChunks.size(); j++) {
+        auto& hash = newChunks[j].hash;
+        chunks[j].setHash(capnp::Data::Reader(hash.begin(), hash.size()));
+        chunks[j].setSize(newChunks[j].size);
+      }
+      newChunks.clear();
+    }
+  }
+
+  auto out = raiiOpen("new/manifest", O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC);
+  capnp::writeMessageToFd(out, message);
+  KJ_SYSCALL(fsync(out));
 }
 
 } // namespace sandstorm
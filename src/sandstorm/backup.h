@@ -18,7 +18,10 @@
 #define SANDSTORM_BACKUP_H_
 
 #include "abstract-main.h"
+#include "zip.h"
+#include <kj/function.h>
 #include <kj/io.h>
+#include <kj/vector.h>
 #include <unistd.h>
 
 namespace sandstorm {
@@ -33,6 +36,8 @@ public:
   bool setRestore();
   bool setFile(kj::StringPtr arg);
   bool setRoot(kj::StringPtr arg);
+  bool setChunks(kj::StringPtr arg);
+  bool setPrevious(kj::StringPtr arg);
   bool setUid(kj::StringPtr arg);
   bool run(kj::StringPtr grainDir);
 
@@ -42,12 +47,24 @@ private:
   kj::StringPtr filename;
   kj::StringPtr root = "";
   kj::Maybe<uid_t> sandboxUid;
+  kj::StringPtr chunksDir;         // empty unless incremental
+  kj::StringPtr previousManifest;  // empty if none
+  uint threadCount = 1;
 
   void writeSetgroupsIfPresent(const char *contents);
   void writeUserNSMap(const char *type, kj::StringPtr contents);
   void bind(kj::StringPtr src, kj::StringPtr dst, unsigned long flags);
   static void pump(kj::InputStream& in, kj::OutputStream& out);
-  bool findFilesToZip(kj::StringPtr path, kj::OutputStream& out);
+  void addToZip(ZipWriter& zip, kj::StringPtr path);
+
+  struct LocalFile;
+  void listTree(kj::String path, kj::Vector<LocalFile>& files);
+  void writeManifest(kj::Maybe<kj::AutoCloseFd> previousManifestFd);
+
+  struct ExtractEntry;
+  void extractTree(kj::ArrayPtr<ExtractEntry> entries);
+  void extractZip(const ZipReader& zip);
+  void extractManifest(int manifestFd);
 };
 
 } // namespace sandstorm
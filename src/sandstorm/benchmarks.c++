@@ -0,0 +1,336 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util.h"
+#include "simd-http-parser.h"
+#include <kj/main.h>
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <string.h>
+
+namespace sandstorm {
+namespace {
+
+// =======================================================================================
+// HttpBodyWriter
+
+kj::Promise<uint64_t> drainLoop(kj::AsyncInputStream& input, kj::ArrayPtr<byte> buffer,
+                                uint64_t total) {
+  return input.tryRead(buffer.begin(), 1, buffer.size())
+      .then([&input,buffer,total](size_t n) -> kj::Promise<uint64_t> {
+    if (n == 0) return total;
+    return drainLoop(input, buffer, total + n);
+  });
+}
+
+void benchmarkUpload(kj::ProcessContext& context) {
+  // Simulates a chunked streaming upload arriving as many small pipelined ByteStream.write()
+  // calls, as sandstorm-http-bridge sees it, with and without coalescing.
+
+  static constexpr size_t CHUNK_SIZE = 4096;
+  static constexpr size_t CHUNK_COUNT = 8192;
+  static constexpr size_t WINDOW = 64;
+
+  auto io = kj::setupAsyncIo();
+  auto chunk = kj::heapArray<byte>(CHUNK_SIZE);
+  memset(chunk.begin(), 'x', chunk.size());
+
+  for (bool coalesce: {false, true}) {
+    auto pipe = io.provider->newTwoWayPipe();
+    auto readBuffer = kj::heapArray<byte>(65536);
+    auto received = drainLoop(*pipe.ends[1], readBuffer, 0);
+
+    auto startTime = monotonicNanoseconds();
+
+    kj::Vector<kj::Promise<void>> writes(CHUNK_COUNT);
+    if (coalesce) {
+      HttpBodyWriter writer(*pipe.ends[0]);
+      writer.setChunked(true);
+      for (size_t i = 0; i < CHUNK_COUNT; i++) {
+        if (i >= WINDOW) kj::mv(writes[i - WINDOW]).wait(io.waitScope);
+        writes.add(writer.writeBody(chunk));
+      }
+      writer.finish().wait(io.waitScope);
+    } else {
+      // The way RequestStreamImpl used to do it: three writes per chunk, each waiting on the last.
+      auto& stream = *pipe.ends[0];
+      kj::Promise<void> previousWrite = kj::READY_NOW;
+      for (size_t i = 0; i < CHUNK_COUNT; i++) {
+        if (i >= WINDOW) kj::mv(writes[i - WINDOW]).wait(io.waitScope);
+        auto fork = previousWrite.then([&]() {
+          kj::String chunkSize = kj::str(kj::hex(chunk.size()), "\r\n");
+          kj::ArrayPtr<char> buffer = chunkSize.asArray();
+          return stream.write(buffer.begin(), buffer.size())
+              .attach(kj::mv(chunkSize))
+              .then([&]() {
+            return stream.write(chunk.begin(), chunk.size()).then([&]() {
+              return stream.write("\r\n", 2);
+            });
+          });
+        }).fork();
+        previousWrite = fork.addBranch();
+        writes.add(fork.addBranch());
+      }
+      previousWrite.then([&]() { return stream.write("0\r\n\r\n", 5); }).wait(io.waitScope);
+    }
+    pipe.ends[0]->shutdownWrite();
+    uint64_t total = received.wait(io.waitScope);
+
+    auto elapsed = monotonicNanoseconds() - startTime;
+    KJ_ASSERT(total == CHUNK_COUNT * (CHUNK_SIZE + 8) + 5, total);
+    context.warning(kj::str("upload, ", coalesce ? "coalesced" : "three writes per chunk", ": ",
+                            elapsed / 1000000, " ms, ",
+                            total * 1000 / kj::max(elapsed, 1ull), " MB/s"));
+  }
+}
+
+// =======================================================================================
+// HttpHeadBuilder
+
+void benchmarkRequestHead(kj::ProcessContext& context) {
+  // Builds a typical sandstorm-http-bridge request head many times, both the old way (a string
+  // per line, then joined) and with HttpHeadBuilder.
+
+  static constexpr uint ITERATIONS = 100000;
+
+  kj::StringPtr sessionLines[] = {
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)",
+    "X-Sandstorm-Tab-Id: 0123456789abcdef0123456789abcdef",
+    "X-Sandstorm-Username: Alice%20Smith",
+    "X-Sandstorm-User-Id: 0123456789abcdef0123456789abcdef",
+    "X-Sandstorm-Preferred-Handle: alice",
+    "X-Sandstorm-Permissions: read,write,admin",
+    "X-Sandstorm-Base-Path: https://ui-0123456789abcdef.example.com",
+    "Host: ui-0123456789abcdef.example.com",
+    "X-Forwarded-Proto: https",
+    "X-Sandstorm-Session-Id: 0123456789abcdef0123456789abcdef",
+  };
+  kj::StringPtr cookieArray[] = { "session=abcdef0123456789", "theme=dark", "lang=en" };
+  kj::StringPtr acceptArray[] = { "text/html", "application/xhtml+xml", "application/xml" };
+  auto cookies = kj::arrayPtr(cookieArray, kj::size(cookieArray));
+  auto accept = kj::arrayPtr(acceptArray, kj::size(acceptArray));
+
+  size_t checksum = 0;
+
+  auto startTime = monotonicNanoseconds();
+  for (uint n = 0; n < ITERATIONS; n++) {
+    kj::Vector<kj::String> lines(16);
+    lines.add(kj::str("GET ", "/", "some/path?query=1", " HTTP/1.1"));
+    lines.add(kj::str("Accept-Language: ", "en-US,en;q=0.8"));
+    for (auto line: sessionLines) {
+      lines.add(kj::str(line));
+    }
+    lines.add(kj::str("Cookie: ", kj::strArray(cookies, "; ")));
+    lines.add(kj::str("Accept: ", kj::strArray(accept, ", ")));
+    lines.add(kj::str(""));
+    lines.add(kj::str(""));
+    for (auto& line: lines) {
+      KJ_ASSERT(line.findFirst('\n') == nullptr);
+    }
+    auto text = kj::strArray(lines, "\r\n");
+    auto bytes = kj::heapArray<byte>(text.size());
+    memcpy(bytes.begin(), text.begin(), text.size());
+    checksum += bytes.size();
+  }
+  auto linesTime = monotonicNanoseconds() - startTime;
+
+  HttpHeadBuilder sessionBuilder;
+  for (auto line: sessionLines) {
+    sessionBuilder.addLine(line);
+  }
+  auto sessionHeaders = kj::heapString(sessionBuilder.getLines());
+
+  startTime = monotonicNanoseconds();
+  for (uint n = 0; n < ITERATIONS; n++) {
+    HttpHeadBuilder request(sessionHeaders.size() + 1024);
+    request.addLine("GET ", "/", "some/path?query=1", " HTTP/1.1");
+    request.addLine("Accept-Language: ", "en-US,en;q=0.8");
+    request.addLines(sessionHeaders);
+    request.add("Cookie: ");
+    for (uint i: kj::indices(cookies)) {
+      if (i > 0) request.add("; ");
+      request.add(cookies[i]);
+    }
+    request.endLine();
+    request.add("Accept: ");
+    for (uint i: kj::indices(accept)) {
+      if (i > 0) request.add(", ");
+      request.add(accept[i]);
+    }
+    request.endLine();
+    checksum -= request.finish().size();
+  }
+  auto builderTime = monotonicNanoseconds() - startTime;
+
+  KJ_ASSERT(checksum == 0);
+  context.warning(kj::str("request head, line vector: ", linesTime / ITERATIONS, " ns/request"));
+  context.warning(kj::str("request head, HttpHeadBuilder: ", builderTime / ITERATIONS,
+                          " ns/request"));
+}
+
+// =======================================================================================
+// SimdHttpParser
+
+size_t benchmarkBytes = 0;
+int countBytes(http_parser*, const char*, size_t n) { benchmarkBytes += n; return 0; }
+int pauseAtEnd(http_parser* p) { http_parser_pause(p, 1); return 0; }
+
+void benchmarkResponseParser(kj::ProcessContext& context) {
+  // Parses a typical response head, and a 64KB chunked response, many times with http_parser and
+  // with each SimdHttpParser variant that this CPU supports.
+
+  kj::StringPtr head =
+      "HTTP/1.1 200 OK\r\n"
+      "Server: nginx/1.10.3\r\n"
+      "Date: Mon, 27 Feb 2017 10:00:00 GMT\r\n"
+      "Content-Type: text/html; charset=utf-8\r\n"
+      "Content-Length: 5\r\n"
+      "Connection: keep-alive\r\n"
+      "Cache-Control: no-cache, no-store, must-revalidate\r\n"
+      "ETag: \"5c3a-54f9b9a3c1e80\"\r\n"
+      "Set-Cookie: session=0123456789abcdef0123456789abcdef; Path=/; HttpOnly\r\n"
+      "Content-Security-Policy: default-src 'self'; script-src 'self' 'unsafe-inline'\r\n"
+      "X-Frame-Options: SAMEORIGIN\r\n"
+      "Vary: Accept-Encoding\r\n"
+      "\r\n"
+      "hello";
+
+  kj::Vector<char> chunkedText;
+  chunkedText.addAll(kj::StringPtr("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"));
+  for (uint i = 0; i < 64; i++) {
+    chunkedText.addAll(kj::StringPtr("400;name=value\r\n"));
+    for (uint j = 0; j < 1024; j++) chunkedText.add('x');
+    chunkedText.addAll(kj::StringPtr("\r\n"));
+  }
+  chunkedText.addAll(kj::StringPtr("0\r\n\r\n"));
+  auto chunked = kj::heapString(chunkedText.begin(), chunkedText.size());
+
+  http_parser_settings settings;
+  memset(&settings, 0, sizeof(settings));
+  settings.on_status = &countBytes;
+  settings.on_header_field = &countBytes;
+  settings.on_header_value = &countBytes;
+  settings.on_body = &countBytes;
+  settings.on_message_complete = &pauseAtEnd;
+
+  struct Case {
+    kj::StringPtr name;
+    kj::StringPtr input;
+    uint iterations;
+  };
+  Case cases[] = {
+    { "response head", head, 100000 },
+    { "64KB chunked response", chunked, 2000 },
+  };
+
+  for (auto& c: cases) {
+    auto time = [&](kj::Maybe<SimdHttpParser::Isa> isa) -> uint64_t {
+      auto startTime = monotonicNanoseconds();
+      for (uint n = 0; n < c.iterations; n++) {
+        http_parser parser;
+        http_parser_init(&parser, HTTP_RESPONSE);
+        KJ_IF_MAYBE(i, isa) {
+          SimdHttpParser simd(*i);
+          simd.execute(parser, settings, c.input.begin(), c.input.size());
+        } else {
+          http_parser_execute(&parser, &settings, c.input.begin(), c.input.size());
+        }
+        KJ_ASSERT(parser.http_errno == HPE_PAUSED);
+      }
+      return (monotonicNanoseconds() - startTime) / c.iterations;
+    };
+
+    context.warning(kj::str("response parser, ", c.name, ", http_parser: ", time(nullptr),
+                            " ns/response"));
+    for (auto isa: {SimdHttpParser::Isa::SCALAR, SimdHttpParser::Isa::SSE2,
+                    SimdHttpParser::Isa::AVX2}) {
+      if (!SimdHttpParser::isSupported(isa)) continue;
+      context.warning(kj::str("response parser, ", c.name, ", ", SimdHttpParser::isaName(isa),
+                              ": ", time(isa), " ns/response"));
+    }
+  }
+
+  KJ_ASSERT(benchmarkBytes > 0);
+}
+
+// =======================================================================================
+
+struct Benchmark {
+  kj::StringPtr name;
+  void (*run)(kj::ProcessContext& context);
+};
+
+const Benchmark BENCHMARKS[] = {
+  { "upload", &benchmarkUpload },
+  { "request-head", &benchmarkRequestHead },
+  { "response-parser", &benchmarkResponseParser },
+};
+
+}  // namespace
+
+class BenchmarkMain {
+  // Times hot paths of sandstorm-http-bridge. These used to be KJ_TESTs, but they made the test
+  // suite slow and their numbers mean little on a loaded machine, so they're a program of their
+  // own that is built along with everything else but only ever run by hand.
+
+public:
+  BenchmarkMain(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    kj::Vector<kj::StringPtr> names;
+    for (auto& benchmark: BENCHMARKS) {
+      names.add(benchmark.name);
+    }
+    description = kj::str("Runs each <benchmark> named, or all of them, and prints the timings. "
+                          "Benchmarks: ", kj::strArray(names, ", "), ".");
+
+    return kj::MainBuilder(context, "Sandstorm benchmarks", description)
+        .expectZeroOrMoreArgs("<benchmark>", KJ_BIND_METHOD(*this, addBenchmark))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  kj::String description;
+  kj::Vector<const Benchmark*> selected;
+
+  kj::MainBuilder::Validity addBenchmark(kj::StringPtr name) {
+    for (auto& benchmark: BENCHMARKS) {
+      if (benchmark.name == name) {
+        selected.add(&benchmark);
+        return true;
+      }
+    }
+    return "no such benchmark";
+  }
+
+  kj::MainBuilder::Validity run() {
+    if (selected.size() == 0) {
+      for (auto& benchmark: BENCHMARKS) {
+        selected.add(&benchmark);
+      }
+    }
+    for (auto benchmark: selected) {
+      benchmark->run(context);
+    }
+    return true;
+  }
+};
+
+}  // namespace sandstorm
+
+KJ_MAIN(sandstorm::BenchmarkMain)
@@ -0,0 +1,213 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "chunk-store.h"
+#include "util.h"
+#include "test-util.h"
+#include <sandstorm/backend.capnp.h>
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <kj/test.h>
+#include <kj/vector.h>
+#include <set>
+#include <unistd.h>
+
+namespace sandstorm {
+namespace {
+
+class CollectingOutputStream final: public kj::OutputStream {
+public:
+  void write(const void* buffer, size_t size) override {
+    auto bytes = reinterpret_cast<const kj::byte*>(buffer);
+    data.addAll(bytes, bytes + size);
+  }
+
+  kj::Vector<kj::byte> data;
+};
+
+kj::Array<kj::byte> makeContent(size_t size, uint64_t seed) {
+  auto result = kj::heapArray<kj::byte>(size);
+  uint64_t state = seed;
+  for (auto& b: result) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    b = state;
+  }
+  return result;
+}
+
+kj::Vector<kj::String> chunkFile(kj::StringPtr path, kj::ArrayPtr<const kj::byte> content) {
+  // Writes `content` to `path` and returns a string form of each of its chunks.
+  kj::FdOutputStream(raiiOpen(path, O_WRONLY | O_CREAT | O_TRUNC))
+      .write(content.begin(), content.size());
+
+  kj::Vector<kj::String> result;
+  size_t total = 0;
+  Chunker chunker;
+  auto fd = raiiOpen(path, O_RDONLY);
+  chunker.reset(fd);
+  for (;;) {
+    auto chunk = chunker.next();
+    if (chunk.size() == 0) break;
+    KJ_EXPECT(chunk.size() <= Chunker::MAX_SIZE);
+    total += chunk.size();
+    result.add(hexEncode(chunk));
+  }
+  KJ_EXPECT(total == content.size());
+  return result;
+}
+
+KJ_TEST("Chunker boundaries survive an insertion") {
+  TempDir dir;
+  auto path = kj::str(dir.path, "/file");
+
+  auto content = makeContent(8 << 20, 88172645463325252ull);
+  auto before = chunkFile(path, content);
+  KJ_EXPECT(before.size() > 32, before.size());
+  for (auto& chunk: before.slice(0, before.size() - 1)) {
+    KJ_EXPECT(chunk.size() / 2 >= Chunker::MIN_SIZE);
+  }
+
+  // Insert a few bytes near the start. Only the chunk containing them should change.
+  kj::Vector<kj::byte> edited;
+  edited.addAll(content.begin(), content.begin() + 1000);
+  edited.addAll(kj::StringPtr("inserted").asBytes());
+  edited.addAll(content.begin() + 1000, content.end());
+  auto after = chunkFile(path, edited.asPtr());
+
+  std::set<kj::StringPtr> beforeSet;
+  for (auto& chunk: before) beforeSet.insert(chunk);
+  size_t changed = 0;
+  for (auto& chunk: after) {
+    if (beforeSet.count(chunk) == 0) ++changed;
+  }
+  KJ_EXPECT(changed <= 2, changed, after.size());
+}
+
+KJ_TEST("ChunkStore round trip") {
+  TempDir dir;
+  ChunkStore store(dir.path);
+
+  auto content = makeContent(100000, 1);
+  auto hash = store.add(content);
+  KJ_EXPECT(store.contains(hash));
+  KJ_EXPECT(hexEncode(store.add(content)) == hexEncode(hash));
+
+  {
+    CollectingOutputStream out;
+    store.read(hash, content.size(), out);
+    KJ_EXPECT(out.data.asPtr() == content.asPtr());
+  }
+
+  auto other = makeContent(100, 2);
+  auto otherHash = store.add(other);
+  KJ_EXPECT(hexEncode(otherHash) != hexEncode(hash));
+
+  // A chunk file that doesn't match its name is rejected.
+  auto hex = hexEncode(hash);
+  auto otherHex = hexEncode(otherHash);
+  KJ_SYSCALL(rename(kj::str(dir.path, "/chunks/", otherHex.slice(0, 2), '/', otherHex).cStr(),
+                    kj::str(dir.path, "/chunks/", hex.slice(0, 2), '/', hex).cStr()));
+  CollectingOutputStream out;
+  KJ_EXPECT(kj::runCatchingExceptions([&]() { store.read(hash, other.size(), out); })
+      != nullptr);
+}
+
+void writeManifest(kj::StringPtr path, kj::ArrayPtr<const kj::Array<kj::byte>> hashes,
+                   size_t chunkSize) {
+  // Writes a manifest with one file, made of the given chunks.
+  capnp::MallocMessageBuilder message;
+  auto file = message.initRoot<BackupManifest>().initFiles(1)[0];
+  file.setPath("data/file");
+  auto chunks = file.initRegular(hashes.size());
+  for (uint i = 0; i < hashes.size(); i++) {
+    chunks[i].setHash(capnp::Data::Reader(hashes[i].begin(), hashes[i].size()));
+    chunks[i].setSize(chunkSize);
+  }
+  capnp::writeMessageToFd(raiiOpen(path, O_WRONLY | O_CREAT | O_EXCL), message);
+}
+
+KJ_TEST("commitIncrementalBackup checks what the backup wrote") {
+  TempDir dir;
+  ChunkStore store(dir.path);
+  auto shared = store.add(makeContent(1000, 1));
+
+  // A backup which reuses one chunk and adds another.
+  auto incoming = kj::str(dir.path, "/incoming/backup-one");
+  recursivelyCreateParent(kj::str(incoming, "/chunks/x"));
+  ChunkStore sandboxed(dir.path, kj::str(incoming, "/chunks"));
+  auto content = makeContent(1000, 2);
+  auto added = sandboxed.add(content);
+  KJ_EXPECT(sandboxed.contains(added));
+  KJ_EXPECT(!store.contains(added));
+  writeManifest(kj::str(incoming, "/manifest"),
+                kj::arr(kj::heapArray(shared.asPtr()), kj::heapArray(added.asPtr())), 1000);
+
+  commitIncrementalBackup(dir.path, "backup-one", "grain-one");
+  KJ_EXPECT(access(incoming.cStr(), F_OK) < 0);
+  KJ_EXPECT(access(kj::str(dir.path, "/manifests/backup-one").cStr(), F_OK) == 0);
+  KJ_EXPECT(access(kj::str(dir.path, "/latest/grain-one").cStr(), F_OK) == 0);
+  {
+    CollectingOutputStream out;
+    store.read(added, content.size(), out);
+    KJ_EXPECT(out.data.asPtr() == content.asPtr());
+  }
+
+  // A backup whose new chunk doesn't match its name is refused, and nothing joins the store.
+  incoming = kj::str(dir.path, "/incoming/backup-two");
+  recursivelyCreateParent(kj::str(incoming, "/chunks/x"));
+  ChunkStore liar(dir.path, kj::str(incoming, "/chunks"));
+  auto claimed = liar.add(makeContent(1000, 3));
+  auto actual = liar.add(makeContent(1000, 4));
+  KJ_SYSCALL(rename(kj::str(incoming, "/chunks/", hexEncode(actual)).cStr(),
+                    kj::str(incoming, "/chunks/", hexEncode(claimed)).cStr()));
+  writeManifest(kj::str(incoming, "/manifest"), kj::arr(kj::heapArray(claimed.asPtr())), 1000);
+
+  KJ_EXPECT(kj::runCatchingExceptions([&]() {
+    commitIncrementalBackup(dir.path, "backup-two", "grain-one");
+  }) != nullptr);
+  KJ_EXPECT(!store.contains(claimed));
+  KJ_EXPECT(access(kj::str(dir.path, "/manifests/backup-two").cStr(), F_OK) < 0);
+}
+
+KJ_TEST("collectChunkGarbage keeps every chunk when a manifest is unreadable") {
+  TempDir dir;
+  ChunkStore store(dir.path);
+  auto used = store.add(makeContent(1000, 1));
+  auto unused = store.add(makeContent(1000, 2));
+  KJ_SYSCALL(mkdir(kj::str(dir.path, "/manifests").cStr(), 0755));
+  writeManifest(kj::str(dir.path, "/manifests/good"), kj::arr(kj::heapArray(used.asPtr())), 1000);
+  kj::FdOutputStream(raiiOpen(kj::str(dir.path, "/manifests/bad"), O_WRONLY | O_CREAT))
+      .write("bad", 3);
+
+  // Other leftovers still get cleaned up.
+  recursivelyCreateParent(kj::str(dir.path, "/incoming/failed-backup/chunks/x"));
+
+  collectChunkGarbage(dir.path);
+  KJ_EXPECT(store.contains(used));
+  KJ_EXPECT(store.contains(unused));
+  KJ_EXPECT(access(kj::str(dir.path, "/incoming/failed-backup").cStr(), F_OK) < 0);
+
+  // Once the bad manifest is gone, so is the chunk that nothing uses.
+  KJ_SYSCALL(unlink(kj::str(dir.path, "/manifests/bad").cStr()));
+  collectChunkGarbage(dir.path);
+  KJ_EXPECT(store.contains(used));
+  KJ_EXPECT(!store.contains(unused));
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,425 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "chunk-store.h"
+#include "flat-hash.h"
+#include "util.h"
+#include <sandstorm/backend.capnp.h>
+#include <kj/debug.h>
+#include <capnp/serialize.h>
+#include <sodium/crypto_generichash_blake2b.h>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+
+static constexpr uint64_t BOUNDARY_MASK = 0xffff000000000000ull;
+// A chunk ends where these bits of the rolling hash are all zero. Each bit of the hash depends on
+// the bytes since it was shifted in, so these bits cover a window of the last 49 to 64 bytes.
+
+static constexpr size_t CHUNKER_BUFFER_SIZE = 4u << 20;
+
+namespace {
+
+void hashChunk(kj::ArrayPtr<const kj::byte> content, kj::byte hash[ChunkStore::HASH_SIZE]) {
+  KJ_ASSERT(crypto_generichash_blake2b(hash, ChunkStore::HASH_SIZE,
+                                       content.begin(), content.size(), nullptr, 0) == 0);
+}
+
+void makeDirectory(kj::StringPtr path) {
+  while (mkdir(path.cStr(), 0777) < 0) {
+    int error = errno;
+    if (error == EEXIST) {
+      break;
+    } else if (error != EINTR) {
+      KJ_FAIL_SYSCALL("mkdir", error, path);
+    }
+  }
+}
+
+void unlinkIfExists(kj::StringPtr path) {
+  while (unlink(path.cStr()) < 0) {
+    int error = errno;
+    if (error == ENOENT) {
+      break;
+    } else if (error != EINTR) {
+      KJ_FAIL_SYSCALL("unlink", error, path);
+    }
+  }
+}
+
+kj::Array<kj::byte> readChunkFile(int fd, kj::StringPtr path,
+                                  kj::ArrayPtr<const kj::byte> hash, size_t size) {
+  // Returns the content of the chunk file open as `fd`, throwing if it doesn't match the hash.
+
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats), path);
+  KJ_REQUIRE(S_ISREG(stats.st_mode), "chunk is not a regular file", path);
+  auto compressed = kj::heapArray<kj::byte>(stats.st_size);
+  kj::FdInputStream(fd).read(compressed.begin(), compressed.size());
+
+  auto content = kj::heapArray<kj::byte>(size);
+  uLongf contentSize = size;
+  int result = uncompress(content.begin(), &contentSize, compressed.begin(), compressed.size());
+  KJ_REQUIRE(result == Z_OK && contentSize == size, "corrupt chunk", path, result);
+
+  kj::byte actualHash[ChunkStore::HASH_SIZE];
+  hashChunk(content, actualHash);
+  KJ_REQUIRE(memcmp(actualHash, hash.begin(), ChunkStore::HASH_SIZE) == 0, "corrupt chunk", path);
+  return content;
+}
+
+kj::Array<kj::String> listDirectoryIfExists(kj::StringPtr path) {
+  if (access(path.cStr(), F_OK) < 0) return nullptr;
+  return listDirectory(path);
+}
+
+uint64_t hashKey(kj::ArrayPtr<const kj::byte> hash) {
+  // Key for a chunk in a FlatHashMap. The hash is already random, so its first bytes will do.
+  KJ_REQUIRE(hash.size() == ChunkStore::HASH_SIZE, "bad chunk hash");
+  uint64_t key;
+  memcpy(&key, hash.begin(), sizeof(key));
+  return key == 0 ? 1 : key;
+}
+
+kj::Maybe<uint64_t> parseHashKey(kj::StringPtr name) {
+  // Returns the hashKey() of the chunk with the given file name, or null if it isn't one.
+  if (name.size() != ChunkStore::HASH_SIZE * 2) return nullptr;
+
+  kj::byte hash[ChunkStore::HASH_SIZE];
+  for (uint i = 0; i < ChunkStore::HASH_SIZE; i++) {
+    kj::byte value = 0;
+    for (char c: {name[i * 2], name[i * 2 + 1]}) {
+      value <<= 4;
+      if (c >= '0' && c <= '9') {
+        value |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        value |= c - 'a' + 10;
+      } else {
+        return nullptr;
+      }
+    }
+    hash[i] = value;
+  }
+  return hashKey(kj::arrayPtr(hash, sizeof(hash)));
+}
+
+}  // namespace
+
+// =======================================================================================
+
+ChunkStore::ChunkStore(kj::StringPtr dir, kj::StringPtr newChunksDir)
+    : dir(kj::heapString(dir)), newChunksDir(kj::heapString(newChunksDir)) {}
+
+kj::Array<kj::byte> ChunkStore::add(kj::ArrayPtr<const kj::byte> content) {
+  auto hash = kj::heapArray<kj::byte>(HASH_SIZE);
+  hashChunk(content, hash.begin());
+  if (contains(hash)) return hash;
+
+  uLongf compressedSize = compressBound(content.size());
+  auto compressed = kj::heapArray<kj::byte>(compressedSize);
+  int result = compress(compressed.begin(), &compressedSize, content.begin(), content.size());
+  KJ_ASSERT(result == Z_OK, "compress() failed", result);
+
+  // Write to a temporary file first, so that a chunk that exists is always complete.
+  auto hex = hexEncode(hash);
+  auto tmpDir = newChunksDir.size() > 0 ? kj::heapString(newChunksDir) : kj::str(dir, "/tmp");
+  makeDirectory(tmpDir);
+  auto tmpPath = kj::str(tmpDir, '/', hex, '.', getpid());
+  {
+    auto fd = raiiOpen(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+    kj::FdOutputStream(fd.get()).write(compressed.begin(), compressedSize);
+    KJ_SYSCALL(fdatasync(fd), tmpPath);
+  }
+
+  kj::String path;
+  if (newChunksDir.size() > 0) {
+    path = kj::str(newChunksDir, '/', hex);
+  } else {
+    makeDirectory(kj::str(dir, "/chunks"));
+    makeDirectory(kj::str(dir, "/chunks/", hex.slice(0, 2)));
+    path = pathFor(hash);
+  }
+  KJ_SYSCALL(rename(tmpPath.cStr(), path.cStr()), path);
+  return hash;
+}
+
+bool ChunkStore::contains(kj::ArrayPtr<const kj::byte> hash) const {
+  if (access(pathFor(hash).cStr(), F_OK) == 0) return true;
+  return newChunksDir.size() > 0 &&
+      access(kj::str(newChunksDir, '/', hexEncode(hash)).cStr(), F_OK) == 0;
+}
+
+void ChunkStore::read(kj::ArrayPtr<const kj::byte> hash, size_t size,
+                      kj::OutputStream& out) const {
+  auto path = pathFor(hash);
+  auto content = readChunkFile(raiiOpen(path, O_RDONLY | O_CLOEXEC), path, hash, size);
+  out.write(content.begin(), content.size());
+}
+
+void ChunkStore::adopt(kj::ArrayPtr<const kj::byte> hash, size_t size, kj::StringPtr path) {
+  // Checking the content also makes sure the name is right, so that we don't let a bad chunk
+  // into the store, where every later backup of the same data would share it.
+  KJ_REQUIRE(size <= Chunker::MAX_SIZE, "chunk too big", path, size);
+  readChunkFile(raiiOpen(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC), path, hash, size);
+
+  auto hex = hexEncode(hash);
+  makeDirectory(kj::str(dir, "/chunks"));
+  makeDirectory(kj::str(dir, "/chunks/", hex.slice(0, 2)));
+  auto finalPath = pathFor(hash);
+  KJ_SYSCALL(rename(path.cStr(), finalPath.cStr()), path, finalPath);
+}
+
+kj::String ChunkStore::pathFor(kj::ArrayPtr<const kj::byte> hash) const {
+  KJ_REQUIRE(hash.size() == HASH_SIZE, "bad chunk hash");
+  auto hex = hexEncode(hash);
+  return kj::str(dir, "/chunks/", hex.slice(0, 2), '/', hex);
+}
+
+// =======================================================================================
+
+Chunker::Chunker(): buffer(kj::heapArray<kj::byte>(CHUNKER_BUFFER_SIZE)) {
+  // The gear table only needs to be random-looking, but it must never change, or chunks will
+  // stop matching those in existing backups. We generate it with splitmix64.
+  uint64_t state = 0;
+  for (auto& entry: gear) {
+    state += 0x9e3779b97f4a7c15ull;
+    uint64_t z = state;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    entry = z ^ (z >> 31);
+  }
+}
+
+void Chunker::reset(int fd) {
+  this->fd = fd;
+  start = 0;
+  end = 0;
+  eof = false;
+}
+
+kj::ArrayPtr<const kj::byte> Chunker::next() {
+  if (end - start < MAX_SIZE && !eof) {
+    // Refill, reading as much as we can at once.
+    memmove(buffer.begin(), buffer.begin() + start, end - start);
+    end -= start;
+    start = 0;
+    while (end < buffer.size() && !eof) {
+      ssize_t n;
+      KJ_SYSCALL(n = ::read(fd, buffer.begin() + end, buffer.size() - end));
+      if (n == 0) {
+        eof = true;
+      } else {
+        end += n;
+      }
+    }
+  }
+
+  auto available = buffer.slice(start, kj::min(end, start + MAX_SIZE));
+  size_t size = findBoundary(available);
+  start += size;
+  return available.slice(0, size);
+}
+
+size_t Chunker::findBoundary(kj::ArrayPtr<const kj::byte> data) const {
+  if (data.size() <= MIN_SIZE) return data.size();
+
+  uint64_t hash = 0;
+  for (size_t i = MIN_SIZE; i < data.size(); i++) {
+    hash = (hash << 1) + gear[data[i]];
+    if ((hash & BOUNDARY_MASK) == 0) return i + 1;
+  }
+  return data.size();
+}
+
+// =======================================================================================
+
+void commitIncrementalBackup(kj::StringPtr dir, kj::StringPtr backupId, kj::StringPtr grainId) {
+  auto incomingDir = kj::str(dir, "/incoming/", backupId);
+  auto newChunksDir = kj::str(incomingDir, "/chunks");
+  auto incomingManifest = kj::str(incomingDir, "/manifest");
+
+  {
+    auto fd = raiiOpen(incomingManifest, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat stats;
+    KJ_SYSCALL(fstat(fd, &stats), incomingManifest);
+    KJ_REQUIRE(S_ISREG(stats.st_mode), "backup manifest is not a regular file");
+
+    capnp::ReaderOptions options;
+    options.traversalLimitInWords = kj::maxValue;
+    capnp::StreamFdMessageReader reader(fd.get(), options);
+
+    ChunkStore store(dir);
+    for (auto file: reader.getRoot<BackupManifest>().getFiles()) {
+      if (file.isRegular()) {
+        for (auto chunk: file.getRegular()) {
+          auto hash = chunk.getHash();
+          if (!store.contains(hash)) {
+            // Throws if the backup didn't write it, or wrote something else.
+            store.adopt(hash, chunk.getSize(), kj::str(newChunksDir, '/', hexEncode(hash)));
+          }
+        }
+      }
+    }
+  }
+
+  makeDirectory(kj::str(dir, "/manifests"));
+  auto manifestPath = kj::str(dir, "/manifests/", backupId);
+  KJ_SYSCALL(rename(incomingManifest.cStr(), manifestPath.cStr()), manifestPath);
+
+  // Make this the backup that the grain's next one compares against. Replace the link atomically,
+  // so that there's always one.
+  makeDirectory(kj::str(dir, "/latest"));
+  auto latestPath = kj::str(dir, "/latest/", grainId);
+  auto tmpPath = kj::str(latestPath, ".new");
+  unlinkIfExists(tmpPath);
+  KJ_SYSCALL(symlink(kj::str("../manifests/", backupId).cStr(), tmpPath.cStr()), tmpPath);
+  KJ_SYSCALL(rename(tmpPath.cStr(), latestPath.cStr()), latestPath);
+
+  // Whatever's left over is chunks that the manifest didn't use.
+  recursivelyDelete(incomingDir);
+}
+
+void collectChunkGarbage(kj::StringPtr dir) {
+  // Mark every chunk some manifest refers to. Nothing is deleted until we've read them all.
+  FlatHashMap<bool> referenced;
+  bool sweep = true;
+  auto manifestsDir = kj::str(dir, "/manifests");
+  for (auto& name: listDirectoryIfExists(manifestsDir)) {
+    auto path = kj::str(manifestsDir, '/', name);
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      auto fd = raiiOpen(path, O_RDONLY | O_CLOEXEC);
+      capnp::ReaderOptions options;
+      options.traversalLimitInWords = kj::maxValue;
+      capnp::StreamFdMessageReader reader(fd.get(), options);
+      for (auto file: reader.getRoot<BackupManifest>().getFiles()) {
+        if (file.isRegular()) {
+          for (auto chunk: file.getRegular()) {
+            bool created;
+            referenced.findOrCreate(hashKey(chunk.getHash()), created) = true;
+          }
+        }
+      }
+    })) {
+      // We can't tell which chunks this backup needs, so keep them all. Carry on marking anyway,
+      // so that one bad manifest doesn't stop the rest of the clean-up below.
+      KJ_LOG(ERROR, "couldn't read backup manifest; not deleting any chunks", path, *exception);
+      sweep = false;
+    }
+  }
+
+  // Sweep the rest. Since keys are only part of the hash, we might keep a chunk we didn't need to,
+  // but never the reverse.
+  uint64_t deleted = 0;
+  auto chunksDir = kj::str(dir, "/chunks");
+  if (sweep) {
+    for (auto& prefix: listDirectoryIfExists(chunksDir)) {
+      auto prefixDir = kj::str(chunksDir, '/', prefix);
+      for (auto& name: listDirectory(prefixDir)) {
+        KJ_IF_MAYBE(key, parseHashKey(name)) {
+          if (referenced.find(*key) == nullptr) {
+            unlinkIfExists(kj::str(prefixDir, '/', name));
+            ++deleted;
+          }
+        }
+      }
+    }
+  }
+
+  auto tmpDir = kj::str(dir, "/tmp");
+  for (auto& name: listDirectoryIfExists(tmpDir)) {
+    unlinkIfExists(kj::str(tmpDir, '/', name));
+  }
+
+  // Left behind by backups which failed.
+  auto incomingDir = kj::str(dir, "/incoming");
+  for (auto& name: listDirectoryIfExists(incomingDir)) {
+    recursivelyDelete(kj::str(incomingDir, '/', name));
+  }
+
+  // Forget grains whose latest backup was deleted.
+  auto latestDir = kj::str(dir, "/latest");
+  for (auto& name: listDirectoryIfExists(latestDir)) {
+    auto path = kj::str(latestDir, '/', name);
+    if (access(path.cStr(), F_OK) < 0 && errno == ENOENT) {
+      unlinkIfExists(path);
+    }
+  }
+
+  KJ_LOG(INFO, "collected backup chunk garbage", referenced.size(), deleted);
+}
+
+// =======================================================================================
+
+class ChunkGarbageCollector::Use {
+public:
+  explicit Use(ChunkGarbageCollector& collector): collector(collector) { ++collector.users; }
+  ~Use() noexcept(false) {
+    --collector.users;
+    collector.maybeStart();
+  }
+  KJ_DISALLOW_COPY(Use);
+
+private:
+  ChunkGarbageCollector& collector;
+};
+
+ChunkGarbageCollector::ChunkGarbageCollector(
+    ThreadPool& pool, kj::Timer& timer, kj::StringPtr dir)
+    : pool(pool), timer(timer), dir(kj::heapString(dir)), tasks(*this) {}
+
+ChunkGarbageCollector::~ChunkGarbageCollector() noexcept(false) {}
+
+void ChunkGarbageCollector::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+kj::Promise<kj::Own<ChunkGarbageCollector::Use>> ChunkGarbageCollector::startUsing() {
+  KJ_IF_MAYBE(c, collecting) {
+    return c->addBranch().then([this]() { return startUsing(); });
+  }
+  return kj::heap<Use>(*this);
+}
+
+void ChunkGarbageCollector::collectSoon() {
+  if (scheduled) return;
+  scheduled = true;
+  // Wait a while, so that deleting many backups in a row doesn't collect after each one.
+  tasks.add(timer.afterDelay(10 * kj::MINUTES).then([this]() {
+    scheduled = false;
+    due = true;
+    maybeStart();
+  }));
+}
+
+void ChunkGarbageCollector::maybeStart() {
+  if (!due || users > 0 || collecting != nullptr) return;
+  due = false;
+
+  auto promise = pool.runBulk([dir = kj::heapString(dir)]() { collectChunkGarbage(dir); })
+      .catch_([](kj::Exception&& e) {
+    KJ_LOG(ERROR, "backup chunk garbage collection failed", e);
+  }).fork();
+  tasks.add(promise.addBranch().then([this]() {
+    collecting = nullptr;
+    maybeStart();
+  }));
+  collecting = kj::mv(promise);
+}
+
+}  // namespace sandstorm
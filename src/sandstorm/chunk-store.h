@@ -0,0 +1,154 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_CHUNK_STORE_H_
+#define SANDSTORM_CHUNK_STORE_H_
+
+// Incremental backups split each file into content-defined chunks, and keep each distinct chunk
+// just once, in a store shared by all of them. The store is a directory laid out as follows:
+//
+//   chunks/<first two hex digits of hash>/<hash in hex>
+//       The chunk's content, zlib-compressed.
+//   manifests/<backupId>
+//       A BackupManifest (see backend.capnp) listing each file in the backup and its chunks.
+//   latest/<grainId>
+//       Symlink to the grain's most recent manifest, which the next backup compares against.
+//   incoming/<backupId>/
+//       Where a backup in progress writes its manifest (as `manifest`) and the chunks the store
+//       lacked (as `chunks/<hash in hex>`).
+//   tmp/
+//       Chunks being written.
+//
+// The `backup` command only reads the store; it writes nothing but its own incoming directory
+// (see `backup --chunks`). The backend then checks what it wrote and moves it into place with
+// commitIncrementalBackup(). ChunkGarbageCollector cleans up chunks when backups are deleted.
+
+#include "thread-pool.h"
+#include <kj/async-io.h>
+#include <kj/io.h>
+#include <kj/string.h>
+
+namespace sandstorm {
+
+class ChunkStore {
+  // Stores and retrieves chunks by hash.
+
+public:
+  explicit ChunkStore(kj::StringPtr dir, kj::StringPtr newChunksDir = nullptr);
+  // If `newChunksDir` is given, add() writes chunks the store lacks there, named by their hashes
+  // in hex, rather than into the store itself.
+
+  static constexpr size_t HASH_SIZE = 32;
+
+  kj::Array<kj::byte> add(kj::ArrayPtr<const kj::byte> content);
+  // Stores the chunk, unless it's already present, and returns its hash.
+
+  bool contains(kj::ArrayPtr<const kj::byte> hash) const;
+
+  void read(kj::ArrayPtr<const kj::byte> hash, size_t size, kj::OutputStream& out) const;
+  // Writes the chunk's content to `out`, throwing if it's missing or doesn't match the hash. May
+  // be called from several threads at once.
+
+  void adopt(kj::ArrayPtr<const kj::byte> hash, size_t size, kj::StringPtr path);
+  // Moves the chunk file at `path`, written by some other ChunkStore's add(), into this store,
+  // after checking that it really is the chunk with the given hash and size. Throws otherwise.
+
+private:
+  kj::String dir;
+  kj::String newChunksDir;
+
+  kj::String pathFor(kj::ArrayPtr<const kj::byte> hash) const;
+};
+
+class Chunker {
+  // Splits a file into chunks at content-defined boundaries: a boundary goes wherever a rolling
+  // hash of the preceding bytes matches a pattern. Thus, inserting or deleting bytes in a file
+  // only changes the chunks around the edit, and the rest of the file still deduplicates against
+  // the previous backup.
+
+public:
+  Chunker();
+
+  void reset(int fd);
+  // Starts on a new file.
+
+  static constexpr size_t MIN_SIZE = 16u << 10;
+  static constexpr size_t MAX_SIZE = 256u << 10;
+  // Chunks average about 64KiB beyond the minimum.
+
+  kj::ArrayPtr<const kj::byte> next();
+  // Returns the next chunk, which remains valid until the next call. Returns an empty array at
+  // EOF.
+
+private:
+  int fd = -1;
+  kj::Array<kj::byte> buffer;
+  size_t start = 0;
+  size_t end = 0;
+  bool eof = false;
+  uint64_t gear[256];
+
+  size_t findBoundary(kj::ArrayPtr<const kj::byte> data) const;
+};
+
+void commitIncrementalBackup(kj::StringPtr dir, kj::StringPtr backupId, kj::StringPtr grainId);
+// Takes the manifest and chunks that `backup --chunks` left in incoming/<backupId>, checks that
+// the chunks match their hashes and that the manifest refers to no chunk that doesn't exist, then
+// moves them into the store and makes the manifest the grain's latest. Throws if anything is
+// amiss. Run this only after the `backup` process has exited, as it trusts nothing it wrote.
+
+void collectChunkGarbage(kj::StringPtr dir);
+// Deletes chunks which no manifest refers to, along with leftovers of backups which didn't
+// finish. Must not run while a backup is using the store. If some manifest can't be read, keeps
+// every chunk, since any of them might be its.
+
+class ChunkGarbageCollector: private kj::TaskSet::ErrorHandler {
+  // Runs collectChunkGarbage() on the thread pool, a little while after backups are deleted, when
+  // no backup or restore is using the store.
+
+public:
+  ChunkGarbageCollector(ThreadPool& pool, kj::Timer& timer, kj::StringPtr dir);
+  ~ChunkGarbageCollector() noexcept(false);
+
+  class Use;
+
+  kj::Promise<kj::Own<Use>> startUsing();
+  // Waits until collection isn't running, then returns an object which prevents collection from
+  // starting until it's dropped. Hold one while running a backup or restore.
+
+  void collectSoon();
+  // Call after deleting a manifest.
+
+private:
+  ThreadPool& pool;
+  kj::Timer& timer;
+  kj::String dir;
+
+  uint users = 0;
+  bool scheduled = false;  // waiting for the delay to pass
+  bool due = false;        // waiting for `users` to reach zero
+  kj::Maybe<kj::ForkedPromise<void>> collecting;
+
+  kj::TaskSet tasks;
+
+  void maybeStart();
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_CHUNK_STORE_H_
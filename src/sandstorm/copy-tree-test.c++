@@ -0,0 +1,171 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "copy-tree.h"
+#include "thread-pool.h"
+#include "util.h"
+#include "test-util.h"
+#include <kj/test.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+namespace {
+
+void writeFile(kj::StringPtr path, kj::StringPtr content, mode_t mode = 0644) {
+  kj::FdOutputStream(raiiOpen(path, O_WRONLY | O_CREAT | O_EXCL, mode))
+      .write(content.begin(), content.size());
+  KJ_SYSCALL(chmod(path.cStr(), mode));  // in spite of the umask
+}
+
+void setTime(kj::StringPtr path, time_t seconds) {
+  struct timespec times[2];
+  times[0].tv_sec = seconds;
+  times[0].tv_nsec = 0;
+  times[1] = times[0];
+  KJ_SYSCALL(utimensat(AT_FDCWD, path.cStr(), times, AT_SYMLINK_NOFOLLOW), path);
+}
+
+struct stat lstatOrDie(kj::StringPtr path) {
+  struct stat stats;
+  KJ_SYSCALL(lstat(path.cStr(), &stats), path);
+  return stats;
+}
+
+kj::String readLink(kj::StringPtr path) {
+  char target[PATH_MAX];
+  ssize_t n;
+  KJ_SYSCALL(n = readlink(path.cStr(), target, sizeof(target)), path);
+  return kj::heapString(target, n);
+}
+
+KJ_TEST("copyTree copies contents, modes, and times") {
+  TempDir tmp;
+  auto from = kj::str(tmp.path, "/from");
+  KJ_SYSCALL(mkdir(from.cStr(), 0755));
+  KJ_SYSCALL(mkdir(kj::str(from, "/sub").cStr(), 0750));
+  writeFile(kj::str(from, "/sub/private"), "secret", 0600);
+  writeFile(kj::str(from, "/script"), "#!/bin/sh", 0755);
+  KJ_SYSCALL(symlink("sub/private", kj::str(from, "/link").cStr()));
+  KJ_SYSCALL(mkfifo(kj::str(from, "/fifo").cStr(), 0644));
+
+  // More files than fit in the queue, so that the walker has to help with copying.
+  KJ_SYSCALL(mkdir(kj::str(from, "/many").cStr(), 0755));
+  for (uint i = 0; i < 600; i++) {
+    writeFile(kj::str(from, "/many/", i), kj::str(i));
+  }
+
+  // Set times last, since creating children changes a directory's mtime.
+  setTime(kj::str(from, "/sub/private"), 1000000);
+  setTime(kj::str(from, "/script"), 2000000);
+  setTime(kj::str(from, "/link"), 3000000);
+  setTime(kj::str(from, "/sub"), 4000000);
+  setTime(from, 5000000);
+
+  // Extra threads come from the pool that copyTree() is called on.
+  auto io = kj::setupAsyncIo();
+  ThreadPool pool(*io.lowLevelProvider, 4);
+
+  for (uint threadCount: {1u, 4u}) {
+    auto to = kj::str(tmp.path, "/to", threadCount);
+    pool.runBulk([&]() { copyTree(from, to, threadCount); }).wait(io.waitScope);
+
+    KJ_EXPECT(readAll(kj::str(to, "/sub/private")) == "secret");
+    KJ_EXPECT(readAll(kj::str(to, "/script")) == "#!/bin/sh");
+    for (uint i = 0; i < 600; i++) {
+      KJ_EXPECT(readAll(kj::str(to, "/many/", i)) == kj::str(i));
+    }
+    KJ_EXPECT(access(kj::str(to, "/fifo").cStr(), F_OK) < 0);
+
+    auto link = lstatOrDie(kj::str(to, "/link"));
+    KJ_EXPECT(S_ISLNK(link.st_mode));
+    KJ_EXPECT(readLink(kj::str(to, "/link")) == "sub/private");
+    KJ_EXPECT(link.st_mtim.tv_sec == 3000000);
+
+    auto priv = lstatOrDie(kj::str(to, "/sub/private"));
+    KJ_EXPECT((priv.st_mode & 0777) == 0600, priv.st_mode);
+    KJ_EXPECT(priv.st_mtim.tv_sec == 1000000);
+    auto script = lstatOrDie(kj::str(to, "/script"));
+    KJ_EXPECT((script.st_mode & 0777) == 0755, script.st_mode);
+    KJ_EXPECT(script.st_mtim.tv_sec == 2000000);
+
+    auto sub = lstatOrDie(kj::str(to, "/sub"));
+    KJ_EXPECT((sub.st_mode & 0777) == 0750, sub.st_mode);
+    KJ_EXPECT(sub.st_mtim.tv_sec == 4000000);
+    KJ_EXPECT(lstatOrDie(to).st_mtim.tv_sec == 5000000);
+  }
+}
+
+KJ_TEST("copyTree never follows symlinks") {
+  TempDir tmp;
+  auto outside = kj::str(tmp.path, "/outside");
+  KJ_SYSCALL(mkdir(outside.cStr(), 0755));
+  writeFile(kj::str(outside, "/secret"), "secret");
+
+  // Links to a directory and a file elsewhere are copied as links, not as what they point to.
+  auto from = kj::str(tmp.path, "/from");
+  KJ_SYSCALL(mkdir(from.cStr(), 0755));
+  KJ_SYSCALL(symlink(outside.cStr(), kj::str(from, "/dir").cStr()));
+  KJ_SYSCALL(symlink(kj::str(outside, "/secret").cStr(), kj::str(from, "/file").cStr()));
+
+  auto to = kj::str(tmp.path, "/to");
+  copyTree(from, to);
+  KJ_EXPECT(S_ISLNK(lstatOrDie(kj::str(to, "/dir")).st_mode));
+  KJ_EXPECT(S_ISLNK(lstatOrDie(kj::str(to, "/file")).st_mode));
+  KJ_EXPECT(readLink(kj::str(to, "/dir")) == outside);
+
+  // Nor is the top of the tree followed if it's a link.
+  auto link = kj::str(tmp.path, "/link");
+  KJ_SYSCALL(symlink(outside.cStr(), link.cStr()));
+  KJ_EXPECT(kj::runCatchingExceptions([&]() { copyTree(link, kj::str(tmp.path, "/to2")); })
+      != nullptr);
+}
+
+KJ_TEST("copyFileContent falls back when it can't clone") {
+  TempDir tmp;
+  auto content = kj::str("hello, world");
+  auto inPath = kj::str(tmp.path, "/in");
+  writeFile(inPath, content);
+  auto buffer = kj::heapArray<kj::byte>(4);  // small, so that read/write loops
+
+  uint i = 0;
+  auto copyWith = [&](int in, CopyMethod first) {
+    auto outPath = kj::str(tmp.path, "/out", i++);
+    CopyMethod method = copyFileContent(in, raiiOpen(outPath, O_WRONLY | O_CREAT | O_EXCL),
+                                        buffer, first);
+    KJ_EXPECT(readAll(outPath) == content);
+    return method;
+  };
+
+  // Which methods work on a file depends on the filesystem and kernel, but we never go back to
+  // an earlier one.
+  copyWith(raiiOpen(inPath, O_RDONLY), CopyMethod::CLONE);
+  KJ_EXPECT(copyWith(raiiOpen(inPath, O_RDONLY), CopyMethod::COPY_FILE_RANGE) !=
+            CopyMethod::CLONE);
+  KJ_EXPECT(copyWith(raiiOpen(inPath, O_RDONLY), CopyMethod::READ_WRITE) ==
+            CopyMethod::READ_WRITE);
+
+  // Neither FICLONE nor copy_file_range() can read from a pipe, so this goes all the way down.
+  auto pipe = Pipe::make();
+  kj::FdOutputStream(pipe.writeEnd.get()).write(content.begin(), content.size());
+  pipe.writeEnd = nullptr;
+  KJ_EXPECT(copyWith(pipe.readEnd, CopyMethod::CLONE) == CopyMethod::READ_WRITE);
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,368 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "copy-tree.h"
+#include "util.h"
+#include "thread-pool.h"
+#include "version.h"
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/mutex.h>
+#include <kj/vector.h>
+#include <deque>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// In case kernel headers are old.
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+namespace sandstorm {
+
+static constexpr size_t COPY_BUFFER_SIZE = 1u << 20;
+
+static constexpr size_t MAX_QUEUED_FILES = 256;
+// Files found but not yet copied. Each one keeps its directory open, so this bounds the number of
+// open file descriptors.
+
+namespace {
+
+void setModificationTime(int fd, const struct stat& stats, kj::StringPtr name = nullptr) {
+  // Sets the mtime of `fd`, or if `name` is given, of `name` in the directory `fd` (without
+  // following symlinks), to that in `stats`.
+
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1] = stats.st_mtim;
+
+  if (name.size() == 0) {
+    KJ_SYSCALL(futimens(fd, times));
+  } else {
+    KJ_SYSCALL(utimensat(fd, name.cStr(), times, AT_SYMLINK_NOFOLLOW), name);
+  }
+}
+
+bool copyFileRange(int in, int out) {
+  // Copies the rest of `in` to `out` with copy_file_range(). Returns false if the kernel or the
+  // filesystem doesn't support it before anything was copied.
+
+#ifdef SYS_copy_file_range
+  bool copiedAny = false;
+  for (;;) {
+    ssize_t n = syscall(SYS_copy_file_range, in, nullptr, out, nullptr, size_t(1) << 30, 0);
+    if (n > 0) {
+      copiedAny = true;
+    } else if (n == 0) {
+      return true;
+    } else {
+      int error = errno;
+      if (error == EINTR) {
+        continue;
+      } else if (!copiedAny && (error == ENOSYS || error == EXDEV || error == EINVAL ||
+                                error == EOPNOTSUPP || error == EBADF)) {
+        return false;
+      } else {
+        KJ_FAIL_SYSCALL("copy_file_range", error);
+      }
+    }
+  }
+#else
+  return false;
+#endif
+}
+
+struct Directory {
+  // A directory being copied, open on both sides, so that nothing under it is ever looked up by
+  // path. Closed once everything in it has been created.
+
+  kj::String path;  // relative to the top of the tree; for error messages
+  kj::AutoCloseFd from;
+  kj::AutoCloseFd to;
+  struct stat stats;
+
+  uint pendingFiles = 0;  // queued or being copied
+  bool listed = false;    // all subdirectories and symlinks created, all files queued
+  // Protected by TreeCopier::state's lock.
+};
+
+struct File {
+  Directory* parent;
+  kj::String name;
+};
+
+class TreeCopier {
+  // One thread walks the tree, creating directories and symlinks and queuing regular files, which
+  // the other threads -- borrowed from the calling thread's ThreadPool -- copy. If the others fall
+  // behind, the walker copies files too.
+
+public:
+  void run(kj::StringPtr from, kj::StringPtr to, uint threadCount);
+
+private:
+  struct State {
+    std::deque<File> queue;
+    bool walkClaimed = false;
+    bool walkDone = false;
+    kj::Maybe<kj::Exception> error;
+  };
+  kj::MutexGuarded<State> state;
+
+  kj::Vector<kj::Own<Directory>> directories;
+  // Only the walker adds to this. The Directory objects don't move, so files can point to them.
+
+  kj::Array<kj::byte> walkerBuffer = kj::heapArray<kj::byte>(COPY_BUFFER_SIZE);
+
+  Directory& addDirectory(kj::String path, kj::AutoCloseFd from, kj::AutoCloseFd to);
+  void walk(Directory& dir);
+  void enqueue(File file);
+  void copyFiles();
+  void copy(File& file, kj::ArrayPtr<kj::byte> buffer);
+  void finish(Directory& dir);
+  void recordError(kj::Exception&& exception);
+};
+
+void TreeCopier::run(kj::StringPtr from, kj::StringPtr to, uint threadCount) {
+  auto fromFd = raiiOpen(from, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  KJ_SYSCALL(mkdir(to.cStr(), 0700), to);
+  auto toFd = raiiOpen(to, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  Directory& top = addDirectory(kj::heapString("."), kj::mv(fromFd), kj::mv(toFd));
+
+  // Even when cloning, each file costs a few syscalls that may have to wait for the disk, so
+  // it's worth copying several at once. Whichever thread gets here first walks the tree.
+  ThreadPool::parallelize(threadCount, [&]() {
+    bool walker;
+    {
+      auto lock = state.lockExclusive();
+      walker = !lock->walkClaimed;
+      lock->walkClaimed = true;
+    }
+
+    if (walker) {
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { walk(top); })) {
+        recordError(kj::mv(*exception));
+      }
+      state.lockExclusive()->walkDone = true;
+    }
+    copyFiles();
+  });
+
+  auto lock = state.lockExclusive();
+  KJ_IF_MAYBE(exception, lock->error) {
+    kj::throwFatalException(kj::mv(*exception));
+  }
+}
+
+Directory& TreeCopier::addDirectory(kj::String path, kj::AutoCloseFd from, kj::AutoCloseFd to) {
+  auto dir = kj::heap<Directory>();
+  dir->path = kj::mv(path);
+  dir->from = kj::mv(from);
+  dir->to = kj::mv(to);
+  KJ_SYSCALL(fstat(dir->from, &dir->stats), dir->path);
+  Directory& result = *dir;
+  directories.add(kj::mv(dir));
+  return result;
+}
+
+void TreeCopier::walk(Directory& dir) {
+  for (auto& name: listDirectoryFd(dir.from)) {
+    if (state.lockExclusive()->error != nullptr) return;
+
+    struct stat stats;
+    KJ_SYSCALL(fstatat(dir.from, name.cStr(), &stats, AT_SYMLINK_NOFOLLOW), dir.path, name);
+
+    if (S_ISDIR(stats.st_mode)) {
+      // O_NOFOLLOW makes sure that what we open is still the directory we saw, and not a symlink
+      // that replaced it.
+      auto from = raiiOpenAt(dir.from, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      KJ_SYSCALL(mkdirat(dir.to, name.cStr(), 0700), dir.path, name);
+      auto to = raiiOpenAt(dir.to, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      walk(addDirectory(kj::str(dir.path, '/', name), kj::mv(from), kj::mv(to)));
+    } else if (S_ISLNK(stats.st_mode)) {
+      char target[PATH_MAX];
+      ssize_t n;
+      KJ_SYSCALL(n = readlinkat(dir.from, name.cStr(), target, sizeof(target) - 1),
+                 dir.path, name);
+      target[n] = '\0';
+      KJ_SYSCALL(symlinkat(target, dir.to, name.cStr()), dir.path, name);
+      setModificationTime(dir.to, stats, name);
+    } else if (S_ISREG(stats.st_mode)) {
+      enqueue(File { &dir, kj::mv(name) });
+    }
+    // Sockets, FIFOs, and devices are skipped, as in backups.
+  }
+
+  bool done;
+  {
+    auto lock = state.lockExclusive();
+    dir.listed = true;
+    done = dir.pendingFiles == 0;
+  }
+  if (done) finish(dir);
+}
+
+void TreeCopier::enqueue(File file) {
+  kj::Maybe<File> overflow;
+  {
+    auto lock = state.lockExclusive();
+    ++file.parent->pendingFiles;
+    lock->queue.push_back(kj::mv(file));
+    if (lock->queue.size() > MAX_QUEUED_FILES) {
+      // The other threads can't keep up, or there aren't any.
+      overflow = kj::mv(lock->queue.front());
+      lock->queue.pop_front();
+    }
+  }
+
+  KJ_IF_MAYBE(f, overflow) {
+    copy(*f, walkerBuffer);
+  }
+}
+
+void TreeCopier::copyFiles() {
+  auto buffer = kj::heapArray<kj::byte>(COPY_BUFFER_SIZE);
+  for (;;) {
+    kj::Maybe<File> file;
+    {
+      auto lock = state.lockExclusive();
+      lock.wait([](const State& s) {
+        return s.error != nullptr || s.walkDone || !s.queue.empty();
+      });
+      if (lock->error != nullptr || lock->queue.empty()) return;
+      file = kj::mv(lock->queue.front());
+      lock->queue.pop_front();
+    }
+
+    copy(KJ_ASSERT_NONNULL(file), buffer);
+  }
+}
+
+void TreeCopier::copy(File& file, kj::ArrayPtr<kj::byte> buffer) {
+  Directory& dir = *file.parent;
+
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    // O_NONBLOCK so that if a FIFO has replaced the file since we listed it, we don't hang.
+    auto in = raiiOpenAt(dir.from, file.name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    struct stat stats;
+    KJ_SYSCALL(fstat(in, &stats), dir.path, file.name);
+    if (!S_ISREG(stats.st_mode)) return;
+
+    auto out = raiiOpenAt(dir.to, file.name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    copyFileContent(in, out, buffer);
+    KJ_SYSCALL(fchmod(out, stats.st_mode & 0777), dir.path, file.name);
+    setModificationTime(out, stats);
+  })) {
+    recordError(kj::mv(*exception));
+  }
+
+  bool done;
+  {
+    auto lock = state.lockExclusive();
+    done = --dir.pendingFiles == 0 && dir.listed;
+  }
+  if (done) finish(dir);
+}
+
+void TreeCopier::finish(Directory& dir) {
+  // Creating a directory's contents changes its mtime, so set it once they're all there.
+
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    KJ_SYSCALL(fchmod(dir.to, dir.stats.st_mode & 0777), dir.path);
+    setModificationTime(dir.to, dir.stats);
+  })) {
+    recordError(kj::mv(*exception));
+  }
+  dir.from = nullptr;
+  dir.to = nullptr;
+}
+
+void TreeCopier::recordError(kj::Exception&& exception) {
+  auto lock = state.lockExclusive();
+  if (lock->error == nullptr) {
+    lock->error = kj::mv(exception);
+  }
+}
+
+}  // namespace
+
+CopyMethod copyFileContent(int in, int out, kj::ArrayPtr<kj::byte> buffer, CopyMethod first) {
+  // Any failure to clone just means we have to copy; if it was something like ENOSPC, copying
+  // will fail too.
+  if (first == CopyMethod::CLONE && ioctl(out, FICLONE, in) >= 0) {
+    return CopyMethod::CLONE;
+  }
+  if (first != CopyMethod::READ_WRITE && copyFileRange(in, out)) {
+    return CopyMethod::COPY_FILE_RANGE;
+  }
+
+  for (;;) {
+    ssize_t n;
+    KJ_SYSCALL(n = read(in, buffer.begin(), buffer.size()));
+    if (n == 0) break;
+    kj::FdOutputStream(out).write(buffer.begin(), n);
+  }
+  return CopyMethod::READ_WRITE;
+}
+
+void copyTree(kj::StringPtr from, kj::StringPtr to, uint threadCount) {
+  TreeCopier().run(from, to, threadCount);
+}
+
+// =======================================================================================
+
+CopyTreeMain::CopyTreeMain(kj::ProcessContext& context): context(context) {}
+
+kj::MainFunc CopyTreeMain::getMain() {
+  return kj::MainBuilder(context, "Sandstorm version " SANDSTORM_VERSION,
+                         "Copies the directory tree <from> to <to>, which must not exist yet. "
+                         "For use by the Sandstorm backend.")
+      .addOptionWithArg({'j', "threads"}, KJ_BIND_METHOD(*this, setThreads), "<count>",
+                        "Copy up to <count> files at once.")
+      .expectArg("<from>", KJ_BIND_METHOD(*this, setFrom))
+      .expectArg("<to>", KJ_BIND_METHOD(*this, run))
+      .build();
+}
+
+bool CopyTreeMain::setThreads(kj::StringPtr arg) {
+  KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+    if (*n > 0) {
+      threadCount = *n;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CopyTreeMain::setFrom(kj::StringPtr arg) {
+  from = arg;
+  return true;
+}
+
+bool CopyTreeMain::run(kj::StringPtr to) {
+  auto io = kj::setupAsyncIo();
+
+  // One thread more than we'll use, since bulk jobs always leave one free.
+  ThreadPool pool(*io.lowLevelProvider, threadCount + 1);
+  pool.runBulk([this,to]() { copyTree(from, to, threadCount); }).wait(io.waitScope);
+  return true;
+}
+
+}  // namespace sandstorm
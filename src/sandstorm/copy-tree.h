@@ -0,0 +1,77 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_COPY_TREE_H_
+#define SANDSTORM_COPY_TREE_H_
+
+#include "abstract-main.h"
+#include <kj/array.h>
+#include <kj/common.h>
+#include <kj/string.h>
+
+namespace sandstorm {
+
+void copyTree(kj::StringPtr from, kj::StringPtr to, uint threadCount = 1);
+// Copies the directory tree at `from` to `to`, which must not exist yet. Permissions and
+// modification times are copied; ownership is not. Sockets, FIFOs, and devices are skipped.
+//
+// Regular files are cloned with FICLONE where the filesystem supports it (btrfs, XFS), so that
+// the copy takes no time and shares blocks with the original until one of them is modified.
+// Otherwise, they're copied with copy_file_range(), which at least keeps the data in the kernel,
+// or failing that with read() and write(). If `threadCount` is more than 1 and this is called
+// from a ThreadPool job, up to that many of the pool's threads copy files at once. (See
+// ThreadPool::parallelize().)
+//
+// Symlinks are copied as-is and never followed. Everything below `from` and `to` is reached
+// through file descriptors for its parent directory, opened with O_NOFOLLOW, so even if `from`
+// is modified during the copy, nothing outside it is copied and nothing outside `to` is written.
+// (The copy may of course be inconsistent, so don't let that happen.)
+
+enum class CopyMethod {
+  CLONE,
+  COPY_FILE_RANGE,
+  READ_WRITE
+};
+
+CopyMethod copyFileContent(int in, int out, kj::ArrayPtr<kj::byte> buffer,
+                           CopyMethod first = CopyMethod::CLONE);
+// Copies the content of `in`, which must be at its start, to `out`, which must be empty. Tries
+// each method from `first` on until one works, and returns that one. `buffer` is used by
+// READ_WRITE. Exposed for testing.
+
+class CopyTreeMain: public AbstractMain {
+  // Main class for the "copy-tree" program, which runs copyTree() in a process of its own. The
+  // backend uses it to clone grains under the setuid sandbox, where only the grain's sandbox uid
+  // can read all of its files, and must own the copies.
+
+public:
+  CopyTreeMain(kj::ProcessContext& context);
+
+  kj::MainFunc getMain() override;
+
+private:
+  kj::ProcessContext& context;
+  uint threadCount = 1;
+  kj::StringPtr from;
+
+  bool setThreads(kj::StringPtr arg);
+  bool setFrom(kj::StringPtr arg);
+  bool run(kj::StringPtr to);
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_COPY_TREE_H_
@@ -0,0 +1,95 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "flat-hash.h"
+#include <kj/test.h>
+#include <unordered_map>
+
+namespace sandstorm {
+namespace {
+
+KJ_TEST("FlatHashMap basics") {
+  FlatHashMap<uint> map;
+  KJ_EXPECT(map.size() == 0);
+  KJ_EXPECT(map.find(123) == nullptr);
+  KJ_EXPECT(!map.erase(123));
+
+  bool created;
+  map.findOrCreate(123, created) = 456;
+  KJ_EXPECT(created);
+  KJ_EXPECT(map.findOrCreate(123, created) == 456);
+  KJ_EXPECT(!created);
+  map[789] = 1;
+  KJ_EXPECT(map.size() == 2);
+
+  KJ_ASSERT(map.find(123) != nullptr);
+  KJ_EXPECT(*map.find(123) == 456);
+  KJ_EXPECT(map.erase(123));
+  KJ_EXPECT(map.find(123) == nullptr);
+  KJ_EXPECT(map.size() == 1);
+
+  map.clear();
+  KJ_EXPECT(map.size() == 0);
+  KJ_EXPECT(map.find(789) == nullptr);
+}
+
+KJ_TEST("FlatHashMap matches std::unordered_map") {
+  // Random operations over a small key space, so that the table goes through plenty of growth,
+  // collisions, and removals from the middle of probe runs.
+
+  FlatHashMap<uint64_t> map;
+  std::unordered_map<uint64_t, uint64_t> expected;
+
+  uint64_t state = 88172645463325252ull;
+  for (uint i = 0; i < 200000; i++) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    uint64_t key = state % 5000 + 1;
+    switch ((state >> 32) % 3) {
+      case 0:
+        map[key] = state;
+        expected[key] = state;
+        break;
+      case 1:
+        KJ_ASSERT(map.erase(key) == (expected.erase(key) > 0), key);
+        break;
+      case 2: {
+        auto iter = expected.find(key);
+        uint64_t* value = map.find(key);
+        if (iter == expected.end()) {
+          KJ_ASSERT(value == nullptr, key);
+        } else {
+          KJ_ASSERT(value != nullptr, key);
+          KJ_ASSERT(*value == iter->second, key);
+        }
+        break;
+      }
+    }
+    KJ_ASSERT(map.size() == expected.size());
+  }
+
+  size_t count = 0;
+  map.forEach([&](uint64_t key, uint64_t value) {
+    ++count;
+    KJ_EXPECT(expected[key] == value, key);
+  });
+  KJ_EXPECT(count == expected.size());
+}
+
+}  // namespace
+}  // namespace sandstorm
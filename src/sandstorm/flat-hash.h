@@ -0,0 +1,162 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_FLAT_HASH_H_
+#define SANDSTORM_FLAT_HASH_H_
+
+#include <kj/array.h>
+#include <kj/debug.h>
+#include <inttypes.h>
+
+namespace sandstorm {
+
+template <typename T>
+class FlatHashMap {
+  // A hash table from non-zero 64-bit keys to small values, for tables that may hold millions of
+  // entries. Unlike std::unordered_map, entries are stored inline in one array -- no allocation
+  // and no pointers per entry -- and the table is kept at most 3/4 full. Lookups use linear
+  // probing; removal shifts later entries back rather than leaving tombstones, so a table with a
+  // lot of churn doesn't degrade.
+  //
+  // Key 0 marks an empty slot and cannot be used. `T` must be default-constructible and movable.
+  // Pointers returned by find() and findOrCreate() are invalidated by any insertion or removal.
+
+public:
+  FlatHashMap() = default;
+  FlatHashMap(FlatHashMap&&) = default;
+  FlatHashMap& operator=(FlatHashMap&&) = default;
+  KJ_DISALLOW_COPY(FlatHashMap);
+
+  size_t size() const { return count; }
+
+  T* find(uint64_t key) {
+    KJ_IREQUIRE(key != 0);
+    if (count == 0) return nullptr;
+    for (size_t i = home(key);; i = (i + 1) & mask()) {
+      if (slots[i].key == key) return &slots[i].value;
+      if (slots[i].key == 0) return nullptr;
+    }
+  }
+
+  T& findOrCreate(uint64_t key, bool& created) {
+    // Returns the value for `key`, inserting a default-constructed one (and setting `created`) if
+    // there wasn't one.
+
+    KJ_IREQUIRE(key != 0);
+    if ((count + 1) * 4 > slots.size() * 3) {
+      rehash(slots.size() == 0 ? 16 : slots.size() * 2);
+    }
+    for (size_t i = home(key);; i = (i + 1) & mask()) {
+      if (slots[i].key == key) {
+        created = false;
+        return slots[i].value;
+      }
+      if (slots[i].key == 0) {
+        slots[i].key = key;
+        slots[i].value = T();
+        ++count;
+        created = true;
+        return slots[i].value;
+      }
+    }
+  }
+
+  T& operator[](uint64_t key) {
+    bool created;
+    return findOrCreate(key, created);
+  }
+
+  bool erase(uint64_t key) {
+    // Removes `key`, returning false if it wasn't present.
+
+    KJ_IREQUIRE(key != 0);
+    if (count == 0) return false;
+    size_t i = home(key);
+    while (slots[i].key != key) {
+      if (slots[i].key == 0) return false;
+      i = (i + 1) & mask();
+    }
+
+    // Slot `i` is now a hole. Walk forward through the run of entries after it, moving back into
+    // the hole any entry whose home slot is at or before the hole, so that probing for it still
+    // works.
+    for (size_t j = (i + 1) & mask(); slots[j].key != 0; j = (j + 1) & mask()) {
+      size_t distanceFromHome = (j - home(slots[j].key)) & mask();
+      size_t distanceFromHole = (j - i) & mask();
+      if (distanceFromHome >= distanceFromHole) {
+        slots[i] = kj::mv(slots[j]);
+        i = j;
+      }
+    }
+    slots[i].key = 0;
+    slots[i].value = T();
+    --count;
+    return true;
+  }
+
+  void clear() {
+    slots = nullptr;
+    count = 0;
+  }
+
+  template <typename Func>
+  void forEach(Func&& func) {
+    // Calls func(key, value) for every entry, in no particular order. `func` must not modify the
+    // table.
+
+    for (auto& slot: slots) {
+      if (slot.key != 0) func(slot.key, slot.value);
+    }
+  }
+
+private:
+  struct Slot {
+    uint64_t key;
+    T value;
+  };
+
+  kj::Array<Slot> slots;
+  size_t count = 0;
+
+  size_t mask() const { return slots.size() - 1; }
+
+  size_t home(uint64_t key) const {
+    // Keys are often sequential (e.g. inode numbers), so scramble them before picking a slot.
+    // This is the finalizer from SplitMix64.
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+    key = key ^ (key >> 31);
+    return key & mask();
+  }
+
+  void rehash(size_t newSize) {
+    auto oldSlots = kj::mv(slots);
+    slots = kj::heapArray<Slot>(newSize);
+    for (auto& slot: slots) {
+      slot.key = 0;
+    }
+    for (auto& slot: oldSlots) {
+      if (slot.key == 0) continue;
+      size_t i = home(slot.key);
+      while (slots[i].key != 0) i = (i + 1) & mask();
+      slots[i] = kj::mv(slot);
+    }
+  }
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_FLAT_HASH_H_
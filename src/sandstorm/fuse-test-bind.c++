@@ -19,6 +19,9 @@
 #include <kj/io.h>
 #include <kj/async-unix.h>
 #include <kj/debug.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "util.h"
 
 namespace sandstorm {
 
@@ -35,6 +38,13 @@ public:
                           "Set mount options.")
         .addOption({'c', "cache-forever"}, KJ_BIND_METHOD(*this, setCacheForever),
                    "Assume for caching purposes that the source directory never changes.")
+        .addOptionWithArg({'t', "threads"}, KJ_BIND_METHOD(*this, setThreads), "<count>",
+                          "Serve requests from a pool of <count> threads.")
+        .addOptionWithArg({'b', "benchmark"}, KJ_BIND_METHOD(*this, setBenchmark), "<command>",
+                          "Instead of waiting for Ctrl+C, run <command> under /bin/sh with the "
+                          "mount point as its working directory, report how long it took, and "
+                          "unmount. E.g. use the command that starts your app to measure boot "
+                          "time, and compare different --threads settings.")
         .expectArg("<mount-point>", KJ_BIND_METHOD(*this, setMountPoint))
         .expectArg("<soure-dir>", KJ_BIND_METHOD(*this, setBindTo))
         .callAfterParsing(KJ_BIND_METHOD(*this, run))
@@ -47,6 +57,7 @@ private:
   kj::StringPtr mountPoint;
   kj::StringPtr bindTo;
   FuseOptions bindOptions;
+  kj::StringPtr benchmarkCommand;
 
   kj::MainBuilder::Validity setOptions(kj::StringPtr arg) {
     options = arg;
@@ -58,6 +69,20 @@ private:
     return true;
   }
 
+  kj::MainBuilder::Validity setThreads(kj::StringPtr arg) {
+    KJ_IF_MAYBE(i, parseUInt(arg, 10)) {
+      bindOptions.threadCount = *i;
+      return true;
+    } else {
+      return "invalid thread count";
+    }
+  }
+
+  kj::MainBuilder::Validity setBenchmark(kj::StringPtr arg) {
+    benchmarkCommand = arg;
+    return true;
+  }
+
   kj::MainBuilder::Validity setMountPoint(kj::StringPtr arg) {
     mountPoint = arg;
     return true;
@@ -75,6 +100,7 @@ private:
     kj::UnixEventPort::captureSignal(SIGQUIT);
     kj::UnixEventPort::captureSignal(SIGTERM);
     kj::UnixEventPort::captureSignal(SIGHUP);
+    kj::UnixEventPort::captureSignal(SIGCHLD);
 
     kj::UnixEventPort eventPort;
     kj::EventLoop loop(eventPort);
@@ -92,6 +118,26 @@ private:
 
     FuseMount mount(mountPoint, options);
 
+    if (benchmarkCommand != nullptr) {
+      auto startTime = monotonicNanoseconds();
+      pid_t pid = runBenchmarkCommand();
+      auto fuseTask = bindFuse(eventPort, mount.getFd(), kj::mv(root), bindOptions)
+          .then([]() -> int {
+            KJ_FAIL_ASSERT("filesystem unmounted while benchmark was running");
+          });
+      int status = onChildExit(eventPort, pid)
+          .exclusiveJoin(kj::mv(fuseTask))
+          .wait(waitScope);
+      auto elapsed = monotonicNanoseconds() - startTime;
+
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        context.exitError("benchmark command failed");
+      }
+      context.warning(kj::str("Benchmark took ", elapsed / 1000000, " ms with ",
+                              bindOptions.threadCount, " FUSE threads."));
+      return true;
+    }
+
     context.warning("FUSE mirror mounted. Ctrl+C to unmount.");
 
     bindFuse(eventPort, mount.getFd(), kj::mv(root), bindOptions)
@@ -104,6 +150,35 @@ private:
 
     return true;
   }
+
+  pid_t runBenchmarkCommand() {
+    pid_t pid;
+    KJ_SYSCALL(pid = fork());
+    if (pid == 0) {
+      // KJ likes to adjust the signal mask.  Fix it.
+      sigset_t emptySet;
+      KJ_SYSCALL(sigemptyset(&emptySet));
+      KJ_SYSCALL(sigprocmask(SIG_SETMASK, &emptySet, nullptr));
+
+      KJ_SYSCALL(chdir(mountPoint.cStr()), mountPoint);
+      KJ_SYSCALL(execl("/bin/sh", "sh", "-c", benchmarkCommand.cStr(), (char*)nullptr));
+      KJ_UNREACHABLE;
+    }
+    return pid;
+  }
+
+  kj::Promise<int> onChildExit(kj::UnixEventPort& eventPort, pid_t pid) {
+    int status;
+    int waitResult;
+    KJ_SYSCALL(waitResult = waitpid(pid, &status, WNOHANG));
+    if (waitResult == 0) {
+      return eventPort.onSignal(SIGCHLD).then([this,&eventPort,pid](siginfo_t&& info) {
+        return onChildExit(eventPort, pid);
+      });
+    } else {
+      return status;
+    }
+  }
 };
 
 }  // namespace sandstorm
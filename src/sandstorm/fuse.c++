@@ -20,7 +20,10 @@
 #include <linux/fuse.h>
 #include <kj/debug.h>
 #include <kj/one-of.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
 #include <unordered_map>
+#include <deque>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
@@ -35,11 +38,66 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 
 namespace sandstorm {
 
 using kj::uint;
 
+namespace fuse {
+
+struct BigLockHolder {
+  // The current thread's hold on a multi-threaded FuseDriver's big lock. See Unlocked.
+
+  const kj::MutexGuarded<bool>* mutex;
+  kj::Maybe<kj::Locked<bool>> lock;
+};
+
+static thread_local BigLockHolder* currentBigLock = nullptr;
+
+Unlocked::Unlocked(): holder(currentBigLock) {
+  if (holder != nullptr) {
+    currentBigLock = nullptr;
+    holder->lock = nullptr;
+  }
+}
+
+Unlocked::~Unlocked() noexcept(false) {
+  if (holder != nullptr) {
+    holder->lock = holder->mutex->lockExclusive();
+    currentBigLock = holder;
+  }
+}
+
+}  // namespace fuse
+
+class BigLockScope {
+  // Holds `mutex` as the current thread's big lock for the duration of the scope. A null `mutex`
+  // (i.e. a single-threaded driver) makes this a no-op.
+
+public:
+  explicit BigLockScope(const kj::MutexGuarded<bool>* mutex): holder { mutex, nullptr } {
+    if (mutex != nullptr) {
+      KJ_ASSERT(fuse::currentBigLock == nullptr, "FUSE big lock is not recursive");
+      holder.lock = mutex->lockExclusive();
+      fuse::currentBigLock = &holder;
+    }
+  }
+
+  ~BigLockScope() noexcept(false) {
+    if (holder.mutex != nullptr) {
+      fuse::currentBigLock = nullptr;
+      holder.lock = nullptr;
+    }
+  }
+
+  KJ_DISALLOW_COPY(BigLockScope);
+
+private:
+  fuse::BigLockHolder holder;
+};
+
 class FuseDriver {
 public:
   FuseDriver(kj::UnixEventPort& eventPort, int fuseFd, kj::Own<fuse::Node>&& root,
@@ -53,6 +111,32 @@ public:
     if ((flags & O_NONBLOCK) == 0) {
       KJ_SYSCALL(fcntl(fuseFd, F_SETFL, flags | O_NONBLOCK));
     }
+
+    if (options.threadCount > 0) {
+      int fd;
+      KJ_SYSCALL(fd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE));
+      jobEvent = kj::AutoCloseFd(fd);
+      KJ_SYSCALL(fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+      workerErrorEvent = kj::AutoCloseFd(fd);
+      workerErrorObserver = kj::heap<kj::UnixEventPort::FdObserver>(eventPort, workerErrorEvent,
+          kj::UnixEventPort::FdObserver::OBSERVE_READ);
+
+      for (uint i = 0; i < options.threadCount; i++) {
+        workers.add(kj::heap<kj::Thread>([this]() { workerLoop(); }));
+      }
+    }
+  }
+
+  ~FuseDriver() noexcept(false) {
+    if (workers.size() > 0) {
+      {
+        auto lock = bigLock.lockExclusive();
+        shuttingDown = true;
+      }
+      uint64_t count = workers.size();
+      KJ_SYSCALL(write(jobEvent, &count, sizeof(count)));
+      workers.resize(0);  // joins
+    }
   }
 
   kj::Promise<void> run() {
@@ -60,7 +144,11 @@ public:
     abortReadLoop = kj::mv(paf.fulfiller);
 
     // Wait for readLoop() to report disconnect, but fail early if aborted.
-    return readLoop().exclusiveJoin(kj::mv(paf.promise));
+    auto result = readLoop().exclusiveJoin(kj::mv(paf.promise));
+    KJ_IF_MAYBE(o, workerErrorObserver) {
+      result = result.exclusiveJoin(watchWorkerErrors(**o));
+    }
+    return kj::mv(result);
   }
 
 private:
@@ -243,6 +331,163 @@ private:
     }
   };
 
+  struct SplicePipe {
+    kj::AutoCloseFd readEnd;
+    kj::AutoCloseFd writeEnd;
+  };
+
+  struct SpliceResponse: public ResponseBase {
+    // A FUSE_READ reply whose content has already been spliced from the backing file into
+    // `content`. When written, we put the header into `message`, move the content in behind it
+    // (pipe-to-pipe splice moves page references rather than copying), and splice the whole
+    // message into the device, which can then steal the pages for its page cache.
+    //
+    // writeSelf() may be called again after it fails with EINTR, so it only assembles `message`
+    // once. If the device doesn't accept splices, it falls back to copying the message out of the
+    // pipe and writing it normally.
+
+    FuseDriver& driver;
+    SplicePipe content;
+    SplicePipe message;
+    size_t contentSize = 0;
+    bool assembled = false;
+    kj::Array<kj::byte> copied;  // message content, if we had to fall back to write()
+    bool sent = false;
+
+    explicit SpliceResponse(FuseDriver& driver): driver(driver) {}
+    ~SpliceResponse() noexcept(false) {
+      // Pipes that might still contain data can't be reused.
+      if (sent) {
+        driver.returnSplicePipe(kj::mv(content));
+        driver.returnSplicePipe(kj::mv(message));
+      }
+    }
+
+    virtual size_t size() override { return sizeof(header) + contentSize; }
+
+    virtual ssize_t writeSelf(int fd) override {
+      if (!assembled) {
+        ssize_t n;
+        KJ_SYSCALL(n = write(message.writeEnd, &header, sizeof(header)));
+        KJ_ASSERT(n == sizeof(header));
+
+        size_t remaining = contentSize;
+        while (remaining > 0) {
+          KJ_SYSCALL(n = splice(content.readEnd, nullptr, message.writeEnd, nullptr, remaining,
+                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+          KJ_ASSERT(n > 0);
+          remaining -= n;
+        }
+        assembled = true;
+      }
+
+      if (copied == nullptr) {
+        ssize_t n = splice(message.readEnd, nullptr, fd, nullptr, size(), SPLICE_F_MOVE);
+        if (n >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+          sent = n == size();
+          return n;
+        }
+
+        // The kernel doesn't support splicing into the device after all. Don't try again.
+        KJ_LOG(WARNING, "splice() to FUSE device failed; disabling FUSE splice reads",
+               strerror(errno));
+        driver.useSplice = false;
+        copyOutOfPipe();
+      }
+
+      return write(fd, copied.begin(), copied.size());
+    }
+
+    void copyOutOfPipe() {
+      // The failed splice() shouldn't have consumed anything, but make sure, since otherwise
+      // read() would block forever.
+      int available;
+      KJ_SYSCALL(ioctl(message.readEnd, FIONREAD, &available));
+      KJ_ASSERT(available == size(), "splice() to FUSE device consumed part of the message");
+
+      copied = kj::heapArray<kj::byte>(size());
+      kj::FdInputStream(message.readEnd.get()).read(copied.begin(), copied.size());
+      sent = true;  // the pipes are now empty and can be reused
+    }
+  };
+
+  static constexpr size_t SPLICE_PIPE_SIZE = 256u << 10;
+  // Room for the largest read the kernel will send us (32 pages at protocol 7.20) plus the
+  // header and page misalignment, with plenty to spare.
+
+  bool useSplice = false;  // set by FUSE_INIT if the kernel supports it
+  kj::Vector<SplicePipe> sparePipes;
+
+  bool takeSplicePipe(SplicePipe& pipe) {
+    if (sparePipes.size() > 0) {
+      pipe = kj::mv(sparePipes.back());
+      sparePipes.removeLast();
+      return true;
+    }
+
+    int fds[2];
+    KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+    pipe.readEnd = kj::AutoCloseFd(fds[0]);
+    pipe.writeEnd = kj::AutoCloseFd(fds[1]);
+
+    if (fcntl(fds[0], F_SETPIPE_SZ, SPLICE_PIPE_SIZE) < 0) {
+      // Probably /proc/sys/fs/pipe-max-size is set very low. Don't bother trying again.
+      KJ_LOG(WARNING, "couldn't enlarge pipe; disabling FUSE splice reads", strerror(errno));
+      useSplice = false;
+      return false;
+    }
+
+    return true;
+  }
+
+  void returnSplicePipe(SplicePipe&& pipe) {
+    if (sparePipes.size() < 2 * kj::max(options.threadCount, 1u) + 2) {
+      sparePipes.add(kj::mv(pipe));
+    }
+  }
+
+  kj::Maybe<kj::Own<ResponseBase>> trySpliceRead(int fd, uint64_t offset, uint32_t size) {
+    // Reads the requested content straight into a pipe, without copying it through userspace.
+    // Returns null if the caller should fall back to fuse::File::read().
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    if (!useSplice || size + 2 * pageSize > SPLICE_PIPE_SIZE) return nullptr;
+
+    auto response = kj::heap<SpliceResponse>(*this);
+    if (!takeSplicePipe(response->content) || !takeSplicePipe(response->message)) {
+      return nullptr;
+    }
+
+    loff_t pos = offset;
+    size_t total = 0;
+    int error = 0;
+    {
+      fuse::Unlocked unlocked;
+      while (total < size) {
+        ssize_t n = splice(fd, &pos, response->content.writeEnd, nullptr, size - total,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+          if (errno == EINTR) continue;
+          error = errno;
+          break;
+        } else if (n == 0) {
+          // EOF.
+          break;
+        }
+        total += n;
+      }
+    }
+
+    if (error != 0) {
+      // E.g. EINVAL if the backing filesystem doesn't support splice. The pipes are dropped
+      // since they may contain partial data.
+      return nullptr;
+    }
+
+    response->contentSize = total;
+    return kj::Own<ResponseBase>(kj::mv(response));
+  }
+
   template <typename T>
   kj::Own<Response<T>> allocResponse() {
     return kj::heap<Response<T>>();
@@ -259,9 +504,26 @@ private:
 
   template <typename Function>
   void performReplyTask(uint64_t requestId, int defaultError, Function&& task) {
+    if (workers.size() > 0) {
+      // Hand off to the pool. We're holding the big lock, so the queue is ours to touch.
+      jobQueue.push_back(Job { requestId, defaultError, kj::mv(task) });
+      uint64_t one = 1;
+      KJ_SYSCALL(write(jobEvent, &one, sizeof(one)));
+    } else {
+      KJ_IF_MAYBE(e, runReplyTask(requestId, defaultError, task)) {
+        abortReadLoop->reject(kj::mv(*e));
+      }
+    }
+  }
+
+  template <typename Function>
+  kj::Maybe<kj::Exception> runReplyTask(uint64_t requestId, int defaultError, Function& task) {
+    // Runs `task` and writes its response. Returns an exception if the write failed, in which
+    // case the driver should abort.
+
     kj::Maybe<kj::Own<ResponseBase>> maybeResponse;
     auto exception = kj::runCatchingExceptions(
-        [&maybeResponse, requestId, KJ_MVCAP(task)]() mutable {
+        [&maybeResponse, requestId, &task]() mutable {
       auto taskResponse = task(); // This is allowed to be an error response.
       taskResponse->header.unique = requestId;
       maybeResponse = kj::mv(taskResponse);
@@ -275,15 +537,13 @@ private:
     }
 
     KJ_IF_MAYBE (response, maybeResponse) {
-      auto writeException = kj::runCatchingExceptions([KJ_MVCAP(response), this] () {
+      // We only get an exception here if the write failed.
+      return kj::runCatchingExceptions([KJ_MVCAP(response), this] () {
         writeResponse(kj::mv(*response));
       });
-
-      KJ_IF_MAYBE(e, writeException) {
-        // We only get here if the write failed. Abort.
-        abortReadLoop->reject(kj::mv(*e));
-      }
     }
+
+    return nullptr;
   }
 
   void sendReply(uint64_t requestId, kj::Own<ResponseBase>&& response) {
@@ -341,6 +601,70 @@ private:
     }
   }
 
+  // =====================================================================================
+  // Worker pool (only when options.threadCount > 0)
+
+  kj::MutexGuarded<bool> bigLock;
+  // Held by whichever thread is currently running filesystem code or touching the tables above.
+  // The event loop thread holds it while dispatching; workers hold it while running reply tasks,
+  // except where the filesystem implementation releases it using fuse::Unlocked.
+
+  struct Job {
+    uint64_t requestId;
+    int defaultError;
+    kj::Function<kj::Own<ResponseBase>()> task;
+  };
+
+  std::deque<Job> jobQueue;  // protected by bigLock
+  bool shuttingDown = false;  // protected by bigLock
+  kj::AutoCloseFd jobEvent;  // eventfd semaphore; incremented once per queued job
+
+  kj::Maybe<kj::Exception> workerError;  // protected by bigLock
+  kj::AutoCloseFd workerErrorEvent;  // signaled when workerError is set
+  kj::Maybe<kj::Own<kj::UnixEventPort::FdObserver>> workerErrorObserver;
+
+  kj::Vector<kj::Own<kj::Thread>> workers;
+
+  const kj::MutexGuarded<bool>* bigLockIfThreaded() {
+    return options.threadCount > 0 ? &bigLock : nullptr;
+  }
+
+  void workerLoop() {
+    for (;;) {
+      uint64_t count;
+      ssize_t n;
+      KJ_SYSCALL(n = read(jobEvent, &count, sizeof(count)));
+      KJ_ASSERT(n == sizeof(count));
+
+      BigLockScope lock(&bigLock);
+      if (shuttingDown) return;
+      KJ_ASSERT(!jobQueue.empty());
+
+      // Note that `job` is destroyed before `lock`, so any references it holds are dropped
+      // under the lock.
+      auto job = kj::mv(jobQueue.front());
+      jobQueue.pop_front();
+
+      KJ_IF_MAYBE(e, runReplyTask(job.requestId, job.defaultError, job.task)) {
+        if (workerError == nullptr) {
+          workerError = kj::mv(*e);
+          uint64_t one = 1;
+          KJ_SYSCALL(write(workerErrorEvent, &one, sizeof(one)));
+        }
+      }
+    }
+  }
+
+  kj::Promise<void> watchWorkerErrors(kj::UnixEventPort::FdObserver& errorObserver) {
+    return errorObserver.whenBecomesReadable().then([this,&errorObserver]() -> kj::Promise<void> {
+      BigLockScope lock(&bigLock);
+      KJ_IF_MAYBE(e, workerError) {
+        kj::throwFatalException(kj::mv(*e));
+      }
+      return watchWorkerErrors(errorObserver);
+    });
+  }
+
   // =====================================================================================
   // Read loop
 
@@ -373,6 +697,7 @@ private:
 
       // OK, we got some bytes.
       auto bufferPtr = kj::arrayPtr(buffer, bytesRead);
+      BigLockScope lock(bigLockIfThreaded());
 
       while (bufferPtr.size() > 0) {
         struct fuse_in_header header;
@@ -402,9 +727,21 @@ private:
         auto reply = allocResponse<struct fuse_init_out>();
         reply->body.major = 7;
         reply->body.minor = 20;
-        reply->body.max_readahead = 65536;
+        // 128k is the most the kernel will ask for in one read at this protocol version.
+        reply->body.max_readahead = 128u << 10;
         reply->body.max_write = 65536;
 
+        if (initBody.flags & FUSE_SPLICE_WRITE) {
+          // Answer reads of loopback files using splice(); see trySpliceRead().
+          useSplice = true;
+          reply->body.flags |= initBody.flags & (FUSE_SPLICE_WRITE | FUSE_SPLICE_MOVE);
+        }
+
+        if (workers.size() > 0) {
+          // Let the kernel issue readahead concurrently with other reads of the same file.
+          reply->body.flags |= initBody.flags & FUSE_ASYNC_READ;
+        }
+
 #ifdef FUSE_COMPAT_22_INIT_OUT_SIZE
         // Compatibility with pre-2.15 kernels.
         reply->bodySize = FUSE_COMPAT_22_INIT_OUT_SIZE;
@@ -444,10 +781,12 @@ private:
         auto requestId = header.unique;
         uint64_t parentId = header.nodeid;
         kj::String ownName = kj::heapString(name);
+        auto node = nodeIter->second.node->addRef();
 
         performReplyTask(requestId, EIO,
-            [this, parentId, nodeIter, KJ_MVCAP(ownName)]() mutable -> kj::Own<ResponseBase> {
-          auto maybeLookupResult = nodeIter->second.node->lookup(ownName.slice(0));
+            [this, parentId, KJ_MVCAP(node), KJ_MVCAP(ownName)]() mutable
+            -> kj::Own<ResponseBase> {
+          auto maybeLookupResult = node->lookup(ownName.slice(0));
           KJ_IF_MAYBE(lookupResult, maybeLookupResult) {
             auto result = lookupResult->node->getAttributes();
             auto attributes = result.attributes;
@@ -498,8 +837,22 @@ private:
             }
             return kj::mv(reply);
           } else {
-            auto reply = kj::heap<ResponseBase>();
-            reply->header.error = -ENOENT;  // Has to be negative. Just because.
+            uint64_t negativeTtl = node->getNegativeLookupTtl();
+            if (negativeTtl == 0) {
+              auto reply = kj::heap<ResponseBase>();
+              reply->header.error = -ENOENT;  // Has to be negative. Just because.
+              return kj::mv(reply);
+            }
+
+            // A successful reply with node ID zero creates a negative dentry which the kernel
+            // keeps for `entry_valid`.
+            auto reply = allocResponse<struct fuse_entry_out>();
+            reply->body.nodeid = 0;
+            if (options.cacheForever) {
+              reply->body.entry_valid = 365 * kj::DAYS / kj::SECONDS;
+            } else {
+              splitTime(negativeTtl, &reply->body.entry_valid, &reply->body.entry_valid_nsec);
+            }
             return kj::mv(reply);
           }
         });
@@ -507,8 +860,10 @@ private:
       }
 
       case FUSE_GETATTR: {
-        performReplyTask(header.unique, EIO, [this, nodeIter]() -> kj::Own<ResponseBase> {
-          auto response = nodeIter->second.node->getAttributes();
+        auto node = nodeIter->second.node->addRef();
+        performReplyTask(header.unique, EIO,
+            [this, KJ_MVCAP(node)]() mutable -> kj::Own<ResponseBase> {
+          auto response = node->getAttributes();
 
           auto reply = allocResponse<struct fuse_attr_out>();
           if (options.cacheForever) {
@@ -522,14 +877,17 @@ private:
         break;
       }
 
-      case FUSE_READLINK:
+      case FUSE_READLINK: {
         // No input.
-        performReplyTask(header.unique, EINVAL, [this, nodeIter]() -> kj::Own<ResponseBase> {
-          auto link = nodeIter->second.node->readlink();
+        auto node = nodeIter->second.node->addRef();
+        performReplyTask(header.unique, EINVAL,
+            [this, KJ_MVCAP(node)]() mutable -> kj::Own<ResponseBase> {
+          auto link = node->readlink();
           auto bytes = kj::arrayPtr(reinterpret_cast<const kj::byte*>(link.begin()), link.size());
           return allocResponse<void>(kj::mv(link), bytes);
         });
         break;
+      }
 
       case FUSE_OPEN: {
         auto request = consumeStruct<struct fuse_open_in>(body);
@@ -541,8 +899,10 @@ private:
 
         // TODO(perf): Can we assume the kernel will check permissions before open()? If so,
         //   perhaps we ought to assume this should always succeed and thus pipeline it?
-        performReplyTask(header.unique, EIO, [this, nodeIter]() -> kj::Own<ResponseBase> {
-          auto response = nodeIter->second.node->openAsFile();
+        auto node = nodeIter->second.node->addRef();
+        performReplyTask(header.unique, EIO,
+            [this, KJ_MVCAP(node)]() mutable -> kj::Own<ResponseBase> {
+          auto response = node->openAsFile();
           KJ_IF_MAYBE(file, response) {
             auto reply = allocResponse<struct fuse_open_out>();
             reply->body.fh = handleCounter++;
@@ -563,10 +923,17 @@ private:
 
         auto iter2 = fileMap.find(request.fh);
         KJ_REQUIRE(iter2 != fileMap.end(), "Kernel requested invalid file handle?");
+        auto file = iter2->second.cap->addRef();
 
         performReplyTask(header.unique, EIO,
-            [this, KJ_MVCAP(request), iter2]() -> kj::Own<ResponseBase> {
-          auto bytes = iter2->second.cap->read(request.offset, request.size);
+            [this, KJ_MVCAP(request), KJ_MVCAP(file)]() mutable -> kj::Own<ResponseBase> {
+          KJ_IF_MAYBE(fd, file->getSpliceableFd()) {
+            KJ_IF_MAYBE(response, trySpliceRead(*fd, request.offset, request.size)) {
+              return kj::mv(*response);
+            }
+          }
+
+          auto bytes = file->read(request.offset, request.size);
           kj::ArrayPtr<kj::byte> slice = bytes.asPtr();
           return allocResponse<void>(kj::mv(bytes), slice);
         });
@@ -592,8 +959,10 @@ private:
 
         // TODO(perf): Can we assume the kernel will check permissions before open()? If so,
         //   perhaps we ought to assume this should always succeed and thus pipeline it?
-        performReplyTask(header.unique, EIO, [this, nodeIter]() -> kj::Own<ResponseBase> {
-          auto maybeDirectory = nodeIter->second.node->openAsDirectory();
+        auto node = nodeIter->second.node->addRef();
+        performReplyTask(header.unique, EIO,
+            [this, KJ_MVCAP(node)]() mutable -> kj::Own<ResponseBase> {
+          auto maybeDirectory = node->openAsDirectory();
           KJ_IF_MAYBE(directory, maybeDirectory) {
             auto reply = allocResponse<struct fuse_open_out>();
             reply->body.fh = handleCounter++;
@@ -624,10 +993,12 @@ private:
 
         auto requestedSize = request.size;
         auto requestedOffset = request.offset;
+        auto directory = iter2->second.cap->addRef();
 
         performReplyTask(header.unique, EIO,
-            [this, requestedSize, requestedOffset, iter2]() -> kj::Own<ResponseBase> {
-          auto entries = iter2->second.cap->read(
+            [this, requestedSize, requestedOffset, KJ_MVCAP(directory)]() mutable
+            -> kj::Own<ResponseBase> {
+          auto entries = directory->read(
               requestedOffset,
               requestedSize / (sizeof(struct fuse_dirent) + 16));
 
@@ -703,9 +1074,10 @@ private:
           sendError(header.unique, EROFS);
         } else if (request.mask != 0) {
           // Need to check permissions.
+          auto node = nodeIter->second.node->addRef();
           performReplyTask(header.unique, EACCES,
-              [this, nodeIter, mask]() -> kj::Own<ResponseBase> {
-            auto result = nodeIter->second.node->getAttributes();
+              [this, KJ_MVCAP(node), mask]() mutable -> kj::Own<ResponseBase> {
+            auto result = node->getAttributes();
             auto attributes = result.attributes;
             // TODO(someday):  Account for uid/gid?  Currently irrelevant.
             if (mask & R_OK) {
@@ -725,8 +1097,9 @@ private:
       }
 
       case FUSE_INTERRUPT: {
-        // We deal with tasks sequentially, so whatever task this call was intended to interrupt
-        // has in fact already completed. Therefore there's nothing for us to do.
+        // When single-threaded, we deal with tasks sequentially, so whatever task this call was
+        // intended to interrupt has in fact already completed. With a worker pool the task may
+        // still be queued or running, but we're allowed to simply let it finish.
         break;
       }
 
@@ -848,6 +1221,7 @@ inline int64_t toNanos(const struct timespec& ts) {
 class FileImpl final: public fuse::File, public kj::Refcounted {
 public:
   explicit FileImpl(kj::StringPtr path) {
+    fuse::Unlocked unlocked;
     int ifd;
     KJ_SYSCALL(ifd = open(path.cStr(), O_RDONLY), path);
     fd = kj::AutoCloseFd(ifd);
@@ -858,6 +1232,10 @@ public:
   }
 
 protected:
+  kj::Maybe<int> getSpliceableFd() override {
+    return fd.get();
+  }
+
   kj::Array<uint8_t> read(uint64_t offset, uint32_t size) override {
     KJ_REQUIRE(size < (1 << 22), "read too large", size);
 
@@ -865,6 +1243,7 @@ protected:
 
     kj::byte* ptr = result.begin();
 
+    fuse::Unlocked unlocked;
     while (size > 0) {
       ssize_t n;
       KJ_SYSCALL(n = pread(fd, ptr, size, offset));
@@ -891,6 +1270,7 @@ private:
 class DirectoryImpl final: public fuse::Directory, public kj::Refcounted {
 public:
   DirectoryImpl(kj::StringPtr path) {
+    fuse::Unlocked unlocked;
     dir = opendir(path.cStr());
     if (dir == nullptr) {
       int error = errno;
@@ -908,6 +1288,10 @@ public:
 
 protected:
   kj::Array<Entry> read(uint64_t offset, uint32_t requestedCount) override {
+    // The kernel serializes readdir on any one open directory, so `dir` and `currentOffset` are
+    // safe to touch while unlocked.
+    fuse::Unlocked unlocked;
+
     if (offset != currentOffset) {
       seekdir(dir, offset);
       currentOffset = offset;
@@ -975,9 +1359,15 @@ protected:
 
     auto fullPath = kj::str(path, '/', name);
     struct stat new_stats;
-    auto n = lstat(fullPath.cStr(), &new_stats);
+    int n;
+    int error = 0;
+    {
+      fuse::Unlocked unlocked;
+      n = lstat(fullPath.cStr(), &new_stats);
+      if (n < 0) error = errno;
+    }
 
-    if (n < 0 && errno == ENOENT) {
+    if (n < 0 && error == ENOENT) {
       return nullptr;
     } else {
       uint64_t xttl = ttl / kj::NANOSECONDS;
@@ -986,6 +1376,10 @@ protected:
     }
   }
 
+  uint64_t getNegativeLookupTtl() override {
+    return ttl / kj::NANOSECONDS;
+  }
+
   GetAttributesResults getAttributes() override {
     updateStats();
 
@@ -1034,7 +1428,10 @@ protected:
   kj::String readlink() override {
     char buffer[PATH_MAX + 1];
     int n;
-    KJ_SYSCALL(n = ::readlink(path.cStr(), buffer, PATH_MAX));
+    {
+      fuse::Unlocked unlocked;
+      KJ_SYSCALL(n = ::readlink(path.cStr(), buffer, PATH_MAX));
+    }
     buffer[n] = '\0';
     return kj::heapString(buffer);
   }
@@ -1050,8 +1447,14 @@ private:
     KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
     uint64_t time = toNanos(ts);
     if (time >= statsExpirationTime) {
+      // Stat into a local so that a concurrent call never sees a half-written `stats`.
+      struct stat newStats;
+      {
+        fuse::Unlocked unlocked;
+        KJ_SYSCALL(lstat(path.cStr(), &newStats), path);
+      }
+      stats = newStats;
       statsExpirationTime = time + ttl / kj::NANOSECONDS;
-      KJ_SYSCALL(lstat(path.cStr(), &stats), path);
     }
   }
 };
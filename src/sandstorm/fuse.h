@@ -41,6 +41,10 @@ public:
 
   virtual kj::Maybe<LookupResults> lookup(kj::StringPtr name) = 0;
 
+  virtual uint64_t getNegativeLookupTtl() { return 0; }
+  // Nanoseconds for which the kernel may remember that `lookup()` returned null for some name,
+  // rather than asking again. Zero disables negative caching.
+
   enum class Type {
     UNKNOWN = 0,
     BLOCK_DEVICE = 1,
@@ -84,6 +88,11 @@ class File {
 public:
   virtual kj::Own<File> addRef() = 0;
   virtual kj::Array<uint8_t> read(uint64_t offset, uint32_t size) = 0;
+
+  virtual kj::Maybe<int> getSpliceableFd() { return nullptr; }
+  // If reading this file is equivalent to pread() on some file descriptor, returns that
+  // descriptor, so that the driver may splice() content directly from it into the FUSE device
+  // rather than calling read(). The descriptor must remain valid as long as the File does.
 };
 
 class Directory {
@@ -100,6 +109,28 @@ public:
   virtual kj::Array<Entry> read(uint64_t offset, uint32_t count) = 0;
 };
 
+struct BigLockHolder;
+
+class Unlocked {
+  // When the driver runs with `FuseOptions::threadCount` > 0, calls into Node, File, and
+  // Directory are made from a pool of threads, but the driver holds a single global lock around
+  // each one. So, implementations do not need to be thread-safe -- not even their refcounting.
+  //
+  // Constructing an Unlocked releases that lock until it is destroyed, letting other requests
+  // proceed in the meantime. Use it around slow system calls (stat(), read(), readdir(), ...),
+  // and be careful not to touch any state that could be shared with other nodes -- including
+  // adding or dropping references -- while it is in scope. When the driver is single-threaded,
+  // or the lock has already been released further up the stack, Unlocked does nothing.
+
+public:
+  Unlocked();
+  ~Unlocked() noexcept(false);
+  KJ_DISALLOW_COPY(Unlocked);
+
+private:
+  BigLockHolder* holder;
+};
+
 } // namespace fuse
 
 struct FuseOptions {
@@ -107,6 +138,11 @@ struct FuseOptions {
   // Set true to ignore the TTL values returned by the filesystem implementation and instead
   // assume for caching purposes that content never changes. In addition to ignoring TTLs, the
   // page cache will not be flushed when a file is reopened.
+
+  kj::uint threadCount = 0;
+  // If non-zero, requests are executed on a pool of this many threads rather than on the event
+  // loop, so that lookups, getattrs, and reads of independent nodes can overlap while waiting on
+  // the disk. See fuse::Unlocked for how node implementations take advantage of this.
 };
 
 kj::Promise<void> bindFuse(kj::UnixEventPort& eventPort, int fuseFd, kj::Own<fuse::Node> root,
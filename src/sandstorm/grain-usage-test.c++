@@ -0,0 +1,143 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "grain-usage.h"
+#include "util.h"
+#include "test-util.h"
+#include <kj/test.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+namespace {
+
+void writeFile(kj::StringPtr path, size_t size, int flags = O_TRUNC) {
+  auto data = kj::heapArray<kj::byte>(size);
+  memset(data.begin(), 'x', data.size());
+  kj::FdOutputStream(raiiOpen(path, O_WRONLY | O_CREAT | flags, 0644))
+      .write(data.begin(), data.size());
+}
+
+struct Fixture {
+  TempDir tmp;
+  kj::String grainsDir = kj::str(tmp.path, "/grains");
+  kj::String indexPath = kj::str(tmp.path, "/usage-index");
+  kj::AsyncIoContext io = kj::setupAsyncIo();
+  ThreadPool pool {*io.lowLevelProvider, 2};
+
+  Fixture() {
+    KJ_SYSCALL(mkdir(grainsDir.cStr(), 0755));
+  }
+
+  kj::String makeGrain(kj::StringPtr grainId, size_t size) {
+    auto path = kj::str(grainsDir, '/', grainId);
+    KJ_SYSCALL(mkdir(path.cStr(), 0755));
+    writeFile(kj::str(path, "/data"), size);
+    return path;
+  }
+
+  kj::Own<GrainUsageIndex> newIndex() {
+    return kj::heap<GrainUsageIndex>(pool, io.provider->getTimer(), grainsDir, indexPath);
+  }
+};
+
+KJ_TEST("GrainUsageIndex tracks owner totals as grains move and go") {
+  Fixture f;
+  auto index = f.newIndex();
+  auto& ws = f.io.waitScope;
+
+  // Until the front-end has listed every grain, user totals can't be trusted.
+  KJ_EXPECT(!index->areAllOwnersKnown());
+  index->setAllOwnersKnown();
+  KJ_EXPECT(index->areAllOwnersKnown());
+
+  index->grainStarted("grain-one", "alice");
+  index->reportSize("grain-one", 1000);
+  index->grainStarted("grain-two", "alice");
+  index->reportSize("grain-two", 200);
+  KJ_EXPECT(index->getUserUsage("alice").wait(ws) == 1200);
+  KJ_EXPECT(index->getUserUsage("bob").wait(ws) == 0);
+
+  // Reports replace rather than add to the old size.
+  index->reportSize("grain-one", 3000);
+  KJ_EXPECT(index->getUserUsage("alice").wait(ws) == 3200);
+  KJ_EXPECT(index->getUsage("grain-one", "alice").wait(ws) == 3000);
+
+  // Changing hands moves the size from one total to the other. An empty owner means "unknown",
+  // not "nobody".
+  index->setOwner("grain-one", "bob");
+  KJ_EXPECT(index->getUserUsage("alice").wait(ws) == 200);
+  KJ_EXPECT(index->getUserUsage("bob").wait(ws) == 3000);
+  index->setOwner("grain-one", "");
+  KJ_EXPECT(index->getUserUsage("bob").wait(ws) == 3000);
+
+  index->grainDeleted("grain-one");
+  KJ_EXPECT(index->getUserUsage("bob").wait(ws) == 0);
+  KJ_EXPECT(index->getUserUsage("alice").wait(ws) == 200);
+}
+
+KJ_TEST("GrainUsageIndex walks stopped grains and reuses the result until they run") {
+  Fixture f;
+  auto grainPath = f.makeGrain("grain-one", 64 << 10);
+  auto index = f.newIndex();
+  auto& ws = f.io.waitScope;
+
+  uint64_t first = index->getUsage("grain-one", "alice").wait(ws);
+  KJ_EXPECT(first >= 64 << 10, first);
+  KJ_EXPECT(first == countStorageUsage(grainPath));
+  KJ_EXPECT(index->getUserUsage("alice").wait(ws) == first);
+
+  // Growing a file doesn't change the grain directory's ctime, so the fingerprint still matches
+  // and we don't walk again. (Only running grains change, and starting one replaces its socket.)
+  writeFile(kj::str(grainPath, "/data"), 64 << 10, O_APPEND);
+  KJ_EXPECT(index->getUsage("grain-one", "alice").wait(ws) == first);
+
+  // Creating a file in the grain directory, as starting the supervisor does, invalidates it.
+  writeFile(kj::str(grainPath, "/socket"), 0);
+  uint64_t second = index->getUsage("grain-one", "alice").wait(ws);
+  KJ_EXPECT(second > first, first, second);
+  KJ_EXPECT(second == countStorageUsage(grainPath));
+  KJ_EXPECT(index->getUserUsage("alice").wait(ws) == second);
+}
+
+KJ_TEST("GrainUsageIndex survives a restart") {
+  Fixture f;
+  auto& ws = f.io.waitScope;
+  f.makeGrain("grain-two", 16 << 10);
+
+  uint64_t walked;
+  {
+    auto index = f.newIndex();
+    index->grainStarted("grain-one", "alice");
+    index->reportSize("grain-one", 1000);
+    index->grainStopped("grain-one");
+    walked = index->getUsage("grain-two", "bob").wait(ws);
+  }  // saves on destruction
+
+  auto index = f.newIndex();
+  KJ_EXPECT(index->getUserUsage("alice").wait(ws) == 1000);
+  KJ_EXPECT(index->getUserUsage("bob").wait(ws) == walked);
+
+  // A corrupt index is discarded rather than trusted.
+  index = nullptr;
+  writeFile(f.indexPath, 3);
+  index = f.newIndex();
+  KJ_EXPECT(index->getUserUsage("alice").wait(ws) == 0);
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,514 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "grain-usage.h"
+#include "util.h"
+#include <sandstorm/backend.capnp.h>
+#include <kj/debug.h>
+#include <kj/mutex.h>
+#include <kj/vector.h>
+#include <capnp/serialize.h>
+#include <stdio.h>  // rename()
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+
+static constexpr uint WALK_THREADS = 3;
+// Pool threads used to walk one grain, when idle.
+
+static constexpr uint MAX_CONCURRENT_WALKS = 2;
+
+namespace {
+
+uint64_t allocatedSize(const struct stat& stats) {
+  // Count blocks, not length, because what we care about is allocated space.
+  uint64_t size = stats.st_blocks * 512;
+
+  if (!S_ISDIR(stats.st_mode) && stats.st_nlink != 0) {
+    // Don't overcount hard links. (Note that st_nlink can in fact be zero in cases where we are
+    // racing with directory modifications, so we check for that to avoid divide-by-zero crashes.)
+    size /= stats.st_nlink;
+  }
+
+  return size;
+}
+
+int64_t changeTime(const struct stat& stats) {
+  return stats.st_ctim.tv_sec * 1000000000ll + stats.st_ctim.tv_nsec;
+}
+
+struct WalkState {
+  kj::Vector<kj::String> directories;  // not yet listed
+  uint busy = 0;                       // threads currently listing a directory
+  uint64_t total = 0;
+  kj::Maybe<kj::Exception> error;
+};
+
+void countDirectory(kj::StringPtr path, uint64_t& total, kj::Vector<kj::String>& subdirectories) {
+  // Adds the sizes of the children of `path` to `total`, and adds the paths of those which are
+  // directories to `subdirectories`.
+
+  KJ_IF_MAYBE(dirFd, raiiOpenIfExists(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {
+    for (auto& name: listDirectoryFd(*dirFd)) {
+      struct stat stats;
+      if (fstatat(*dirFd, name.cStr(), &stats, AT_SYMLINK_NOFOLLOW) < 0) {
+        int error = errno;
+        if (error == ENOENT) continue;  // deleted since we listed the directory
+        KJ_FAIL_SYSCALL("fstatat", error, path, name);
+      }
+
+      total += allocatedSize(stats);
+      if (S_ISDIR(stats.st_mode)) {
+        subdirectories.add(kj::str(path, '/', name));
+      }
+    }
+  }
+}
+
+void walkWorker(kj::MutexGuarded<WalkState>& state) {
+  // Lists directories from `state` until there are none left and no other thread might find more.
+
+  uint64_t total = 0;
+  kj::Vector<kj::String> subdirectories;
+  kj::String path;
+  bool working = false;
+
+  for (;;) {
+    {
+      auto lock = state.lockExclusive();
+      if (working) {
+        --lock->busy;
+        for (auto& subdirectory: subdirectories) {
+          lock->directories.add(kj::mv(subdirectory));
+        }
+        subdirectories.clear();
+        working = false;
+      }
+
+      // If there's nothing to list but another thread is still listing a directory, that may
+      // turn up more work, so wait for it.
+      lock.wait([](const WalkState& s) {
+        return s.error != nullptr || s.directories.size() > 0 || s.busy == 0;
+      });
+
+      if (lock->error != nullptr || lock->directories.size() == 0) {
+        break;
+      }
+
+      path = kj::mv(lock->directories.end()[-1]);
+      lock->directories.removeLast();
+      ++lock->busy;
+      working = true;
+    }
+
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      countDirectory(path, total, subdirectories);
+    })) {
+      auto lock = state.lockExclusive();
+      if (lock->error == nullptr) {
+        lock->error = kj::mv(*exception);
+      }
+    }
+  }
+
+  state.lockExclusive()->total += total;
+}
+
+}  // namespace
+
+uint64_t countStorageUsage(kj::StringPtr path, uint threadCount) {
+  KJ_REQUIRE(!path.endsWith("/"),
+      "refusing to recursively traverse directory name with trailing / to reduce risk of "
+      "catastrophic empty-string bugs");
+
+  struct stat stats;
+  KJ_SYSCALL(lstat(path.cStr(), &stats), path);
+  uint64_t total = allocatedSize(stats);
+  if (!S_ISDIR(stats.st_mode)) return total;
+
+  kj::MutexGuarded<WalkState> state;
+  state.lockExclusive()->directories.add(kj::heapString(path));
+
+  ThreadPool::parallelize(threadCount, [&state]() { walkWorker(state); });
+
+  auto lock = state.lockExclusive();
+  KJ_IF_MAYBE(exception, lock->error) {
+    kj::throwFatalException(kj::mv(*exception));
+  }
+  return total + lock->total;
+}
+
+// =======================================================================================
+
+class GrainUsageIndex::WalkSlot {
+  // Permission to walk a grain. Passed on to the next waiter when destroyed.
+
+public:
+  explicit WalkSlot(GrainUsageIndex& index): index(index) {}
+  ~WalkSlot() noexcept(false) { index.releaseWalkSlot(); }
+  KJ_DISALLOW_COPY(WalkSlot);
+
+private:
+  GrainUsageIndex& index;
+};
+
+GrainUsageIndex::GrainUsageIndex(ThreadPool& pool, kj::Timer& timer,
+                                 kj::StringPtr grainsDir, kj::StringPtr indexPath)
+    : pool(pool), timer(timer), grainsDir(kj::heapString(grainsDir)),
+      indexPath(kj::heapString(indexPath)), tasks(*this) {
+  load();
+}
+
+GrainUsageIndex::~GrainUsageIndex() noexcept(false) {
+  if (saveScheduled) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([this]() { save(); })) {
+      KJ_LOG(ERROR, "couldn't save grain storage usage index", *exception);
+    }
+  }
+}
+
+void GrainUsageIndex::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+kj::Promise<uint64_t> GrainUsageIndex::getUsage(kj::StringPtr grainId, kj::StringPtr ownerId) {
+  Record& record = getRecord(grainId);
+  changeOwner(record, ownerId);
+
+  KJ_IF_MAYBE(size, record.size) {
+    if (record.running) {
+      if (record.reportedThisRun) {
+        return *size;
+      }
+    } else if (record.dirInode == 0) {
+      // The last thing we heard was the supervisor's report. It may have missed the last moments
+      // before the grain shut down, so check in the background, but this is close enough for now.
+      tasks.add(walk(record));
+      return *size;
+    } else {
+      auto path = kj::str(grainsDir, '/', grainId);
+      struct stat stats;
+      if (lstat(path.cStr(), &stats) >= 0 &&
+          stats.st_ino == record.dirInode && changeTime(stats) == record.dirChangeTime) {
+        // Nothing has run in this grain since we last walked it.
+        return *size;
+      }
+    }
+  }
+
+  return walk(record).then([this,grainId = kj::heapString(grainId)]() {
+    auto iter = records.find(grainId);
+    KJ_REQUIRE(iter != records.end(), "grain was deleted", grainId);
+    return KJ_ASSERT_NONNULL(iter->second.size);
+  });
+}
+
+kj::Promise<uint64_t> GrainUsageIndex::getUserUsage(kj::StringPtr ownerId) {
+  auto iter = owners.find(ownerId);
+  if (iter == owners.end()) {
+    return uint64_t(0);
+  } else if (iter->second.unsizedCount == 0) {
+    return iter->second.total;
+  }
+
+  // Some of this user's grains have never been counted. That only happens once per grain, so
+  // it's fine to go looking through all the grains for them.
+  kj::Vector<kj::Promise<void>> walks;
+  for (auto& entry: records) {
+    Record& record = entry.second;
+    if (record.ownerId == ownerId && record.size == nullptr) {
+      walks.add(walk(record).catch_([grainId = kj::heapString(record.grainId)](kj::Exception&& e) {
+        // Maybe the grain is gone. Count the others anyway.
+        KJ_LOG(WARNING, "couldn't count grain storage", grainId, e);
+      }));
+    }
+  }
+
+  return kj::joinPromises(walks.releaseAsArray())
+      .then([this,ownerId = kj::heapString(ownerId)]() {
+    auto iter = owners.find(ownerId);
+    return iter == owners.end() ? uint64_t(0) : iter->second.total;
+  });
+}
+
+void GrainUsageIndex::grainStarted(kj::StringPtr grainId, kj::StringPtr ownerId) {
+  Record& record = getRecord(grainId);
+  changeOwner(record, ownerId);
+  record.running = true;
+  record.reportedThisRun = false;
+  record.dirInode = 0;
+  record.dirChangeTime = 0;
+  scheduleSave();
+}
+
+void GrainUsageIndex::grainStopped(kj::StringPtr grainId) {
+  auto iter = records.find(grainId);
+  if (iter != records.end()) {
+    iter->second.running = false;
+  }
+}
+
+void GrainUsageIndex::grainDeleted(kj::StringPtr grainId) {
+  auto iter = records.find(grainId);
+  if (iter != records.end()) {
+    removeFromOwner(iter->second);
+    records.erase(iter);
+    scheduleSave();
+  }
+}
+
+void GrainUsageIndex::setOwner(kj::StringPtr grainId, kj::StringPtr ownerId) {
+  changeOwner(getRecord(grainId), ownerId);
+}
+
+void GrainUsageIndex::reportSize(kj::StringPtr grainId, uint64_t bytes) {
+  Record& record = getRecord(grainId);
+  changeSize(record, bytes);
+  record.reportedThisRun = true;
+  record.dirInode = 0;
+  record.dirChangeTime = 0;
+  scheduleSave();
+}
+
+GrainUsageIndex::Record& GrainUsageIndex::getRecord(kj::StringPtr grainId) {
+  auto iter = records.find(grainId);
+  if (iter != records.end()) {
+    return iter->second;
+  }
+
+  Record record;
+  record.grainId = kj::heapString(grainId);
+  kj::StringPtr grainIdPtr = record.grainId;
+  return records.insert(std::make_pair(grainIdPtr, kj::mv(record))).first->second;
+}
+
+void GrainUsageIndex::changeOwner(Record& record, kj::StringPtr ownerId) {
+  if (ownerId.size() == 0 || record.ownerId == ownerId) return;
+
+  removeFromOwner(record);
+  record.ownerId = kj::heapString(ownerId);
+  addToOwner(record);
+  scheduleSave();
+}
+
+void GrainUsageIndex::changeSize(Record& record, uint64_t size) {
+  removeFromOwner(record);
+  record.size = size;
+  addToOwner(record);
+}
+
+void GrainUsageIndex::addToOwner(const Record& record) {
+  if (record.ownerId.size() == 0) return;
+
+  auto iter = owners.find(record.ownerId);
+  if (iter == owners.end()) {
+    Owner owner;
+    owner.ownerId = kj::heapString(record.ownerId);
+    kj::StringPtr ownerIdPtr = owner.ownerId;
+    iter = owners.insert(std::make_pair(ownerIdPtr, kj::mv(owner))).first;
+  }
+
+  Owner& owner = iter->second;
+  ++owner.grainCount;
+  KJ_IF_MAYBE(size, record.size) {
+    owner.total += *size;
+  } else {
+    ++owner.unsizedCount;
+  }
+}
+
+void GrainUsageIndex::removeFromOwner(const Record& record) {
+  if (record.ownerId.size() == 0) return;
+
+  auto iter = owners.find(record.ownerId);
+  KJ_ASSERT(iter != owners.end(), "owner totals out of sync", record.ownerId);
+
+  Owner& owner = iter->second;
+  KJ_IF_MAYBE(size, record.size) {
+    owner.total -= *size;
+  } else {
+    --owner.unsizedCount;
+  }
+  if (--owner.grainCount == 0) {
+    owners.erase(iter);
+  }
+}
+
+kj::Promise<void> GrainUsageIndex::walk(Record& record) {
+  // Returns a promise for the completion of a walk of the grain, starting one if there isn't one
+  // in progress.
+
+  KJ_IF_MAYBE(inProgress, record.walk) {
+    return inProgress->addBranch();
+  }
+
+  auto forked = startWalk(kj::heapString(record.grainId)).fork();
+  auto result = forked.addBranch();
+
+  // Forget the walk once it's done, so that the next one starts afresh.
+  auto forget = [this](kj::StringPtr grainId) {
+    auto iter = records.find(grainId);
+    if (iter != records.end()) {
+      iter->second.walk = nullptr;
+    }
+  };
+  tasks.add(forked.addBranch().then(
+      [forget,grainId = kj::heapString(record.grainId)]() { forget(grainId); },
+      [forget,grainId = kj::heapString(record.grainId)](kj::Exception&&) { forget(grainId); }));
+
+  record.walk = kj::mv(forked);
+  return result;
+}
+
+kj::Promise<void> GrainUsageIndex::startWalk(kj::String grainId) {
+  return acquireWalkSlot().then([this,KJ_MVCAP(grainId)](kj::Own<WalkSlot>&& slot) mutable {
+    auto path = kj::str(grainsDir, '/', grainId);
+
+    // Note the directory's ctime before we start, so that if anything starts running in the
+    // grain during the walk, the fingerprint won't match afterwards.
+    struct stat before;
+    KJ_SYSCALL(lstat(path.cStr(), &before), path);
+    auto iter = records.find(grainId);
+    bool wasRunning = iter != records.end() && iter->second.running;
+
+    return countInBackground(kj::mv(path)).attach(kj::mv(slot))
+        .then([this,KJ_MVCAP(grainId),before,wasRunning](uint64_t size) {
+      auto iter = records.find(grainId);
+      if (iter == records.end()) return;  // deleted meanwhile
+      Record& record = iter->second;
+
+      if (record.running) {
+        // The grain has started since. Its supervisor's reports are more current, if any.
+        if (!record.reportedThisRun) changeSize(record, size);
+        record.dirInode = 0;
+        record.dirChangeTime = 0;
+      } else {
+        changeSize(record, size);
+        if (wasRunning) {
+          // We may have seen the grain half-way through a change.
+          record.dirInode = 0;
+          record.dirChangeTime = 0;
+        } else {
+          record.dirInode = before.st_ino;
+          record.dirChangeTime = changeTime(before);
+        }
+      }
+      scheduleSave();
+    });
+  });
+}
+
+kj::Promise<kj::Own<GrainUsageIndex::WalkSlot>> GrainUsageIndex::acquireWalkSlot() {
+  if (walksInProgress < MAX_CONCURRENT_WALKS) {
+    ++walksInProgress;
+    return kj::heap<WalkSlot>(*this);
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<kj::Own<WalkSlot>>();
+  walksWaiting.push_back(kj::mv(paf.fulfiller));
+  return kj::mv(paf.promise);
+}
+
+void GrainUsageIndex::releaseWalkSlot() {
+  while (!walksWaiting.empty()) {
+    auto fulfiller = kj::mv(walksWaiting.front());
+    walksWaiting.pop_front();
+    if (fulfiller->isWaiting()) {
+      // Hand our slot directly to the next walk.
+      fulfiller->fulfill(kj::heap<WalkSlot>(*this));
+      return;
+    }
+  }
+  --walksInProgress;
+}
+
+kj::Promise<uint64_t> GrainUsageIndex::countInBackground(kj::String path) {
+  return pool.runBulk([KJ_MVCAP(path)]() { return countStorageUsage(path, WALK_THREADS); });
+}
+
+// ---------------------------------------------------------------------------------------
+
+void GrainUsageIndex::load() {
+  KJ_IF_MAYBE(fd, raiiOpenIfExists(indexPath, O_RDONLY | O_CLOEXEC)) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      capnp::ReaderOptions options;
+      options.traversalLimitInWords = kj::maxValue;
+      capnp::StreamFdMessageReader reader(fd->get(), options);
+
+      for (auto grain: reader.getRoot<GrainUsageRecords>().getGrains()) {
+        Record& record = getRecord(grain.getGrainId());
+        changeOwner(record, grain.getOwnerId());
+        if (grain.getHasSize()) changeSize(record, grain.getSize());
+        record.dirInode = grain.getDirInode();
+        record.dirChangeTime = grain.getDirChangeTime();
+      }
+    })) {
+      // It's only a cache, so we can rebuild it.
+      KJ_LOG(ERROR, "couldn't read grain storage usage index; starting over", *exception);
+      records.clear();
+      owners.clear();
+    }
+  }
+}
+
+void GrainUsageIndex::scheduleSave() {
+  // Changes tend to come in bursts (e.g. every running grain reporting its size), so wait a bit
+  // and save them all at once.
+
+  if (saveScheduled) return;
+  saveScheduled = true;
+  tasks.add(timer.afterDelay(10 * kj::SECONDS).then([this]() {
+    if (saveScheduled) save();
+  }));
+}
+
+void GrainUsageIndex::save() {
+  saveScheduled = false;
+
+  uint count = 0;
+  for (auto& entry: records) {
+    if (entry.second.size != nullptr || entry.second.ownerId.size() > 0) ++count;
+  }
+
+  capnp::MallocMessageBuilder message;
+  auto grains = message.initRoot<GrainUsageRecords>().initGrains(count);
+  uint i = 0;
+  for (auto& entry: records) {
+    const Record& record = entry.second;
+    if (record.size == nullptr && record.ownerId.size() == 0) continue;
+
+    auto grain = grains[i++];
+    grain.setGrainId(record.grainId);
+    grain.setOwnerId(record.ownerId);
+    KJ_IF_MAYBE(size, record.size) {
+      grain.setSize(*size);
+    } else {
+      grain.setHasSize(false);
+    }
+    grain.setDirInode(record.dirInode);
+    grain.setDirChangeTime(record.dirChangeTime);
+  }
+
+  // We don't bother to fsync(): if the file is lost or mangled in a crash, we start over.
+  auto tmpPath = kj::str(indexPath, ".tmp");
+  capnp::writeMessageToFd(raiiOpen(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600),
+                          message);
+  KJ_SYSCALL(rename(tmpPath.cStr(), indexPath.cStr()));
+}
+
+}  // namespace sandstorm
@@ -0,0 +1,145 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_GRAIN_USAGE_H_
+#define SANDSTORM_GRAIN_USAGE_H_
+
+#include "thread-pool.h"
+#include <kj/async-io.h>
+#include <kj/string.h>
+#include <map>
+#include <deque>
+
+namespace sandstorm {
+
+uint64_t countStorageUsage(kj::StringPtr path, uint threadCount = 1);
+// Returns the number of bytes of disk space allocated to the directory tree at `path`. Files
+// with several hard links count for a proportional share of their size at each link. If
+// `threadCount` is more than 1 and this is called from a ThreadPool job, the tree is walked by up
+// to that many of the pool's threads at once, which helps a lot when the filesystem has to go to
+// disk. (See ThreadPool::parallelize().)
+
+class GrainUsageIndex: private kj::TaskSet::ErrorHandler {
+  // Keeps track of how much storage each grain uses, so that the backend can answer
+  // getGrainStorageUsage() without walking the grain's files every time. Totals per owner are
+  // kept up-to-date as grain sizes change, so that getUserStorageUsage() is just a lookup.
+  //
+  // While a grain runs, its supervisor watches its storage and reports the total to us (via
+  // reportSize()). When a grain isn't running, we walk its directory, and then remember the
+  // inode number and ctime of the grain's top-level directory along with the result. Every start
+  // of the supervisor replaces the "socket" file in that directory, so until they change, the
+  // result is still good, and answering takes just one stat(). Walks happen on background
+  // threads.
+  //
+  // The index is saved to disk shortly after it changes, so it survives restarts.
+
+public:
+  GrainUsageIndex(ThreadPool& pool, kj::Timer& timer,
+                  kj::StringPtr grainsDir, kj::StringPtr indexPath);
+  // `grainsDir` contains a directory for each grain, named by its ID. The index is saved to
+  // `indexPath`.
+
+  ~GrainUsageIndex() noexcept(false);
+
+  kj::Promise<uint64_t> getUsage(kj::StringPtr grainId, kj::StringPtr ownerId);
+  // Returns the number of bytes of storage used by the grain.
+
+  kj::Promise<uint64_t> getUserUsage(kj::StringPtr ownerId);
+  // Returns the number of bytes of storage used by all grains known to belong to `ownerId`. This
+  // undercounts unless areAllOwnersKnown().
+
+  bool areAllOwnersKnown() { return allOwnersKnown; }
+  void setAllOwnersKnown() { allOwnersKnown = true; }
+  // The backend isn't told who owns a grain until the front-end mentions it along with its owner,
+  // so getUserUsage() can only be trusted once the front-end has listed every grain. We don't
+  // save this: the front-end lists them again whenever it connects.
+
+  void grainStarted(kj::StringPtr grainId, kj::StringPtr ownerId);
+  void grainStopped(kj::StringPtr grainId);
+  void grainDeleted(kj::StringPtr grainId);
+  void setOwner(kj::StringPtr grainId, kj::StringPtr ownerId);
+  // The backend calls these as grains come and go, or change hands. An empty `ownerId` means "not
+  // known".
+
+  void reportSize(kj::StringPtr grainId, uint64_t bytes);
+  // Called when a running grain's supervisor reports its size.
+
+private:
+  ThreadPool& pool;
+  kj::Timer& timer;
+  kj::String grainsDir;
+  kj::String indexPath;
+
+  struct Record {
+    kj::String grainId;
+    kj::String ownerId;  // empty if not known yet
+
+    kj::Maybe<uint64_t> size;
+
+    uint64_t dirInode = 0;
+    int64_t dirChangeTime = 0;
+    // Identity and ctime (in nanoseconds) of the grain's directory when `size` was computed by
+    // walking it. Zero if `size` came from the supervisor, or the walk overlapped a run.
+
+    bool running = false;
+    bool reportedThisRun = false;
+
+    kj::Maybe<kj::ForkedPromise<void>> walk;
+    // Walk in progress, if any.
+  };
+  std::map<kj::StringPtr, Record> records;
+
+  struct Owner {
+    kj::String ownerId;
+    uint grainCount = 0;
+    uint unsizedCount = 0;  // grains whose size we don't know yet
+    uint64_t total = 0;     // sum of the sizes we do know
+  };
+  std::map<kj::StringPtr, Owner> owners;
+  // Only Records with a non-empty `ownerId` are counted here. Always modify `ownerId` and `size`
+  // using changeOwner() and changeSize() to keep this in sync.
+
+  class WalkSlot;
+  uint walksInProgress = 0;
+  std::deque<kj::Own<kj::PromiseFulfiller<kj::Own<WalkSlot>>>> walksWaiting;
+  // We limit the number of grains walked at once, since each walk is already multi-threaded.
+
+  bool allOwnersKnown = false;
+  bool saveScheduled = false;
+
+  kj::TaskSet tasks;
+
+  Record& getRecord(kj::StringPtr grainId);
+  void changeOwner(Record& record, kj::StringPtr ownerId);
+  void changeSize(Record& record, uint64_t size);
+  void addToOwner(const Record& record);
+  void removeFromOwner(const Record& record);
+  kj::Promise<void> walk(Record& record);
+  kj::Promise<void> startWalk(kj::String grainId);
+  kj::Promise<kj::Own<WalkSlot>> acquireWalkSlot();
+  void releaseWalkSlot();
+  kj::Promise<uint64_t> countInBackground(kj::String path);
+
+  void load();
+  void scheduleSave();
+  void save();
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_GRAIN_USAGE_H_
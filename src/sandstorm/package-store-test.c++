@@ -0,0 +1,90 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "package-store.h"
+#include "util.h"
+#include "test-util.h"
+#include <kj/test.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+namespace {
+
+void writeFile(kj::StringPtr path, kj::StringPtr content, mode_t mode = 0644) {
+  kj::FdOutputStream(raiiOpen(path, O_WRONLY | O_CREAT | O_EXCL, mode))
+      .write(content.begin(), content.size());
+  KJ_SYSCALL(chmod(path.cStr(), mode));
+}
+
+struct stat statFile(kj::StringPtr path) {
+  struct stat stats;
+  KJ_SYSCALL(lstat(path.cStr(), &stats), path);
+  return stats;
+}
+
+uint countObjects(kj::StringPtr store) {
+  uint count = 0;
+  for (auto& prefix: listDirectory(kj::str(store, "/objects"))) {
+    count += listDirectory(kj::str(store, "/objects/", prefix)).size();
+  }
+  return count;
+}
+
+KJ_TEST("package store shares identical files and collects unused ones") {
+  TempDir tmp;
+  auto store = kj::str(tmp.path, "/store");
+  auto a = kj::str(tmp.path, "/a");
+  auto b = kj::str(tmp.path, "/b");
+  KJ_SYSCALL(mkdir(a.cStr(), 0755));
+  KJ_SYSCALL(mkdir(kj::str(a, "/sub").cStr(), 0755));
+  KJ_SYSCALL(mkdir(b.cStr(), 0755));
+
+  writeFile(kj::str(a, "/lib"), "shared");
+  writeFile(kj::str(a, "/sub/copy"), "shared");
+  writeFile(kj::str(a, "/only-a"), "version 1");
+  writeFile(kj::str(b, "/lib"), "shared");
+  writeFile(kj::str(b, "/run"), "shared", 0755);
+  writeFile(kj::str(b, "/only-b"), "version 2");
+
+  addToPackageStore(store, a);
+  addToPackageStore(store, b);
+
+  // Same content and permissions: one inode.
+  auto lib = statFile(kj::str(a, "/lib"));
+  KJ_EXPECT(statFile(kj::str(a, "/sub/copy")).st_ino == lib.st_ino);
+  KJ_EXPECT(statFile(kj::str(b, "/lib")).st_ino == lib.st_ino);
+  KJ_EXPECT(lib.st_nlink == 4);
+
+  // Different permissions: not shared.
+  auto run = statFile(kj::str(b, "/run"));
+  KJ_EXPECT(run.st_ino != lib.st_ino);
+  KJ_EXPECT((run.st_mode & 0777) == 0755);
+
+  KJ_EXPECT(readAll(kj::str(a, "/only-a")) == "version 1");
+  KJ_EXPECT(countObjects(store) == 4);
+
+  collectPackageGarbage(store);
+  KJ_EXPECT(countObjects(store) == 4);
+
+  recursivelyDelete(a);
+  collectPackageGarbage(store);
+  KJ_EXPECT(countObjects(store) == 3);
+  KJ_EXPECT(statFile(kj::str(b, "/lib")).st_nlink == 2);
+  KJ_EXPECT(readAll(kj::str(b, "/lib")) == "shared");
+}
+
+}  // namespace
+}  // namespace sandstorm
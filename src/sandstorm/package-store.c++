@@ -0,0 +1,188 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "package-store.h"
+#include "util.h"
+#include <kj/debug.h>
+#include <sodium/crypto_generichash_blake2b.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+namespace sandstorm {
+
+static constexpr size_t OBJECT_HASH_SIZE = 32;
+
+static constexpr time_t STALE_TMP_SECONDS = 60 * 60;
+// Links in `tmp` older than this were left by a crash, not an install still in progress.
+
+namespace {
+
+void makeDirectory(kj::StringPtr path) {
+  while (mkdir(path.cStr(), 0777) < 0) {
+    int error = errno;
+    if (error == EEXIST) {
+      break;
+    } else if (error != EINTR) {
+      KJ_FAIL_SYSCALL("mkdir", error, path);
+    }
+  }
+}
+
+void unlinkIfExists(kj::StringPtr path) {
+  while (unlink(path.cStr()) < 0) {
+    int error = errno;
+    if (error == ENOENT) {
+      break;
+    } else if (error != EINTR) {
+      KJ_FAIL_SYSCALL("unlink", error, path);
+    }
+  }
+}
+
+kj::Array<kj::String> listDirectoryIfExists(kj::StringPtr path) {
+  if (access(path.cStr(), F_OK) < 0) return nullptr;
+  return listDirectory(path);
+}
+
+kj::String hashFile(kj::StringPtr path, const struct stat& stats) {
+  // Returns the hex name of the object for the file.
+
+  crypto_generichash_blake2b_state state;
+  KJ_ASSERT(crypto_generichash_blake2b_init(&state, nullptr, 0, OBJECT_HASH_SIZE) == 0);
+
+  // Files that differ in these can't be the same inode.
+  uint32_t attributes[3] = { stats.st_mode & 07777, stats.st_uid, stats.st_gid };
+  crypto_generichash_blake2b_update(&state,
+      reinterpret_cast<const byte*>(attributes), sizeof(attributes));
+
+  auto fd = raiiOpen(path, O_RDONLY | O_CLOEXEC);
+  byte buffer[65536];
+  for (;;) {
+    ssize_t n;
+    KJ_SYSCALL(n = read(fd, buffer, sizeof(buffer)), path);
+    if (n == 0) break;
+    crypto_generichash_blake2b_update(&state, buffer, n);
+  }
+
+  byte hash[OBJECT_HASH_SIZE];
+  crypto_generichash_blake2b_final(&state, hash, sizeof(hash));
+  return hexEncode(kj::arrayPtr(hash, sizeof(hash)));
+}
+
+void addFile(kj::StringPtr storeDir, kj::StringPtr path, const struct stat& stats,
+             kj::StringPtr tmpPath) {
+  auto hex = hashFile(path, stats);
+  auto prefixDir = kj::str(storeDir, "/objects/", hex.slice(0, 2));
+  auto objectPath = kj::str(prefixDir, '/', hex);
+
+  for (;;) {
+    // Link to the object from `tmp` first, so that we only replace the file once we know the
+    // object is there.
+    if (link(objectPath.cStr(), tmpPath.cStr()) == 0) {
+      KJ_SYSCALL(rename(tmpPath.cStr(), path.cStr()), tmpPath, path);
+      return;
+    }
+
+    int error = errno;
+    if (error == ENOENT) {
+      // Not in the store yet (or it was just collected), so this file becomes the object.
+      makeDirectory(prefixDir);
+      if (link(path.cStr(), objectPath.cStr()) == 0) return;
+      error = errno;
+      if (error != EEXIST && error != EINTR) {
+        KJ_FAIL_SYSCALL("link(path, objectPath)", error, path, objectPath);
+      }
+      // Someone else added it first. Link to theirs.
+    } else if (error == EEXIST) {
+      // Left by a crashed thread which had the same ID.
+      unlinkIfExists(tmpPath);
+    } else if (error == EMLINK) {
+      // The object is in so many packages that it can't have any more links. Keep this copy.
+      return;
+    } else if (error != EINTR) {
+      KJ_FAIL_SYSCALL("link(objectPath, tmpPath)", error, objectPath, tmpPath);
+    }
+  }
+}
+
+void addTree(kj::StringPtr storeDir, kj::StringPtr path, kj::StringPtr tmpPath) {
+  struct stat stats;
+  KJ_SYSCALL(lstat(path.cStr(), &stats), path);
+
+  if (S_ISDIR(stats.st_mode)) {
+    for (auto& name: listDirectory(path)) {
+      addTree(storeDir, kj::str(path, '/', name), tmpPath);
+    }
+
+    // Replacing files changed the directory's times. Put them back as the package had them.
+    struct timespec times[2] = { stats.st_atim, stats.st_mtim };
+    KJ_SYSCALL(utimensat(AT_FDCWD, path.cStr(), times, AT_SYMLINK_NOFOLLOW), path);
+  } else if (S_ISREG(stats.st_mode) && stats.st_nlink == 1) {
+    // (A file with other links is already shared, or is something we'd better not touch.)
+    addFile(storeDir, path, stats, tmpPath);
+  }
+}
+
+}  // namespace
+
+void addToPackageStore(kj::StringPtr storeDir, kj::StringPtr tree) {
+  makeDirectory(storeDir);
+  makeDirectory(kj::str(storeDir, "/objects"));
+  auto tmpDir = kj::str(storeDir, "/tmp");
+  makeDirectory(tmpDir);
+
+  // No two threads add a file at once with the same thread ID.
+  auto tmpPath = kj::str(tmpDir, '/', syscall(SYS_gettid));
+  addTree(storeDir, tree, tmpPath);
+}
+
+void collectPackageGarbage(kj::StringPtr storeDir) {
+  uint64_t kept = 0;
+  uint64_t deleted = 0;
+  auto objectsDir = kj::str(storeDir, "/objects");
+  for (auto& prefix: listDirectoryIfExists(objectsDir)) {
+    auto prefixDir = kj::str(objectsDir, '/', prefix);
+    for (auto& name: listDirectory(prefixDir)) {
+      auto path = kj::str(prefixDir, '/', name);
+      struct stat stats;
+      KJ_SYSCALL(lstat(path.cStr(), &stats), path);
+      if (stats.st_nlink > 1) {
+        ++kept;
+      } else {
+        unlinkIfExists(path);
+        ++deleted;
+      }
+    }
+  }
+
+  // Linking a file updates its ctime, so that's when each of these was made.
+  time_t cutoff = time(nullptr) - STALE_TMP_SECONDS;
+  auto tmpDir = kj::str(storeDir, "/tmp");
+  for (auto& name: listDirectoryIfExists(tmpDir)) {
+    auto path = kj::str(tmpDir, '/', name);
+    struct stat stats;
+    if (lstat(path.cStr(), &stats) == 0 && stats.st_ctime < cutoff) {
+      unlinkIfExists(path);
+    }
+  }
+
+  KJ_LOG(INFO, "collected package store garbage", kept, deleted);
+}
+
+}  // namespace sandstorm
@@ -0,0 +1,55 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_PACKAGE_STORE_H_
+#define SANDSTORM_PACKAGE_STORE_H_
+
+// Most files in a package are the same as in the previous version of the app, and apps built on
+// the same runtime share many more. So, when the backend installs a package, it hard-links each
+// file to a single copy kept in a store shared by all packages. Besides saving disk space, this
+// lets grains running different versions of an app share those files in the page cache. The
+// store is a directory laid out as follows:
+//
+//   objects/<first two hex digits of hash>/<hash in hex>
+//       A file found in one or more packages. The hash covers its content, permissions, and
+//       ownership, which hard links necessarily share.
+//   tmp/
+//       Links on their way into a package.
+//
+// The store must be on the same filesystem as the packages. An object whose link count is 1 is
+// no longer in any package, so there is no index to keep up to date.
+
+#include <kj/string.h>
+
+namespace sandstorm {
+
+void addToPackageStore(kj::StringPtr storeDir, kj::StringPtr tree);
+// Replaces each regular file under `tree` with a hard link to the store's copy of the same file,
+// adding it to the store if it isn't there yet. Content and permissions don't change, but a
+// file takes on the modification time of the first package that had it. Call this before the
+// tree is moved into place; nothing else may be using it.
+//
+// Each file is replaced atomically, so if this throws partway, the tree is still intact.
+
+void collectPackageGarbage(kj::StringPtr storeDir);
+// Deletes objects that are no longer in any package, along with links left in `tmp` by a
+// crash. May run at the same time as addToPackageStore(), though an object it deletes just as a
+// new package links to it will then be missing from the store, and so won't be shared with the
+// packages after that.
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_PACKAGE_STORE_H_
@@ -0,0 +1,175 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reaper.h"
+#include "util.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <stdio.h>  // rename()
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+
+static constexpr double REAP_FILES_PER_SECOND = 5000;
+static constexpr double REAP_BYTES_PER_SECOND = 256 << 20;
+// Deletion rate limits. Unlinking a file costs a metadata write, and freeing its blocks costs
+// more the bigger it is, so we limit both.
+
+static constexpr uint REAP_BATCH_FILES = 1000;
+// Files deleted per job, so that a job never holds a pool thread for more than a moment.
+
+struct Reaper::Walk {
+  // A depth-first walk through the trash, which each job takes up where the last one left off.
+  // Owned by the running job rather than the Reaper, which may be destroyed first.
+
+  struct Level {
+    kj::String path;
+    struct stat stats;
+    kj::Array<kj::String> names;  // children
+    size_t next;                  // index of the next child to delete
+  };
+  kj::Vector<Level> stack;
+  // The bottom level is the trash directory itself, listing only the trees to delete.
+
+  uint64_t files = 0;     // deleted by the last job
+  uint64_t bytes = 0;
+  bool finished = false;  // everything listed at the start has been deleted
+
+  void deleteSome(kj::StringPtr tmpDir);
+  void enter(kj::String path);
+  void deleted(const struct stat& stats);
+};
+
+void Reaper::Walk::deleteSome(kj::StringPtr tmpDir) {
+  files = 0;
+  bytes = 0;
+
+  if (stack.size() == 0) {
+    kj::Vector<kj::String> trash;
+    for (auto& name: listDirectory(tmpDir)) {
+      if (name.startsWith("deleting.")) trash.add(kj::mv(name));
+    }
+    struct stat stats;
+    memset(&stats, 0, sizeof(stats));
+    stack.add(Level { kj::heapString(tmpDir), stats, trash.releaseAsArray(), 0 });
+  }
+
+  while (files < REAP_BATCH_FILES) {
+    Level& top = stack.end()[-1];
+    if (top.next < top.names.size()) {
+      enter(kj::str(top.path, '/', top.names[top.next++]));
+    } else if (stack.size() == 1) {
+      finished = true;
+      return;
+    } else {
+      KJ_SYSCALL(rmdir(top.path.cStr()), top.path) { break; }
+      deleted(top.stats);
+      stack.removeLast();
+    }
+  }
+}
+
+void Reaper::Walk::enter(kj::String path) {
+  // Deletes `path` if it isn't a directory, or pushes it onto the stack to empty first if it is.
+
+  struct stat stats;
+  KJ_SYSCALL(lstat(path.cStr(), &stats), path) { return; }
+  if (S_ISDIR(stats.st_mode)) {
+    auto names = listDirectory(path);
+    stack.add(Level { kj::mv(path), stats, kj::mv(names), 0 });
+  } else {
+    KJ_SYSCALL(unlink(path.cStr()), path) { break; }
+    deleted(stats);
+  }
+}
+
+void Reaper::Walk::deleted(const struct stat& stats) {
+  ++files;
+  bytes += stats.st_blocks * 512;
+}
+
+// =======================================================================================
+
+Reaper::Reaper(ThreadPool& pool, kj::Timer& timer, kj::StringPtr tmpDir)
+    : pool(pool), timer(timer), tmpDir(kj::heapString(tmpDir)), tasks(*this) {
+  // Pick up where the last run left off.
+  start();
+}
+
+void Reaper::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+void Reaper::remove(kj::StringPtr path) {
+  KJ_REQUIRE(!path.endsWith("/"),
+      "refusing to recursively delete directory name with trailing / to reduce risk of "
+      "catastrophic empty-string bugs");
+  auto tmpPath = kj::str(tmpDir, "/deleting.", time(nullptr), ".", counter++);
+
+  while (rename(path.cStr(), tmpPath.cStr()) < 0) {
+    int error = errno;
+    if (error == ENOENT) {
+      return;
+    } else if (error != EINTR) {
+      KJ_FAIL_SYSCALL("rename(path, tmpPath)", error, path, tmpPath);
+    }
+  }
+
+  start();
+}
+
+void Reaper::start() {
+  if (running) {
+    // The running job may have listed `tmpDir` already.
+    rerun = true;
+    return;
+  }
+
+  running = true;
+  rerun = false;
+  tasks.add(reapSome(kj::heap<Walk>()).then([this]() {
+    running = false;
+    if (rerun) start();
+  }, [this](kj::Exception&& exception) {
+    // Try again on the next remove(), rather than spinning.
+    running = false;
+    KJ_LOG(ERROR, "failed to delete trash", exception);
+  }));
+}
+
+kj::Promise<void> Reaper::reapSome(kj::Own<Walk> walk) {
+  auto startTime = timer.now();
+  return pool.runBulk([tmpDir = kj::heapString(tmpDir), KJ_MVCAP(walk)]() mutable {
+    walk->deleteSome(tmpDir);
+    return kj::mv(walk);
+  }).then([this,startTime](kj::Own<Walk>&& walk) -> kj::Promise<void> {
+    if (walk->finished) return kj::READY_NOW;
+
+    // Wait out the rate limits here rather than sleeping on the pool's thread.
+    double seconds = kj::max(walk->files / REAP_FILES_PER_SECOND,
+                             walk->bytes / REAP_BYTES_PER_SECOND);
+    auto delay = int64_t(seconds * 1e9) * kj::NANOSECONDS - (timer.now() - startTime);
+    if (delay < 0 * kj::NANOSECONDS) delay = 0 * kj::NANOSECONDS;
+    return timer.afterDelay(delay).then([this,KJ_MVCAP(walk)]() mutable {
+      return reapSome(kj::mv(walk));
+    });
+  });
+}
+
+}  // namespace sandstorm
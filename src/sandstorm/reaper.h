@@ -0,0 +1,61 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_REAPER_H_
+#define SANDSTORM_REAPER_H_
+
+#include "thread-pool.h"
+#include <kj/async.h>
+#include <kj/string.h>
+
+namespace sandstorm {
+
+class Reaper: private kj::TaskSet::ErrorHandler {
+  // Deletes directory trees in the background. remove() only renames the tree to
+  // `<tmpDir>/deleting.*`, which is instant; the reaper then deletes everything matching that
+  // pattern in a series of small bulk jobs on the thread pool, one tree at a time and no faster
+  // than a fixed rate, so that deleting a huge grain neither starves running grains of disk
+  // bandwidth nor ties up a thread. Trees left behind by a previous run (e.g. because the server
+  // was restarted) are deleted too.
+
+public:
+  Reaper(ThreadPool& pool, kj::Timer& timer, kj::StringPtr tmpDir);
+  // `tmpDir` must be on the same filesystem as anything passed to remove().
+
+  void remove(kj::StringPtr path);
+  // Deletes `path`, recursively if it's a directory. Does nothing if it doesn't exist. Once this
+  // returns, `path` is gone, though its space may not have been freed yet.
+
+private:
+  struct Walk;
+
+  ThreadPool& pool;
+  kj::Timer& timer;
+  kj::String tmpDir;
+  uint counter = 0;
+  bool running = false;  // reaping jobs are on the thread pool, or waiting to be
+  bool rerun = false;    // remove() was called while it ran, so another is needed
+  kj::TaskSet tasks;
+
+  void start();
+  kj::Promise<void> reapSome(kj::Own<Walk> walk);
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_REAPER_H_
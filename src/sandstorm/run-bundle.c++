@@ -17,6 +17,7 @@
 #include <kj/main.h>
 #include <kj/debug.h>
 #include <kj/io.h>
+#include <kj/async-unix.h>
 #include <kj/parse/common.h>
 #include <kj/parse/char.h>
 #include <capnp/schema.h>
@@ -64,6 +65,7 @@
 #include "spk.h"
 #include "backend.h"
 #include "backup.h"
+#include "copy-tree.h"
 
 namespace sandstorm {
 
@@ -456,12 +458,20 @@ public:
       if (programName.endsWith("supervisor")) {  // historically "sandstorm-supervisor"
         alternateMain = kj::heap<SupervisorMain>(context);
         return alternateMain->getMain();
+      } else if (programName.endsWith("supervisor-pool")) {
+        auto supervisorMain = kj::heap<SupervisorMain>(context);
+        auto result = supervisorMain->getPoolMain();
+        alternateMain = kj::mv(supervisorMain);
+        return result;
       } else if (programName == "spk" || programName.endsWith("/spk")) {
         alternateMain = getSpkMain(context);
         return alternateMain->getMain();
       } else if (programName == "backup" || programName.endsWith("/backup")) {
         alternateMain = kj::heap<BackupMain>(context);
         return alternateMain->getMain();
+      } else if (programName == "copy-tree" || programName.endsWith("/copy-tree")) {
+        alternateMain = kj::heap<CopyTreeMain>(context);
+        return alternateMain->getMain();
       }
     }
 
@@ -1175,6 +1185,8 @@ private:
     bool allowDevAccounts = false;
     bool hideTroubleshooting = false;
     uint smtpListenPort = 30025;
+    uint supervisorPoolSize = 2;
+    uint maxConcurrentGrainStarts = 8;
   };
 
   kj::String updateFile;
@@ -1650,6 +1662,18 @@ private:
         } else {
           KJ_FAIL_REQUIRE("invalid config value SMTP_LISTEN_PORT", value);
         }
+      } else if (key == "SUPERVISOR_POOL_SIZE") {
+        KJ_IF_MAYBE(n, parseUInt(value, 10)) {
+          config.supervisorPoolSize = *n;
+        } else {
+          KJ_FAIL_REQUIRE("invalid config value SUPERVISOR_POOL_SIZE", value);
+        }
+      } else if (key == "MAX_CONCURRENT_GRAIN_STARTS") {
+        KJ_IF_MAYBE(n, parseUInt(value, 10)) {
+          config.maxConcurrentGrainStarts = *n;
+        } else {
+          KJ_FAIL_REQUIRE("invalid config value MAX_CONCURRENT_GRAIN_STARTS", value);
+        }
       }
     }
 
@@ -2244,10 +2268,15 @@ private:
       dropPrivs(config.uids, avoidUserns);
       clearSignalMask();
 
+      // The backend waits for some of its children asynchronously. This must come after
+      // clearSignalMask() and before BackendImpl starts its threads.
+      kj::UnixEventPort::captureChildExit();
+
       auto paf = kj::newPromiseAndFulfiller<Backend::Client>();
       TwoPartyServerWithClientBootstrap server(kj::mv(paf.promise));
-      paf.fulfiller->fulfill(kj::heap<BackendImpl>(*io.lowLevelProvider, network,
-        server.getBootstrap().castAs<SandstormCoreFactory>(), sandboxUid));
+      paf.fulfiller->fulfill(kj::heap<BackendImpl>(*io.lowLevelProvider, io.unixEventPort,
+        network, io.provider->getTimer(), server.getBootstrap().castAs<SandstormCoreFactory>(),
+        sandboxUid, config.supervisorPoolSize, config.maxConcurrentGrainStarts));
 
       // Signal readiness.
       write(outPipe, "ready", 5);
@@ -36,10 +36,12 @@
 #include <unordered_map>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
 #include <stdio.h>
 
@@ -57,22 +59,21 @@
 #include "version.h"
 #include "util.h"
 #include "bridge-proxy.h"
+#include "simd-http-parser.h"
 
 namespace sandstorm {
 
-kj::Array<byte> toBytes(kj::StringPtr text, kj::ArrayPtr<const byte> data = nullptr) {
-  auto result = kj::heapArray<byte>(text.size() + data.size());
-  memcpy(result.begin(), text.begin(), text.size());
-  memcpy(result.begin() + text.size(), data.begin(), data.size());
-  return result;
-}
-
 kj::String textIdentityId(capnp::Data::Reader id) {
   // We truncate to 128 bits to be a little more wieldy. Still 32 chars, though.
   KJ_ASSERT(id.size() == 32, "Identity ID not a SHA-256?");
   return hexEncode(id.slice(0, kj::min(id.size(), 16)));
 }
 
+bool useSimdResponseParser = false;
+SimdHttpParser::Isa simdResponseParserIsa = SimdHttpParser::Isa::SCALAR;
+// Which parser HttpParser uses for responses from the app. Set from the command line by
+// SandstormHttpBridgeMain before any requests are handled. The SIMD parser is opt-in for now.
+
 struct HttpStatusInfo {
   WebSession::Response::Which type;
 
@@ -154,13 +155,161 @@ const HeaderWhitelist REQUEST_HEADER_WHITELIST(*WebSession::Context::HEADER_WHIT
 const HeaderWhitelist RESPONSE_HEADER_WHITELIST(*WebSession::Response::HEADER_WHITELIST);
 #pragma clang diagnostic pop
 
+class AppConnectionPool;
+
+class AppConnection final: public kj::AsyncIoStream, public kj::Refcounted {
+  // A connection to the app's HTTP server. When the last reference is dropped, the underlying
+  // stream is handed back to the AppConnectionPool for reuse, but only if both the request and
+  // the response were seen through to the end and the app agreed to keep the connection alive.
+  // Otherwise, the connection is simply closed.
+
+public:
+  AppConnection(AppConnectionPool& pool, kj::Own<kj::AsyncIoStream>&& stream, bool reused)
+      : pool(pool), stream(kj::mv(stream)), reused(reused) {}
+  ~AppConnection() noexcept(false);
+
+  bool isReused() { return reused; }
+  // True if this connection was previously used for another request. The app may have decided to
+  // close such a connection at the same moment that we decided to reuse it.
+
+  void setRequestDone() { requestDone = true; }
+  // Call once the whole request, including the body, has been written.
+
+  void setResponseDone() { responseDone = true; }
+  // Call once the whole response has been read, and only if the app indicated that the
+  // connection may be kept alive.
+
+  kj::Promise<size_t> read(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return stream->read(buffer, minBytes, maxBytes);
+  }
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return stream->tryRead(buffer, minBytes, maxBytes);
+  }
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    return stream->write(buffer, size);
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    return stream->write(pieces);
+  }
+  void shutdownWrite() override {
+    requestDone = false;
+    return stream->shutdownWrite();
+  }
+  void abortRead() override {
+    responseDone = false;
+    return stream->abortRead();
+  }
+
+private:
+  AppConnectionPool& pool;
+  kj::Own<kj::AsyncIoStream> stream;
+  bool reused;
+  bool requestDone = false;
+  bool responseDone = false;
+};
+
+class AppConnectionPool: private kj::TaskSet::ErrorHandler {
+  // Keeps idle keep-alive connections to the app's HTTP server, so that each request doesn't have
+  // to pay for a new connection (and the app for a new accept()).
+  //
+  // While a connection sits idle, we keep a read outstanding on it, so that we notice right away
+  // if the app closes it (or, erroneously, sends unsolicited bytes), in which case it is dropped.
+  // Idle connections are also dropped after IDLE_TIMEOUT, which is chosen to be shorter than the
+  // keep-alive timeouts of common app servers (e.g. Node's default of 5 seconds) so that we
+  // usually close the connection before the app does.
+
+public:
+  AppConnectionPool(kj::NetworkAddress& serverAddr, kj::Timer& timer)
+      : serverAddr(serverAddr), timer(timer), tasks(*this) {}
+
+  kj::Promise<kj::Own<AppConnection>> connect() {
+    // Get a connection to the app, reusing an idle one if available. If the caller's request is
+    // safe to replay (see RFC 7230 section 6.3.1), it should retry on connectFresh() when a
+    // reused connection turns out to have been closed before the app responded.
+
+    if (idleConnections.empty()) {
+      return connectFresh();
+    }
+
+    // Take the most-recently-used connection, as it is least likely to be timed out by the app.
+    auto iter = idleConnections.end();
+    --iter;
+    auto stream = kj::mv(iter->second.stream);
+    idleConnections.erase(iter);
+    return kj::refcounted<AppConnection>(*this, kj::mv(stream), true);
+  }
+
+  kj::Promise<kj::Own<AppConnection>> connectFresh() {
+    // Make a new connection to the app, bypassing the idle pool.
+
+    return serverAddr.connect().then([this](kj::Own<kj::AsyncIoStream>&& stream) {
+      return kj::refcounted<AppConnection>(*this, kj::mv(stream), false);
+    });
+  }
+
+  void release(kj::Own<kj::AsyncIoStream>&& stream) {
+    // Called by ~AppConnection() when a connection is eligible for reuse.
+
+    if (idleConnections.size() >= MAX_IDLE_CONNECTIONS) {
+      // Drop the connection which has been idle the longest.
+      idleConnections.erase(idleConnections.begin());
+    }
+
+    uint64_t id = nextIdleId++;
+    auto& idle = idleConnections[id];
+    idle.stream = kj::mv(stream);
+    idle.watcher = idle.stream->tryRead(&idle.readByte, 1, 1).ignoreResult()
+        .exclusiveJoin(timer.afterDelay(IDLE_TIMEOUT))
+        .catch_([](kj::Exception&&) {})
+        .then([this, id]() {
+      // The app closed the connection, sent something unexpected, or we timed out. Either way the
+      // connection is no longer usable. We can't destroy the watcher from inside its own
+      // continuation, so drop the entry on a later turn.
+      tasks.add(kj::evalLater([this, id]() {
+        idleConnections.erase(id);
+      }));
+    }).eagerlyEvaluate(nullptr);
+  }
+
+private:
+  static constexpr size_t MAX_IDLE_CONNECTIONS = 16;
+  static constexpr kj::Duration IDLE_TIMEOUT = 4 * kj::SECONDS;
+
+  struct IdleConnection {
+    kj::Own<kj::AsyncIoStream> stream;
+    kj::Promise<void> watcher = nullptr;
+    byte readByte;
+  };
+
+  kj::NetworkAddress& serverAddr;
+  kj::Timer& timer;
+  std::map<uint64_t, IdleConnection> idleConnections;
+  // Idle connections, keyed by the order in which they became idle.
+
+  uint64_t nextIdleId = 0;
+  kj::TaskSet tasks;
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, exception);
+  }
+};
+
+constexpr kj::Duration AppConnectionPool::IDLE_TIMEOUT;
+
+AppConnection::~AppConnection() noexcept(false) {
+  if (requestDone && responseDone) {
+    pool.release(kj::mv(stream));
+  }
+}
+
 class HttpParser: public sandstorm::Handle::Server,
                   private http_parser,
                   private kj::TaskSet::ErrorHandler {
 public:
-  HttpParser(sandstorm::ByteStream::Client responseStream)
+  HttpParser(sandstorm::ByteStream::Client responseStream, bool isHeadRequest = false)
     : responseStream(responseStream),
-      taskSet(*this) {
+      taskSet(*this),
+      isHeadRequest(isHeadRequest) {
     memset(&settings, 0, sizeof(settings));
     settings.on_status = &on_status;
     settings.on_header_field = &on_header_field;
@@ -169,6 +318,9 @@ public:
     settings.on_headers_complete = &on_headers_complete;
     settings.on_message_complete = &on_message_complete;
     http_parser_init(this, HTTP_RESPONSE);
+    if (useSimdResponseParser) {
+      simdParser = SimdHttpParser(simdResponseParserIsa);
+    }
   }
 
   kj::Promise<kj::ArrayPtr<byte>> readResponse(kj::AsyncIoStream& stream) {
@@ -177,20 +329,44 @@ public:
     // If the response is an upgrade, return any remainder bytes that should be forwarded to the
     // new web socket; otherwise return an empty array.
 
-    return stream.tryRead(buffer, 1, sizeof(buffer)).then(
-        [this, &stream](size_t actual) mutable -> kj::Promise<kj::ArrayPtr<byte>> {
-      size_t nread = http_parser_execute(this, &settings, reinterpret_cast<char*>(buffer), actual);
+    kj::ArrayPtr<byte> target = kj::arrayPtr(buffer, sizeof(buffer));
+    if (bodyOrphan != nullptr && bodySize < bodyOrphan.get().size()) {
+      // The rest of the stream is exactly the rest of a small body destined for the response
+      // message, so read it straight into place.
+      target = bodyOrphan.get().slice(bodySize, bodyOrphan.get().size());
+    }
+
+    return stream.tryRead(target.begin(), 1, target.size()).then(
+        [this, &stream, target](size_t actual) mutable -> kj::Promise<kj::ArrayPtr<byte>> {
+      if (actual == 0 && !receivedAnyBytes) {
+        // The app closed the connection without sending anything. If this was a reused keep-alive
+        // connection, the app probably timed it out just as we sent our request, so report this
+        // as a disconnect, which the caller may choose to retry.
+        kj::throwFatalException(KJ_EXCEPTION(DISCONNECTED,
+            "Sandboxed app closed connection without sending a response."));
+      }
+      receivedAnyBytes = true;
+
+      size_t nread = parse(target.begin(), actual);
       if (nread != actual && !upgrade) {
-        const char* error = http_errno_description(HTTP_PARSER_ERRNO(this));
-        KJ_FAIL_ASSERT("Failed to parse HTTP response from sandboxed app.", error);
-      } else if (upgrade) {
+        if (messageComplete) {
+          // We pause the parser at the end of the message (see onMessageComplete()), so the
+          // leftover bytes came after the response. We can't reuse this connection.
+          canReuseConnection = false;
+        } else {
+          const char* error = http_errno_description(HTTP_PARSER_ERRNO(this));
+          KJ_FAIL_ASSERT("Failed to parse HTTP response from sandboxed app.", error);
+        }
+      }
+
+      if (upgrade) {
         KJ_ASSERT(nread <= actual && nread >= 0);
-        return kj::arrayPtr(buffer + nread, actual - nread);
+        return target.slice(nread, actual);
       } else if (messageComplete || actual == 0) {
         // The parser is done or the stream has closed.
         KJ_ASSERT(headersComplete, "HTTP response from sandboxed app had incomplete headers.");
         return kj::arrayPtr(buffer, 0);
-      } else if (headersComplete && status_code / 100 == 2) {
+      } else if (headersComplete && status_code / 100 == 2 && bodyOrphan == nullptr) {
         isStreaming = true;
 
         KJ_IF_MAYBE(length, findHeader("content-length")) {
@@ -205,7 +381,9 @@ public:
           // Error while writing.
 
           // Shut down input, so that the app knows it can stop generating it.
-          responseInput->abortRead();
+          if (responseInput.get() != nullptr) {
+            responseInput->abortRead();
+          }
 
           // Drop the response stream, so that Sandstorm knows no more data is coming.
           responseStream = nullptr;
@@ -220,10 +398,25 @@ public:
     });
   }
 
-  void pumpStream(kj::Own<kj::AsyncIoStream>&& stream) {
+  bool hasReceivedData() { return receivedAnyBytes; }
+
+  void setResponseOrphanage(capnp::Orphanage orphanage) {
+    // Provide the orphanage of the message which will later be passed to build(). Small
+    // successful responses of known length are then read directly into that message rather than
+    // being streamed or buffered separately.
+    responseOrphanage = orphanage;
+  }
+
+  void pumpStream(kj::Own<AppConnection>&& stream) {
+    // Take ownership of the connection from which the response is being read. If the response is
+    // streaming, we continue reading the body from it; otherwise the response is already complete
+    // and the connection can go back to the pool, if the app allows that.
+
     if (isStreaming) {
       responseInput = kj::mv(stream);
       startPumpStream();
+    } else if (messageComplete && canReuseConnection) {
+      stream->setResponseDone();
     }
   }
 
@@ -365,6 +558,10 @@ public:
         if (isStreaming) {
           KJ_ASSERT(body.size() == 0);
           content.initBody().setStream(handle);
+        } else if (bodyOrphan != nullptr) {
+          // Already in the response message; the app may have sent less than it promised.
+          bodyOrphan.truncate(bodySize);
+          content.initBody().adoptBytes(kj::mv(bodyOrphan));
         } else {
           auto data = content.initBody().initBytes(body.size());
           memcpy(data.begin(), body.begin(), body.size());
@@ -486,6 +683,7 @@ private:
   sandstorm::ByteStream::Client responseStream;
   kj::TaskSet taskSet;
   http_parser_settings settings;
+  kj::Maybe<SimdHttpParser> simdParser;
   kj::Vector<RawHeader> rawHeaders;
   kj::Vector<char> rawStatusString;
   HeaderElementType lastHeaderElement = NONE;
@@ -499,15 +697,39 @@ private:
   bool streamDone = false;
   bool readStalled = false;
   bool aborted = false;
+  bool isHeadRequest;
+  bool receivedAnyBytes = false;
+  bool canReuseConnection = false;
 
   kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> writeReady;
   capnp::Request<ByteStream::WriteParams, ByteStream::WriteResults> nextWrite = nullptr;
   capnp::Orphan<capnp::Data> nextWriteData;
   size_t nextWriteSize = 0;  // how many bytes are already in `nextWriteData`
 
-  kj::Own<kj::AsyncIoStream> responseInput;
+  kj::Maybe<capnp::Orphanage> responseOrphanage;
+  capnp::Orphan<capnp::Data> bodyOrphan;
+  size_t bodySize = 0;  // how many bytes are already in `bodyOrphan`
+  // For small responses of known length, the body, allocated directly in the response message.
+
+  static constexpr uint64_t MAX_UNSTREAMED_BODY_SIZE = 64u << 10;
+  // Successful responses with a Content-Length up to this size are returned inline rather than
+  // streamed, saving the ByteStream round trips.
+
+  kj::Own<AppConnection> responseInput;
   byte buffer[8192];
 
+  size_t parse(const byte* data, size_t size) {
+    // Feeds bytes from the app to whichever parser is in use; same contract as
+    // http_parser_execute().
+
+    auto chars = reinterpret_cast<const char*>(data);
+    KJ_IF_MAYBE(simd, simdParser) {
+      return simd->execute(*this, settings, chars, size);
+    } else {
+      return http_parser_execute(this, &settings, chars, size);
+    }
+  }
+
   kj::Promise<void> pumpWrites() {
     if (nextWriteSize > 0) {
       // Send the current write and allocate a new one.
@@ -583,30 +805,45 @@ private:
       return kj::READY_NOW;
     }
 
-    // Make sure not to read more bytes than would fit in our output buffer.
-    size_t n = kj::min(sizeof(buffer), nextWriteData.getReader().size() - nextWriteSize);
+    kj::ArrayPtr<byte> target;
+    if (nextWriteSize == 0) {
+      // pumpWrites() won't send the next write while it's empty, so we can read straight into it
+      // and let the parser decode the body in place.
+      target = nextWriteData.get();
+    } else {
+      // pumpWrites() may send the next write as soon as the previous one completes, so read into
+      // our own buffer instead, making sure not to read more bytes than would fit.
+      target = kj::arrayPtr(buffer,
+          kj::min(sizeof(buffer), nextWriteData.getReader().size() - nextWriteSize));
+    }
 
-    if (n == 0) {
+    if (target.size() == 0) {
       // We're out of space. Wait.
       readStalled = true;
       return kj::READY_NOW;
     }
 
-    return responseInput->tryRead(buffer, 1, n)
-        .then([this](size_t actual) -> kj::Promise<void> {
+    return responseInput->tryRead(target.begin(), 1, target.size())
+        .then([this, target](size_t actual) -> kj::Promise<void> {
       if (aborted) {
         // Output failed; give up.
         return kj::READY_NOW;
       }
 
-      size_t nread = http_parser_execute(this, &settings, reinterpret_cast<char*>(buffer), actual);
-      if (nread != actual) {
+      size_t nread = parse(target.begin(), actual);
+      if (nread != actual && !messageComplete) {
         // The parser failed.
         const char* error = http_errno_description(HTTP_PARSER_ERRNO(this));
         KJ_FAIL_ASSERT("Failed to parse HTTP response from sandboxed app.", error);
       } else if (messageComplete || actual == 0) {
         // The parser is done or the stream has closed.
         streamDone = true;
+        if (messageComplete && nread == actual && canReuseConnection) {
+          responseInput->setResponseDone();
+        }
+        // Release the connection (possibly back to the pool). We're still inside a callback on
+        // its read, so wait a turn.
+        taskSet.add(kj::evalLater([this]() { responseInput = nullptr; }));
         KJ_IF_MAYBE(w, writeReady) {
           w->get()->fulfill();
           writeReady = nullptr;
@@ -732,14 +969,23 @@ private:
   }
 
 
+  static void appendBody(kj::ArrayPtr<byte> dest, size_t& destSize,
+                         kj::ArrayPtr<const char> data) {
+    // Append `data` to the first `destSize` bytes of `dest`. If we read directly into `dest`, then
+    // `data` is either already in place or, for chunked encoding, a little past it, having been
+    // preceded by chunk headers. Hence memmove(), which is a no-op in the former case.
+
+    KJ_ASSERT(data.size() <= dest.size() - destSize, data.size(), dest.size(), destSize);
+    byte* target = dest.begin() + destSize;
+    if (reinterpret_cast<const byte*>(data.begin()) != target) {
+      memmove(target, data.begin(), data.size());
+    }
+    destSize += data.size();
+  }
+
   void onBody(kj::ArrayPtr<const char> data) {
     if (isStreaming) {
-      // Copy into the buffer we're working on.
-      kj::ArrayPtr<byte> buffer = nextWriteData.get();
-      buffer = buffer.slice(nextWriteSize, buffer.size());
-      KJ_ASSERT(data.size() <= buffer.size(), data.size(), buffer.size(), nextWriteSize);
-      memcpy(buffer.begin(), data.begin(), data.size());
-      nextWriteSize += data.size();
+      appendBody(nextWriteData.get(), nextWriteSize, data);
 
       // Indicate data is ready. (Most of these fulfill() calls will be no-ops if no one is
       // waiting.)
@@ -747,6 +993,8 @@ private:
         w->get()->fulfill();
         writeReady = nullptr;
       }
+    } else if (bodyOrphan != nullptr) {
+      appendBody(bodyOrphan.get(), bodySize, data);
     } else {
       body.addAll(data);
     }
@@ -761,10 +1009,26 @@ private:
 
     headersComplete = true;
     KJ_ASSERT(status_code >= 100, (int)status_code);
+
+    KJ_IF_MAYBE(orphanage, responseOrphanage) {
+      auto iter = HTTP_STATUS_CODES.find(status_code);
+      if (!isHeadRequest && iter != HTTP_STATUS_CODES.end() &&
+          iter->second.type == WebSession::Response::CONTENT &&
+          !(flags & F_CHUNKED) && content_length > 0 &&
+          content_length <= MAX_UNSTREAMED_BODY_SIZE) {
+        // http_parser has set content_length from the Content-Length header.
+        bodyOrphan = orphanage->newOrphan<capnp::Data>(content_length);
+      }
+    }
   }
 
   void onMessageComplete() {
     messageComplete = true;
+    canReuseConnection = !upgrade && http_should_keep_alive(this);
+
+    // Stop the parser here, so that http_parser_execute() tells us about any bytes following the
+    // response rather than trying to parse them as a second response.
+    http_parser_pause(this, 1);
   }
 
 #define ON_DATA(lower, title) \
@@ -782,11 +1046,18 @@ private:
   ON_DATA(header_field, HeaderField)
   ON_DATA(header_value, HeaderValue)
   ON_DATA(body, Body)
-  ON_EVENT(headers_complete, HeadersComplete)
   ON_EVENT(message_complete, MessageComplete)
 #undef ON_DATA
 #undef ON_EVENT
 
+  static int on_headers_complete(http_parser* p) {
+    auto self = static_cast<HttpParser*>(p);
+    self->onHeadersComplete();
+    // A response to HEAD has no body regardless of what Content-Length says. Returning 1 tells
+    // http_parser so, which matters now that the app won't close the connection after responding.
+    return self->isHeadRequest ? 1 : 0;
+  }
+
   static void maybePrintInvalidEtagWarning(kj::StringPtr input) {
     static bool alreadyLoggedMessage = false;
     if (alreadyLoggedMessage) {
@@ -847,24 +1118,16 @@ public:
 
   void pump() {
     // Repeatedly read from serverStream and write to clientStream.
-    tasks.add(serverStream->tryRead(buffer, 1, sizeof(buffer))
-        .then([this](size_t amount) {
-      if (amount > 0) {
-        sendData(kj::arrayPtr(buffer, amount));
-        pump();
-      } else {
-        // EOF.
-        clientStream = nullptr;
-      }
-    }));
+    tasks.add(readLoop());
   }
 
-  void sendData(kj::ArrayPtr<byte> data) {
-    // Write the given bytes to clientStream.
-    auto request = clientStream.sendBytesRequest(
-        capnp::MessageSize { data.size() / sizeof(capnp::word) + 8, 0 });
-    request.setMessage(data);
-    tasks.add(request.send().ignoreResult());
+  void sendData(kj::ArrayPtr<const byte> data) {
+    // Write the given bytes to clientStream. Small writes are coalesced while an earlier send is
+    // still in flight.
+    pending.addAll(data);
+    if (sendsInFlight == 0 || pending.size() >= MAX_MESSAGE_SIZE) {
+      flush();
+    }
   }
 
 protected:
@@ -886,10 +1149,97 @@ private:
   // The promise working on writing data to serverStream.  AsyncIoStream wants only one write() at
   // a time, so new writes have to wait for the previous write to finish.
 
+  static constexpr size_t WINDOW_SIZE = 256u << 10;
+  // We stop reading from the app while this many bytes are sent to the client but not yet
+  // acknowledged, so that a chatty app can't make us (or the RPC layer) buffer without bound.
+
+  static constexpr size_t MIN_READ_SIZE = 4096;
+  static constexpr size_t MAX_READ_SIZE = 64u << 10;
+  // Bounds on the read buffer size. We start small, since most WebSockets are mostly idle, and
+  // double the buffer each time a read fills it.
+
+  static constexpr size_t MAX_MESSAGE_SIZE = 64u << 10;
+  // Once this many bytes have been coalesced we send them without waiting for earlier sends.
+
+  kj::Array<byte> readBuffer = kj::heapArray<byte>(MIN_READ_SIZE);
+
+  kj::Vector<byte> pending;
+  // Bytes read from the app but not yet sent, because a send is already in flight.
+
+  size_t bytesInFlight = 0;
+  uint sendsInFlight = 0;
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> windowOpen;
+  // Fulfilled when a send returns, if readLoop() is waiting for room in the window.
+
   kj::TaskSet tasks;
   // Pending calls to clientStream.sendBytes() and serverStream.read().
 
-  byte buffer[4096];
+  kj::Promise<void> readLoop() {
+    if (bytesInFlight + pending.size() >= WINDOW_SIZE) {
+      // Window is full. Wait for a send to return.
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      windowOpen = kj::mv(paf.fulfiller);
+      return paf.promise.then([this]() { return readLoop(); });
+    }
+
+    return serverStream->tryRead(readBuffer.begin(), 1, readBuffer.size())
+        .then([this](size_t amount) -> kj::Promise<void> {
+      if (amount == 0) {
+        // EOF.
+        flush();
+        clientStream = nullptr;
+        return kj::READY_NOW;
+      }
+
+      bool filled = amount == readBuffer.size();
+      sendData(readBuffer.slice(0, amount));
+
+      if (filled && readBuffer.size() < MAX_READ_SIZE) {
+        readBuffer = kj::heapArray<byte>(readBuffer.size() * 2);
+      } else if (amount < readBuffer.size() / 4 && readBuffer.size() > MIN_READ_SIZE) {
+        readBuffer = kj::heapArray<byte>(readBuffer.size() / 2);
+      }
+
+      return readLoop();
+    });
+  }
+
+  void flush() {
+    // Send everything in `pending` now.
+
+    if (pending.size() == 0) return;
+
+    size_t size = pending.size();
+    auto request = clientStream.sendBytesRequest(
+        capnp::MessageSize { size / sizeof(capnp::word) + 8, 0 });
+    request.setMessage(pending.asPtr());
+    pending.clear();
+
+    bytesInFlight += size;
+    ++sendsInFlight;
+    tasks.add(request.send().then([this,size](auto&&) {
+      sendDone(size);
+    }, [this,size](kj::Exception&& exception) {
+      sendDone(size);
+      kj::throwFatalException(kj::mv(exception));
+    }));
+  }
+
+  void sendDone(size_t size) {
+    bytesInFlight -= size;
+    --sendsInFlight;
+
+    if (sendsInFlight == 0) {
+      // Send whatever accumulated while we were waiting.
+      flush();
+    }
+
+    KJ_IF_MAYBE(f, windowOpen) {
+      f->get()->fulfill();
+      windowOpen = nullptr;
+    }
+  }
 
   void taskFailed(kj::Exception&& exception) override {
     // TODO(soon):  What do we do when a server -> client send throws?  Probably just ignore it;
@@ -900,37 +1250,13 @@ private:
   }
 };
 
-class RefcountedAsyncIoStream: public kj::AsyncIoStream, public kj::Refcounted {
-public:
-  RefcountedAsyncIoStream(kj::Own<kj::AsyncIoStream>&& stream)
-      : stream(kj::mv(stream)) {}
-
-  kj::Promise<size_t> read(void* buffer, size_t minBytes, size_t maxBytes) override {
-    return stream->read(buffer, minBytes, maxBytes);
-  }
-  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
-    return stream->tryRead(buffer, minBytes, maxBytes);
-  }
-  kj::Promise<void> write(const void* buffer, size_t size) override {
-    return stream->write(buffer, size);
-  }
-  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
-    return stream->write(pieces);
-  }
-  void shutdownWrite() override {
-    return stream->shutdownWrite();
-  }
-
-private:
-  kj::Own<kj::AsyncIoStream> stream;
-};
-
 class RequestStreamImpl final: public WebSession::RequestStream::Server {
 public:
-  RequestStreamImpl(kj::String httpRequest,
-                    kj::Own<kj::AsyncIoStream> stream,
+  RequestStreamImpl(HttpHeadBuilder httpRequest,
+                    kj::Own<AppConnection> stream,
                     sandstorm::ByteStream::Client responseStream)
-      : stream(kj::refcounted<RefcountedAsyncIoStream>(kj::mv(stream))),
+      : stream(kj::mv(stream)),
+        body(*this->stream),
         responseStream(responseStream),
         httpRequest(kj::mv(httpRequest)) {}
 
@@ -944,6 +1270,7 @@ public:
 
     auto parser = kj::heap<HttpParser>(responseStream);
     auto results = context.getResults();
+    parser->setResponseOrphanage(capnp::Orphanage::getForMessageContaining(results));
 
     return parser->readResponse(*stream).then(
         [this, results, KJ_MVCAP(parser)]
@@ -966,25 +1293,8 @@ public:
       KJ_REQUIRE(bytesReceived <= *s, "received more bytes than expected");
     }
 
-    // Forward the data.
-    auto promise = previousWrite.then([this, data]() {
-      if (isChunked) {
-        kj::String chunkSize = kj::str(kj::hex(data.size()), "\r\n");
-        kj::ArrayPtr<char> buffer = chunkSize.asArray();
-        return stream->write(buffer.begin(), buffer.size())
-            .attach(kj::mv(chunkSize))
-            .then([this, data] () {
-          return stream->write(data.begin(), data.size()).then([this] () {
-            return stream->write("\r\n", 2);
-          });
-        });
-      } else {
-        return stream->write(data.begin(), data.size());
-      }
-    });
-    auto fork = promise.fork();
-    previousWrite = fork.addBranch();
-    return fork.addBranch();
+    // Forward the data. Writes that arrive while an earlier one is in progress are coalesced.
+    return body.writeBody(data);
   }
 
   kj::Promise<void> done(DoneContext context) override {
@@ -999,15 +1309,9 @@ public:
     // expected size. (If we have written headers then the size we pass will be ignored.)
     writeHeadersOnce(kj::implicitCast<uint64_t>(0));
 
-    if (isChunked) {
-      previousWrite = previousWrite.then([this]() {
-        return stream->write("0\r\n\r\n", 5);
-      });
-    }
-
-    auto fork = previousWrite.fork();
-    previousWrite = fork.addBranch();
-    return fork.addBranch();
+    return body.finish().then([this]() {
+      stream->setRequestDone();
+    });
   }
 
   kj::Promise<void> expectSize(ExpectSizeContext context) override {
@@ -1018,41 +1322,35 @@ public:
   }
 
 private:
-  kj::Own<RefcountedAsyncIoStream> stream;
+  kj::Own<AppConnection> stream;
+  HttpBodyWriter body;
   sandstorm::ByteStream::Client responseStream;
   bool doneCalled = false;
   bool getResponseCalled = false;
   bool isChunked = true; // chunked unless we get expectSize() before we write the headers
   uint64_t bytesReceived = 0;
   kj::Maybe<uint64_t> expectedSize;
-  kj::Promise<void> previousWrite = nullptr;  // initialized in writeHeadersOnce()
-  kj::Maybe<kj::String> httpRequest;
+  kj::Maybe<HttpHeadBuilder> httpRequest;
+  // The request head, minus the terminating blank line, until writeHeadersOnce() finishes it.
+  // Afterwards it must outlive the write.
 
-  void writeHeadersOnce(kj::Maybe<uint64_t> contentLength) {
-    KJ_IF_MAYBE(r, httpRequest) {
-      // We haven't sent the request yet.
-      kj::String reqString = kj::mv(*r);
-      httpRequest = nullptr;
-
-      // Hackily splice in content-length or transfer-encoding header.
-      KJ_ASSERT(reqString.endsWith("\r\n\r\n"));
-      KJ_IF_MAYBE(l, contentLength) {
-        isChunked = false;
-        reqString = kj::str(
-            reqString.slice(0, reqString.size() - 2),
-            "Content-Length: ", *l, "\r\n"
-            "\r\n");
-      } else {
-        reqString = kj::str(
-            reqString.slice(0, reqString.size() - 2),
-            "Transfer-Encoding: chunked\r\n"
-            "\r\n");
-      }
+  bool headersWritten = false;
 
-      auto bytes = toBytes(reqString);
-      kj::ArrayPtr<const byte> bytesRef = bytes;
-      previousWrite = stream->write(bytesRef.begin(), bytesRef.size()).attach(kj::mv(bytes));
+  void writeHeadersOnce(kj::Maybe<uint64_t> contentLength) {
+    if (headersWritten) return;
+    headersWritten = true;
+
+    // We haven't sent the request yet. Add content-length or transfer-encoding header.
+    auto& request = KJ_ASSERT_NONNULL(httpRequest);
+    KJ_IF_MAYBE(l, contentLength) {
+      isChunked = false;
+      request.addLine("Content-Length: ", *l);
+    } else {
+      request.addLine("Transfer-Encoding: chunked");
     }
+
+    body.setChunked(isChunked);
+    body.writeRaw(request.finish());
   }
 };
 
@@ -1065,14 +1363,34 @@ public:
 
   kj::String formatPermissions(capnp::List<bool>::Reader userPermissions) {
     auto configPermissions = config.getViewInfo().getPermissions();
-    kj::Vector<kj::String> permissionVec(configPermissions.size());
+    uint count = kj::min(configPermissions.size(), userPermissions.size());
 
-    for (uint i = 0; i < configPermissions.size() && i < userPermissions.size(); ++i) {
+    // The same few permission sets come up over and over, so we remember how we formatted each.
+    auto bits = kj::heapString(count);
+    for (uint i = 0; i < count; ++i) {
+      bits[i] = userPermissions[i] ? '1' : '0';
+    }
+    auto iter = permissionCache.find(bits);
+    if (iter != permissionCache.end()) {
+      return kj::heapString(iter->second.text);
+    }
+
+    kj::Vector<kj::String> permissionVec(configPermissions.size());
+    for (uint i = 0; i < count; ++i) {
       if (userPermissions[i]) {
         permissionVec.add(kj::str(configPermissions[i].getName()));
       }
     }
-    return kj::strArray(permissionVec, ",");
+    auto result = kj::strArray(permissionVec, ",");
+
+    if (permissionCache.size() >= MAX_PERMISSION_CACHE_SIZE) {
+      permissionCache.clear();
+    }
+    kj::StringPtr key = bits;
+    permissionCache.insert(std::make_pair(key,
+        FormattedPermissions { kj::mv(bits), kj::heapString(result) }));
+
+    return result;
   }
 
   capnp::List<spk::BridgeConfig::PowerboxApi>::Reader getPowerboxApis() {
@@ -1186,6 +1504,15 @@ private:
   };
   std::map<kj::StringPtr, IdentityRecord> liveIdentities;
 
+  struct FormattedPermissions {
+    kj::String bits;
+    kj::String text;
+  };
+  std::map<kj::StringPtr, FormattedPermissions> permissionCache;
+  // Results of formatPermissions(), keyed by `bits`, which has a '0' or '1' per permission.
+
+  static constexpr size_t MAX_PERMISSION_CACHE_SIZE = 256;
+
   kj::TaskSet tasks;
 
   virtual void taskFailed(kj::Exception&& exception) override {
@@ -1285,14 +1612,14 @@ private:
 
 class WebSessionImpl final: public BridgeHttpSession::Server {
 public:
-  WebSessionImpl(kj::NetworkAddress& serverAddr,
+  WebSessionImpl(AppConnectionPool& connectionPool,
                  UserInfo::Reader userInfo, SessionContext::Client sessionContext,
                  BridgeContext& bridgeContext, kj::String&& sessionId, kj::String&& tabId,
                  kj::String&& basePath, kj::String&& userAgent, kj::String&& acceptLanguages,
                  kj::String&& rootPath, kj::String&& permissions,
                  kj::Maybe<kj::String> remoteAddress,
                  kj::Maybe<OwnCapnp<BridgeObjectId::HttpApi>>&& apiInfo)
-      : serverAddr(serverAddr),
+      : connectionPool(connectionPool),
         sessionContext(kj::mv(sessionContext)),
         bridgeContext(bridgeContext),
         sessionId(kj::mv(sessionId)),
@@ -1311,6 +1638,7 @@ public:
     if (userInfo.hasIdentityId()) {
       userId = textIdentityId(userInfo.getIdentityId());
     }
+    sessionHeaders = makeSessionHeaders();
     if (this->sessionId != nullptr) {
       bridgeContext.sessions.insert({kj::StringPtr(this->sessionId), this->sessionContext});
     }
@@ -1324,45 +1652,44 @@ public:
 
   kj::Promise<void> get(GetContext context) override {
     GetParams::Reader params = context.getParams();
-    kj::String httpRequest = makeHeaders(
-        params.getIgnoreBody() ? "HEAD" : "GET", params.getPath(), params.getContext());
-    return sendRequest(toBytes(httpRequest), context);
+    auto request = startRequest(
+        params.getIgnoreBody() ? "HEAD" : "GET", params.getPath());
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), nullptr, context, params.getIgnoreBody());
   }
 
   kj::Promise<void> post(PostContext context) override {
     PostParams::Reader params = context.getParams();
     auto content = params.getContent();
-    kj::String httpRequest = makeHeaders("POST", params.getPath(), params.getContext(),
-      kj::str("Content-Type: ", content.getMimeType()),
-      kj::str("Content-Length: ", content.getContent().size()),
-      content.hasEncoding() ? kj::str("Content-Encoding: ", content.getEncoding()) : nullptr);
-    return sendRequest(toBytes(httpRequest, content.getContent()), context);
+    auto request = startRequest("POST", params.getPath(), content.getContent().size());
+    addContentHeaders(request, content);
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), content.getContent(), context);
   }
 
   kj::Promise<void> put(PutContext context) override {
     PutParams::Reader params = context.getParams();
     auto content = params.getContent();
-    kj::String httpRequest = makeHeaders("PUT", params.getPath(), params.getContext(),
-      kj::str("Content-Type: ", content.getMimeType()),
-      kj::str("Content-Length: ", content.getContent().size()),
-      content.hasEncoding() ? kj::str("Content-Encoding: ", content.getEncoding()) : nullptr);
-    return sendRequest(toBytes(httpRequest, content.getContent()), context);
+    auto request = startRequest("PUT", params.getPath(), content.getContent().size());
+    addContentHeaders(request, content);
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), content.getContent(), context);
   }
 
   kj::Promise<void> patch(PatchContext context) override {
     PatchParams::Reader params = context.getParams();
     auto content = params.getContent();
-    kj::String httpRequest = makeHeaders("PATCH", params.getPath(), params.getContext(),
-      kj::str("Content-Type: ", content.getMimeType()),
-      kj::str("Content-Length: ", content.getContent().size()),
-      content.hasEncoding() ? kj::str("Content-Encoding: ", content.getEncoding()) : nullptr);
-    return sendRequest(toBytes(httpRequest, content.getContent()), context);
+    auto request = startRequest("PATCH", params.getPath(), content.getContent().size());
+    addContentHeaders(request, content);
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), content.getContent(), context);
   }
 
   kj::Promise<void> delete_(DeleteContext context) override {
     DeleteParams::Reader params = context.getParams();
-    kj::String httpRequest = makeHeaders("DELETE", params.getPath(), params.getContext());
-    return sendRequest(toBytes(httpRequest), context);
+    auto request = startRequest("DELETE", params.getPath());
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), nullptr, context);
   }
 
   kj::Promise<void> propfind(PropfindContext context) override {
@@ -1376,114 +1703,117 @@ public:
     }
 
     auto xml = params.getXmlContent();
-    kj::String httpRequest = makeHeaders(
-        "PROPFIND", params.getPath(), params.getContext(),
-        kj::str("Content-Type: application/xml;charset=utf-8"),
-        kj::str("Content-Length: ", xml.size()),
-        kj::str("Depth: ", depth));
-    return sendRequest(toBytes(httpRequest, xml.asBytes()), context);
+    auto request = startRequest("PROPFIND", params.getPath(), xml.size());
+    request.addLine("Content-Type: application/xml;charset=utf-8");
+    request.addLine("Content-Length: ", xml.size());
+    request.addLine("Depth: ", depth);
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), xml.asBytes(), context);
   }
 
   kj::Promise<void> proppatch(ProppatchContext context) override {
     ProppatchParams::Reader params = context.getParams();
     auto xml = params.getXmlContent();
-    kj::String httpRequest = makeHeaders(
-        "PROPPATCH", params.getPath(), params.getContext(),
-        kj::str("Content-Type: application/xml;charset=utf-8"),
-        kj::str("Content-Length: ", xml.size()));
-    return sendRequest(toBytes(httpRequest, xml.asBytes()), context);
+    auto request = startRequest("PROPPATCH", params.getPath(), xml.size());
+    request.addLine("Content-Type: application/xml;charset=utf-8");
+    request.addLine("Content-Length: ", xml.size());
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), xml.asBytes(), context);
   }
 
   kj::Promise<void> mkcol(MkcolContext context) override {
     MkcolParams::Reader params = context.getParams();
     auto content = params.getContent();
-    kj::String httpRequest = makeHeaders(
-        "MKCOL", params.getPath(), params.getContext(),
-        kj::str("Content-Type: ", content.getMimeType()),
-        kj::str("Content-Length: ", content.getContent().size()),
-        content.hasEncoding() ? kj::str("Content-Encoding: ", content.getEncoding()) : nullptr);
-    return sendRequest(toBytes(httpRequest, content.getContent()), context);
+    auto request = startRequest("MKCOL", params.getPath(), content.getContent().size());
+    addContentHeaders(request, content);
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), content.getContent(), context);
   }
 
   kj::Promise<void> copy(CopyContext context) override {
     CopyParams::Reader params = context.getParams();
-    kj::String httpRequest = makeHeaders(
-        "COPY", params.getPath(), params.getContext(),
-        makeDestinationHeader(params.getDestination()),
-        makeOverwriteHeader(params.getNoOverwrite()),
-        makeDepthHeader(params.getShallow()));
-    return sendRequest(toBytes(httpRequest), context);
+    auto request = startRequest("COPY", params.getPath());
+    request.addLine(makeDestinationHeader(params.getDestination()));
+    request.addLine(makeOverwriteHeader(params.getNoOverwrite()));
+    request.addLine(makeDepthHeader(params.getShallow()));
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), nullptr, context);
   }
 
   kj::Promise<void> move(MoveContext context) override {
     MoveParams::Reader params = context.getParams();
-    kj::String httpRequest = makeHeaders(
-        "MOVE", params.getPath(), params.getContext(),
-        makeDestinationHeader(params.getDestination()),
-        makeOverwriteHeader(params.getNoOverwrite()));
-    return sendRequest(toBytes(httpRequest), context);
+    auto request = startRequest("MOVE", params.getPath());
+    request.addLine(makeDestinationHeader(params.getDestination()));
+    request.addLine(makeOverwriteHeader(params.getNoOverwrite()));
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), nullptr, context);
   }
 
   kj::Promise<void> lock(LockContext context) override {
     LockParams::Reader params = context.getParams();
     auto xml = params.getXmlContent();
-    kj::String httpRequest = makeHeaders(
-        "LOCK", params.getPath(), params.getContext(),
-        kj::str("Content-Type: application/xml;charset=utf-8"),
-        kj::str("Content-Length: ", xml.size()),
-        makeDepthHeader(params.getShallow()));
-    return sendRequest(toBytes(httpRequest, xml.asBytes()), context);
+    auto request = startRequest("LOCK", params.getPath(), xml.size());
+    request.addLine("Content-Type: application/xml;charset=utf-8");
+    request.addLine("Content-Length: ", xml.size());
+    request.addLine(makeDepthHeader(params.getShallow()));
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), xml.asBytes(), context);
   }
 
   kj::Promise<void> unlock(UnlockContext context) override {
     UnlockParams::Reader params = context.getParams();
-    kj::String httpRequest = makeHeaders(
-        "UNLOCK", params.getPath(), params.getContext(),
-        kj::str("Lock-Token: ", params.getLockToken()));
-    return sendRequest(toBytes(httpRequest, nullptr), context);
+    auto request = startRequest("UNLOCK", params.getPath());
+    request.addLine("Lock-Token: ", params.getLockToken());
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), nullptr, context);
   }
 
   kj::Promise<void> acl(AclContext context) override {
     AclParams::Reader params = context.getParams();
     auto xml = params.getXmlContent();
-    kj::String httpRequest = makeHeaders(
-        "ACL", params.getPath(), params.getContext(),
-        kj::str("Content-Type: application/xml;charset=utf-8"),
-        kj::str("Content-Length: ", xml.size()));
-    return sendRequest(toBytes(httpRequest, xml.asBytes()), context);
+    auto request = startRequest("ACL", params.getPath(), xml.size());
+    request.addLine("Content-Type: application/xml;charset=utf-8");
+    request.addLine("Content-Length: ", xml.size());
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), xml.asBytes(), context);
   }
 
   kj::Promise<void> report(ReportContext context) override {
     ReportParams::Reader params = context.getParams();
     auto content = params.getContent();
-    kj::String httpRequest = makeHeaders(
-        "REPORT", params.getPath(), params.getContext(),
-        kj::str("Content-Type: ", content.getMimeType()),
-        kj::str("Content-Length: ", content.getContent().size()),
-        content.hasEncoding() ? kj::str("Content-Encoding: ", content.getEncoding()) : nullptr);
-    return sendRequest(toBytes(httpRequest, content.getContent()), context);
+    auto request = startRequest("REPORT", params.getPath(), content.getContent().size());
+    addContentHeaders(request, content);
+    addCommonHeaders(request, params.getContext());
+    return sendRequest(kj::mv(request), content.getContent(), context);
   }
 
   kj::Promise<void> options(OptionsContext context) override {
     OptionsParams::Reader params = context.getParams();
-    kj::String httpRequest = makeHeaders("OPTIONS", params.getPath(), params.getContext());
-    return sendOptionsRequest(kj::mv(httpRequest), context);
+    auto request = startRequest("OPTIONS", params.getPath());
+    addCommonHeaders(request, params.getContext());
+    return sendOptionsRequest(kj::mv(request), context);
   }
 
   kj::Promise<void> postStreaming(PostStreamingContext context) override {
     PostStreamingParams::Reader params = context.getParams();
-    kj::String httpRequest = makeHeaders("POST", params.getPath(), params.getContext(),
-        kj::str("Content-Type: ", params.getMimeType()),
-        params.hasEncoding() ? kj::str("Content-Encoding: ", params.getEncoding()) : nullptr);
-    return sendRequestStreaming(kj::mv(httpRequest), context);
+    auto request = startRequest("POST", params.getPath());
+    request.addLine("Content-Type: ", params.getMimeType());
+    if (params.hasEncoding()) {
+      request.addLine("Content-Encoding: ", params.getEncoding());
+    }
+    addCommonHeaders(request, params.getContext());
+    return sendRequestStreaming(kj::mv(request), context);
   }
 
   kj::Promise<void> putStreaming(PutStreamingContext context) override {
     PutStreamingParams::Reader params = context.getParams();
-    kj::String httpRequest = makeHeaders("PUT", params.getPath(), params.getContext(),
-        kj::str("Content-Type: ", params.getMimeType()),
-        params.hasEncoding() ? kj::str("Content-Encoding: ", params.getEncoding()) : nullptr);
-    return sendRequestStreaming(kj::mv(httpRequest), context);
+    auto request = startRequest("PUT", params.getPath());
+    request.addLine("Content-Type: ", params.getMimeType());
+    if (params.hasEncoding()) {
+      request.addLine("Content-Encoding: ", params.getEncoding());
+    }
+    addCommonHeaders(request, params.getContext());
+    return sendRequestStreaming(kj::mv(request), context);
   }
 
   kj::Promise<void> openWebSocket(OpenWebSocketContext context) override {
@@ -1492,30 +1822,36 @@ public:
 
     auto params = context.getParams();
 
-    kj::Vector<kj::String> lines(16);
+    HttpHeadBuilder httpRequest(sessionHeaders.size() + 1024);
 
-    lines.add(kj::str("GET ", rootPath, params.getPath(), " HTTP/1.1"));
-    lines.add(kj::str("Upgrade: websocket"));
-    lines.add(kj::str("Connection: Upgrade"));
-    lines.add(kj::str("Sec-WebSocket-Key: mj9i153gxeYNlGDoKdoXOQ=="));
+    httpRequest.addLine("GET ", rootPath, params.getPath(), " HTTP/1.1");
+    httpRequest.addLine("Upgrade: websocket");
+    httpRequest.addLine("Connection: Upgrade");
+    httpRequest.addLine("Sec-WebSocket-Key: mj9i153gxeYNlGDoKdoXOQ==");
     auto protocols = params.getProtocol();
     if (protocols.size() > 0) {
-      lines.add(kj::str("Sec-WebSocket-Protocol: ", kj::strArray(params.getProtocol(), ", ")));
+      httpRequest.add("Sec-WebSocket-Protocol: ");
+      for (uint i: kj::indices(protocols)) {
+        if (i > 0) httpRequest.add(", ");
+        httpRequest.add(protocols[i]);
+      }
+      httpRequest.endLine();
     }
-    lines.add(kj::str("Sec-WebSocket-Version: 13"));
+    httpRequest.addLine("Sec-WebSocket-Version: 13");
 
-    addCommonHeaders(lines, params.getContext());
+    addCommonHeaders(httpRequest, params.getContext());
 
-    auto httpRequest = toBytes(catHeaderLines(lines));
+    kj::ArrayPtr<const byte> httpRequestRef = httpRequest.finish();
     WebSession::WebSocketStream::Client clientStream = params.getClientStream();
     sandstorm::ByteStream::Client responseStream =
         context.getParams().getContext().getResponseStream();
     context.releaseParams();
 
-    return serverAddr.connect().then(
-        [this, KJ_MVCAP(httpRequest), KJ_MVCAP(clientStream), responseStream, context]
-        (kj::Own<kj::AsyncIoStream>&& stream) mutable {
-      kj::ArrayPtr<const byte> httpRequestRef = httpRequest;
+    // WebSocket connections are never returned to the pool, so don't take one from it either.
+    return connectionPool.connectFresh().then(
+        [this, KJ_MVCAP(httpRequest), httpRequestRef,
+         KJ_MVCAP(clientStream), responseStream, context]
+        (kj::Own<AppConnection>&& stream) mutable {
       auto& streamRef = *stream;
       return streamRef.write(httpRequestRef.begin(), httpRequestRef.size())
           .attach(kj::mv(httpRequest))
@@ -1556,7 +1892,7 @@ public:
   }
 
 private:
-  kj::NetworkAddress& serverAddr;
+  AppConnectionPool& connectionPool;
   SessionContext::Client sessionContext;
   BridgeContext& bridgeContext;
   kj::String sessionId;
@@ -1575,113 +1911,121 @@ private:
   kj::Maybe<kj::String> remoteAddress;
   kj::Maybe<OwnCapnp<BridgeObjectId::HttpApi>> apiInfo;
 
-  kj::String makeHeaders(kj::StringPtr method, kj::StringPtr path,
-                         WebSession::Context::Reader context,
-                         kj::String extraHeader1 = nullptr,
-                         kj::String extraHeader2 = nullptr,
-                         kj::String extraHeader3 = nullptr) {
-    kj::Vector<kj::String> lines(16);
-
-    lines.add(kj::str(method, " ", rootPath, path, " HTTP/1.1"));
-    lines.add(kj::str("Connection: close"));
-    if (extraHeader1 != nullptr) {
-      lines.add(kj::mv(extraHeader1));
-    }
-    if (extraHeader2 != nullptr) {
-      lines.add(kj::mv(extraHeader2));
-    }
-    if (extraHeader3 != nullptr) {
-      lines.add(kj::mv(extraHeader3));
-    }
-    if (acceptLanguages.size() > 0) {
-      lines.add(kj::str("Accept-Language: ", acceptLanguages));
-    }
+  kj::String sessionHeaders;
+  // Header lines which are the same on every request, from makeSessionHeaders().
 
-    addCommonHeaders(lines, context);
+  kj::String makeSessionHeaders() {
+    // Serialize the headers which are the same for every request in this session, so that each
+    // request can just copy them.
 
-    return catHeaderLines(lines);
-  }
+    HttpHeadBuilder lines(1024);
 
-  static kj::String catHeaderLines(kj::Vector<kj::String>& lines) {
-    for (auto& line: lines) {
-      KJ_ASSERT(line.findFirst('\n') == nullptr,
-                "HTTP header contained newline; blocking to prevent injection.");
-    }
-
-    return kj::strArray(lines, "\r\n");
-  }
-
-  void addCommonHeaders(kj::Vector<kj::String>& lines, WebSession::Context::Reader context) {
     if (userAgent.size() > 0) {
-      lines.add(kj::str("User-Agent: ", userAgent));
+      lines.addLine("User-Agent: ", userAgent);
     }
-    lines.add(kj::str("X-Sandstorm-Tab-Id: ", tabId));
-    lines.add(kj::str("X-Sandstorm-Username: ", userDisplayName));
+    lines.addLine("X-Sandstorm-Tab-Id: ", tabId);
+    lines.addLine("X-Sandstorm-Username: ", userDisplayName);
     KJ_IF_MAYBE(u, userId) {
-      lines.add(kj::str("X-Sandstorm-User-Id: ", *u));
+      lines.addLine("X-Sandstorm-User-Id: ", *u);
 
       // Since the user is logged in, also include their other info.
       if (userHandle.size() > 0) {
-        lines.add(kj::str("X-Sandstorm-Preferred-Handle: ", userHandle));
+        lines.addLine("X-Sandstorm-Preferred-Handle: ", userHandle);
       }
       if (userPicture.size() > 0) {
-        lines.add(kj::str("X-Sandstorm-User-Picture: ", userPicture));
+        lines.addLine("X-Sandstorm-User-Picture: ", userPicture);
       }
       capnp::EnumSchema schema = capnp::Schema::from<Profile::Pronouns>();
       uint pronounValue = static_cast<uint>(userPronouns);
       auto enumerants = schema.getEnumerants();
       if (pronounValue > 0 && pronounValue < enumerants.size()) {
-        lines.add(kj::str("X-Sandstorm-User-Pronouns: ",
-            enumerants[pronounValue].getProto().getName()));
+        lines.addLine("X-Sandstorm-User-Pronouns: ",
+            enumerants[pronounValue].getProto().getName());
       }
     }
-    lines.add(kj::str("X-Sandstorm-Permissions: ", permissions));
+    lines.addLine("X-Sandstorm-Permissions: ", permissions);
     if (basePath.size() > 0) {
-      lines.add(kj::str("X-Sandstorm-Base-Path: ", basePath));
-      lines.add(kj::str("Host: ", extractHostFromUrl(basePath)));
-      lines.add(kj::str("X-Forwarded-Proto: ", extractProtocolFromUrl(basePath)));
+      lines.addLine("X-Sandstorm-Base-Path: ", basePath);
+      lines.addLine("Host: ", extractHostFromUrl(basePath));
+      lines.addLine("X-Forwarded-Proto: ", extractProtocolFromUrl(basePath));
     } else {
       // Dummy value. Some API servers (e.g. git-http-backend) fail if Host is not present.
-      lines.add(kj::str("Host: sandbox"));
+      lines.addLine("Host: sandbox");
     }
-    lines.add(kj::str("X-Sandstorm-Session-Id: ", sessionId));
+    lines.addLine("X-Sandstorm-Session-Id: ", sessionId);
     KJ_IF_MAYBE(addr, remoteAddress) {
-      lines.add(kj::str("X-Real-IP: ", *addr));
+      lines.addLine("X-Real-IP: ", *addr);
     }
     KJ_IF_MAYBE(i, apiInfo) {
-      lines.add(kj::str("X-Sandstorm-Api: ", i->getName()));
+      lines.addLine("X-Sandstorm-Api: ", i->getName());
+    }
+
+    return kj::heapString(lines.getLines());
+  }
+
+  HttpHeadBuilder startRequest(kj::StringPtr method, kj::StringPtr path, size_t bodySize = 0) {
+    // Start a request head, sized so that, typically, it and the body can be serialized without
+    // reallocating. Add request-specific headers, then call addCommonHeaders().
+
+    HttpHeadBuilder request(sessionHeaders.size() + rootPath.size() + path.size() + 1024 +
+                            bodySize);
+    request.addLine(method, " ", rootPath, path, " HTTP/1.1");
+    if (acceptLanguages.size() > 0) {
+      request.addLine("Accept-Language: ", acceptLanguages);
+    }
+    return request;
+  }
+
+  template <typename Content>
+  static void addContentHeaders(HttpHeadBuilder& request, Content content) {
+    request.addLine("Content-Type: ", content.getMimeType());
+    request.addLine("Content-Length: ", content.getContent().size());
+    if (content.hasEncoding()) {
+      request.addLine("Content-Encoding: ", content.getEncoding());
+    }
+  }
+
+  template <typename List, typename Func>
+  static void addListHeader(HttpHeadBuilder& request, kj::StringPtr name, List list,
+                            kj::StringPtr delimiter, Func&& addItem) {
+    request.add(name, ": ");
+    for (uint i: kj::indices(list)) {
+      if (i > 0) request.add(delimiter);
+      addItem(list[i]);
     }
+    request.endLine();
+  }
+
+  void addCommonHeaders(HttpHeadBuilder& request, WebSession::Context::Reader context) {
+    request.addLines(sessionHeaders);
 
     auto cookies = context.getCookies();
     if (cookies.size() > 0) {
-      lines.add(kj::str("Cookie: ", kj::strArray(
-            KJ_MAP(c, cookies) {
-              return kj::str(c.getKey(), "=", c.getValue());
-            }, "; ")));
+      addListHeader(request, "Cookie", cookies, "; ", [&](auto c) {
+        request.add(c.getKey(), "=", c.getValue());
+      });
     }
     auto acceptList = context.getAccept();
     if (acceptList.size() > 0) {
-      lines.add(kj::str("Accept: ", kj::strArray(
-            KJ_MAP(c, acceptList) {
-              if (c.getQValue() == 1.0) {
-                return kj::str(c.getMimeType());
-              } else {
-                return kj::str(c.getMimeType(), "; q=", c.getQValue());
-              }
-            }, ", ")));
+      addListHeader(request, "Accept", acceptList, ", ", [&](auto c) {
+        if (c.getQValue() == 1.0) {
+          request.add(c.getMimeType());
+        } else {
+          request.add(c.getMimeType(), "; q=", c.getQValue());
+        }
+      });
     } else {
-      lines.add(kj::str("Accept: */*"));
+      request.addLine("Accept: */*");
     }
     auto acceptEncodingList = context.getAcceptEncoding();
     if (acceptEncodingList.size() > 0) {
-      lines.add(kj::str("Accept-Encoding: ", kj::strArray(
-            KJ_MAP(c, acceptEncodingList) {
-              if (c.getQValue() == 1.0) {
-                return kj::str(c.getContentCoding());
-              } else {
-                return kj::str(c.getContentCoding(), "; q=", c.getQValue());
-              }
-            }, ", ")));
+      addListHeader(request, "Accept-Encoding", acceptEncodingList, ", ", [&](auto c) {
+        if (c.getQValue() == 1.0) {
+          request.add(c.getContentCoding());
+        } else {
+          request.add(c.getContentCoding(), "; q=", c.getQValue());
+        }
+      });
     }
     auto additionalHeaderList = context.getAdditionalHeaders();
     if (additionalHeaderList.size() > 0) {
@@ -1695,121 +2039,145 @@ private:
         // a WebSession capability to us, and that app could send whatever it wants, so we need
         // to check.
         if (REQUEST_HEADER_WHITELIST.matches(headerName)) {
-          // Note that we check elsewhere that each line contains no newlines, to prevent
+          // Note that endLine() checks that each line contains no newlines, to prevent
           // injections.
-          lines.add(kj::str(headerName, ": ", headerValue));
+          request.addLine(headerName, ": ", headerValue);
         }
       }
     }
+    auto addETag = [&](auto e) {
+      if (e.getWeak()) {
+        request.add("W/\"", e.getValue(), '"');
+      } else {
+        request.add('"', e.getValue(), '"');
+      }
+    };
     auto eTagPrecondition = context.getETagPrecondition();
     switch (eTagPrecondition.which()) {
       case WebSession::Context::ETagPrecondition::NONE:
         break;
       case WebSession::Context::ETagPrecondition::EXISTS:
-        lines.add(kj::str("If-Match: *"));
+        request.addLine("If-Match: *");
         break;
       case WebSession::Context::ETagPrecondition::DOESNT_EXIST:
-        lines.add(kj::str("If-None-Match: *"));
+        request.addLine("If-None-Match: *");
         break;
       case WebSession::Context::ETagPrecondition::MATCHES_ONE_OF:
-        lines.add(kj::str("If-Match: ", kj::strArray(
-              KJ_MAP(e, eTagPrecondition.getMatchesOneOf()) {
-                if (e.getWeak()) {
-                  return kj::str("W/\"", e.getValue(), '"');
-                } else {
-                  return kj::str('"', e.getValue(), '"');
-                }
-              }, ", ")));
+        addListHeader(request, "If-Match", eTagPrecondition.getMatchesOneOf(), ", ", addETag);
         break;
       case WebSession::Context::ETagPrecondition::MATCHES_NONE_OF:
-        lines.add(kj::str("If-None-Match: ", kj::strArray(
-              KJ_MAP(e, eTagPrecondition.getMatchesNoneOf()) {
-                if (e.getWeak()) {
-                  return kj::str("W/\"", e.getValue(), '"');
-                } else {
-                  return kj::str('"', e.getValue(), '"');
-                }
-              }, ", ")));
+        addListHeader(request, "If-None-Match", eTagPrecondition.getMatchesNoneOf(), ", ",
+                      addETag);
         break;
     }
-
-    lines.add(kj::str(""));
-    lines.add(kj::str(""));
   }
 
   template <typename Context>
-  kj::Promise<void> sendRequest(kj::Array<byte> httpRequest, Context& context) {
+  kj::Promise<void> sendRequest(HttpHeadBuilder&& httpRequest, kj::ArrayPtr<const byte> body,
+                                Context& context, bool isHeadRequest = false) {
+    // Note that `body` probably points into the params, so we must copy it before releasing them.
+    kj::ArrayPtr<const byte> httpRequestRef = httpRequest.finish(body);
     sandstorm::ByteStream::Client responseStream =
         context.getParams().getContext().getResponseStream();
     context.releaseParams();
-    return serverAddr.connect().then(
-        [KJ_MVCAP(httpRequest), responseStream, context]
-        (kj::Own<kj::AsyncIoStream>&& stream) mutable {
-      kj::ArrayPtr<const byte> httpRequestRef = httpRequest;
-      auto& streamRef = *stream;
-      return streamRef.write(httpRequestRef.begin(), httpRequestRef.size())
-          .attach(kj::mv(httpRequest))
-          .then([KJ_MVCAP(stream), responseStream, context]() mutable {
-        // Note:  Do not do stream->shutdownWrite() as some HTTP servers will decide to close the
-        // socket immediately on EOF, even if they have not actually responded to previous requests
-        // yet.
-        auto parser = kj::heap<HttpParser>(responseStream);
-        auto results = context.getResults();
-
-        return parser->readResponse(*stream).then(
-            [results, KJ_MVCAP(stream), KJ_MVCAP(parser)]
-            (kj::ArrayPtr<byte> remainder) mutable {
-          KJ_ASSERT(remainder.size() == 0);
-          parser->pumpStream(kj::mv(stream));
-          auto &parserRef = *parser;
-          sandstorm::Handle::Client handle = kj::mv(parser);
-          parserRef.build(results, handle);
-        });
-      });
-    });
+    auto parser = kj::heap<HttpParser>(responseStream, isHeadRequest);
+    parser->setResponseOrphanage(capnp::Orphanage::getForMessageContaining(context.getResults()));
+    auto& parserRef = *parser;
+    return sendAndReadResponse(httpRequestRef, parserRef)
+        .then([context, KJ_MVCAP(parser)](kj::Own<AppConnection>&& stream) mutable {
+      auto results = context.getResults();
+      parser->pumpStream(kj::mv(stream));
+      auto &parserRef = *parser;
+      sandstorm::Handle::Client handle = kj::mv(parser);
+      parserRef.build(results, handle);
+    }).attach(kj::mv(httpRequest));
   }
 
   template <typename Context>
-  kj::Promise<void> sendRequestStreaming(kj::String httpRequest, Context& context) {
+  kj::Promise<void> sendRequestStreaming(HttpHeadBuilder&& httpRequest, Context& context) {
     sandstorm::ByteStream::Client responseStream =
       context.getParams().getContext().getResponseStream();
     context.releaseParams();
-    return serverAddr.connect().then(
+    // We can't replay a streaming request if a reused connection turns out to be dead, so always
+    // start with a fresh connection. It still goes back to the pool when we're done with it.
+    return connectionPool.connectFresh().then(
         [KJ_MVCAP(httpRequest), responseStream, context]
-        (kj::Own<kj::AsyncIoStream>&& stream) mutable {
+        (kj::Own<AppConnection>&& stream) mutable {
       auto requestStream = kj::heap<RequestStreamImpl>(
           kj::mv(httpRequest), kj::mv(stream), responseStream);
       context.getResults().setStream(kj::mv(requestStream));
     });
   }
 
-  kj::Promise<void> sendOptionsRequest(kj::String httpRequest, OptionsContext& context) {
+  kj::Promise<void> sendOptionsRequest(HttpHeadBuilder&& httpRequest, OptionsContext& context) {
+    auto httpRequestRef = httpRequest.finish();
     context.releaseParams();
-    return serverAddr.connect().then(
-        [KJ_MVCAP(httpRequest), context]
-        (kj::Own<kj::AsyncIoStream>&& stream) mutable {
-      kj::StringPtr httpRequestRef = httpRequest;
-      auto& streamRef = *stream;
-      return streamRef.write(httpRequestRef.begin(), httpRequestRef.size())
-          .attach(kj::mv(httpRequest))
-          .then([KJ_MVCAP(stream), context]() mutable {
-        // Note:  Do not do stream->shutdownWrite() as some HTTP servers will decide to close the
-        // socket immediately on EOF, even if they have not actually responded to previous requests
-        // yet.
-        auto parser = kj::heap<HttpParser>(kj::heap<IgnoreStream>());
-
-        return parser->readResponse(*stream).then(
-            [context, KJ_MVCAP(stream), KJ_MVCAP(parser)]
-            (kj::ArrayPtr<byte> remainder) mutable {
-          KJ_ASSERT(remainder.size() == 0);
-          parser->pumpStream(kj::mv(stream));
-          auto &parserRef = *parser;
-          parserRef.buildOptions(context.getResults());
+    auto parser = kj::heap<HttpParser>(kj::heap<IgnoreStream>());
+    auto& parserRef = *parser;
+    return sendAndReadResponse(httpRequestRef, parserRef)
+        .then([context, KJ_MVCAP(parser)](kj::Own<AppConnection>&& stream) mutable {
+      parser->pumpStream(kj::mv(stream));
+      parser->buildOptions(context.getResults());
+    }).attach(kj::mv(httpRequest));
+  }
+
+  kj::Promise<kj::Own<AppConnection>> sendAndReadResponse(
+      kj::ArrayPtr<const byte> httpRequest, HttpParser& parser) {
+    // Send `httpRequest` on a pooled connection and read the response into `parser`, returning
+    // the connection for the parser to continue reading from (if streaming) or to release. The
+    // caller must keep `httpRequest` and `parser` alive until the returned promise resolves.
+
+    return connectionPool.connect().then(
+        [this, httpRequest, &parser](kj::Own<AppConnection>&& stream) {
+      return sendAndReadResponse(kj::mv(stream), httpRequest, parser);
+    });
+  }
+
+  kj::Promise<kj::Own<AppConnection>> sendAndReadResponse(
+      kj::Own<AppConnection> stream, kj::ArrayPtr<const byte> httpRequest, HttpParser& parser) {
+    auto& streamRef = *stream;
+    bool isReused = streamRef.isReused();
+
+    // Note:  Do not do stream->shutdownWrite() as some HTTP servers will decide to close the
+    // socket immediately on EOF, even if they have not actually responded to previous requests
+    // yet.
+    return streamRef.write(httpRequest.begin(), httpRequest.size())
+        .then([&streamRef, &parser]() {
+      streamRef.setRequestDone();
+      return parser.readResponse(streamRef);
+    }).then([KJ_MVCAP(stream)](kj::ArrayPtr<byte> remainder) mutable
+            -> kj::Promise<kj::Own<AppConnection>> {
+      KJ_ASSERT(remainder.size() == 0);
+      return kj::mv(stream);
+    }, [this, isReused, httpRequest, &parser](kj::Exception&& e)
+        -> kj::Promise<kj::Own<AppConnection>> {
+      if (isReused && e.getType() == kj::Exception::Type::DISCONNECTED &&
+          !parser.hasReceivedData() && isSafeToReplay(httpRequest)) {
+        // The app probably closed this keep-alive connection before it saw our request. Retry
+        // once on a new connection. We can't be sure the app didn't act on the request, though,
+        // so we only do this for methods which have no side effects.
+        return connectionPool.connectFresh().then(
+            [this, httpRequest, &parser](kj::Own<AppConnection>&& stream) {
+          return sendAndReadResponse(kj::mv(stream), httpRequest, parser);
         });
-      });
+      }
+      return kj::mv(e);
     });
   }
 
+  static bool isSafeToReplay(kj::ArrayPtr<const byte> httpRequest) {
+    // Returns true if the request's method is safe (RFC 7231 section 4.2.1, RFC 4918, RFC 3253),
+    // so that sending it to the app a second time cannot have any additional effect.
+
+    kj::ArrayPtr<const char> text = httpRequest.asChars();
+    for (kj::StringPtr method: {"GET ", "HEAD ", "OPTIONS ", "PROPFIND ", "REPORT "}) {
+      if (text.size() >= method.size() && text.slice(0, method.size()) == method.asArray()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   class IgnoreStream: public ByteStream::Server {
   protected:
     kj::Promise<void> write(WriteContext context) override { return kj::READY_NOW; }
@@ -1836,7 +2204,7 @@ private:
 };
 
 WebSession::Client newPowerboxApiSession(
-    kj::NetworkAddress& serverAddress, BridgeContext& bridgeContext,
+    AppConnectionPool& connectionPool, BridgeContext& bridgeContext,
     OwnCapnp<BridgeObjectId::HttpApi>&& httpApi) {
   // We need to fetch the user's profile information.
   //
@@ -1851,10 +2219,10 @@ WebSession::Client newPowerboxApiSession(
   auto pictureRequest = profileRequest.getProfile().getPicture().getUrlRequest().send();
 
   return profileRequest
-      .then([&serverAddress,&bridgeContext,KJ_MVCAP(httpApi),
+      .then([&connectionPool,&bridgeContext,KJ_MVCAP(httpApi),
              KJ_MVCAP(pictureRequest),KJ_MVCAP(identity)](
           capnp::Response<Identity::GetProfileResults> profileResponse) mutable {
-    return pictureRequest.then([&serverAddress,&bridgeContext,KJ_MVCAP(httpApi),
+    return pictureRequest.then([&connectionPool,&bridgeContext,KJ_MVCAP(httpApi),
                                 KJ_MVCAP(profileResponse),KJ_MVCAP(identity)](
         capnp::Response<StaticAsset::GetUrlResults> pictureResponse) mutable {
       auto profile = profileResponse.getProfile();
@@ -1870,7 +2238,7 @@ WebSession::Client newPowerboxApiSession(
       userInfo.setIdentity(kj::mv(identity));
 
       return WebSession::Client(
-          kj::heap<WebSessionImpl>(serverAddress, userInfo, nullptr,
+          kj::heap<WebSessionImpl>(connectionPool, userInfo, nullptr,
                                    bridgeContext, nullptr, nullptr,
                                    nullptr, nullptr, nullptr,
                                    kj::str(httpApi.getPath(), '/'),
@@ -2031,10 +2399,10 @@ private:
 
 class RequestSessionImpl final: public WebSession::Server {
 public:
-  RequestSessionImpl(kj::NetworkAddress& serverAddress, BridgeContext& bridgeContext,
+  RequestSessionImpl(AppConnectionPool& connectionPool, BridgeContext& bridgeContext,
                      SessionContext::Client sessionContext,
                      kj::Array<byte>&& identityId, kj::Array<bool>&& permissions)
-      : serverAddress(serverAddress),
+      : connectionPool(connectionPool),
         bridgeContext(bridgeContext),
         sessionContext(kj::mv(sessionContext)),
         identityId(kj::mv(identityId)),
@@ -2132,7 +2500,7 @@ public:
           httpApi.setPath(api.getPath());
           httpApi.setPermissions(api.getPermissions());
 
-          req.setCap(newPowerboxApiSession(serverAddress, bridgeContext,
+          req.setCap(newPowerboxApiSession(connectionPool, bridgeContext,
               newOwnCapnp(httpApi.asReader())));
 
           results.initNoContent();
@@ -2151,7 +2519,7 @@ public:
   }
 
 private:
-  kj::NetworkAddress& serverAddress;
+  AppConnectionPool& connectionPool;
   BridgeContext& bridgeContext;
   SessionContext::Client sessionContext;
   kj::Array<byte> identityId;
@@ -2204,11 +2572,11 @@ private:
 
 class UiViewImpl final: public MainView<BridgeObjectId>::Server {
 public:
-  explicit UiViewImpl(kj::NetworkAddress& serverAddress,
+  explicit UiViewImpl(AppConnectionPool& connectionPool,
                       BridgeContext& bridgeContext,
                       spk::BridgeConfig::Reader config,
                       kj::Promise<void>&& connectPromise)
-      : serverAddress(serverAddress),
+      : connectionPool(connectionPool),
         bridgeContext(bridgeContext),
         config(config),
         connectPromise(connectPromise.fork()) {}
@@ -2250,7 +2618,7 @@ public:
       auto sessionParams = params.getSessionParams().getAs<WebSession::Params>();
 
       UiSession::Client session =
-        kj::heap<WebSessionImpl>(serverAddress, userInfo, params.getContext(),
+        kj::heap<WebSessionImpl>(connectionPool, userInfo, params.getContext(),
                                  bridgeContext, kj::str(sessionIdCounter++),
                                  hexEncode(params.getTabId()),
                                  kj::heapString(sessionParams.getBasePath()),
@@ -2273,7 +2641,7 @@ public:
       }
 
       UiSession::Client session =
-        kj::heap<WebSessionImpl>(serverAddress, userInfo, params.getContext(),
+        kj::heap<WebSessionImpl>(connectionPool, userInfo, params.getContext(),
                                  bridgeContext, kj::str(sessionIdCounter++),
                                  hexEncode(params.getTabId()),
                                  kj::heapString(""), kj::heapString(""), kj::heapString(""),
@@ -2307,7 +2675,7 @@ public:
 
     UiSession::Client session =
         kj::heap<RequestSessionImpl>(
-            serverAddress, bridgeContext, params.getContext(),
+            connectionPool, bridgeContext, params.getContext(),
             kj::heapArray(userInfo.getIdentityId()), kj::mv(permissions));
 
     context.getResults(capnp::MessageSize {2, 1}).setSession(
@@ -2327,7 +2695,7 @@ public:
     KJ_REQUIRE(objectId.isHttpApi(), "unrecognized object ID type");
 
     context.getResults().setCap(
-        newPowerboxApiSession(serverAddress, bridgeContext, newOwnCapnp(objectId.getHttpApi())));
+        newPowerboxApiSession(connectionPool, bridgeContext, newOwnCapnp(objectId.getHttpApi())));
     return kj::READY_NOW;
   }
 
@@ -2379,7 +2747,7 @@ private:
     }
   }
 
-  kj::NetworkAddress& serverAddress;
+  AppConnectionPool& connectionPool;
   BridgeContext& bridgeContext;
   spk::BridgeConfig::Reader config;
 
@@ -2411,7 +2779,14 @@ public:
     return kj::MainBuilder(context, "Sandstorm version " SANDSTORM_VERSION,
                            "Acts as a Sandstorm init application.  Runs <command>, then tries to "
                            "connect to it as an HTTP server at the given address (typically, "
-                           "'127.0.0.1:<port>') in order to handle incoming requests.")
+                           "'127.0.0.1:<port>') in order to handle incoming requests.  If the "
+                           "bridge config specifies `appSocketPath`, connects to the app via that "
+                           "Unix socket instead, and <port> is ignored.")
+        .addOptionWithArg({"http-parser"}, KJ_BIND_METHOD(*this, setHttpParser), "<parser>",
+                          "Selects how responses from the app are parsed: 'avx2', 'sse2', or "
+                          "'scalar' for the built-in parser using that instruction set, "
+                          "'auto' for the fastest of those this CPU supports, or 'legacy' "
+                          "(the default) for the original byte-at-a-time parser.")
         .expectArg("<port>", KJ_BIND_METHOD(*this, setPort))
         .expectOneOrMoreArgs("<command>", KJ_BIND_METHOD(*this, addCommandArg))
         .callAfterParsing(KJ_BIND_METHOD(*this, run))
@@ -2428,6 +2803,30 @@ public:
     }).wait(ioContext.waitScope);
   }
 
+  kj::MainBuilder::Validity setHttpParser(kj::StringPtr name) {
+    if (name == "legacy") {
+      useSimdResponseParser = false;
+      return true;
+    } else if (name == "auto") {
+      useSimdResponseParser = true;
+      simdResponseParserIsa = SimdHttpParser::bestIsa();
+      return true;
+    }
+
+    for (auto isa: {SimdHttpParser::Isa::SCALAR, SimdHttpParser::Isa::SSE2,
+                    SimdHttpParser::Isa::AVX2}) {
+      if (name == SimdHttpParser::isaName(isa)) {
+        if (!SimdHttpParser::isSupported(isa)) {
+          return "this CPU doesn't support that instruction set";
+        }
+        useSimdResponseParser = true;
+        simdResponseParserIsa = isa;
+        return true;
+      }
+    }
+    return "unknown parser";
+  }
+
   kj::MainBuilder::Validity addCommandArg(kj::StringPtr arg) {
     command.add(kj::heapString(arg));
     return true;
@@ -2463,7 +2862,7 @@ public:
                                 int numTriesSoFar) {
     return address->connect().then([this, loggedSlowStartupMessage](auto x) -> void {
       if (loggedSlowStartupMessage) {
-        KJ_LOG(WARNING, "App successfully started listening for TCP connections!");
+        KJ_LOG(WARNING, "App successfully started listening for connections!");
       }
     }).catch_(
         [KJ_MVCAP(address), &timer, loggedSlowStartupMessage, numTriesSoFar, this]
@@ -2473,7 +2872,7 @@ public:
       }
       if (!loggedSlowStartupMessage && numTriesSoFar == (30 * 100)) {
         // After 30 seconds (30 * 100 centiseconds) of failure, log a message once.
-        KJ_LOG(WARNING, "App isn't listening for TCP connections after 30 seconds. Continuing "
+        KJ_LOG(WARNING, "App isn't listening for connections after 30 seconds. Continuing "
                "to attempt to connect",
                address->toString());
         loggedSlowStartupMessage = true;
@@ -2488,6 +2887,93 @@ public:
     });
   }
 
+  kj::Promise<void> waitForSocket(kj::StringPtr path) {
+    // Wait for a file to appear at `path`, which the app will create when it binds its listen
+    // socket. We watch the parent directory with inotify rather than polling connect().
+    //
+    // If we can't watch the parent directory (e.g. because the app hasn't created it yet), or we
+    // lose track of events, we log why and return early, leaving it to connectLoop() to poll. If
+    // the socket takes a long time to appear, we log that too, and keep waiting.
+
+    KJ_IF_MAYBE(slashPos, path.findLast('/')) {
+      auto dir = *slashPos == 0 ? kj::heapString("/") : kj::heapString(path.slice(0, *slashPos));
+      auto name = kj::heapString(path.slice(*slashPos + 1));
+
+      int fd;
+      KJ_SYSCALL(fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+      kj::AutoCloseFd inotifyFd(fd);
+
+      if (inotify_add_watch(inotifyFd, dir.cStr(), IN_CREATE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+        int error = errno;
+        KJ_LOG(WARNING, "Can't watch for the app's socket to appear; polling instead",
+               path, strerror(error));
+        return kj::READY_NOW;
+      }
+
+      // Check for the socket only after adding the watch, so that we can't miss its creation.
+      if (access(path.cStr(), F_OK) == 0) {
+        return kj::READY_NOW;
+      }
+
+      auto observer = kj::heap<kj::UnixEventPort::FdObserver>(ioContext.unixEventPort, inotifyFd,
+          kj::UnixEventPort::FdObserver::OBSERVE_READ);
+      auto socketPath = kj::heapString(path);
+      auto promise = waitForSocketLoop(*observer, inotifyFd, socketPath, name);
+
+      auto slowWarning = ioContext.provider->getTimer().afterDelay(30 * kj::SECONDS)
+          .then([path = kj::StringPtr(socketPath)]() -> kj::Promise<void> {
+        KJ_LOG(WARNING, "App hasn't created its socket after 30 seconds. Continuing to wait",
+               path);
+        return kj::NEVER_DONE;
+      });
+
+      return promise.exclusiveJoin(kj::mv(slowWarning))
+          .attach(kj::mv(observer))
+          .attach(kj::mv(inotifyFd), kj::mv(socketPath), kj::mv(name));
+    } else {
+      KJ_FAIL_REQUIRE("appSocketPath must be an absolute path", path);
+    }
+  }
+
+  kj::Promise<void> waitForSocketLoop(kj::UnixEventPort::FdObserver& observer,
+                                      int inotifyFd, kj::StringPtr path, kj::StringPtr name) {
+    return observer.whenBecomesReadable().then(
+        [this, &observer, inotifyFd, path, name]() -> kj::Promise<void> {
+      alignas(struct inotify_event) kj::byte buffer[4096];
+
+      for (;;) {
+        ssize_t n;
+        KJ_NONBLOCKING_SYSCALL(n = read(inotifyFd, buffer, sizeof(buffer)));
+
+        if (n < 0) {
+          // EAGAIN; try again later.
+          return waitForSocketLoop(observer, inotifyFd, path, name);
+        }
+
+        KJ_ASSERT(n > 0, "inotify EOF?");
+
+        kj::byte* pos = buffer;
+        while (n > 0) {
+          auto event = reinterpret_cast<struct inotify_event*>(pos);
+          size_t eventSize = sizeof(struct inotify_event) + event->len;
+          KJ_ASSERT(eventSize <= n, "inotify returned partial event?");
+          n -= eventSize;
+          pos += eventSize;
+
+          if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED)) {
+            // Lost track of the directory; fall back to polling.
+            KJ_LOG(WARNING, "Lost track of the app's socket directory; polling instead", path);
+            return kj::READY_NOW;
+          }
+
+          if (event->len > 0 && name == event->name) {
+            return kj::READY_NOW;
+          }
+        }
+      }
+    });
+  }
+
   class ErrorHandlerImpl: public kj::TaskSet::ErrorHandler {
   public:
     void taskFailed(kj::Exception&& exception) override {
@@ -2502,6 +2988,24 @@ public:
     KJ_SYSCALL(setenv("http_proxy", proxyEnv.cStr(), true));
     KJ_SYSCALL(setenv("HTTP_PROXY", proxyEnv.cStr(), true));
 
+    // We potentially re-traverse the BridgeConfig on every request, so make sure to max out the
+    // traversal limit.
+    capnp::ReaderOptions options;
+    options.traversalLimitInWords = kj::maxValue;
+    capnp::StreamFdMessageReader reader(
+        raiiOpen("/sandstorm-http-bridge-config", O_RDONLY), options);
+    auto config = reader.getRoot<spk::BridgeConfig>();
+
+    if (config.hasAppSocketPath()) {
+      // Talk to the app over a Unix socket instead of TCP. Clear any stale socket left over from
+      // a previous run before starting the app, so that we don't mistake it for the app's.
+      auto socketPath = config.getAppSocketPath();
+      KJ_REQUIRE(socketPath.startsWith("/"), "appSocketPath must be an absolute path", socketPath);
+      unlink(socketPath.cStr());
+      address = ioContext.provider->getNetwork()
+          .parseAddress(kj::str("unix:", socketPath)).wait(ioContext.waitScope);
+    }
+
     pid_t child;
     KJ_SYSCALL(child = fork());
     if (child == 0) {
@@ -2544,26 +3048,26 @@ public:
             "** HTTP-BRIDGE: Uncaught exception waiting for child process:\n", e));
       });
 
-      auto connectPromise =
-        connectLoop(address->clone(), ioContext.provider->getTimer(), false, 0);
-
-      // We potentially re-traverse the BridgeConfig on every request, so make sure to max out the
-      // traversal limit.
-      capnp::ReaderOptions options;
-      options.traversalLimitInWords = kj::maxValue;
-      capnp::StreamFdMessageReader reader(
-          raiiOpen("/sandstorm-http-bridge-config", O_RDONLY), options);
-      auto config = reader.getRoot<spk::BridgeConfig>();
+      kj::Promise<void> connectPromise = nullptr;
+      if (config.hasAppSocketPath()) {
+        connectPromise = waitForSocket(config.getAppSocketPath())
+            .then([this]() {
+          return connectLoop(address->clone(), ioContext.provider->getTimer(), false, 0);
+        });
+      } else {
+        connectPromise = connectLoop(address->clone(), ioContext.provider->getTimer(), false, 0);
+      }
 
       auto apiPaf = kj::newPromiseAndFulfiller<SandstormApi<BridgeObjectId>::Client>();
       BridgeContext bridgeContext(kj::mv(apiPaf.promise), config);
+      AppConnectionPool connectionPool(*address, ioContext.provider->getTimer());
 
       // Set up the Supervisor API socket.
       auto stream = ioContext.lowLevelProvider->wrapSocketFd(3);
       capnp::TwoPartyVatNetwork network(*stream, capnp::rpc::twoparty::Side::CLIENT);
       auto rpcSystem = capnp::makeRpcServer(
         network,
-        kj::heap<UiViewImpl>(*address, bridgeContext, config, kj::mv(connectPromise)));
+        kj::heap<UiViewImpl>(connectionPool, bridgeContext, config, kj::mv(connectPromise)));
 
       // Get the SandstormApi by restoring a null SturdyRef.
       capnp::MallocMessageBuilder message;
@@ -0,0 +1,80 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "seccomp-filter.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+namespace sandstorm {
+namespace {
+
+bool sameProgram(kj::ArrayPtr<const sock_filter> a, kj::ArrayPtr<const sock_filter> b) {
+  return a.size() == b.size() && memcmp(a.begin(), b.begin(), a.size() * sizeof(a[0])) == 0;
+}
+
+KJ_TEST("seccomp filter compiles deterministically") {
+  for (bool devmode: {false, true}) {
+    auto program = compileSeccompFilter(devmode);
+    KJ_EXPECT(program.size() > 0);
+    KJ_EXPECT(sameProgram(program, compileSeccompFilter(devmode)));
+  }
+
+  KJ_EXPECT(!sameProgram(compileSeccompFilter(false), compileSeccompFilter(true)));
+}
+
+KJ_TEST("cached seccomp filter is identical to libseccomp's output") {
+  for (bool devmode: {false, true}) {
+    auto cached = getSeccompFilter(devmode);
+    KJ_EXPECT(sameProgram(cached, compileSeccompFilter(devmode)), devmode);
+
+    // Compiled only once.
+    KJ_EXPECT(getSeccompFilter(devmode).begin() == cached.begin());
+  }
+}
+
+KJ_TEST("loaded seccomp filter blocks syscalls") {
+  auto program = getSeccompFilter(false);
+
+  pid_t pid;
+  KJ_SYSCALL(pid = fork());
+  if (pid == 0) {
+    loadSeccompFilter(program);
+
+    // Each of these is refused by the filter with a specific errno; see compileSeccompFilter().
+    bool ok = true;
+    ok = ok && syscall(SYS_unshare, 0) < 0 && errno == ENOSYS;
+    ok = ok && syscall(SYS_ptrace, PTRACE_PEEKDATA, getppid(), 0, 0) < 0 && errno == EPERM;
+    ok = ok && socket(AF_KEY, SOCK_RAW, 0) < 0 && errno == EAFNOSUPPORT;
+
+    // Ordinary calls still work.
+    ok = ok && getpid() > 0;
+    _exit(ok ? 0 : 1);
+  }
+
+  int status;
+  KJ_SYSCALL(waitpid(pid, &status, 0));
+  KJ_EXPECT(WIFEXITED(status) && WEXITSTATUS(status) == 0, status);
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,231 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "seccomp-filter.h"
+#include <kj/debug.h>
+#include <kj/io.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <linux/seccomp.h>
+
+// We need to define these constants before libseccomp has a chance to inject bogus
+// values for them. See https://github.com/seccomp/libseccomp/issues/27
+#ifndef __NR_seccomp
+#define __NR_seccomp 317
+#endif
+#ifndef __NR_bpf
+#define __NR_bpf 321
+#endif
+#ifndef __NR_userfaultfd
+#define __NR_userfaultfd 323
+#endif
+#include <seccomp.h>
+
+#include "util.h"
+
+namespace sandstorm {
+
+#define CHECK_SECCOMP(call)                   \
+  do {                                        \
+    if (auto result = (call)) {               \
+      KJ_FAIL_SYSCALL(#call, -result);        \
+    }                                         \
+  } while (0)
+
+kj::Array<sock_filter> compileSeccompFilter(bool devmode, bool dumpPfc) {
+  // Build a rudimentary seccomp blacklist.
+  // TODO(security): Change this to a whitelist.
+
+  scmp_filter_ctx ctx = seccomp_init(SCMP_ACT_ALLOW);
+  if (ctx == nullptr)
+    KJ_FAIL_SYSCALL("seccomp_init", 0);  // No real error code
+  KJ_DEFER(seccomp_release(ctx));
+
+  // Native code only for now, so there are no seccomp_arch_add calls.
+
+  // Redundant, but this is standard and harmless.
+  CHECK_SECCOMP(seccomp_attr_set(ctx, SCMP_FLTATR_CTL_NNP, 1));
+
+  // It's easy to inadvertently issue an x32 syscall (e.g. syscall(-1)).  Such syscalls
+  // should fail, but there's no need to kill the issuer.
+  CHECK_SECCOMP(seccomp_attr_set(ctx, SCMP_FLTATR_ACT_BADARCH, SCMP_ACT_ERRNO(ENOSYS)));
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"  // SCMP_* macros produce these
+  // Disable some things that seem scary.
+  if (!devmode) {
+    // ptrace is scary
+    CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(ptrace), 0));
+  } else {
+    // Try to be somewhat safe with ptrace in dev mode.  Note that the ability to modify
+    // orig_ax using ptrace allows a complete seccomp bypass.
+    CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(ptrace), 1,
+      SCMP_A0(SCMP_CMP_EQ, PTRACE_POKEUSER)));
+    CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(ptrace), 1,
+      SCMP_A0(SCMP_CMP_EQ, PTRACE_SETREGS)));
+    CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(ptrace), 1,
+      SCMP_A0(SCMP_CMP_EQ, PTRACE_SETFPREGS)));
+    CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(ptrace), 1,
+      SCMP_A0(SCMP_CMP_EQ, PTRACE_SETREGSET)));
+  }
+
+  // Restrict the set of allowable network protocol families
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_GE, AF_NETLINK + 1)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_AX25)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_IPX)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_APPLETALK)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_NETROM)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_BRIDGE)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_ATMPVC)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_X25)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_ROSE)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_DECnet)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_NETBEUI)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_SECURITY)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
+     SCMP_A0(SCMP_CMP_EQ, AF_KEY)));
+
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(add_key), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(request_key), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(keyctl), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(syslog), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(uselib), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(personality), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(acct), 0));
+
+  // 16-bit code is unnecessary in the sandbox, and modify_ldt is a historic source
+  // of interesting information leaks.
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(modify_ldt), 0));
+
+  // Despite existing at a 64-bit syscall, set_thread_area is only useful
+  // for 32-bit programs.  64-bit programs use arch_prctl instead.
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(set_thread_area), 0));
+
+  // Disable namespaces. Nested sandboxing could be useful but the attack surface is large.
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(unshare), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(mount), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(pivot_root), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(quotactl), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(clone), 1,
+      SCMP_A0(SCMP_CMP_MASKED_EQ, CLONE_NEWUSER, CLONE_NEWUSER)));
+
+  // AIO is scary.
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(io_setup), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(io_destroy), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(io_getevents), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(io_submit), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(io_cancel), 0));
+
+  // Scary vm syscalls
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(remap_file_pages), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(mbind), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(get_mempolicy), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(set_mempolicy), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(migrate_pages), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(move_pages), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(vmsplice), 0));
+
+  // Scary futex operations
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(set_robust_list), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(get_robust_list), 0));
+
+  // Utterly terrifying profiling operations
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(perf_event_open), 0));
+
+  // Don't let apps specify their own seccomp filters, since seccomp filters are literally programs
+  // that run in-kernel (albeit with a very limited instruction set).
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EINVAL), SCMP_SYS(prctl), 1,
+      SCMP_A0(SCMP_CMP_EQ, PR_SET_SECCOMP)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(seccomp), 0));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(bpf), 0));
+
+  // New syscalls that don't seem useful to Sandstorm apps therefore we will disallow them.
+  // TODO(cleanup): Can we somehow specify "disallow all calls greater than N" to preemptively
+  //   disable things until we've reviewed them?
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(userfaultfd), 0));
+
+  // TOOD(someday): See if we can get away with turning off mincore, madvise, sysinfo etc.
+
+  // TODO(someday): Turn off POSIX message queues and other such esoteric features.
+
+#pragma GCC diagnostic pop
+
+  if (dumpPfc) {
+    seccomp_export_pfc(ctx, 1);
+  }
+
+  // libseccomp can only export to a file descriptor, so go through a pipe. The program is a few
+  // kilobytes, well within the pipe buffer; the write end is non-blocking so that if that ever
+  // changes we fail rather than deadlock.
+  int fds[2];
+  KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+  kj::AutoCloseFd readEnd(fds[0]);
+  kj::AutoCloseFd writeEnd(fds[1]);
+  KJ_SYSCALL(fcntl(writeEnd, F_SETFL, O_NONBLOCK));
+  CHECK_SECCOMP(seccomp_export_bpf(ctx, writeEnd));
+  writeEnd = nullptr;
+
+  auto bytes = readAllBytes(readEnd);
+  KJ_ASSERT(bytes.size() > 0 && bytes.size() % sizeof(sock_filter) == 0,
+            "libseccomp exported a malformed BPF program", bytes.size());
+  auto result = kj::heapArray<sock_filter>(bytes.size() / sizeof(sock_filter));
+  memcpy(result.begin(), bytes.begin(), bytes.size());
+  return result;
+}
+
+#undef CHECK_SECCOMP
+
+kj::ArrayPtr<const sock_filter> getSeccompFilter(bool devmode) {
+  // Initialization of function-local statics is thread-safe, and is retried if it throws.
+  if (devmode) {
+    static const kj::Array<sock_filter> program = compileSeccompFilter(true);
+    return program;
+  } else {
+    static const kj::Array<sock_filter> program = compileSeccompFilter(false);
+    return program;
+  }
+}
+
+void loadSeccompFilter(kj::ArrayPtr<const sock_filter> program) {
+  KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+
+  struct sock_fprog fprog;
+  memset(&fprog, 0, sizeof(fprog));
+  fprog.len = program.size();
+  fprog.filter = const_cast<sock_filter*>(program.begin());
+  KJ_SYSCALL(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &fprog, 0, 0));
+}
+
+}  // namespace sandstorm
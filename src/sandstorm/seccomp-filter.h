@@ -0,0 +1,40 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_SECCOMP_FILTER_H_
+#define SANDSTORM_SECCOMP_FILTER_H_
+
+#include <kj/array.h>
+#include <linux/filter.h>
+
+namespace sandstorm {
+
+kj::Array<sock_filter> compileSeccompFilter(bool devmode, bool dumpPfc = false);
+// Runs the grain sandbox's seccomp rules through libseccomp and returns the resulting BPF
+// program. `devmode` loosens a few rules for debugging. If `dumpPfc` is true, libseccomp's
+// human-readable rendition is also written to stdout.
+
+kj::ArrayPtr<const sock_filter> getSeccompFilter(bool devmode);
+// Returns compileSeccompFilter(devmode), compiling it only the first time each mode is requested
+// in this process. The program lives until the process exits. Thread-safe.
+
+void loadSeccompFilter(kj::ArrayPtr<const sock_filter> program);
+// Installs `program` as a seccomp filter on the calling thread, setting no_new_privs first as
+// libseccomp would.
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_SECCOMP_FILTER_H_
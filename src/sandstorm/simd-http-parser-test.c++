@@ -0,0 +1,319 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "simd-http-parser.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <string.h>
+#include <algorithm>
+
+namespace sandstorm {
+namespace {
+
+// =======================================================================================
+// Event log
+//
+// Every callback is recorded into a string, so that two parsers can be compared simply by
+// comparing their logs.
+
+struct EventLog {
+  kj::Vector<char> text;
+  int lastDataType = -1;
+  bool skipBody = false;
+  bool pauseAtEnd = true;
+
+  void add(kj::StringPtr s) {
+    text.addAll(s.begin(), s.end());
+  }
+  void note(kj::StringPtr what) {
+    add("|");
+    add(what);
+    lastDataType = -1;
+  }
+  void data(int type, const char* at, size_t length) {
+    if (lastDataType != type) {
+      // Consecutive data callbacks of the same type are merged, since the two parsers are allowed
+      // to split values differently.
+      add(kj::str("|", type, ":"));
+      lastDataType = type;
+    }
+    text.addAll(at, at + length);
+  }
+};
+
+EventLog& logFor(http_parser* parser) { return *reinterpret_cast<EventLog*>(parser->data); }
+
+int onMessageBegin(http_parser* p) { logFor(p).note("begin"); return 0; }
+int onStatus(http_parser* p, const char* at, size_t n) { logFor(p).data(1, at, n); return 0; }
+int onHeaderField(http_parser* p, const char* at, size_t n) { logFor(p).data(2, at, n); return 0; }
+int onHeaderValue(http_parser* p, const char* at, size_t n) { logFor(p).data(3, at, n); return 0; }
+int onBody(http_parser* p, const char* at, size_t n) { logFor(p).data(4, at, n); return 0; }
+int onHeadersComplete(http_parser* p) {
+  // (Bitfields must be copied out before they can be passed to kj::str().)
+  uint status = p->status_code, flags = p->flags, upgrade = p->upgrade;
+  logFor(p).note(kj::str("headers ", status, ' ', p->http_major, '.', p->http_minor,
+                         " flags=", flags, " length=", p->content_length, " upgrade=", upgrade));
+  return logFor(p).skipBody ? 1 : 0;
+}
+int onMessageComplete(http_parser* p) {
+  logFor(p).note("complete");
+  if (logFor(p).pauseAtEnd) http_parser_pause(p, 1);
+  return 0;
+}
+
+http_parser_settings makeSettings() {
+  http_parser_settings settings;
+  memset(&settings, 0, sizeof(settings));
+  settings.on_message_begin = &onMessageBegin;
+  settings.on_status = &onStatus;
+  settings.on_header_field = &onHeaderField;
+  settings.on_header_value = &onHeaderValue;
+  settings.on_headers_complete = &onHeadersComplete;
+  settings.on_body = &onBody;
+  settings.on_message_complete = &onMessageComplete;
+  return settings;
+}
+
+struct Options {
+  kj::ArrayPtr<const size_t> cuts;
+  // Offsets at which to split the input into separate calls to execute().
+
+  bool skipBody = false;
+  bool pauseAtEnd = true;
+};
+
+kj::String run(kj::Maybe<SimdHttpParser::Isa> isa, kj::StringPtr input, Options options,
+               bool* fellBack = nullptr) {
+  // Feeds `input` to either http_parser_execute() (if `isa` is null) or SimdHttpParser, then
+  // signals EOF, and returns the event log.
+
+  auto settings = makeSettings();
+  EventLog log;
+  log.skipBody = options.skipBody;
+  log.pauseAtEnd = options.pauseAtEnd;
+
+  http_parser parser;
+  http_parser_init(&parser, HTTP_RESPONSE);
+  parser.data = &log;
+
+  kj::Maybe<SimdHttpParser> simd;
+  KJ_IF_MAYBE(i, isa) {
+    simd = SimdHttpParser(*i);
+  }
+
+  auto execute = [&](const char* data, size_t len) -> size_t {
+    KJ_IF_MAYBE(s, simd) {
+      return s->execute(parser, settings, data, len);
+    } else {
+      return http_parser_execute(&parser, &settings, data, len);
+    }
+  };
+
+  size_t consumed = 0;
+  size_t prev = 0;
+  bool stopped = false;
+  for (size_t i = 0; i <= options.cuts.size(); i++) {
+    size_t cut = i < options.cuts.size() ? options.cuts[i] : input.size();
+    size_t n = execute(input.begin() + prev, cut - prev);
+    consumed += n;
+    if (n != cut - prev) {
+      stopped = true;
+      break;
+    }
+    prev = cut;
+  }
+
+  bool ok = parser.http_errno == HPE_OK || parser.http_errno == HPE_PAUSED;
+  if (!stopped) {
+    size_t n = execute(nullptr, 0);
+    ok = parser.http_errno == HPE_OK || parser.http_errno == HPE_PAUSED;
+    if (ok) log.note(kj::str("eof ", n));
+  }
+
+  KJ_IF_MAYBE(s, simd) {
+    if (fellBack != nullptr) *fellBack = s->isFallingBack();
+  }
+
+  auto result = kj::str("|error=", http_errno_name(static_cast<http_errno>(parser.http_errno)),
+                        " keepAlive=", http_should_keep_alive(&parser));
+  if (ok) {
+    log.add(result);
+    log.add(kj::str("|consumed=", consumed));
+  } else if (options.cuts.size() > 0) {
+    // When an invalid head arrives in pieces, SimdHttpParser buffers it and hands it to
+    // http_parser all at once, so the callbacks made before the error is noticed can differ.
+    // Only the error itself must match.
+    return result;
+  } else {
+    log.add(result);
+  }
+  return kj::heapString(log.text.begin(), log.text.size());
+}
+
+kj::Array<SimdHttpParser::Isa> supportedIsas() {
+  kj::Vector<SimdHttpParser::Isa> result;
+  for (auto isa: {SimdHttpParser::Isa::SCALAR, SimdHttpParser::Isa::SSE2,
+                  SimdHttpParser::Isa::AVX2}) {
+    if (SimdHttpParser::isSupported(isa)) result.add(isa);
+  }
+  return result.releaseAsArray();
+}
+
+void expectSame(kj::StringPtr input, Options options = Options()) {
+  auto expected = run(nullptr, input, options);
+  for (auto isa: supportedIsas()) {
+    auto actual = run(isa, input, options);
+    KJ_EXPECT(actual == expected, SimdHttpParser::isaName(isa), input, expected, actual);
+  }
+}
+
+// =======================================================================================
+
+const char* const SAMPLES[] = {
+  "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: 11\r\n"
+  "Set-Cookie: a=b; Path=/\r\n\r\nhello world",
+
+  "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nConnection: keep-alive\r\n\r\n"
+  "5\r\nhello\r\n6;ext=1\r\n world\r\n0\r\n\r\n",
+
+  "HTTP/1.1 200 OK\r\nTransfer-Encoding: CHUNKED  \r\n\r\n3\r\nabc\r\n0\r\nX-Trailer: yes\r\n\r\n",
+
+  "HTTP/1.0 200 OK\r\nConnection: Keep-Alive\r\nContent-Length: 3\r\n\r\n"
+  "abcHTTP/1.1 204 No Content\r\n\r\n",
+
+  "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+  "Sec-WebSocket-Accept: xyz\r\n\r\n\x81\x05hello",
+
+  "HTTP/1.1 304 Not Modified\r\nETag: \"abc\"\r\n\r\n",
+
+  "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\nbody until eof\n\nmore",
+
+  "HTTP/1.1 404  Not  Found \r\nContent-Length: 1 2\r\nX-Empty:\r\nX-Spaces: \t  v \r\n\r\n"
+  "012345678901",
+
+  "HTTP/1.1 200\r\nConnection: close\r\nContent-Length:0\r\n\r\n\r\n\r\n",
+
+  "\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nokHTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\nx",
+
+  "HTTP/1.1 200 OK\nContent-Length: 2\n\nok",
+
+  "HTTP/1.1 200 OK\r\nX-Folded: a\r\n  b\r\nContent-Length: 0\r\n\r\n",
+
+  "HTTP/1.1 200 OK\r\nProxy-Connection: close\r\nUpgrade:\r\n\r\nrest",
+
+  "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 5\r\n\r\nerror",
+
+  "HTTP/1.1 200 OK\r\n"
+  "Content-Security-Policy: default-src 'self'; script-src 'self' 'unsafe-inline'; "
+  "style-src 'self' 'unsafe-inline'; img-src 'self' data: blob:; connect-src 'self' wss:\r\n"
+  "Transfer-Encoding: chunked\r\n\r\n"
+  "40;name=a-rather-long-chunk-extension-value\r\n"
+  "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\r\n0\r\n\r\n",
+};
+
+KJ_TEST("SimdHttpParser matches http_parser on sample responses") {
+  for (kj::StringPtr sample: SAMPLES) {
+    expectSame(sample);
+
+    // Also split at every possible point.
+    for (size_t cut = 0; cut <= sample.size(); cut++) {
+      size_t cuts[] = { cut };
+      Options options;
+      options.cuts = cuts;
+      expectSame(sample, options);
+    }
+  }
+}
+
+KJ_TEST("SimdHttpParser parses well-formed responses without falling back") {
+  for (auto isa: supportedIsas()) {
+    for (uint i: {0, 1, 3, 4, 5, 13, 14}) {
+      bool fellBack = true;
+      run(isa, SAMPLES[i], Options(), &fellBack);
+      KJ_EXPECT(!fellBack, SimdHttpParser::isaName(isa), SAMPLES[i]);
+    }
+
+    // Bare LF line endings and folded headers go to http_parser.
+    for (uint i: {10, 11}) {
+      bool fellBack = false;
+      run(isa, SAMPLES[i], Options(), &fellBack);
+      KJ_EXPECT(fellBack, SimdHttpParser::isaName(isa), SAMPLES[i]);
+    }
+  }
+}
+
+KJ_TEST("SimdHttpParser fuzz against http_parser") {
+  // Mutates the samples randomly and splits them at random points, and checks that every
+  // SimdHttpParser variant produces exactly the same callbacks as http_parser.
+
+  static constexpr uint ITERATIONS = 20000;
+  static const char ALPHABET[] = "\r\n :;\t0123456789abcdefHTTP/.-xX\x80";
+
+  uint64_t seed = 0x5eed5eed12345678ull;
+  auto random = [&]() -> uint64_t {
+    // xorshift64*
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 0x2545f4914f6cdd1dull;
+  };
+
+  for (uint iteration = 0; iteration < ITERATIONS; iteration++) {
+    kj::StringPtr sample = SAMPLES[random() % kj::size(SAMPLES)];
+    kj::Vector<char> input;
+    input.addAll(sample.begin(), sample.end());
+
+    uint mutations = random() % 4;
+    for (uint m = 0; m < mutations && input.size() > 0; m++) {
+      size_t at = random() % input.size();
+      char c = ALPHABET[random() % (sizeof(ALPHABET) - 1)];
+      switch (random() % 4) {
+        case 0:
+          input[at] = c;
+          break;
+        case 1:
+          input.add(0);
+          memmove(input.begin() + at + 1, input.begin() + at, input.size() - at - 1);
+          input[at] = c;
+          break;
+        case 2:
+          memmove(input.begin() + at, input.begin() + at + 1, input.size() - at - 1);
+          input.removeLast();
+          break;
+        case 3:
+          input.resize(at);
+          break;
+      }
+    }
+    auto text = kj::heapString(input.begin(), input.size());
+
+    size_t cuts[3];
+    uint cutCount = random() % 4;
+    for (uint i = 0; i < cutCount; i++) {
+      cuts[i] = random() % (text.size() + 1);
+    }
+    std::sort(cuts, cuts + cutCount);
+
+    Options options;
+    options.cuts = kj::arrayPtr(cuts, cutCount);
+    options.skipBody = random() % 5 == 0;
+    options.pauseAtEnd = random() % 3 != 0;
+    expectSame(text, options);
+  }
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,838 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "simd-http-parser.h"
+#include <kj/debug.h>
+#include <string.h>
+#include <limits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SANDSTORM_SIMD_HTTP_X86 1
+#else
+#define SANDSTORM_SIMD_HTTP_X86 0
+#endif
+
+namespace sandstorm {
+
+// =======================================================================================
+// Scanning
+
+static const char* findScalar(const char* begin, const char* end, char a, char b, char c) {
+  for (const char* p = begin; p < end; ++p) {
+    char ch = *p;
+    if (ch == a || ch == b || ch == c) return p;
+  }
+  return end;
+}
+
+#if SANDSTORM_SIMD_HTTP_X86
+
+__attribute__((target("sse2")))
+static const char* findSse2(const char* begin, const char* end, char a, char b, char c) {
+  __m128i va = _mm_set1_epi8(a);
+  __m128i vb = _mm_set1_epi8(b);
+  __m128i vc = _mm_set1_epi8(c);
+
+  const char* p = begin;
+  while (end - p >= 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, va),
+                                             _mm_cmpeq_epi8(block, vb)),
+                                _mm_cmpeq_epi8(block, vc));
+    uint mask = _mm_movemask_epi8(hits);
+    if (mask != 0) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return findScalar(p, end, a, b, c);
+}
+
+__attribute__((target("avx2")))
+static const char* findAvx2(const char* begin, const char* end, char a, char b, char c) {
+  __m256i va = _mm256_set1_epi8(a);
+  __m256i vb = _mm256_set1_epi8(b);
+  __m256i vc = _mm256_set1_epi8(c);
+
+  const char* p = begin;
+  while (end - p >= 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, va),
+                                                   _mm256_cmpeq_epi8(block, vb)),
+                                   _mm256_cmpeq_epi8(block, vc));
+    uint mask = _mm256_movemask_epi8(hits);
+    if (mask != 0) return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return findSse2(p, end, a, b, c);
+}
+
+#endif  // SANDSTORM_SIMD_HTTP_X86
+
+// =======================================================================================
+// Character classes, matching http_parser's.
+
+static inline bool isToken(char c) {
+  // RFC 2616 token characters, as in http_parser's `tokens` table.
+
+  switch (c) {
+    case '(': case ')': case '<': case '>': case '@': case ',': case ';': case ':':
+    case '\\': case '"': case '/': case '[': case ']': case '?': case '=': case '{': case '}':
+      return false;
+    default:
+      return c > 0x20 && c < 0x7f;
+  }
+}
+
+static inline bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static inline int unhex(char c) {
+  // Note that http_parser's `unhex` table only has entries for ASCII, so it reads bytes >= 0x80 as
+  // the digit zero. We do the same, so that both parsers frame bodies identically.
+
+  if (static_cast<unsigned char>(c) >= 0x80) return 0;
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static bool parseDecimal(const char*& p, const char* end, uint& result) {
+  // Parses a version number or status code. Like http_parser, we don't allow more than 999.
+
+  if (p == end || !isDigit(*p)) return false;
+  result = 0;
+  while (p < end && isDigit(*p)) {
+    result = result * 10 + (*p++ - '0');
+    if (result > 999) return false;
+  }
+  return true;
+}
+
+static bool nameIs(const char* name, size_t size, kj::StringPtr lowercase) {
+  // Case-insensitive comparison of a header name, which we've already checked contains only token
+  // characters.
+
+  if (size != lowercase.size()) return false;
+  for (size_t i = 0; i < size; i++) {
+    char c = name[i];
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    if (c != lowercase[i]) return false;
+  }
+  return true;
+}
+
+static bool valueIs(const char* value, size_t size, kj::StringPtr lowercase) {
+  // Does the header value consist of `lowercase`, in any case, followed only by spaces? This is
+  // exactly what http_parser recognizes as e.g. "Connection: close".
+
+  if (size < lowercase.size()) return false;
+  for (size_t i = 0; i < lowercase.size(); i++) {
+    if ((value[i] | 0x20) != lowercase[i]) return false;
+  }
+  for (size_t i = lowercase.size(); i < size; i++) {
+    if (value[i] != ' ') return false;
+  }
+  return true;
+}
+
+static bool callback(http_parser& parser, http_cb cb, http_errno error) {
+  // Invokes a notification callback the way http_parser does. Returns false if parsing must stop
+  // because the callback failed or paused the parser.
+
+  if (cb != nullptr) {
+    if (cb(&parser) != 0) {
+      parser.http_errno = error;
+    }
+    return HTTP_PARSER_ERRNO(&parser) == HPE_OK;
+  }
+  return true;
+}
+
+static bool callback(http_parser& parser, http_data_cb cb, http_errno error,
+                     const char* at, size_t length) {
+  if (cb != nullptr) {
+    if (cb(&parser, at, length) != 0) {
+      parser.http_errno = error;
+    }
+    return HTTP_PARSER_ERRNO(&parser) == HPE_OK;
+  }
+  return true;
+}
+
+static bool countHeaderByte(http_parser& parser) {
+  // http_parser counts the bytes of status lines, headers, and chunk headers, and fails if one of
+  // these exceeds HTTP_MAX_HEADER_SIZE.
+
+  if (++parser.nread > HTTP_MAX_HEADER_SIZE) {
+    parser.http_errno = HPE_HEADER_OVERFLOW;
+    return false;
+  }
+  return true;
+}
+
+// =======================================================================================
+
+SimdHttpParser::Isa SimdHttpParser::bestIsa() {
+  if (isSupported(Isa::AVX2)) {
+    return Isa::AVX2;
+  } else if (isSupported(Isa::SSE2)) {
+    return Isa::SSE2;
+  } else {
+    return Isa::SCALAR;
+  }
+}
+
+bool SimdHttpParser::isSupported(Isa isa) {
+  switch (isa) {
+    case Isa::SCALAR:
+      return true;
+#if SANDSTORM_SIMD_HTTP_X86
+    case Isa::SSE2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse2");
+    case Isa::AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+#else
+    case Isa::SSE2:
+    case Isa::AVX2:
+      return false;
+#endif
+  }
+  KJ_UNREACHABLE;
+}
+
+kj::StringPtr SimdHttpParser::isaName(Isa isa) {
+  switch (isa) {
+    case Isa::SCALAR: return "scalar";
+    case Isa::SSE2: return "sse2";
+    case Isa::AVX2: return "avx2";
+  }
+  KJ_UNREACHABLE;
+}
+
+SimdHttpParser::SimdHttpParser(Isa isa) {
+  KJ_REQUIRE(isSupported(isa), "CPU doesn't support this instruction set", isaName(isa));
+
+  switch (isa) {
+    case Isa::SCALAR:
+      findFunc = &findScalar;
+      break;
+#if SANDSTORM_SIMD_HTTP_X86
+    case Isa::SSE2:
+      findFunc = &findSse2;
+      break;
+    case Isa::AVX2:
+      findFunc = &findAvx2;
+      break;
+#else
+    case Isa::SSE2:
+    case Isa::AVX2:
+      KJ_UNREACHABLE;
+#endif
+  }
+}
+
+size_t SimdHttpParser::execute(http_parser& parser, const http_parser_settings& settings,
+                               const char* data, size_t len) {
+  if (state == State::FALLBACK) {
+    return http_parser_execute(&parser, &settings, data, len);
+  }
+
+  if (HTTP_PARSER_ERRNO(&parser) != HPE_OK) {
+    // In an error state, or paused.
+    return 0;
+  }
+
+  if (len == 0) {
+    // The connection has closed.
+    switch (state) {
+      case State::BODY_IDENTITY_EOF:
+        callback(parser, settings.on_message_complete, HPE_CB_message_complete);
+        return 0;
+      case State::START:
+      case State::DEAD:
+        return 0;
+      case State::HEAD:
+        // Let http_parser report on the partial head.
+        return fallBack(parser, settings, data, len, 0);
+      default:
+        parser.http_errno = HPE_INVALID_EOF_STATE;
+        return 1;
+    }
+  }
+
+  size_t pos = 0;
+  const char* bodyMark = nullptr;  // start of chunk data not yet passed to on_body()
+
+  while (pos < len) {
+    switch (state) {
+      case State::START: {
+        parser.flags = 0;
+        parser.content_length = ULLONG_MAX;
+
+        char c = data[pos];
+        if (c == '\r' || c == '\n') {
+          // Blank lines before a response are ignored, though http_parser (oddly) reports the
+          // beginning of a message for each of these bytes.
+          if (!countHeaderByte(parser)) return pos;
+          ++pos;
+          if (!callback(parser, settings.on_message_begin, HPE_CB_message_begin)) return pos;
+          break;
+        }
+
+        headScanned = 0;
+        lineEnds.clear();
+        state = State::HEAD;
+      }
+      // fall through
+
+      case State::HEAD: {
+        const char* head;
+        size_t size;
+        ptrdiff_t base;  // offset in `data` of the start of the head
+        size_t buffered = headBuffer.size();
+        if (buffered == 0) {
+          head = data + pos;
+          size = len - pos;
+          base = pos;
+        } else {
+          headBuffer.addAll(data, data + len);
+          head = headBuffer.begin();
+          size = headBuffer.size();
+          base = -static_cast<ptrdiff_t>(buffered);
+        }
+
+        auto result = scanHead(parser, head, size);
+        if (result == ScanResult::INCOMPLETE) {
+          if (buffered == 0) {
+            headBuffer.addAll(head, head + size);
+          }
+          return len;
+        }
+
+        if (result == ScanResult::DECLINE || !parseHead(parser, head)) {
+          headBuffer.resize(buffered);
+          return fallBack(parser, settings, data, len, buffered == 0 ? pos : 0);
+        }
+
+        size_t lfPos = base + lineEnds.back() + 1;
+        auto emitResult = emitHead(parser, settings, head, base, len);
+        KJ_IF_MAYBE(stop, emitResult) {
+          return *stop;
+        }
+        headBuffer.clear();
+
+        auto completeResult = headersComplete(parser, settings, lfPos);
+        KJ_IF_MAYBE(stop, completeResult) {
+          return *stop;
+        }
+        pos = lfPos + 1;
+        break;
+      }
+
+      case State::HEADERS_DONE: {
+        if (!countHeaderByte(parser)) return pos;
+        if (data[pos] != '\n') {
+          parser.http_errno = HPE_STRICT;
+          return pos;
+        }
+        auto doneResult = headersDone(parser, settings, pos);
+        KJ_IF_MAYBE(stop, doneResult) {
+          return *stop;
+        }
+        ++pos;
+        break;
+      }
+
+      case State::BODY_IDENTITY: {
+        uint64_t toRead = kj::min(parser.content_length, uint64_t(len - pos));
+        const char* begin = data + pos;
+        parser.content_length -= toRead;
+        pos += toRead;
+
+        if (parser.content_length == 0) {
+          state = State::MESSAGE_DONE;
+          if (!callback(parser, settings.on_body, HPE_CB_body, begin, toRead)) return pos - 1;
+          messageDone(parser);
+          if (!callback(parser, settings.on_message_complete, HPE_CB_message_complete)) {
+            return pos;
+          }
+        } else {
+          if (!callback(parser, settings.on_body, HPE_CB_body, begin, toRead)) return len;
+        }
+        break;
+      }
+
+      case State::BODY_IDENTITY_EOF:
+        callback(parser, settings.on_body, HPE_CB_body, data + pos, len - pos);
+        return len;
+
+      case State::MESSAGE_DONE:
+        ++pos;
+        messageDone(parser);
+        if (!callback(parser, settings.on_message_complete, HPE_CB_message_complete)) {
+          return pos;
+        }
+        break;
+
+      case State::CHUNK_SIZE_START: {
+        if (!countHeaderByte(parser)) return pos;
+        int digit = unhex(data[pos]);
+        if (digit < 0) {
+          parser.http_errno = HPE_INVALID_CHUNK_SIZE;
+          return pos;
+        }
+        parser.content_length = digit;
+        state = State::CHUNK_SIZE;
+        ++pos;
+        break;
+      }
+
+      case State::CHUNK_SIZE: {
+        if (!countHeaderByte(parser)) return pos;
+        char c = data[pos];
+        if (c == '\r') {
+          state = State::CHUNK_SIZE_ALMOST_DONE;
+        } else {
+          int digit = unhex(c);
+          if (digit < 0) {
+            if (c == ';' || c == ' ') {
+              state = State::CHUNK_PARAMETERS;
+            } else {
+              parser.http_errno = HPE_INVALID_CHUNK_SIZE;
+              return pos;
+            }
+          } else if ((ULLONG_MAX - 16) / 16 < parser.content_length) {
+            parser.http_errno = HPE_INVALID_CONTENT_LENGTH;
+            return pos;
+          } else {
+            parser.content_length = parser.content_length * 16 + digit;
+          }
+        }
+        ++pos;
+        break;
+      }
+
+      case State::CHUNK_PARAMETERS: {
+        // Chunk extensions are ignored, so skip straight to the CR.
+        const char* cr = find(data + pos, data + len, '\r', '\r', '\r');
+        size_t count = cr - (data + pos) + (cr < data + len);
+        if (parser.nread + count > HTTP_MAX_HEADER_SIZE) {
+          size_t at = pos + (HTTP_MAX_HEADER_SIZE - parser.nread);
+          parser.nread = HTTP_MAX_HEADER_SIZE + 1;
+          parser.http_errno = HPE_HEADER_OVERFLOW;
+          return at;
+        }
+        parser.nread += count;
+        if (cr < data + len) {
+          state = State::CHUNK_SIZE_ALMOST_DONE;
+        }
+        pos += count;
+        break;
+      }
+
+      case State::CHUNK_SIZE_ALMOST_DONE:
+        if (!countHeaderByte(parser)) return pos;
+        if (data[pos] != '\n') {
+          parser.http_errno = HPE_STRICT;
+          return pos;
+        }
+        parser.nread = 0;
+        if (parser.content_length == 0) {
+          parser.flags |= F_TRAILING;
+          state = State::TRAILERS;
+        } else {
+          state = State::CHUNK_DATA;
+        }
+        ++pos;
+        break;
+
+      case State::CHUNK_DATA: {
+        uint64_t toRead = kj::min(parser.content_length, uint64_t(len - pos));
+        if (bodyMark == nullptr) {
+          bodyMark = data + pos;
+        }
+        parser.content_length -= toRead;
+        pos += toRead;
+        if (parser.content_length == 0) {
+          state = State::CHUNK_DATA_ALMOST_DONE;
+        }
+        break;
+      }
+
+      case State::CHUNK_DATA_ALMOST_DONE:
+        if (data[pos] != '\r') {
+          parser.http_errno = HPE_STRICT;
+          return pos;
+        }
+        state = State::CHUNK_DATA_DONE;
+        if (bodyMark != nullptr) {
+          const char* begin = bodyMark;
+          bodyMark = nullptr;
+          if (!callback(parser, settings.on_body, HPE_CB_body, begin, data + pos - begin)) {
+            return pos + 1;
+          }
+        }
+        ++pos;
+        break;
+
+      case State::CHUNK_DATA_DONE:
+        if (data[pos] != '\n') {
+          parser.http_errno = HPE_STRICT;
+          return pos;
+        }
+        parser.nread = 0;
+        state = State::CHUNK_SIZE_START;
+        ++pos;
+        break;
+
+      case State::TRAILERS: {
+        char c = data[pos];
+        if (c != '\r' && c != '\n') {
+          return fallBackInTrailers(parser, settings, data, len, pos);
+        }
+        if (!countHeaderByte(parser)) return pos;
+        ++pos;
+        if (c == '\r') {
+          state = State::TRAILERS_ALMOST_DONE;
+        } else {
+          messageDone(parser);
+          if (!callback(parser, settings.on_message_complete, HPE_CB_message_complete)) {
+            return pos;
+          }
+        }
+        break;
+      }
+
+      case State::TRAILERS_ALMOST_DONE:
+        if (!countHeaderByte(parser)) return pos;
+        if (data[pos] != '\n') {
+          parser.http_errno = HPE_STRICT;
+          return pos;
+        }
+        ++pos;
+        messageDone(parser);
+        if (!callback(parser, settings.on_message_complete, HPE_CB_message_complete)) {
+          return pos;
+        }
+        break;
+
+      case State::DEAD: {
+        // The response said the connection won't be reused, so anything more is an error.
+        char c = data[pos];
+        if (c != '\r' && c != '\n') {
+          parser.http_errno = HPE_CLOSED_CONNECTION;
+          return pos;
+        }
+        if (!countHeaderByte(parser)) return pos;
+        ++pos;
+        break;
+      }
+
+      case State::FALLBACK:
+        KJ_UNREACHABLE;
+    }
+  }
+
+  if (bodyMark != nullptr) {
+    callback(parser, settings.on_body, HPE_CB_body, bodyMark, data + len - bodyMark);
+  }
+
+  return len;
+}
+
+SimdHttpParser::ScanResult SimdHttpParser::scanHead(
+    const http_parser& parser, const char* head, size_t size) {
+  // Only CRLF line endings are accepted here, so we can find every line by looking for CR and LF
+  // together, and finding a bare LF, or a CR without one, means we decline.
+
+  size_t pos = headScanned;
+  for (;;) {
+    const char* p = find(head + pos, head + size, '\r', '\n', '\n');
+    size_t i = p - head;
+    if (i == size) {
+      headScanned = size;
+      break;
+    }
+
+    if (*p == '\n' || parser.nread + i + 2 > HTTP_MAX_HEADER_SIZE) {
+      // A bare LF, or the head is too big, which http_parser will complain about.
+      return ScanResult::DECLINE;
+    }
+    if (i + 1 == size) {
+      // CR at the end of what we have so far. Look at it again next time.
+      headScanned = i;
+      break;
+    }
+    if (head[i + 1] != '\n') {
+      return ScanResult::DECLINE;
+    }
+
+    lineEnds.add(i);
+    if (lineEnds.size() > 1 && lineEnds[lineEnds.size() - 2] + 2 == i) {
+      // An empty line ends the head.
+      return ScanResult::COMPLETE;
+    }
+    pos = i + 2;
+  }
+
+  if (parser.nread + size > HTTP_MAX_HEADER_SIZE) {
+    return ScanResult::DECLINE;
+  }
+  return ScanResult::INCOMPLETE;
+}
+
+bool SimdHttpParser::parseHead(http_parser& parser, const char* head) {
+  // Status line: "HTTP/<major>.<minor> <code>[ <reason>]"
+
+  const char* p = head;
+  const char* lineEnd = head + lineEnds[0];
+  uint major, minor, status;
+
+  if (lineEnd - p < 5 || memcmp(p, "HTTP/", 5) != 0) return false;
+  p += 5;
+  if (!parseDecimal(p, lineEnd, major) || p == lineEnd || *p++ != '.') return false;
+  if (!parseDecimal(p, lineEnd, minor) || p == lineEnd || *p++ != ' ') return false;
+  while (p < lineEnd && *p == ' ') ++p;
+  if (!parseDecimal(p, lineEnd, status)) return false;
+
+  statusBegin = statusEnd = lineEnds[0];
+  if (p < lineEnd) {
+    if (*p != ' ') return false;
+    statusBegin = p + 1 - head;
+  }
+
+  // Header lines. The last line is the empty one ending the head.
+
+  uint flags = 0;
+  uint64_t contentLength = ULLONG_MAX;
+  headers.clear();
+
+  for (size_t i = 1; i + 1 < lineEnds.size(); i++) {
+    const char* begin = head + lineEnds[i - 1] + 2;
+    const char* end = head + lineEnds[i];
+
+    const char* colon = find(begin, end, ':', ':', ':');
+    if (colon == end || colon == begin) return false;
+    for (const char* c = begin; c < colon; c++) {
+      // (This also catches folded lines, which start with whitespace.)
+      if (!isToken(*c)) return false;
+    }
+
+    const char* value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t')) ++value;
+
+    size_t nameSize = colon - begin;
+    size_t valueSize = end - value;
+
+    if (nameIs(begin, nameSize, "content-length")) {
+      if (valueSize > 0) {
+        if (!isDigit(*value)) return false;
+        contentLength = 0;
+        for (const char* c = value; c < end; c++) {
+          if (*c == ' ') continue;
+          if (!isDigit(*c) || (ULLONG_MAX - 10) / 10 < contentLength) return false;
+          contentLength = contentLength * 10 + (*c - '0');
+        }
+      }
+    } else if (nameIs(begin, nameSize, "transfer-encoding")) {
+      if (valueIs(value, valueSize, "chunked")) flags |= F_CHUNKED;
+    } else if (nameIs(begin, nameSize, "connection") ||
+               nameIs(begin, nameSize, "proxy-connection")) {
+      if (valueIs(value, valueSize, "keep-alive")) {
+        flags |= F_CONNECTION_KEEP_ALIVE;
+      } else if (valueIs(value, valueSize, "close")) {
+        flags |= F_CONNECTION_CLOSE;
+      }
+    } else if (nameIs(begin, nameSize, "upgrade")) {
+      if (valueSize > 0) flags |= F_UPGRADE;
+    }
+
+    headers.add(HeaderSpan {
+      static_cast<uint32_t>(begin - head), static_cast<uint32_t>(colon - head),
+      static_cast<uint32_t>(value - head), static_cast<uint32_t>(end - head)
+    });
+  }
+
+  parser.http_major = major;
+  parser.http_minor = minor;
+  parser.status_code = status;
+  parser.flags = flags;
+  parser.content_length = contentLength;
+  return true;
+}
+
+kj::Maybe<size_t> SimdHttpParser::emitHead(
+    http_parser& parser, const http_parser_settings& settings,
+    const char* head, ptrdiff_t base, size_t len) {
+  // If a callback stops us, return the position at which http_parser would have stopped, as
+  // best we can when that was in an earlier buffer.
+  auto stopAt = [&](size_t headPos) -> size_t {
+    ptrdiff_t result = base + headPos;
+    return result < 0 ? 0 : kj::min(size_t(result), len);
+  };
+
+  if (!callback(parser, settings.on_message_begin, HPE_CB_message_begin)) {
+    return stopAt(1);
+  }
+
+  if (statusEnd > statusBegin &&
+      !callback(parser, settings.on_status, HPE_CB_status,
+                head + statusBegin, statusEnd - statusBegin)) {
+    return stopAt(statusEnd + 1);
+  }
+
+  for (auto& header: headers) {
+    if (!callback(parser, settings.on_header_field, HPE_CB_header_field,
+                  head + header.nameBegin, header.nameEnd - header.nameBegin)) {
+      return stopAt(header.nameEnd + 1);
+    }
+    if (!callback(parser, settings.on_header_value, HPE_CB_header_value,
+                  head + header.valueBegin, header.valueEnd - header.valueBegin)) {
+      return stopAt(header.valueEnd + 1);
+    }
+  }
+
+  return nullptr;
+}
+
+kj::Maybe<size_t> SimdHttpParser::headersComplete(
+    http_parser& parser, const http_parser_settings& settings, size_t lfPos) {
+  parser.upgrade = (parser.flags & F_UPGRADE) != 0;
+
+  if (settings.on_headers_complete != nullptr) {
+    // As with http_parser, returning 1 means "this message has no body", e.g. for HEAD.
+    switch (settings.on_headers_complete(&parser)) {
+      case 0:
+        break;
+      case 1:
+        parser.flags |= F_SKIPBODY;
+        break;
+      default:
+        parser.http_errno = HPE_CB_headers_complete;
+        return lfPos;
+    }
+  }
+
+  if (HTTP_PARSER_ERRNO(&parser) != HPE_OK) {
+    // Paused. We'll pick up from the final LF.
+    state = State::HEADERS_DONE;
+    return lfPos;
+  }
+
+  return headersDone(parser, settings, lfPos);
+}
+
+kj::Maybe<size_t> SimdHttpParser::headersDone(
+    http_parser& parser, const http_parser_settings& settings, size_t lfPos) {
+  // Decide how the body is delimited, as http_parser does in its s_headers_done state.
+
+  parser.nread = 0;
+
+  if (parser.upgrade) {
+    // The rest of the connection is in a different protocol.
+    messageDone(parser);
+    callback(parser, settings.on_message_complete, HPE_CB_message_complete);
+    return lfPos + 1;
+  }
+
+  bool complete = false;
+  if (parser.flags & F_SKIPBODY) {
+    complete = true;
+  } else if (parser.flags & F_CHUNKED) {
+    // Chunked encoding overrides Content-Length.
+    state = State::CHUNK_SIZE_START;
+  } else if (parser.content_length == 0) {
+    complete = true;
+  } else if (parser.content_length != ULLONG_MAX) {
+    state = State::BODY_IDENTITY;
+  } else if (parser.status_code / 100 == 1 ||
+             parser.status_code == 204 || parser.status_code == 304) {
+    // These never have a body (RFC 2616 section 4.4).
+    complete = true;
+  } else {
+    state = State::BODY_IDENTITY_EOF;
+  }
+
+  if (complete) {
+    messageDone(parser);
+    if (!callback(parser, settings.on_message_complete, HPE_CB_message_complete)) {
+      return lfPos + 1;
+    }
+  }
+
+  return nullptr;
+}
+
+void SimdHttpParser::messageDone(http_parser& parser) {
+  state = http_should_keep_alive(&parser) ? State::START : State::DEAD;
+}
+
+size_t SimdHttpParser::fallBack(http_parser& parser, const http_parser_settings& settings,
+                                const char* data, size_t len, size_t headStart) {
+  // Hand the current message, starting from its first byte, to http_parser. We haven't invoked
+  // any callbacks for it yet, and `parser` is still in its start state from http_parser's point
+  // of view, so it's as if http_parser had been parsing all along.
+
+  state = State::FALLBACK;
+  lineEnds.clear();
+  headers.clear();
+
+  if (headBuffer.size() > 0) {
+    auto buffered = kj::mv(headBuffer);
+    size_t n = http_parser_execute(&parser, &settings, buffered.begin(), buffered.size());
+    if (n != buffered.size()) {
+      return 0;
+    }
+  }
+
+  return headStart + http_parser_execute(&parser, &settings, data + headStart, len - headStart);
+}
+
+size_t SimdHttpParser::fallBackInTrailers(
+    http_parser& parser, const http_parser_settings& settings,
+    const char* data, size_t len, size_t pos) {
+  // The last chunk is followed by trailers. Rather than parse them ourselves, we hand over to
+  // http_parser. Its state is private, so we get it to the same point -- just after the last
+  // chunk's size line -- by feeding it the framing of an empty chunked response, and then restore
+  // the fields that clobbers.
+
+  static constexpr char PREAMBLE[] = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n";
+
+  auto major = parser.http_major;
+  auto minor = parser.http_minor;
+  auto status = parser.status_code;
+  auto flags = parser.flags;
+
+  http_parser_settings noCallbacks;
+  memset(&noCallbacks, 0, sizeof(noCallbacks));
+  http_parser_init(&parser, HTTP_RESPONSE);
+  size_t n = http_parser_execute(&parser, &noCallbacks, PREAMBLE, sizeof(PREAMBLE) - 1);
+  KJ_ASSERT(n == sizeof(PREAMBLE) - 1 && HTTP_PARSER_ERRNO(&parser) == HPE_OK);
+
+  parser.http_major = major;
+  parser.http_minor = minor;
+  parser.status_code = status;
+  parser.flags = flags;
+
+  state = State::FALLBACK;
+  return pos + http_parser_execute(&parser, &settings, data + pos, len - pos);
+}
+
+}  // namespace sandstorm
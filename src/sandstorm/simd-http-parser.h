@@ -0,0 +1,152 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_SIMD_HTTP_PARSER_H_
+#define SANDSTORM_SIMD_HTTP_PARSER_H_
+
+#include <kj/common.h>
+#include <kj/string.h>
+#include <kj/vector.h>
+#include <joyent-http/http_parser.h>
+
+namespace sandstorm {
+
+class SimdHttpParser {
+  // A faster replacement for http_parser_execute() when parsing HTTP responses.
+  //
+  // http_parser examines one byte at a time. This parser instead locates line endings, colons, and
+  // the ends of chunk headers by comparing 16 (SSE2) or 32 (AVX2) bytes at once, and then handles
+  // whole status lines, header lines, and chunks at a time.
+  //
+  // It operates on a regular `http_parser` struct -- which must have been initialized with
+  // http_parser_init(..., HTTP_RESPONSE) -- and invokes the same callbacks with the same results,
+  // so http_should_keep_alive(), http_parser_pause(), `status_code`, `flags`, `content_length`,
+  // `upgrade`, and `http_errno` all work as usual. Only a strictly well-formed response head
+  // (CRLF line endings, no folded header lines, valid tokens) is handled here; on anything else,
+  // the bytes of the head are handed to http_parser_execute(), which then parses the rest of the
+  // connection, so that odd input is treated exactly as before. The same goes for chunked
+  // trailers, which apps essentially never send.
+  //
+  // One difference: a head split across several calls is buffered until it is complete, so the
+  // header callbacks all arrive during the last of those calls rather than piecemeal.
+
+public:
+  enum class Isa {
+    // Which instructions to use for scanning.
+
+    SCALAR,
+    SSE2,
+    AVX2
+  };
+
+  static Isa bestIsa();
+  // The fastest variant supported by this CPU.
+
+  static bool isSupported(Isa isa);
+
+  static kj::StringPtr isaName(Isa isa);
+
+  explicit SimdHttpParser(Isa isa = bestIsa());
+  SimdHttpParser(SimdHttpParser&&) = default;
+  SimdHttpParser& operator=(SimdHttpParser&&) = default;
+  KJ_DISALLOW_COPY(SimdHttpParser);
+
+  size_t execute(http_parser& parser, const http_parser_settings& settings,
+                 const char* data, size_t len);
+  // Same contract as http_parser_execute(). `parser` must be the same struct on every call.
+
+  bool isFallingBack() { return state == State::FALLBACK; }
+  // True if this connection has been handed over to http_parser. (For tests.)
+
+private:
+  enum class State: uint8_t {
+    START,                   // before a message; skipping blank lines
+    HEAD,                    // collecting the status line and headers
+    HEADERS_DONE,            // on_headers_complete() paused; awaiting the final LF again
+    BODY_IDENTITY,           // reading `content_length` more bytes of body
+    BODY_IDENTITY_EOF,       // reading body until the connection closes
+    MESSAGE_DONE,            // on_body() paused at the end of the body
+    CHUNK_SIZE_START,
+    CHUNK_SIZE,
+    CHUNK_PARAMETERS,
+    CHUNK_SIZE_ALMOST_DONE,  // saw CR after the chunk size
+    CHUNK_DATA,
+    CHUNK_DATA_ALMOST_DONE,  // expecting CR after the chunk data
+    CHUNK_DATA_DONE,         // expecting LF after the chunk data
+    TRAILERS,                // after the last chunk; expecting trailers or the final CRLF
+    TRAILERS_ALMOST_DONE,    // saw the CR of the final CRLF
+    DEAD,                    // after a message on a connection that won't be reused
+    FALLBACK                 // everything goes to http_parser_execute()
+  };
+
+  typedef const char* FindFunc(const char* begin, const char* end, char a, char b, char c);
+
+  State state = State::START;
+  FindFunc* findFunc;
+
+  kj::Vector<char> headBuffer;
+  // Bytes of a head that has arrived over several calls to execute(). Empty while the head is
+  // being parsed directly out of the caller's buffer.
+
+  size_t headScanned = 0;
+  // How far into the head we've looked for line endings.
+
+  kj::Vector<uint32_t> lineEnds;
+  // Offset within the head of the CR of each CRLF found so far.
+
+  struct HeaderSpan {
+    uint32_t nameBegin;
+    uint32_t nameEnd;
+    uint32_t valueBegin;
+    uint32_t valueEnd;
+  };
+  kj::Vector<HeaderSpan> headers;
+  uint32_t statusBegin = 0;
+  uint32_t statusEnd = 0;
+  // Offsets within the head of each header and of the status text, filled in by parseHead().
+
+  const char* find(const char* begin, const char* end, char a, char b, char c) {
+    return findFunc(begin, end, a, b, c);
+  }
+  // Returns the first occurrence of a, b, or c in [begin, end), or `end`.
+
+  enum class ScanResult { INCOMPLETE, COMPLETE, DECLINE };
+  ScanResult scanHead(const http_parser& parser, const char* head, size_t size);
+  // Looks for the end of the head, continuing from `headScanned`.
+
+  bool parseHead(http_parser& parser, const char* head);
+  // Validates the head and fills in the version, status code, flags and content length. Returns
+  // false if http_parser must handle it instead.
+
+  kj::Maybe<size_t> emitHead(http_parser& parser, const http_parser_settings& settings,
+                             const char* head, ptrdiff_t base, size_t len);
+  kj::Maybe<size_t> headersComplete(http_parser& parser, const http_parser_settings& settings,
+                                    size_t lfPos);
+  kj::Maybe<size_t> headersDone(http_parser& parser, const http_parser_settings& settings,
+                                size_t lfPos);
+  // Each returns the value execute() should return if parsing must stop, or null to continue.
+
+  void messageDone(http_parser& parser);
+
+  size_t fallBack(http_parser& parser, const http_parser_settings& settings,
+                  const char* data, size_t len, size_t headStart);
+  size_t fallBackInTrailers(http_parser& parser, const http_parser_settings& settings,
+                            const char* data, size_t len, size_t pos);
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_SIMD_HTTP_PARSER_H_
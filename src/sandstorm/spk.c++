@@ -25,6 +25,7 @@
 #include <sodium/crypto_sign.h>
 #include <sodium/crypto_hash_sha256.h>
 #include <sodium/crypto_hash_sha512.h>
+#include <lzma.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -117,6 +118,133 @@ public:
   }
 };
 
+// =======================================================================================
+// In-process xz compression, so that packing and verifying don't need to fork an `xz` process and
+// copy everything through pipes.
+
+class XzInputStream final: public kj::InputStream {
+  // Decompresses an xz stream read from `inner`. Like `xz -dc`, accepts concatenated streams and
+  // stream padding, and consumes `inner` through to EOF.
+
+public:
+  explicit XzInputStream(kj::InputStream& inner): inner(inner) {
+    lzma_ret ret = lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED);
+    KJ_ASSERT(ret == LZMA_OK, "lzma_stream_decoder() failed", (int)ret);
+  }
+  ~XzInputStream() noexcept(false) {
+    lzma_end(&stream);
+  }
+
+  size_t tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    stream.next_out = reinterpret_cast<uint8_t*>(buffer);
+    stream.avail_out = maxBytes;
+
+    while (!done && (maxBytes - stream.avail_out < minBytes || stream.avail_out == maxBytes)) {
+      if (stream.avail_in == 0 && !atEof) {
+        stream.next_in = inBuffer;
+        stream.avail_in = inner.tryRead(inBuffer, 1, sizeof(inBuffer));
+        atEof = stream.avail_in == 0;
+      }
+
+      lzma_ret ret = lzma_code(&stream, atEof ? LZMA_FINISH : LZMA_RUN);
+      if (ret == LZMA_STREAM_END) {
+        done = true;
+      } else if (ret == LZMA_BUF_ERROR) {
+        KJ_FAIL_REQUIRE("xz stream is truncated");
+      } else {
+        KJ_REQUIRE(ret == LZMA_OK, "xz decompression failed", (int)ret);
+      }
+    }
+
+    return maxBytes - stream.avail_out;
+  }
+
+private:
+  kj::InputStream& inner;
+  lzma_stream stream = LZMA_STREAM_INIT;
+  bool atEof = false;
+  bool done = false;
+  byte inBuffer[65536];
+};
+
+class XzOutputStream final: public kj::OutputStream {
+  // Compresses everything written into an xz stream written to `inner`, using all CPUs, like
+  // `xz --threads=0 --compress`. You must call finish() at the end.
+
+public:
+  explicit XzOutputStream(kj::OutputStream& inner): inner(inner) {
+    lzma_mt options;
+    memset(&options, 0, sizeof(options));
+    options.threads = kj::max(lzma_cputhreads(), 1u);
+    options.preset = LZMA_PRESET_DEFAULT;
+    options.check = LZMA_CHECK_CRC64;
+    lzma_ret ret = lzma_stream_encoder_mt(&stream, &options);
+    KJ_ASSERT(ret == LZMA_OK, "lzma_stream_encoder_mt() failed", (int)ret);
+    stream.next_out = outBuffer;
+    stream.avail_out = sizeof(outBuffer);
+  }
+  ~XzOutputStream() noexcept(false) {
+    lzma_end(&stream);
+  }
+
+  void write(const void* buffer, size_t size) override {
+    stream.next_in = reinterpret_cast<const uint8_t*>(buffer);
+    stream.avail_in = size;
+    while (stream.avail_in > 0) {
+      lzma_ret ret = lzma_code(&stream, LZMA_RUN);
+      KJ_ASSERT(ret == LZMA_OK, "xz compression failed", (int)ret);
+      if (stream.avail_out == 0) flush();
+    }
+  }
+
+  void finish() {
+    for (;;) {
+      lzma_ret ret = lzma_code(&stream, LZMA_FINISH);
+      if (stream.avail_out == 0 || ret == LZMA_STREAM_END) flush();
+      if (ret == LZMA_STREAM_END) break;
+      KJ_ASSERT(ret == LZMA_OK, "xz compression failed", (int)ret);
+    }
+  }
+
+private:
+  kj::OutputStream& inner;
+  lzma_stream stream = LZMA_STREAM_INIT;
+  byte outBuffer[65536];
+
+  void flush() {
+    inner.write(outBuffer, sizeof(outBuffer) - stream.avail_out);
+    stream.next_out = outBuffer;
+    stream.avail_out = sizeof(outBuffer);
+  }
+};
+
+class Sha256InputStream final: public kj::InputStream {
+  // Hashes everything read through it.
+
+public:
+  explicit Sha256InputStream(kj::InputStream& inner): inner(inner) {
+    KJ_ASSERT(crypto_hash_sha256_init(&state) == 0);
+  }
+
+  size_t tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    size_t n = inner.tryRead(buffer, minBytes, maxBytes);
+    KJ_ASSERT(crypto_hash_sha256_update(&state, reinterpret_cast<byte*>(buffer), n) == 0);
+    return n;
+  }
+
+  void finish(byte hash[crypto_hash_sha256_BYTES]) {
+    // Read through to EOF, then write out the hash.
+
+    byte buffer[8192];
+    while (tryRead(buffer, 1, sizeof(buffer)) > 0) {}
+    KJ_ASSERT(crypto_hash_sha256_final(&state, hash) == 0);
+  }
+
+private:
+  kj::InputStream& inner;
+  crypto_hash_sha256_state state;
+};
+
 // =======================================================================================
 
 class ReplacementFile {
@@ -1002,27 +1130,17 @@ private:
     {
       auto finalFile = raiiOpen(spkfile, O_WRONLY | O_CREAT | O_TRUNC);
 
+      kj::FdOutputStream fileOut(finalFile.get());
+
       // Write magic number uncompressed.
       auto magic = spk::MAGIC_NUMBER.get();
-      kj::FdOutputStream(finalFile.get()).write(magic.begin(), magic.size());
-
-      // Pipe content through xz compressor.
-      auto pipe = Pipe::make();
-      Subprocess::Options childOptions({"xz", "--threads=0", "--compress", "--stdout"});
-      childOptions.stdin = pipe.readEnd.get();
-      childOptions.stdout = finalFile.get();
-      Subprocess child(kj::mv(childOptions));
-      pipe.readEnd = nullptr;
-
-      // Write signature and archive out to the pipe, then close the pipe.
-      {
-        kj::FdOutputStream out(kj::mv(pipe.writeEnd));
-        capnp::writeMessage(out, signatureMessage);
-        out.write(tmpData.begin(), tmpData.size());
-      }
+      fileOut.write(magic.begin(), magic.size());
 
-      // Wait until xz is done compressing.
-      child.waitForSuccess();
+      // Compress the signature and archive.
+      XzOutputStream out(fileOut);
+      capnp::writeMessage(out, signatureMessage);
+      out.write(tmpData.begin(), tmpData.size());
+      out.finish();
     }
 
     printAppId(key.getPublicKey());
@@ -1398,49 +1516,23 @@ private:
     // Read package form spkfd, check the validity and signature, and return the appId. Also write
     // the uncompressed archive to `tmpfile`.
 
-    // We need to compute the hash of the input. The input could be a pipe (not a file), therefore
-    // we need to read it in chunks, hash the content, and write back out to the pipe that xz will
-    // use as input below. We'll do all that in a thread to keep the code simple.
-    byte packageHash[crypto_hash_sha256_BYTES];
-    Pipe spkPipe = Pipe::make();
-    auto hashThread = new kj::Thread([&]() {
-      crypto_hash_sha256_state packageHashState;
-      KJ_ASSERT(crypto_hash_sha256_init(&packageHashState) == 0);
-
-      byte buffer[8192];
-      kj::FdOutputStream out(kj::mv(spkPipe.writeEnd));
-      for (;;) {
-        ssize_t n;
-        KJ_SYSCALL(n = read(spkfd, buffer, sizeof(buffer)));
-        if (n == 0) break;
-        KJ_ASSERT(crypto_hash_sha256_update(&packageHashState, buffer, n) == 0);
-        out.write(buffer, n);
-      }
-
-      KJ_ASSERT(crypto_hash_sha256_final(&packageHashState, packageHash));
-    });
+    // We need to compute the hash of the input, which could be a pipe (not a file), so we hash
+    // the compressed bytes as the decompressor consumes them.
+    kj::FdInputStream rawIn(spkfd);
+    Sha256InputStream hashingIn(rawIn);
 
     // Check the magic number.
     auto expectedMagic = spk::MAGIC_NUMBER.get();
     byte magic[expectedMagic.size()];
-    kj::FdInputStream(spkPipe.readEnd.get()).read(magic, expectedMagic.size());
+    hashingIn.read(magic, expectedMagic.size());
     for (uint i: kj::indices(expectedMagic)) {
       if (magic[i] != expectedMagic[i]) {
         return validationError("Does not appear to be an .spk (bad magic number).");
       }
     }
 
-    // Decompress the remaining bytes in the SPK using xz.
-    Pipe pipe = Pipe::make();
-
-    Subprocess::Options childOptions({"xz", "-dc"});
-    childOptions.stdin = spkPipe.readEnd;
-    childOptions.stdout = pipe.writeEnd;
-    Subprocess child(kj::mv(childOptions));
-
-    spkPipe.readEnd = nullptr;
-    pipe.writeEnd = nullptr;
-    kj::FdInputStream in(kj::mv(pipe.readEnd));
+    // Decompress the remaining bytes in the SPK.
+    XzInputStream in(hashingIn);
 
     // Read in the signature.
     byte publicKey[crypto_sign_PUBLICKEYBYTES];
@@ -1488,10 +1580,9 @@ private:
       tmpOut.write(buffer, n);
     }
 
-    child.waitForSuccess();
-    hashThread = nullptr;  // joins thread
+    byte packageHash[crypto_hash_sha256_BYTES];
+    hashingIn.finish(packageHash);
 
-    // The spk pipe thread should have exited now, completing the hash.
     static_assert(PACKAGE_ID_BYTE_SIZE <= crypto_hash_sha256_BYTES, "package ID size changed?");
     auto packageIdBytes = kj::arrayPtr(packageHash, PACKAGE_ID_BYTE_SIZE);
 
@@ -1717,8 +1808,7 @@ private:
       int spkfd, kj::StringPtr dirname, kj::StringPtr tmpNear,
       kj::Function<kj::String(kj::StringPtr problem)> validationError) {
     // TODO(security):  We could at this point chroot into the output directory and unshare
-    //   various resources for extra security, if not for the fact that we need to invoke xz
-    //   later on.  Maybe link against the xz library so that we don't have to exec it?
+    //   various resources for extra security.
 
     auto tmpfile = openTemporary(tmpNear);
     auto appId = verifyImpl(spkfd, tmpfile, nullptr, kj::mv(validationError));
@@ -1883,6 +1973,7 @@ private:
   kj::String serverBinary;
   kj::StringPtr mountDir;
   bool fuseCaching = false;
+  uint fuseThreads = 0;
   bool mountProc = false;
 
   kj::MainFunc getDevMain() {
@@ -1905,6 +1996,10 @@ private:
             "Enable aggressive caching over the FUSE filesystem used to detect dependencies. "
             "This may improve performance but means that you will have to restart `spk dev` "
             "any time you make a change to your code.")
+        .addOptionWithArg({"threads"}, KJ_BIND_METHOD(*this, setFuseThreads), "<count>",
+            "Serve the FUSE filesystem used to detect dependencies from <count> threads, so "
+            "that the app's file accesses can be handled in parallel. This can speed up startup "
+            "considerably for apps that load many files, such as large node_modules trees.")
         .addOption({"proc"}, KJ_BIND_METHOD(*this, enableMountProc),
             "Mount /proc inside the sandbox. This can be useful for debugging. For security "
             "reasons, this option is only available when you are developing an app; packaged "
@@ -1939,6 +2034,18 @@ private:
     return true;
   }
 
+  kj::MainBuilder::Validity setFuseThreads(kj::StringPtr arg) {
+    KJ_IF_MAYBE(i, parseUInt(arg, 10)) {
+      if (*i > 256) {
+        return "too many threads";
+      }
+      fuseThreads = *i;
+      return true;
+    } else {
+      return "invalid thread count";
+    }
+  }
+
   kj::MainBuilder::Validity enableMountProc() {
     mountProc = true;
     return true;
@@ -2061,6 +2168,7 @@ private:
       // TODO(perf): Implement active cache invalidation. FUSE has protocol support for it. Use
       //   inotify at the other end to detect changes.
       options.cacheForever = fuseCaching;
+      options.threadCount = fuseThreads;
 
       auto onSignal = eventPort.onSignal(SIGINT)
           .exclusiveJoin(eventPort.onSignal(SIGQUIT))
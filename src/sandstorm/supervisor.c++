@@ -50,31 +50,23 @@
 #include <grp.h>
 #include <sys/inotify.h>
 #include <map>
+#include <list>
 #include <unordered_map>
 #include <execinfo.h>
+#include <time.h>
+#include <algorithm>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <sys/eventfd.h>
 #include <sys/resource.h>
 
-// We need to define these constants before libseccomp has a chance to inject bogus
-// values for them. See https://github.com/seccomp/libseccomp/issues/27
-#ifndef __NR_seccomp
-#define __NR_seccomp 317
-#endif
-#ifndef __NR_bpf
-#define __NR_bpf 321
-#endif
-#ifndef __NR_userfaultfd
-#define __NR_userfaultfd 323
-#endif
-#include <seccomp.h>
-
 #include <sandstorm/grain.capnp.h>
 #include <sandstorm/supervisor.capnp.h>
 
 #include "version.h"
 #include "send-fd.h"
+#include "seccomp-filter.h"
+#include "flat-hash.h"
 #include "util.h"
 
 // In case kernel headers are old.
@@ -90,17 +82,27 @@ namespace sandstorm {
 class DiskUsageWatcher: private kj::TaskSet::ErrorHandler {
   // Class which watches a directory tree, counts up the total disk usage, and fires events when
   // it changes. Uses inotify. Which turns out to be... harder than it should be.
+  //
+  // Grains can contain hundreds of thousands of files (git repos, mail stores), so we keep as
+  // little as possible per file. We don't remember names at all: each directory entry is recorded
+  // as the inode it points to, keyed by a hash of the directory's watch descriptor and the name,
+  // and each inode's size is recorded once, which also means a file hard-linked several times
+  // within the grain is only counted once. Events are handled in batches, so that a file written
+  // many times in quick succession is only stat()ed once per batch.
+  //
+  // If inotify's event queue overflows, we re-list the directories we're watching, a few at a
+  // time, rather than starting over. If we run out of inotify watches, we give up on inotify and
+  // periodically walk the whole tree instead.
 
 public:
   DiskUsageWatcher(kj::UnixEventPort& eventPort, kj::Timer& timer, SandstormCore::Client core)
-      : eventPort(eventPort), timer(timer), core(kj::mv(core)), tasks(*this) {}
+      : eventPort(eventPort), timer(timer), core(kj::mv(core)), tasks(*this) {
+    randomizeHashKey();
+  }
 
   kj::Promise<void> init() {
     // Start watching the current directory.
 
-    // Note: this function is also called to restart watching from scratch when the inotify event
-    //   queue overflows (hopefully rare).
-
     int fd;
     KJ_SYSCALL(fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
     inotifyFd = kj::AutoCloseFd(fd);
@@ -111,8 +113,6 @@ public:
     observer = kj::heap<kj::UnixEventPort::FdObserver>(eventPort, inotifyFd,
         kj::UnixEventPort::FdObserver::OBSERVE_READ);
 
-    totalSize = 0;
-    watchMap.clear();
     pendingWatches.add(nullptr);  // root directory
     return readLoop();
   }
@@ -123,28 +123,175 @@ private:
   SandstormCore::Client core;
   kj::AutoCloseFd inotifyFd;
   kj::Own<kj::UnixEventPort::FdObserver> observer;
-  uint64_t totalSize;
+  uint64_t totalSize = 0;
   uint64_t reportedSize = kj::maxValue;
   bool reportInFlight = false;
 
-  struct ChildInfo {
-    kj::String name;
-    uint64_t size;
-  };
   struct WatchInfo {
     kj::String path;  // null = root directory
-    std::map<kj::StringPtr, ChildInfo> childSizes;
+
+    kj::Vector<uint64_t> children;
+    // Keys in `entries` of this directory's children, so that we can find them again when
+    // re-listing the directory.
   };
   std::unordered_map<int, WatchInfo> watchMap;
   // Maps inotify watch descriptors to info about what is being watched.
 
+  struct Entry {
+    uint64_t ino;
+    uint32_t index;  // position of this entry in its directory's `children`
+  };
+  FlatHashMap<Entry> entries;
+  // Every directory entry we know about, keyed by entryKey().
+
+  struct Inode {
+    uint64_t bytes;
+    uint32_t links;  // number of `entries` that point at this inode
+  };
+  FlatHashMap<Inode> inodes;
+  // Disk usage of every inode that `entries` points at, keyed by inode number. (A grain's storage
+  // is a single filesystem, so inode numbers are unique.)
+
+  uint64_t hashKey[2];
+  // Secret key for entryKey(), so that the app can't pick names that collide.
+
+  struct Event {
+    int wd;
+    kj::String name;
+  };
+  kj::Vector<Event> pendingEvents;
+  FlatHashMap<bool> pendingEventKeys;
+  // Children we've received events about in the current batch, each listed once.
+
   kj::Vector<kj::String> pendingWatches;
   // Directories we would like to watch, but we can't add watches on them just yet because we need
   // to finish processing a list of events received from inotify before we mess with the watch
   // descriptor table.
 
+  bool overflowed = false;
+  kj::Vector<int> rescanQueue;
+  // Watched directories we have yet to re-list after the inotify event queue overflowed.
+
+  bool outOfWatches = false;
+  // Set when inotify_add_watch() fails with ENOSPC. We switch to polling at the end of the batch.
+
+  kj::Vector<kj::String> walkStack;
+  uint64_t walkTotal = 0;
+  FlatHashMap<bool> walkLinks;
+  int64_t walkStartTime = 0;
+  // State of the current walk of the tree, when polling. `walkLinks` contains the inode numbers of
+  // files with multiple hard links which we've already counted.
+
   kj::TaskSet tasks;
 
+  kj::Promise<void> readLoop() {
+    bool mayHaveMore = readEvents();
+    processEvents();
+
+    if (!mayHaveMore) {
+      // We've caught up with inotify, so now we can add watches.
+
+      if (overflowed) {
+        // We don't know what we missed, so we'll have to look at everything again. Our watches
+        // are all still in place, though, so there's no need to start over from scratch.
+        KJ_LOG(WARNING, "inotify event queue overflow; re-listing watched directories",
+               watchMap.size());
+        overflowed = false;
+        rescanQueue.clear();
+        for (auto& watch: watchMap) {
+          rescanQueue.add(watch.first);
+        }
+      }
+
+      continueRescan();
+      addPendingWatches();
+    }
+
+    if (outOfWatches) {
+      return startPolling();
+    }
+
+    maybeReportSize();
+
+    if (mayHaveMore || rescanQueue.size() > 0) {
+      // Let other work run before we continue.
+      return yield().then([this]() { return readLoop(); });
+    } else {
+      return observer->whenBecomesReadable().then([this]() { return readLoop(); });
+    }
+  }
+
+  bool readEvents() {
+    // Reads events from inotify into pendingEvents. Returns false if there are no more to read
+    // right now, or true if we stopped because the batch is big enough.
+
+    alignas(struct inotify_event) kj::byte buffer[16384];
+
+    for (uint i = 0; i < 64; i++) {
+      ssize_t n;
+      KJ_NONBLOCKING_SYSCALL(n = read(inotifyFd, buffer, sizeof(buffer)));
+
+      if (n < 0) {
+        // EAGAIN; try again later.
+        return false;
+      }
+
+      KJ_ASSERT(n > 0, "inotify EOF?");
+
+      kj::byte* pos = buffer;
+      while (n > 0) {
+        // Split off one event.
+        auto event = reinterpret_cast<struct inotify_event*>(pos);
+        size_t eventSize = sizeof(struct inotify_event) + event->len;
+        KJ_ASSERT(eventSize <= n, "inotify returned partial event?");
+        KJ_ASSERT(eventSize % sizeof(size_t) == 0, "inotify event not aligned?");
+        n -= eventSize;
+        pos += eventSize;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+          overflowed = true;
+          continue;
+        }
+
+        auto iter = watchMap.find(event->wd);
+        KJ_ASSERT(iter != watchMap.end(), "inotify gave unknown watch descriptor?");
+
+        if (event->mask & (IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE)) {
+          // We'll look at the child once we've read the whole batch, since by then there may
+          // well have been more events about it.
+          bool created;
+          pendingEventKeys.findOrCreate(entryKey(event->wd, event->name), created);
+          if (created) {
+            pendingEvents.add(Event { event->wd, kj::heapString(event->name) });
+          }
+        }
+
+        if (event->mask & IN_IGNORED) {
+          // This watch descriptor is being removed, probably because it was deleted.
+
+          // There shouldn't be any children left, but if there are, go ahead and un-count them.
+          removeAllChildren(iter->second);
+          watchMap.erase(iter);
+        }
+      }
+    }
+
+    return true;
+  }
+
+  void processEvents() {
+    for (auto& event: pendingEvents) {
+      auto iter = watchMap.find(event.wd);
+      if (iter != watchMap.end()) {
+        childEvent(event.wd, iter->second, event.name, true);
+      } else {
+        // The directory went away later in the batch, and its children were un-counted then.
+      }
+    }
+    pendingEvents.clear();
+    pendingEventKeys.clear();
+  }
+
   void addPendingWatches() {
     // Start watching everything that has been added to the pendingWatches list.
 
@@ -160,6 +307,8 @@ private:
     // Start watching `path`. This is idempotent -- it's safe to watch the same path multiple
     // times.
 
+    if (outOfWatches) return;
+
     static const uint32_t FLAGS =
         IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO |
         IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK;
@@ -178,35 +327,10 @@ private:
         // actually exactly what we want to do in these cases anyway.
         watchInfo.path = kj::mv(path);
 
-        // In the case that we are reusing an existing watch descriptor, we want to clear out the
-        // existing contents as they may be stale due to, again, race conditions.
-        for (auto& child: watchInfo.childSizes) {
-          totalSize -= child.second.size;
-        }
-        watchInfo.childSizes.clear();
-
-        // Now repopulate the children by listing the directory.
-        DIR* dir = opendir(pathPtr);
-        if (dir != nullptr) {
-          KJ_DEFER(closedir(dir));
-          for (;;) {
-            errno = 0;
-            struct dirent* entry = readdir(dir);
-            if (entry == nullptr) {
-              int error = errno;
-              if (error == 0) {
-                break;
-              } else {
-                KJ_FAIL_SYSCALL("readdir", error, pathPtr);
-              }
-            }
-
-            kj::StringPtr name = entry->d_name;
-            if (name != "." && name != "..") {
-              childEvent(watchInfo, name);
-            }
-          }
-        }
+        // Now list the directory. In the case that we are reusing an existing watch descriptor,
+        // this also corrects what we had, which may be stale due to, again, race conditions. The
+        // path of every subdirectory has changed if this one moved, so we re-watch all of them.
+        rescanDirectory(wd, watchInfo, true);
 
         return;
       }
@@ -225,73 +349,60 @@ private:
           return;
 
         case ENOSPC:
-          // No more inotify watches available.
-          // TODO(someday): Revert to some sort of polling mode? For now, fall through to error
-          //   case.
+          // No more inotify watches available. We'll switch to polling once we're done with the
+          // current batch.
+          outOfWatches = true;
+          return;
+
         default:
           KJ_FAIL_SYSCALL("inotify_add_watch", error, path);
       }
     }
   }
 
-  kj::Promise<void> readLoop() {
-    addPendingWatches();
-    maybeReportSize();
-    return observer->whenBecomesReadable().then([this]() {
-      alignas(uint64_t) kj::byte buffer[4096];
-
-      for (;;) {
-        ssize_t n;
-        KJ_NONBLOCKING_SYSCALL(n = read(inotifyFd, buffer, sizeof(buffer)));
-
-        if (n < 0) {
-          // EAGAIN; try again later.
-          return readLoop();
-        }
-
-        KJ_ASSERT(n > 0, "inotify EOF?");
+  void continueRescan() {
+    // Re-list some of the directories in rescanQueue -- up to a few thousand entries' worth, so
+    // that a huge tree doesn't hold up everything else.
 
-        kj::byte* pos = buffer;
-        while (n > 0) {
-          // Split off one event.
-          auto event = reinterpret_cast<struct inotify_event*>(pos);
-          size_t eventSize = sizeof(struct inotify_event) + event->len;
-          KJ_ASSERT(eventSize <= n, "inotify returned partial event?");
-          KJ_ASSERT(eventSize % sizeof(size_t) == 0, "inotify event not aligned?");
-          n -= eventSize;
-          pos += eventSize;
+    size_t budget = 4096;
+    while (rescanQueue.size() > 0 && budget > 0) {
+      int wd = rescanQueue.end()[-1];
+      rescanQueue.removeLast();
 
-          if (event->mask & IN_Q_OVERFLOW) {
-            // Queue overflow; start over from scratch.
-            inotifyFd = nullptr;
-            KJ_LOG(WARNING, "inotify event queue overflow; restarting watch from scratch");
-            return init();
-          }
-
-          auto iter = watchMap.find(event->wd);
-          KJ_ASSERT(iter != watchMap.end(), "inotify gave unknown watch descriptor?");
-
-          if (event->mask & (IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE)) {
-            childEvent(iter->second, event->name);
-          }
+      auto iter = watchMap.find(wd);
+      if (iter != watchMap.end()) {
+        size_t count = rescanDirectory(wd, iter->second, false);
+        budget -= kj::min(budget, count + 1);
+      }
+    }
+  }
 
-          if (event->mask & IN_IGNORED) {
-            // This watch descriptor is being removed, probably because it was deleted.
+  size_t rescanDirectory(int wd, WatchInfo& watchInfo, bool watchSubdirectories) {
+    // Brings the children of a watched directory up-to-date with what is on disk, returning the
+    // number of children. If `watchSubdirectories` is false, only subdirectories that are new
+    // are (re-)watched.
 
-            // There shouldn't be any children left, but if there are, go ahead and un-count them.
-            for (auto& child: iter->second.childSizes) {
-              totalSize -= child.second.size;
-            }
+    kj::Vector<uint64_t> seen;
+    listDirectory(watchInfo.path, [&](kj::StringPtr name) {
+      seen.add(childEvent(wd, watchInfo, name, watchSubdirectories));
+    });
 
-            watchMap.erase(iter);
-          }
-        }
+    // Anything else we thought was there isn't anymore. (Iterating backwards means removeEntry()
+    // only ever moves entries we've already checked.)
+    std::sort(seen.begin(), seen.end());
+    for (size_t i = watchInfo.children.size(); i-- > 0;) {
+      uint64_t key = watchInfo.children[i];
+      if (!std::binary_search(seen.begin(), seen.end(), key)) {
+        removeEntry(watchInfo, key);
       }
-    });
+    }
+
+    return seen.size();
   }
 
-  void childEvent(WatchInfo& watchInfo, kj::StringPtr name) {
-    // Called to update the child table when we receive an inotify event with the given name.
+  uint64_t childEvent(int wd, WatchInfo& watchInfo, kj::StringPtr name, bool watchIfDirectory) {
+    // Called to update the entry table when we receive an inotify event with the given name.
+    // Returns the child's key in `entries`.
 
     // OK, we received notification that something happened to the child named `name`.
     // Unfortunately, we don't have any idea how long ago this event happened. Worse, any
@@ -305,29 +416,33 @@ private:
     // vs. what we knew in the past to determine what has changed. Note that if inotify
     // provided a `struct stat` along with the event then we wouldn't have this problem!
 
+    uint64_t key = entryKey(wd, name);
     auto usage = getDiskUsage(watchInfo.path, name);
-    totalSize += usage.bytes;
-
-    auto iter = watchInfo.childSizes.find(name);
-    if (usage.bytes == 0) {
-      // There is no longer a child by this name on disk. Remove whatever is in the map.
-      if (iter != watchInfo.childSizes.end()) {
-        totalSize -= iter->second.size;
-        watchInfo.childSizes.erase(iter);
+    bool changed = true;
+
+    Entry* entry = entries.find(key);
+    if (entry == nullptr) {
+      if (usage.ino != 0) {
+        // There is a child by this name on disk, but not in the table. Add it.
+        entries[key] = Entry { usage.ino, static_cast<uint32_t>(watchInfo.children.size()) };
+        watchInfo.children.add(key);
+        addLink(usage.ino, usage.bytes);
       }
-    } else if (iter == watchInfo.childSizes.end()) {
-      // There is a child by this name on disk, but not in the map. Add it.
-      ChildInfo newChild = { kj::heapString(name), usage.bytes };
-      kj::StringPtr namePtr = newChild.name;
-      KJ_ASSERT(watchInfo.childSizes.insert(std::make_pair(namePtr, kj::mv(newChild))).second);
+    } else if (usage.ino == 0) {
+      // There is no longer a child by this name on disk. Remove whatever is in the table.
+      removeEntry(watchInfo, key);
+    } else if (usage.ino == entry->ino) {
+      // Same node as before. Check for a change in size.
+      setSize(usage.ino, usage.bytes);
+      changed = false;
     } else {
-      // There is a child by this name on disk and in the map. Check for a change in size.
-      totalSize -= iter->second.size;
-      iter->second.size = usage.bytes;
+      // The name now points at a different node.
+      uint64_t oldIno = entry->ino;
+      entry->ino = usage.ino;
+      addLink(usage.ino, usage.bytes);
+      removeLink(oldIno);
     }
 
-    maybeReportSize();
-
     // If the child is a directory, plan to start watching it later. Note that IN_MODIFY events
     // are not generated for subdirectories (only files), so if we got an event on a directory it
     // must be create, move to, move from, or delete. In the latter two cases, the node wouldn't
@@ -336,17 +451,231 @@ private:
     // start watching the directory. In the moved-in case, we are probably already watching the
     // directory, however it is necessary to redo the watch because the path has changed and the
     // directory state may have become inconsistent in the time that the path was wrong.
-    if (usage.isDir) {
+    if (usage.isDir && (watchIfDirectory || changed)) {
       // We can't actually add the new watch now because we need to process the remaining
       // events from the last read() in order to make sure we're caught up with inotify's
       // state.
       pendingWatches.add(kj::mv(usage.path));
     }
+
+    return key;
+  }
+
+  void removeEntry(WatchInfo& watchInfo, uint64_t key) {
+    // Removes a child from `entries` and from its directory's `children`.
+
+    Entry* entry = entries.find(key);
+    KJ_ASSERT(entry != nullptr);
+    uint32_t index = entry->index;
+    removeLink(entry->ino);
+
+    uint64_t lastKey = watchInfo.children.end()[-1];
+    if (lastKey != key) {
+      watchInfo.children[index] = lastKey;
+      entries.find(lastKey)->index = index;
+    }
+    watchInfo.children.removeLast();
+    entries.erase(key);
+  }
+
+  void removeAllChildren(WatchInfo& watchInfo) {
+    for (uint64_t key: watchInfo.children) {
+      Entry* entry = entries.find(key);
+      KJ_ASSERT(entry != nullptr);
+      removeLink(entry->ino);
+      entries.erase(key);
+    }
+    watchInfo.children.clear();
+  }
+
+  void addLink(uint64_t ino, uint64_t bytes) {
+    bool created;
+    Inode& inode = inodes.findOrCreate(ino, created);
+    totalSize -= inode.bytes;
+    totalSize += bytes;
+    inode.bytes = bytes;
+    ++inode.links;
+  }
+
+  void removeLink(uint64_t ino) {
+    Inode* inode = inodes.find(ino);
+    KJ_ASSERT(inode != nullptr);
+    if (--inode->links == 0) {
+      totalSize -= inode->bytes;
+      inodes.erase(ino);
+    }
+  }
+
+  void setSize(uint64_t ino, uint64_t bytes) {
+    Inode* inode = inodes.find(ino);
+    KJ_ASSERT(inode != nullptr);
+    totalSize -= inode->bytes;
+    totalSize += bytes;
+    inode->bytes = bytes;
+  }
+
+  uint64_t entryKey(int wd, kj::StringPtr name) {
+    // SipHash-2-4 of the watch descriptor and name. A collision would make us lose track of a
+    // file, so we use a keyed hash rather than something an app could attack.
+
+    uint64_t v0 = hashKey[0] ^ 0x736f6d6570736575ull;
+    uint64_t v1 = hashKey[1] ^ 0x646f72616e646f6dull;
+    uint64_t v2 = hashKey[0] ^ 0x6c7967656e657261ull;
+    uint64_t v3 = hashKey[1] ^ 0x7465646279746573ull;
+
+    auto rotl = [](uint64_t x, uint b) { return (x << b) | (x >> (64 - b)); };
+    auto round = [&]() {
+      v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+      v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+      v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+      v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+    };
+    auto absorb = [&](uint64_t m) {
+      v3 ^= m;
+      round();
+      round();
+      v0 ^= m;
+    };
+
+    absorb(static_cast<uint32_t>(wd));
+
+    const char* pos = name.begin();
+    size_t remaining = name.size();
+    for (; remaining >= 8; pos += 8, remaining -= 8) {
+      uint64_t m;
+      memcpy(&m, pos, 8);
+      absorb(m);
+    }
+    uint64_t last = static_cast<uint64_t>(name.size() + 8) << 56;
+    for (size_t i = 0; i < remaining; i++) {
+      last |= static_cast<uint64_t>(static_cast<kj::byte>(pos[i])) << (8 * i);
+    }
+    absorb(last);
+
+    v2 ^= 0xff;
+    round();
+    round();
+    round();
+    round();
+
+    uint64_t result = v0 ^ v1 ^ v2 ^ v3;
+    return result == 0 ? 1 : result;  // 0 can't be used as a FlatHashMap key
+  }
+
+  void randomizeHashKey() {
+#ifdef SYS_getrandom
+    if (syscall(SYS_getrandom, hashKey, sizeof(hashKey), 0) == sizeof(hashKey)) return;
+#endif
+
+    // The kernel is too old for getrandom(), and we've been chrooted away from /dev/urandom.
+    // Settle for something the app is unlikely to guess.
+    hashKey[0] = monotonicNanos() ^ reinterpret_cast<uintptr_t>(this);
+    hashKey[1] = (static_cast<uint64_t>(getpid()) << 32) ^ time(nullptr);
+  }
+
+  kj::Promise<void> startPolling() {
+    // We've run out of inotify watches. Drop the ones we have -- another grain may be able to
+    // make better use of them -- and periodically walk the tree instead.
+
+    KJ_LOG(WARNING, "out of inotify watches; falling back to polling grain storage usage",
+           watchMap.size());
+
+    observer = nullptr;
+    inotifyFd = nullptr;
+    watchMap.clear();
+    entries.clear();
+    inodes.clear();
+    pendingWatches.clear();
+    rescanQueue.clear();
+
+    // Until the first walk is done, keep reporting the size we've already counted.
+    return pollLoop();
+  }
+
+  kj::Promise<void> pollLoop() {
+    walkStack.add(nullptr);  // root directory
+    walkTotal = 0;
+    walkStartTime = monotonicNanos();
+    return continueWalk();
+  }
+
+  kj::Promise<void> continueWalk() {
+    if (walkStack.size() > 0) {
+      // List one directory per turn of the event loop, so that other work isn't held up.
+      auto path = kj::mv(walkStack.end()[-1]);
+      walkStack.removeLast();
+
+      listDirectory(path, [&](kj::StringPtr name) {
+        auto usage = getDiskUsage(path, name);
+        if (usage.links > 1 && !usage.isDir) {
+          bool created;
+          walkLinks.findOrCreate(usage.ino, created);
+          if (!created) return;
+        }
+        walkTotal += usage.bytes;
+        if (usage.isDir) {
+          walkStack.add(kj::mv(usage.path));
+        }
+      });
+
+      return yield().then([this]() { return continueWalk(); });
+    }
+
+    walkLinks.clear();
+    totalSize = walkTotal;
+    maybeReportSize();
+
+    // Spend no more than about 2% of our time walking, but don't walk more than twice a minute.
+    kj::Duration delay = (monotonicNanos() - walkStartTime) * 50 * kj::NANOSECONDS;
+    if (delay < 30 * kj::SECONDS) delay = 30 * kj::SECONDS;
+    return timer.afterDelay(delay).then([this]() { return pollLoop(); });
+  }
+
+  kj::Promise<void> yield() {
+    // Unlike evalLater(), a timer doesn't fire until the event loop has checked for I/O, so
+    // this lets RPCs through while we're busy.
+    return timer.afterDelay(0 * kj::NANOSECONDS);
+  }
+
+  static int64_t monotonicNanos() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+  }
+
+  template <typename Func>
+  static void listDirectory(kj::StringPtr path, Func&& func) {
+    // Calls func(name) for each child of the given directory, if it still exists.
+
+    const char* pathPtr = path == nullptr ? "." : path.cStr();
+    DIR* dir = opendir(pathPtr);
+    if (dir == nullptr) return;
+    KJ_DEFER(closedir(dir));
+
+    for (;;) {
+      errno = 0;
+      struct dirent* entry = readdir(dir);
+      if (entry == nullptr) {
+        int error = errno;
+        if (error == 0) {
+          break;
+        } else {
+          KJ_FAIL_SYSCALL("readdir", error, pathPtr);
+        }
+      }
+
+      kj::StringPtr name = entry->d_name;
+      if (name != "." && name != "..") {
+        func(name);
+      }
+    }
   }
 
   struct DiskUsage {
     kj::String path;
     uint64_t bytes;
+    uint64_t ino;  // 0 if the file doesn't exist
+    uint64_t links;
     bool isDir;
   };
 
@@ -364,18 +693,12 @@ private:
         DiskUsage result;
         result.path = kj::mv(path);
         result.isDir = S_ISDIR(stats.st_mode);
+        result.ino = stats.st_ino;
+        result.links = stats.st_nlink;
 
         // Count blocks, not length, because what we care about is allocated space.
         result.bytes = stats.st_blocks * 512;
 
-        if (stats.st_nlink != 0) {
-          // Note: sometimes the link count actually is zero; it often is, for example, during
-          // `git init`, which rapidly creates and deletes some temporary files.
-
-          // Divide by link count so that files with many hardlinks aren't overcounted.
-          result.bytes /= stats.st_nlink;
-        }
-
         return result;
       }
 
@@ -387,7 +710,7 @@ private:
           break;
         case ENOENT:   // File no longer exists...
         case ENOTDIR:  // ... and a parent directory was replaced.
-          return {kj::mv(path), 0, false};
+          return {kj::mv(path), 0, 0, 0, false};
         default:
           // Default
           KJ_FAIL_SYSCALL("lstat", error, path);
@@ -439,6 +762,437 @@ private:
   }
 };
 
+// =======================================================================================
+// Web publishing
+
+class FileRangeInputStream final: public kj::InputStream {
+  // Reads bytes [offset, end) of a file using pread(). We deliberately avoid mmap() here: the
+  // bytes get copied into an RPC message either way, and a mapping would SIGBUS the whole
+  // supervisor if the app truncated the file while we were serving it.
+
+public:
+  FileRangeInputStream(kj::AutoCloseFd fd, uint64_t offset, uint64_t end)
+      : fd(kj::mv(fd)), offset(offset), end(end) {}
+
+  size_t tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    maxBytes = kj::min(maxBytes, end - offset);
+    minBytes = kj::min(minBytes, maxBytes);
+
+    byte* pos = reinterpret_cast<byte*>(buffer);
+    size_t total = 0;
+    while (total < minBytes) {
+      ssize_t n;
+      KJ_SYSCALL(n = pread(fd, pos + total, maxBytes - total, offset));
+      if (n == 0) {
+        // File shrank underneath us.
+        end = offset;
+        break;
+      }
+      total += n;
+      offset += n;
+    }
+    return total;
+  }
+
+private:
+  kj::AutoCloseFd fd;
+  uint64_t offset;
+  uint64_t end;
+};
+
+static kj::String wwwFileETag(const struct stat& stats) {
+  // Like most web servers, we derive the entity tag from the file's metadata rather than hashing
+  // its content, so that answering a conditional request costs only a stat().
+  uint64_t mtimeNs = uint64_t(stats.st_mtim.tv_sec) * 1000000000ull + stats.st_mtim.tv_nsec;
+  return kj::str('"', kj::hex(uint64_t(stats.st_ino)), '-', kj::hex(uint64_t(stats.st_size)),
+                 '-', kj::hex(mtimeNs), '"');
+}
+
+static bool wwwFileETagMatches(kj::StringPtr ifNoneMatch, kj::StringPtr eTag) {
+  // Evaluates an If-None-Match header against `eTag` using weak comparison, as RFC 7232
+  // prescribes for If-None-Match.
+
+  for (auto candidate: split(ifNoneMatch, ',')) {
+    auto tag = trim(candidate);
+    if (tag == "*") return true;
+    kj::StringPtr opaque = tag;
+    if (opaque.startsWith("W/")) opaque = opaque.slice(2);
+    if (opaque == eTag) return true;
+  }
+  return false;
+}
+
+static PumpOptions wwwFilePumpOptions(uint64_t size) {
+  // Static files come from local disk or memory and are typically consumed by a fast front-end,
+  // so send them in much bigger pieces than the generic defaults to cut per-message overhead.
+  PumpOptions options;
+  options.expectedSize = size;
+  options.maxChunkSize = 1u << 20;
+  options.windowSize = 4u << 20;
+  return options;
+}
+
+class WwwFileCache {
+  // A small LRU cache of files under sandbox/www, so that web publishing can serve popular static
+  // files without touching the disk on every request. Like DiskUsageWatcher, we use inotify to
+  // find out when things change, and we drop the affected entries.
+  //
+  // We only cache a file if we were already watching its directory when we read it, if it has
+  // exactly one hard link, and if it wasn't reached through any symlinks, since otherwise we might
+  // miss changes to it. Note that inotify does not report writes made through a shared mmap(); we
+  // assume apps don't publish files that way.
+  //
+  // DiskUsageWatcher already watches every directory in the grain, www included, but we keep an
+  // inotify instance of our own rather than listening in on it. It can't serve us: it doesn't ask
+  // for IN_ATTRIB, which we need to notice a touched file's new mtime (and so its ETag); it
+  // catches up on a queue overflow gradually, while we must drop everything at once; and when it
+  // runs out of watches it switches to polling, which would leave us serving stale files. Watches
+  // on the same directory in two instances do count twice against the per-user limit, but only
+  // for www, which is usually small, and if we hit the limit we simply stop caching.
+
+public:
+  class Content: public kj::Refcounted {
+  public:
+    Content(kj::Array<byte> bytes, const struct stat& stats)
+        : bytes(kj::mv(bytes)), eTag(wwwFileETag(stats)), lastModified(stats.st_mtim.tv_sec) {}
+
+    const kj::Array<byte> bytes;
+    const kj::String eTag;
+    const int64_t lastModified;
+  };
+
+  explicit WwwFileCache(kj::UnixEventPort& eventPort)
+      : eventPort(eventPort),
+        readTask(kj::evalLater([this]() { return init(); })
+            .eagerlyEvaluate([this](kj::Exception&& e) {
+          KJ_LOG(ERROR, "web publishing cache failed; caching disabled", e);
+          reset();
+        })) {}
+
+  kj::Maybe<kj::Own<Content>> find(kj::StringPtr path) {
+    // Look up `path` (relative to sandbox/www), counting a hit or a miss.
+
+    auto iter = entries.find(path);
+    if (iter == entries.end()) {
+      ++misses;
+      return nullptr;
+    }
+
+    ++hits;
+    Entry& entry = *iter->second;
+    lru.splice(lru.begin(), lru, entry.lruPos);
+    return kj::addRef(*entry.content);
+  }
+
+  kj::Maybe<kj::Own<Content>> tryAdd(kj::StringPtr path, int fd, const struct stat& stats) {
+    // Reads the open file `fd` into the cache under `path`, if it is eligible. `path` must
+    // already have been checked to be canonical.
+
+    if (stats.st_size > MAX_FILE_SIZE || stats.st_nlink != 1) return nullptr;
+
+    KJ_IF_MAYBE(slash, path.findLast('/')) {
+      if (dirs.find(kj::heapString(path.slice(0, *slash))) == dirs.end()) return nullptr;
+    } else {
+      if (dirs.find("") == dirs.end()) return nullptr;
+    }
+
+    if (!isReachedDirectly(path, stats)) return nullptr;
+
+    auto bytes = kj::heapArray<byte>(stats.st_size);
+    if (kj::FdInputStream(fd).tryRead(bytes.begin(), bytes.size(), bytes.size()) < bytes.size()) {
+      // File shrank since we stat()ed it.
+      return nullptr;
+    }
+
+    remove(path);
+
+    auto entry = kj::heap<Entry>();
+    entry->path = kj::heapString(path);
+    entry->content = kj::refcounted<Content>(kj::mv(bytes), stats);
+    lru.push_front(entry.get());
+    entry->lruPos = lru.begin();
+    totalBytes += entry->content->bytes.size();
+    auto result = kj::addRef(*entry->content);
+    kj::StringPtr key = entry->path;
+    entries.insert(std::make_pair(key, kj::mv(entry)));
+
+    while (totalBytes > MAX_TOTAL_BYTES) {
+      remove(lru.back()->path);
+    }
+
+    return kj::mv(result);
+  }
+
+  uint64_t getHitCount() { return hits; }
+  uint64_t getMissCount() { return misses; }
+  size_t getEntryCount() { return entries.size(); }
+  size_t getTotalBytes() { return totalBytes; }
+
+private:
+  static constexpr int64_t MAX_FILE_SIZE = 512u << 10;
+  static constexpr size_t MAX_TOTAL_BYTES = 8u << 20;
+
+  struct Entry {
+    kj::String path;
+    kj::Own<Content> content;
+    std::list<Entry*>::iterator lruPos;
+  };
+
+  kj::UnixEventPort& eventPort;
+  kj::AutoCloseFd inotifyFd;
+  kj::Own<kj::UnixEventPort::FdObserver> observer;
+  int sandboxWd = -1;
+
+  std::unordered_map<int, kj::String> watchMap;
+  // Maps inotify watch descriptors to the directory they watch, relative to sandbox/www.
+
+  std::map<kj::StringPtr, int> dirs;
+  // Reverse of watchMap. Keys point into watchMap's values.
+
+  kj::Vector<kj::String> pendingWatches;
+  // Directories to watch once we've finished processing the current batch of events.
+
+  std::map<kj::StringPtr, kj::Own<Entry>> entries;
+  // Keys point into Entry::path. Ordered so that we can drop everything under a directory.
+
+  std::list<Entry*> lru;
+  // Most recently used first.
+
+  size_t totalBytes = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+
+  kj::Promise<void> readTask;
+
+  void reset() {
+    // Forget everything, including all watches.
+
+    entries.clear();
+    lru.clear();
+    totalBytes = 0;
+    dirs.clear();
+    watchMap.clear();
+    pendingWatches.resize(0);
+    observer = nullptr;
+    inotifyFd = nullptr;
+  }
+
+  kj::Promise<void> init() {
+    // Start watching sandbox/www. Also called to start over when we lose track of things.
+
+    reset();
+
+    int fd;
+    KJ_SYSCALL(fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    inotifyFd = kj::AutoCloseFd(fd);
+    observer = kj::heap<kj::UnixEventPort::FdObserver>(eventPort, inotifyFd,
+        kj::UnixEventPort::FdObserver::OBSERVE_READ);
+
+    // Watch the sandbox directory itself so that we notice `www` being created or replaced.
+    KJ_SYSCALL(sandboxWd = inotify_add_watch(inotifyFd, "sandbox",
+        IN_CREATE | IN_DELETE | IN_MOVE | IN_ONLYDIR | IN_DONT_FOLLOW));
+
+    pendingWatches.add(kj::heapString(""));
+    return readLoop();
+  }
+
+  void addPendingWatches() {
+    while (pendingWatches.size() > 0) {
+      auto path = kj::mv(pendingWatches.end()[-1]);
+      pendingWatches.removeLast();
+      addWatch(kj::mv(path));
+    }
+  }
+
+  void addWatch(kj::String&& path) {
+    static const uint32_t FLAGS =
+        IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVE |
+        IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+    auto fullPath = path.size() == 0 ? kj::str("sandbox/www") : kj::str("sandbox/www/", path);
+
+    int wd;
+    for (;;) {
+      wd = inotify_add_watch(inotifyFd, fullPath.cStr(), FLAGS);
+      if (wd >= 0) break;
+
+      int error = errno;
+      switch (error) {
+        case EINTR:
+          break;
+        case ENOENT:
+        case ENOTDIR:
+          // Gone already (or never existed). If it comes back, we'll hear about it.
+          return;
+        default:
+          KJ_FAIL_SYSCALL("inotify_add_watch", error, fullPath);
+      }
+    }
+
+    // Anything cached under this path was read without a watch in place.
+    invalidate(path);
+
+    auto iter = watchMap.find(wd);
+    if (iter != watchMap.end()) {
+      dirs.erase(iter->second);
+      watchMap.erase(iter);
+    }
+    dirs.erase(path);
+    kj::String& watchPath = watchMap[wd];
+    watchPath = kj::mv(path);
+    dirs[watchPath] = wd;
+
+    // Watch subdirectories too. Anything created after the watch above was added will also show
+    // up as an event, so we may add some of these twice, which is harmless.
+    DIR* dir = opendir(fullPath.cStr());
+    if (dir == nullptr) return;
+    KJ_DEFER(closedir(dir));
+    for (;;) {
+      errno = 0;
+      struct dirent* entry = readdir(dir);
+      if (entry == nullptr) {
+        int error = errno;
+        if (error == 0) break;
+        KJ_FAIL_SYSCALL("readdir", error, fullPath);
+      }
+
+      kj::StringPtr name = entry->d_name;
+      if (name == "." || name == "..") continue;
+      if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN) {
+        // For DT_UNKNOWN, addWatch() will simply fail with ENOTDIR if it's not a directory.
+        pendingWatches.add(childPath(watchPath, name));
+      }
+    }
+  }
+
+  static bool isReachedDirectly(kj::StringPtr path, const struct stat& stats) {
+    // Returns true if neither sandbox/www nor any component of `path` under it is a symlink, and
+    // `path` still names the file described by `stats`. We only watch the directories along the
+    // path itself, so we'd never hear about changes to a symlink's target.
+
+    auto fullPath = kj::str("sandbox/www/", path);
+    struct stat linkStats;
+
+    for (size_t pos = strlen("sandbox/"); pos < fullPath.size(); ++pos) {
+      if (fullPath[pos] != '/') continue;
+      fullPath[pos] = '\0';
+      int result = lstat(fullPath.cStr(), &linkStats);
+      fullPath[pos] = '/';
+      if (result < 0 || !S_ISDIR(linkStats.st_mode)) return false;
+    }
+
+    return lstat(fullPath.cStr(), &linkStats) == 0 && S_ISREG(linkStats.st_mode) &&
+        linkStats.st_dev == stats.st_dev && linkStats.st_ino == stats.st_ino;
+  }
+
+  static kj::String childPath(kj::StringPtr parent, kj::StringPtr name) {
+    return parent.size() == 0 ? kj::heapString(name) : kj::str(parent, '/', name);
+  }
+
+  void remove(kj::StringPtr path) {
+    auto iter = entries.find(path);
+    if (iter != entries.end()) {
+      totalBytes -= iter->second->content->bytes.size();
+      lru.erase(iter->second->lruPos);
+      entries.erase(iter);
+    }
+  }
+
+  void invalidate(kj::StringPtr path) {
+    // Drop `path` and everything under it.
+
+    if (path.size() == 0) {
+      entries.clear();
+      lru.clear();
+      totalBytes = 0;
+      return;
+    }
+
+    auto iter = entries.lower_bound(path);
+    while (iter != entries.end() && iter->first.startsWith(path)) {
+      auto next = iter;
+      ++next;
+      if (iter->first.size() == path.size() || iter->first[path.size()] == '/') {
+        totalBytes -= iter->second->content->bytes.size();
+        lru.erase(iter->second->lruPos);
+        entries.erase(iter);
+      }
+      iter = next;
+    }
+  }
+
+  kj::Promise<void> readLoop() {
+    addPendingWatches();
+    return observer->whenBecomesReadable().then([this]() {
+      alignas(uint64_t) kj::byte buffer[4096];
+
+      for (;;) {
+        ssize_t n;
+        KJ_NONBLOCKING_SYSCALL(n = read(inotifyFd, buffer, sizeof(buffer)));
+
+        if (n < 0) {
+          // EAGAIN; try again later.
+          return readLoop();
+        }
+
+        KJ_ASSERT(n > 0, "inotify EOF?");
+
+        kj::byte* pos = buffer;
+        while (n > 0) {
+          auto event = reinterpret_cast<struct inotify_event*>(pos);
+          size_t eventSize = sizeof(struct inotify_event) + event->len;
+          KJ_ASSERT(eventSize <= n, "inotify returned partial event?");
+          n -= eventSize;
+          pos += eventSize;
+
+          if (event->mask & IN_Q_OVERFLOW) {
+            KJ_LOG(WARNING, "inotify event queue overflow; flushing web publishing cache");
+            return init();
+          }
+
+          if (event->wd == sandboxWd) {
+            if (event->len > 0 && kj::StringPtr(event->name) == "www") {
+              // The whole www directory came or went.
+              return init();
+            }
+            continue;
+          }
+
+          auto iter = watchMap.find(event->wd);
+          if (iter == watchMap.end()) {
+            // Trailing event for a watch we already dropped.
+            continue;
+          }
+
+          if ((event->mask & IN_ISDIR) && (event->mask & IN_MOVE)) {
+            // A directory was renamed, which makes the paths of all of the watches under it stale.
+            // This is rare enough that starting over is the simplest correct answer.
+            return init();
+          }
+
+          if (event->len > 0) {
+            auto path = childPath(iter->second, event->name);
+            invalidate(path);
+            if ((event->mask & IN_ISDIR) && (event->mask & IN_CREATE)) {
+              pendingWatches.add(kj::mv(path));
+            }
+          }
+
+          if (event->mask & IN_IGNORED) {
+            // The directory is gone.
+            invalidate(iter->second);
+            auto dirIter = dirs.find(iter->second);
+            if (dirIter != dirs.end() && dirIter->second == event->wd) {
+              dirs.erase(dirIter);
+            }
+            watchMap.erase(iter);
+          }
+        }
+      }
+    });
+  }
+};
+
 // =======================================================================================
 // Termination handling:  Must kill child if parent terminates.
 //
@@ -581,7 +1335,11 @@ kj::MainFunc SupervisorMain::getMain() {
                  "RECOMMENDED during normal use, but it may be useful for debugging.")
       .addOption({"stdio"}, [this]() { keepStdio = true; return true; },
                  "Don't redirect the sandbox's stdio.  Useful for debugging.")
-      .addOption({"dev"}, [this]() { devmode = true; return true; },
+      .addOption({"dev"}, [this]() -> kj::MainBuilder::Validity {
+                   if (prestarted) return "--dev can't be used with a pre-started supervisor";
+                   devmode = true;
+                   return true;
+                 },
                  "Allow some system calls useful for debugging which are blocked in production.")
       .addOption({"seccomp-dump-pfc"}, [this]() { seccompDumpPfc = true; return true; },
                  "Dump libseccomp PFC output.")
@@ -594,6 +1352,21 @@ kj::MainFunc SupervisorMain::getMain() {
       .build();
 }
 
+kj::MainFunc SupervisorMain::getPoolMain() {
+  return kj::MainBuilder(context, "Sandstorm version " SANDSTORM_VERSION,
+                         "Pre-starts a Sandstorm grain supervisor: does all sandbox setup that "
+                         "doesn't depend on the grain, then reads the arguments to `supervisor` "
+                         "from stdin, each terminated by a NUL byte, and proceeds as if it had "
+                         "been started with them. --uid, if needed, must be given here rather "
+                         "than on stdin. Exits quietly if stdin is closed without sending "
+                         "anything.")
+      .addOptionWithArg({"uid"}, KJ_BIND_METHOD(*this, setUid), "<uid>",
+                        "Use setuid sandbox rather than userns. Must start as root, but swiches "
+                        "to <uid> to run the app.")
+      .callAfterParsing(KJ_BIND_METHOD(*this, runPool))
+      .build();
+}
+
 // =====================================================================================
 // Flag handlers
 
@@ -635,6 +1408,9 @@ kj::MainBuilder::Validity SupervisorMain::setVar(kj::StringPtr path) {
 }
 
 kj::MainBuilder::Validity SupervisorMain::setUid(kj::StringPtr arg) {
+  if (prestarted) {
+    return "--uid must be passed to supervisor-pool, not in the grain assignment";
+  }
   KJ_IF_MAYBE(u, parseUInt(arg, 10)) {
     if (getuid() != 0) {
       return "must start as root to use --uid";
@@ -663,7 +1439,10 @@ kj::MainBuilder::Validity SupervisorMain::addCommandArg(kj::StringPtr arg) {
 // =====================================================================================
 
 kj::MainBuilder::Validity SupervisorMain::run() {
-  isIpTablesAvailable = checkIfIpTablesLoaded();
+  if (!prestarted) {
+    isIpTablesAvailable = checkIfIpTablesLoaded();
+    buildSeccompFilter();
+  }
 
   setupSupervisor();
 
@@ -703,6 +1482,44 @@ kj::MainBuilder::Validity SupervisorMain::run() {
   }
 }
 
+kj::MainBuilder::Validity SupervisorMain::runPool() {
+  // Everything up to the grain assignment here must not depend on the grain or on any flag other
+  // than --uid. In particular --dev is refused once `prestarted` is set, since it changes both the
+  // uid map and the seccomp filter.
+
+  isIpTablesAvailable = checkIfIpTablesLoaded();
+  buildSeccompFilter();
+
+  KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+  closeFds();
+  setResourceLimits();
+  unshareOuter();
+
+  // Wait for the backend to tell us which grain we're running.
+  auto assignment = readAll(STDIN_FILENO);
+  if (assignment.size() == 0) {
+    // The backend shut down or shrank its pool.
+    _exit(0);
+  }
+  KJ_REQUIRE(assignment[assignment.size() - 1] == '\0', "incomplete supervisor-pool assignment");
+
+  kj::Vector<kj::StringPtr> args;
+  size_t start = 0;
+  for (size_t i: kj::indices(assignment)) {
+    if (assignment[i] == '\0') {
+      args.add(kj::StringPtr(assignment.begin() + start, i - start));
+      start = i + 1;
+    }
+  }
+
+  prestarted = true;
+  getMain()(context.getProgramName(), args);
+
+  // getMain() ends with run(), which never returns, unless the arguments were invalid, in which
+  // case MainBuilder has already reported the problem and exited.
+  KJ_UNREACHABLE;
+}
+
 // =====================================================================================
 
 void SupervisorMain::bind(kj::StringPtr src, kj::StringPtr dst, unsigned long flags) {
@@ -752,14 +1569,27 @@ kj::String SupervisorMain::realPath(kj::StringPtr path) {
 // =====================================================================================
 
 void SupervisorMain::setupSupervisor() {
-  // Enable no_new_privs so that once we drop privileges we can never regain them through e.g.
-  // execing a suid-root binary.  Sandboxed apps should not need that.
-  KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+  if (prestarted) {
+    // runPool() already did the rest, except for checkPaths(), which must create the grain's
+    // files as the sandbox user rather than as root.
+    KJ_IF_MAYBE(u, sandboxUid) {
+      KJ_SYSCALL(seteuid(*u));
+      checkPaths();
+      KJ_SYSCALL(seteuid(0));
+    } else {
+      checkPaths();
+    }
+  } else {
+    // Enable no_new_privs so that once we drop privileges we can never regain them through e.g.
+    // execing a suid-root binary.  Sandboxed apps should not need that.
+    KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+
+    closeFds();
+    setResourceLimits();
+    checkPaths();
+    unshareOuter();
+  }
 
-  closeFds();
-  setResourceLimits();
-  checkPaths();
-  unshareOuter();
   setupFilesystem();
   setupStdio();
 
@@ -1064,149 +1894,23 @@ void SupervisorMain::setupStdio() {
   // supervisor, stdout is how we tell our parent that we're ready to receive connections.
 }
 
+void SupervisorMain::buildSeccompFilter() {
+  // Compile the seccomp filter to be installed by setupSeccomp(). Pre-started supervisors do this
+  // before they are assigned a grain, which takes libseccomp's cost off the grain's start-up path.
+  // We never read the program from disk: anything that could write the file could then choose the
+  // sandbox policy of every grain.
+
+  seccompFilter = getSeccompFilter(devmode);
+}
+
 void SupervisorMain::setupSeccomp() {
-  // Install a rudimentary seccomp blacklist.
-  // TODO(security): Change this to a whitelist.
-
-  scmp_filter_ctx ctx = seccomp_init(SCMP_ACT_ALLOW);
-  if (ctx == nullptr)
-    KJ_FAIL_SYSCALL("seccomp_init", 0);  // No real error code
-  KJ_DEFER(seccomp_release(ctx));
-
-#define CHECK_SECCOMP(call)                   \
-  do {                                        \
-    if (auto result = (call)) {               \
-      KJ_FAIL_SYSCALL(#call, -result);        \
-    }                                         \
-  } while (0)
-
-  // Native code only for now, so there are no seccomp_arch_add calls.
-
-  // Redundant, but this is standard and harmless.
-  CHECK_SECCOMP(seccomp_attr_set(ctx, SCMP_FLTATR_CTL_NNP, 1));
-
-  // It's easy to inadvertently issue an x32 syscall (e.g. syscall(-1)).  Such syscalls
-  // should fail, but there's no need to kill the issuer.
-  CHECK_SECCOMP(seccomp_attr_set(ctx, SCMP_FLTATR_ACT_BADARCH, SCMP_ACT_ERRNO(ENOSYS)));
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmissing-field-initializers"  // SCMP_* macros produce these
-  // Disable some things that seem scary.
-  if (!devmode) {
-    // ptrace is scary
-    CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(ptrace), 0));
-  } else {
-    // Try to be somewhat safe with ptrace in dev mode.  Note that the ability to modify
-    // orig_ax using ptrace allows a complete seccomp bypass.
-    CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(ptrace), 1,
-      SCMP_A0(SCMP_CMP_EQ, PTRACE_POKEUSER)));
-    CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(ptrace), 1,
-      SCMP_A0(SCMP_CMP_EQ, PTRACE_SETREGS)));
-    CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(ptrace), 1,
-      SCMP_A0(SCMP_CMP_EQ, PTRACE_SETFPREGS)));
-    CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(ptrace), 1,
-      SCMP_A0(SCMP_CMP_EQ, PTRACE_SETREGSET)));
-  }
-
-  // Restrict the set of allowable network protocol families
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_GE, AF_NETLINK + 1)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_AX25)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_IPX)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_APPLETALK)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_NETROM)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_BRIDGE)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_ATMPVC)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_X25)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_ROSE)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_DECnet)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_NETBEUI)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_SECURITY)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1,
-     SCMP_A0(SCMP_CMP_EQ, AF_KEY)));
-
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(add_key), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(request_key), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(keyctl), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(syslog), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(uselib), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(personality), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(acct), 0));
-
-  // 16-bit code is unnecessary in the sandbox, and modify_ldt is a historic source
-  // of interesting information leaks.
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(modify_ldt), 0));
-
-  // Despite existing at a 64-bit syscall, set_thread_area is only useful
-  // for 32-bit programs.  64-bit programs use arch_prctl instead.
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(set_thread_area), 0));
-
-  // Disable namespaces. Nested sandboxing could be useful but the attack surface is large.
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(unshare), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(mount), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(pivot_root), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(quotactl), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(clone), 1,
-      SCMP_A0(SCMP_CMP_MASKED_EQ, CLONE_NEWUSER, CLONE_NEWUSER)));
-
-  // AIO is scary.
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(io_setup), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(io_destroy), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(io_getevents), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(io_submit), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(io_cancel), 0));
-
-  // Scary vm syscalls
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(remap_file_pages), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(mbind), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(get_mempolicy), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(set_mempolicy), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(migrate_pages), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(move_pages), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(vmsplice), 0));
-
-  // Scary futex operations
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(set_robust_list), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(get_robust_list), 0));
-
-  // Utterly terrifying profiling operations
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(perf_event_open), 0));
-
-  // Don't let apps specify their own seccomp filters, since seccomp filters are literally programs
-  // that run in-kernel (albeit with a very limited instruction set).
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EINVAL), SCMP_SYS(prctl), 1,
-      SCMP_A0(SCMP_CMP_EQ, PR_SET_SECCOMP)));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(seccomp), 0));
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(bpf), 0));
-
-  // New syscalls that don't seem useful to Sandstorm apps therefore we will disallow them.
-  // TODO(cleanup): Can we somehow specify "disallow all calls greater than N" to preemptively
-  //   disable things until we've reviewed them?
-  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(userfaultfd), 0));
-
-  // TOOD(someday): See if we can get away with turning off mincore, madvise, sysinfo etc.
-
-  // TODO(someday): Turn off POSIX message queues and other such esoteric features.
+  // Install the filter from buildSeccompFilter().
 
   if (seccompDumpPfc) {
-    seccomp_export_pfc(ctx, 1);
+    compileSeccompFilter(devmode, true);
   }
 
-  CHECK_SECCOMP(seccomp_load(ctx));
-
-#pragma GCC diagnostic pop
-#undef CHECK_SECCOMP
+  loadSeccompFilter(seccompFilter);
 }
 
 void SupervisorMain::unshareNetwork() {
@@ -2008,10 +2712,12 @@ class SupervisorMain::SupervisorImpl final: public Supervisor::Server {
 public:
   inline SupervisorImpl(kj::UnixEventPort& eventPort, MainView<>::Client&& mainView,
                         WakelockSet& wakelockSet, kj::AutoCloseFd startAppEvent,
-                        SandstormCore::Client sandstormCore, kj::Own<CapRedirector> coreRedirector)
+                        SandstormCore::Client sandstormCore, kj::Own<CapRedirector> coreRedirector,
+                        WwwFileCache& wwwFileCache)
       : eventPort(eventPort), mainView(kj::mv(mainView)),
         wakelockSet(wakelockSet), sandstormCore(sandstormCore),
-        coreRedirector(kj::mv(coreRedirector)), startAppEvent(kj::mv(startAppEvent)) {}
+        coreRedirector(kj::mv(coreRedirector)), startAppEvent(kj::mv(startAppEvent)),
+        wwwFileCache(wwwFileCache) {}
 
   kj::Promise<void> getMainView(GetMainViewContext context) override {
     ensureStarted();
@@ -2124,6 +2830,16 @@ public:
     auto params = context.getParams();
     auto path = params.getPath();
 
+    KJ_IF_MAYBE(content, wwwFileCache.find(path)) {
+      // Only canonical paths of regular files are ever cached, so skip straight to serving.
+      uint64_t start, end;
+      if (!checkWwwFileRequest(context, (*content)->bytes.size(), (*content)->eTag,
+                               (*content)->lastModified, start, end)) {
+        return kj::READY_NOW;
+      }
+      return sendWwwFileContent(context, kj::mv(*content), start, end);
+    }
+
     {
       // Prohibit non-canonical requests.
       auto parts = split(path, '/');
@@ -2140,18 +2856,26 @@ public:
     }
 
     auto fullPath = kj::str("sandbox/www/", path);
-    KJ_IF_MAYBE(fd, raiiOpenIfExists(fullPath, O_RDONLY)) {
+    KJ_IF_MAYBE(fd, raiiOpenIfExists(fullPath, O_RDONLY | O_CLOEXEC)) {
       struct stat stats;
       KJ_SYSCALL(fstat(*fd, &stats));
 
       if (S_ISREG(stats.st_mode)) {
+        uint64_t start, end;
+        if (!checkWwwFileRequest(context, stats.st_size, wwwFileETag(stats),
+                                 stats.st_mtim.tv_sec, start, end)) {
+          return kj::READY_NOW;
+        }
+
+        KJ_IF_MAYBE(content, wwwFileCache.tryAdd(path, *fd, stats)) {
+          return sendWwwFileContent(context, kj::mv(*content), start, end);
+        }
+
         auto stream = params.getStream();
         context.releaseParams();
-        auto req = stream.expectSizeRequest();
-        req.setSize(stats.st_size);
-        auto expectSizeTask = req.send();
-        auto inStream = kj::heap<kj::FdInputStream>(kj::mv(*fd));
-        return pump(*inStream, kj::mv(stream)).attach(kj::mv(inStream), kj::mv(expectSizeTask));
+        auto inStream = kj::heap<FileRangeInputStream>(kj::mv(*fd), start, end);
+        return pump(*inStream, kj::mv(stream), wwwFilePumpOptions(end - start))
+            .attach(kj::mv(inStream));
       } else if (S_ISDIR(stats.st_mode)) {
         context.getResults(capnp::MessageSize {4, 0})
             .setStatus(Supervisor::WwwFileStatus::DIRECTORY);
@@ -2166,6 +2890,15 @@ public:
     }
   }
 
+  kj::Promise<void> getWwwFileCacheStats(GetWwwFileCacheStatsContext context) override {
+    auto results = context.getResults(capnp::MessageSize {8, 0});
+    results.setHits(wwwFileCache.getHitCount());
+    results.setMisses(wwwFileCache.getMissCount());
+    results.setEntryCount(wwwFileCache.getEntryCount());
+    results.setTotalBytes(wwwFileCache.getTotalBytes());
+    return kj::READY_NOW;
+  }
+
 private:
   kj::UnixEventPort& eventPort;
   MainView<>::Client mainView;
@@ -2173,6 +2906,56 @@ private:
   SandstormCore::Client sandstormCore;
   kj::Own<CapRedirector> coreRedirector;
   kj::AutoCloseFd startAppEvent;
+  WwwFileCache& wwwFileCache;
+
+  static bool checkWwwFileRequest(GetWwwFileHackContext& context, uint64_t size,
+                                  kj::StringPtr eTag, int64_t lastModified,
+                                  uint64_t& start, uint64_t& end) {
+    // Fills in the results describing a regular file and evaluates the request's conditional and
+    // range parameters against them. Returns false if the call has been fully answered.
+    // Otherwise, sets [start, end) to the part of the file which should be sent.
+
+    auto params = context.getParams();
+    auto results = context.getResults();
+    results.setSize(size);
+    results.setETag(eTag);
+    results.setLastModified(lastModified);
+
+    if (params.hasIfNoneMatch()) {
+      if (wwwFileETagMatches(params.getIfNoneMatch(), eTag)) {
+        results.setStatus(Supervisor::WwwFileStatus::NOT_MODIFIED);
+        return false;
+      }
+    } else if (params.getIfModifiedSince() != 0 &&
+               lastModified <= params.getIfModifiedSince()) {
+      results.setStatus(Supervisor::WwwFileStatus::NOT_MODIFIED);
+      return false;
+    }
+
+    start = 0;
+    end = size;
+    if (params.hasRange()) {
+      auto range = params.getRange();
+      start = range.getStart();
+      end = kj::min(range.getEnd(), size);
+      if (start >= end) {
+        results.setStatus(Supervisor::WwwFileStatus::RANGE_NOT_SATISFIABLE);
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  static kj::Promise<void> sendWwwFileContent(GetWwwFileHackContext& context,
+                                              kj::Own<WwwFileCache::Content> content,
+                                              uint64_t start, uint64_t end) {
+    auto stream = context.getParams().getStream();
+    context.releaseParams();
+    auto inStream = kj::heap<kj::ArrayInputStream>(content->bytes.slice(start, end));
+    return pump(*inStream, kj::mv(stream), wwwFilePumpOptions(end - start))
+        .attach(kj::mv(inStream), kj::mv(content));
+  }
 
   void ensureStarted() {
     // Ensure that the app has been started.
@@ -2355,6 +3138,9 @@ kj::Promise<void> SupervisorMain::DefaultSystemConnector::run(
   DiskUsageWatcher diskWatcher(ioContext.unixEventPort, ioContext.provider->getTimer(), coreCap);
   auto diskWatcherTask = diskWatcher.init();
 
+  // Cache hot files for web publishing.
+  WwwFileCache wwwFileCache(ioContext.unixEventPort);
+
   // Set up the RPC connection to the app and export the supervisor interface.
   auto appConnection = ioContext.lowLevelProvider->wrapSocketFd(apiFd,
       kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
@@ -2380,7 +3166,7 @@ kj::Promise<void> SupervisorMain::DefaultSystemConnector::run(
   //   them persistable, though it's unclear how that would work with SessionContext.
   Supervisor::Client mainCap = kj::heap<SupervisorImpl>(
       ioContext.unixEventPort, kj::mv(app), wakelockSet, kj::mv(startEventFd),
-      coreCap, kj::addRef(*coreRedirector));
+      coreCap, kj::addRef(*coreRedirector), wwwFileCache);
 
   auto acceptTask = systemConnector->run(ioContext, kj::mv(mainCap), kj::mv(coreRedirector));
 
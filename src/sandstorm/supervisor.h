@@ -24,6 +24,7 @@
 #include <capnp/capability.h>
 #include <sandstorm/supervisor.capnp.h>
 #include <kj/io.h>
+#include <linux/filter.h>
 
 namespace sandstorm {
 
@@ -43,6 +44,13 @@ public:
 
   kj::MainFunc getMain() override;
 
+  kj::MainFunc getPoolMain();
+  // Main function for `supervisor-pool`, which pre-starts a supervisor for a grain to be named
+  // later. It does all of the setup that doesn't depend on the grain, then reads the arguments it
+  // would normally have been given on the command line from stdin, each NUL-terminated, and
+  // continues as a regular supervisor. The backend keeps a few of these around so that opening a
+  // grain doesn't have to wait for that setup.
+
   void setIsNew(bool isNew);
   void setMountProc(bool mountProc);
   kj::MainBuilder::Validity setAppName(kj::StringPtr name);
@@ -81,6 +89,7 @@ public:
   // system connects to it. "The system" means the rest of Sandstorm, e.g. the Sandstorm front-end.
 
   kj::MainBuilder::Validity run();
+  kj::MainBuilder::Validity runPool();
 
 private:
   kj::ProcessContext& context;
@@ -100,6 +109,14 @@ private:
   bool isIpTablesAvailable = false;
   kj::Maybe<uid_t> sandboxUid;  // nullptr = use userns
 
+  bool prestarted = false;
+  // True if this is a `supervisor-pool` process that has received its grain assignment, meaning
+  // that the grain-independent setup is already done.
+
+  kj::ArrayPtr<const sock_filter> seccompFilter;
+  // The BPF program to load when entering the sandbox, from getSeccompFilter(). Fetched once,
+  // before forking, since the supervisor and the app both need it.
+
   class SandstormApiImpl;
   class SupervisorImpl;
 
@@ -115,6 +132,7 @@ private:
   void makeCharDeviceNode(const char *name, const char* realName, int major, int minor);
   void setupFilesystem();
   void setupStdio();
+  void buildSeccompFilter();
   void setupSeccomp();
   void unshareNetwork();
   bool checkIfIpTablesLoaded();
@@ -0,0 +1,45 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_TEST_UTIL_H_
+#define SANDSTORM_TEST_UTIL_H_
+// Helpers shared by the *-test.c++ files. Not for use outside of tests.
+
+#include "util.h"
+#include <kj/debug.h>
+#include <kj/string.h>
+#include <stdlib.h>
+
+namespace sandstorm {
+
+class TempDir {
+  // A fresh directory under /tmp, deleted along with its contents when this goes out of scope.
+
+public:
+  explicit TempDir(kj::StringPtr name = "test") {
+    auto pattern = kj::str("/tmp/sandstorm-", name, ".XXXXXX");
+    if (mkdtemp(pattern.begin()) == nullptr) KJ_FAIL_SYSCALL("mkdtemp", errno, pattern);
+    path = kj::mv(pattern);
+  }
+  ~TempDir() noexcept(false) { recursivelyDelete(path); }
+  KJ_DISALLOW_COPY(TempDir);
+
+  kj::String path;
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_TEST_UTIL_H_
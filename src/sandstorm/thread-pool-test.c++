@@ -0,0 +1,77 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread-pool.h"
+#include <kj/test.h>
+
+namespace sandstorm {
+namespace {
+
+KJ_TEST("ThreadPool keeps a thread free of bulk jobs") {
+  auto io = kj::setupAsyncIo();
+  ThreadPool pool(*io.lowLevelProvider, 2);
+
+  kj::MutexGuarded<uint> started(0u);
+  kj::MutexGuarded<bool> released(false);
+  auto bulkJob = [&]() {
+    ++*started.lockExclusive();
+    released.lockExclusive().wait([](const bool& r) { return r; });
+  };
+
+  auto first = pool.runBulk([&]() { bulkJob(); });
+  auto second = pool.runBulk([&]() { bulkJob(); });
+  started.lockExclusive().wait([](const uint& n) { return n > 0; });
+
+  // The first bulk job holds one thread. The other runs ordinary jobs, but not the second.
+  KJ_EXPECT(pool.run([]() { return 123; }).wait(io.waitScope) == 123);
+  KJ_EXPECT(*started.lockShared() == 1);
+
+  *released.lockExclusive() = true;
+  first.wait(io.waitScope);
+  second.wait(io.waitScope);
+  KJ_EXPECT(*started.lockShared() == 2);
+}
+
+KJ_TEST("ThreadPool::parallelize() borrows only idle threads") {
+  // Off the pool, there's only the calling thread.
+  uint calls = 0;
+  ThreadPool::parallelize(4, [&]() { ++calls; });
+  KJ_EXPECT(calls == 1);
+
+  auto io = kj::setupAsyncIo();
+  ThreadPool pool(*io.lowLevelProvider, 3);
+  kj::MutexGuarded<uint> running(0u);
+  pool.runBulk([&]() {
+    // Bulk work may use only two of the three threads, so of the three calls asked for, the
+    // caller's and one other happen. Each waits for the other, so the third is never started.
+    ThreadPool::parallelize(3, [&]() {
+      auto lock = running.lockExclusive();
+      ++*lock;
+      lock.wait([](const uint& n) { return n >= 2; });
+    });
+  }).wait(io.waitScope);
+  KJ_EXPECT(*running.lockShared() == 2);
+
+  // Exceptions from any of the calls come back to the caller.
+  KJ_EXPECT(kj::runCatchingExceptions([&]() {
+    pool.runBulk([]() {
+      ThreadPool::parallelize(2, []() { KJ_FAIL_ASSERT("oops"); });
+    }).wait(io.waitScope);
+  }) != nullptr);
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,203 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread-pool.h"
+#include <kj/debug.h>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+namespace sandstorm {
+
+static kj::AutoCloseFd newEventFd(int flags) {
+  int fd;
+  KJ_SYSCALL(fd = eventfd(0, EFD_CLOEXEC | flags));
+  return kj::AutoCloseFd(fd);
+}
+
+static thread_local ThreadPool* currentPool = nullptr;
+// The pool whose worker this thread is, if any.
+
+ThreadPool::ThreadPool(kj::LowLevelAsyncIoProvider& ioProvider, uint threadCount)
+    : maxBulkRunning(kj::max(threadCount, 2u) - 1),
+      doneEvent(newEventFd(EFD_NONBLOCK)),
+      doneStream(ioProvider.wrapInputFd(doneEvent,
+          kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
+          kj::LowLevelAsyncIoProvider::ALREADY_NONBLOCK)),
+      tasks(*this) {
+  KJ_REQUIRE(threadCount > 0);
+  tasks.add(receiveCompletions());
+  for (uint i = 0; i < threadCount; i++) {
+    workers.add(kj::heap<kj::Thread>([this]() { workerLoop(); }));
+  }
+}
+
+ThreadPool::~ThreadPool() noexcept(false) {
+  // Let running jobs finish, but don't start any more. Jobs that never ran are destroyed along
+  // with `queue`, rejecting their promises.
+  queue.lockExclusive()->shuttingDown = true;
+  workers.clear();
+}
+
+void ThreadPool::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+void ThreadPool::add(kj::Own<Job> job, bool bulk) {
+  auto lock = queue.lockExclusive();
+  (bulk ? lock->pendingBulk : lock->pending).push_back(kj::mv(job));
+}
+
+void ThreadPool::workerLoop() {
+  currentPool = this;
+
+  for (;;) {
+    kj::Own<Job> job;
+    bool bulk = false;
+    {
+      auto lock = queue.lockExclusive();
+      lock.wait([this](const Queue& q) {
+        return q.shuttingDown || !q.pending.empty() ||
+               (!q.pendingBulk.empty() && q.bulkRunning < maxBulkRunning);
+      });
+      if (lock->shuttingDown) return;
+
+      if (!lock->pending.empty()) {
+        job = kj::mv(lock->pending.front());
+        lock->pending.pop_front();
+      } else {
+        job = kj::mv(lock->pendingBulk.front());
+        lock->pendingBulk.pop_front();
+        ++lock->bulkRunning;
+        bulk = true;
+      }
+      job->dequeued();
+    }
+
+    job->run();
+
+    bool wasEmpty;
+    {
+      auto lock = queue.lockExclusive();
+      if (bulk) --lock->bulkRunning;
+      wasEmpty = lock->done.empty();
+      lock->done.add(kj::mv(job));
+    }
+    if (wasEmpty) {
+      // Otherwise, the event loop has yet to collect the earlier jobs, and will get this one too.
+      uint64_t one = 1;
+      KJ_SYSCALL(write(doneEvent, &one, sizeof(one)));
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------------------
+
+struct ThreadPool::HelperGroup {
+  kj::Function<void()>& func;
+
+  // Protected by the pool's queue lock:
+  uint running;
+  kj::Maybe<kj::Exception> error;
+};
+
+class ThreadPool::HelperJob final: public Job {
+  // Calls a parallelize() caller's function on another of the pool's threads. The caller waits
+  // for every helper that has been dequeued, and removes those that haven't from the queue, so
+  // `group` outlives every use of it here.
+
+public:
+  HelperJob(ThreadPool& pool, HelperGroup& group): pool(pool), group(group) {}
+
+  void dequeued() override {
+    ++group.running;
+  }
+
+  void run() override {
+    auto error = kj::runCatchingExceptions([this]() { group.func(); });
+
+    auto lock = pool.queue.lockExclusive();
+    if (group.error == nullptr) {
+      group.error = kj::mv(error);
+    }
+    --group.running;
+  }
+
+  void complete() override {}
+
+private:
+  ThreadPool& pool;
+  HelperGroup& group;
+};
+
+void ThreadPool::parallelize(uint threadCount, kj::Function<void()> func) {
+  if (currentPool == nullptr || threadCount <= 1) {
+    func();
+  } else {
+    currentPool->parallelizeHere(threadCount, func);
+  }
+}
+
+void ThreadPool::parallelizeHere(uint threadCount, kj::Function<void()>& func) {
+  HelperGroup group { func, 0, nullptr };
+  kj::Vector<Job*> helpers;
+  {
+    auto lock = queue.lockExclusive();
+    for (uint i = 1; i < threadCount; i++) {
+      auto helper = kj::heap<HelperJob>(*this, group);
+      helpers.add(helper.get());
+      lock->pendingBulk.push_back(kj::mv(helper));
+    }
+  }
+
+  auto error = kj::runCatchingExceptions([&]() { func(); });
+
+  {
+    auto lock = queue.lockExclusive();
+
+    // Helpers that haven't started yet have nothing left to do.
+    auto& pending = lock->pendingBulk;
+    pending.erase(std::remove_if(pending.begin(), pending.end(), [&](const kj::Own<Job>& job) {
+      return std::find(helpers.begin(), helpers.end(), job.get()) != helpers.end();
+    }), pending.end());
+
+    lock.wait([&group](const Queue&) { return group.running == 0; });
+    if (error == nullptr) {
+      error = kj::mv(group.error);
+    }
+  }
+
+  KJ_IF_MAYBE(exception, error) {
+    kj::throwFatalException(kj::mv(*exception));
+  }
+}
+
+kj::Promise<void> ThreadPool::receiveCompletions() {
+  return doneStream->read(&eventValue, sizeof(eventValue), sizeof(eventValue))
+      .then([this](size_t n) {
+    kj::Vector<kj::Own<Job>> done;
+    {
+      auto lock = queue.lockExclusive();
+      done = kj::mv(lock->done);
+    }
+    for (auto& job: done) {
+      job->complete();
+    }
+    return receiveCompletions();
+  });
+}
+
+}  // namespace sandstorm
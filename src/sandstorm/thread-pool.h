@@ -0,0 +1,183 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_THREAD_POOL_H_
+#define SANDSTORM_THREAD_POOL_H_
+
+#include <kj/async-io.h>
+#include <kj/function.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
+#include <kj/vector.h>
+#include <deque>
+
+namespace sandstorm {
+
+class ThreadPool: private kj::TaskSet::ErrorHandler {
+  // Runs blocking work -- mostly filesystem operations, which can take seconds on a big grain or
+  // a busy disk -- on a fixed set of threads, so that it doesn't stall the event loop that
+  // everything else is waiting on. Results are delivered back on the event loop's thread.
+  //
+  // Jobs come in two kinds. Bulk jobs, such as copying or walking a whole grain, can take minutes
+  // and nobody is waiting on them urgently, so ordinary jobs always go first, and bulk jobs are
+  // never allowed to occupy every thread.
+  //
+  // Not thread-safe: except for parallelize(), all calls must come from the event loop's thread.
+
+public:
+  ThreadPool(kj::LowLevelAsyncIoProvider& ioProvider, uint threadCount);
+  ~ThreadPool() noexcept(false);
+  KJ_DISALLOW_COPY(ThreadPool);
+
+  template <typename Func>
+  kj::Promise<decltype(kj::instance<Func>()())> run(Func&& func);
+  // Calls `func()` on one of the pool's threads and returns its result, or the exception it
+  // threw. Jobs start in the order in which they were submitted, ahead of any bulk jobs.
+  //
+  // `func` runs to completion even if the promise is canceled, so it must own (capture by value)
+  // whatever it uses.
+
+  template <typename Func>
+  kj::Promise<decltype(kj::instance<Func>()())> runBulk(Func&& func);
+  // Like run(), but for a bulk job. Bulk jobs start in the order in which they were submitted,
+  // whenever no ordinary job is waiting and fewer than `max(threadCount - 1, 1)` bulk jobs are
+  // running.
+
+  static void parallelize(uint threadCount, kj::Function<void()> func);
+  // Calls `func()` on the calling thread and, if that is one of a pool's threads, on up to
+  // `threadCount - 1` of its other threads at once, then returns once all of those calls have.
+  // Each call should take work from a queue shared with the others until none is left. The
+  // other threads are requested as bulk jobs; any that haven't started by the time the calling
+  // thread's own call returns aren't needed and are never used, so this never waits on unrelated
+  // jobs. Rethrows the first exception any of the calls threw.
+
+private:
+  class Job {
+  public:
+    virtual ~Job() noexcept(false) {}
+    virtual void run() = 0;       // called on a worker thread
+    virtual void complete() = 0;  // called on the event loop's thread
+    virtual void dequeued() {}    // called on a worker thread, with the queue locked
+  };
+
+  template <typename T>
+  class JobImpl;
+  struct HelperGroup;
+  class HelperJob;
+
+  struct Queue {
+    std::deque<kj::Own<Job>> pending;      // ordinary jobs waiting for a worker
+    std::deque<kj::Own<Job>> pendingBulk;  // bulk jobs waiting for a worker
+    uint bulkRunning = 0;
+    kj::Vector<kj::Own<Job>> done;         // waiting for the event loop
+    bool shuttingDown = false;
+  };
+
+  const uint maxBulkRunning;
+  kj::MutexGuarded<Queue> queue;
+  kj::AutoCloseFd doneEvent;  // eventfd; signaled when jobs are added to `done`
+  kj::Own<kj::AsyncInputStream> doneStream;
+  uint64_t eventValue;
+  kj::TaskSet tasks;
+
+  kj::Vector<kj::Own<kj::Thread>> workers;
+  // Declared last so that they're joined before anything they use is destroyed.
+
+  template <typename Func>
+  kj::Promise<decltype(kj::instance<Func>()())> submit(Func&& func, bool bulk);
+  void add(kj::Own<Job> job, bool bulk);
+  void workerLoop();
+  void parallelizeHere(uint threadCount, kj::Function<void()>& func);
+  kj::Promise<void> receiveCompletions();
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+// =======================================================================================
+// inline implementation details
+
+template <typename T>
+class ThreadPool::JobImpl final: public Job {
+public:
+  JobImpl(kj::Function<T()> func, kj::Own<kj::PromiseFulfiller<T>> fulfiller)
+      : func(kj::mv(func)), fulfiller(kj::mv(fulfiller)) {}
+
+  void run() override {
+    error = kj::runCatchingExceptions([this]() { result = func(); });
+    func = nullptr;  // release captures on the worker, where they were used
+  }
+
+  void complete() override {
+    KJ_IF_MAYBE(exception, error) {
+      fulfiller->reject(kj::mv(*exception));
+    } else KJ_IF_MAYBE(value, result) {
+      fulfiller->fulfill(kj::mv(*value));
+    }
+  }
+
+private:
+  kj::Function<T()> func;
+  kj::Own<kj::PromiseFulfiller<T>> fulfiller;
+  kj::Maybe<T> result;
+  kj::Maybe<kj::Exception> error;
+};
+
+template <>
+class ThreadPool::JobImpl<void> final: public Job {
+public:
+  JobImpl(kj::Function<void()> func, kj::Own<kj::PromiseFulfiller<void>> fulfiller)
+      : func(kj::mv(func)), fulfiller(kj::mv(fulfiller)) {}
+
+  void run() override {
+    error = kj::runCatchingExceptions([this]() { func(); });
+    func = nullptr;
+  }
+
+  void complete() override {
+    KJ_IF_MAYBE(exception, error) {
+      fulfiller->reject(kj::mv(*exception));
+    } else {
+      fulfiller->fulfill();
+    }
+  }
+
+private:
+  kj::Function<void()> func;
+  kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  kj::Maybe<kj::Exception> error;
+};
+
+template <typename Func>
+kj::Promise<decltype(kj::instance<Func>()())> ThreadPool::submit(Func&& func, bool bulk) {
+  typedef decltype(kj::instance<Func>()()) T;
+  auto paf = kj::newPromiseAndFulfiller<T>();
+  add(kj::heap<JobImpl<T>>(kj::Function<T()>(kj::fwd<Func>(func)), kj::mv(paf.fulfiller)), bulk);
+  return kj::mv(paf.promise);
+}
+
+template <typename Func>
+kj::Promise<decltype(kj::instance<Func>()())> ThreadPool::run(Func&& func) {
+  return submit(kj::fwd<Func>(func), false);
+}
+
+template <typename Func>
+kj::Promise<decltype(kj::instance<Func>()())> ThreadPool::runBulk(Func&& func) {
+  return submit(kj::fwd<Func>(func), true);
+}
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_THREAD_POOL_H_
@@ -0,0 +1,106 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "union-fs.h"
+#include "util.h"
+#include "test-util.h"
+#include <kj/test.h>
+#include <kj/thread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+namespace {
+
+class RacingNode final: public fuse::Node, public kj::Refcounted {
+  // Wraps a loopback node, calling `inWindow` after each lookup or stat but before returning its
+  // result -- the window in which a real loopback node has the FUSE driver's big lock released,
+  // and other workers may use the same LookupCache.
+
+public:
+  RacingNode(kj::Own<fuse::Node> delegate, kj::Function<void()> inWindow)
+      : delegate(kj::mv(delegate)), inWindow(kj::mv(inWindow)) {}
+
+  kj::Own<fuse::Node> addRef() override { return kj::addRef(*this); }
+
+  kj::Maybe<LookupResults> lookup(kj::StringPtr name) override {
+    auto result = delegate->lookup(name);
+    inWindow();
+    return kj::mv(result);
+  }
+
+  GetAttributesResults getAttributes() override {
+    auto result = delegate->getAttributes();
+    inWindow();
+    return result;
+  }
+
+  kj::Maybe<kj::Own<fuse::File>> openAsFile() override { return delegate->openAsFile(); }
+  kj::Maybe<kj::Own<fuse::Directory>> openAsDirectory() override {
+    return delegate->openAsDirectory();
+  }
+  kj::String readlink() override { return delegate->readlink(); }
+
+private:
+  kj::Own<fuse::Node> delegate;
+  kj::Function<void()> inWindow;
+};
+
+KJ_TEST("LookupCache doesn't keep results that raced with a change") {
+  TempDir tmp;
+  auto cache = newLookupCache();
+  auto dirPath = kj::heapString(tmp.path);
+  auto filePath = kj::str(tmp.path, "/foo");
+
+  // Another FUSE worker, whose requests sync the cache, consuming inotify events.
+  auto otherDir = newCachingNode(newLoopbackFuseNode(dirPath, kj::maxValue), dirPath, *cache);
+
+  // Look up `foo` before it exists, and have the other worker create it and look it up while
+  // our lookup's result is in flight.
+  bool created = false;
+  auto dir = newCachingNode(kj::refcounted<RacingNode>(
+      newLoopbackFuseNode(dirPath, kj::maxValue), [&]() {
+    if (created) return;
+    created = true;
+    kj::Thread([&]() {
+      kj::FdOutputStream(raiiOpen(filePath, O_WRONLY | O_CREAT | O_EXCL, 0644)).write("x", 1);
+      KJ_SYSCALL(chmod(filePath.cStr(), 0644));  // in spite of the umask
+      KJ_EXPECT(otherDir->lookup("foo") != nullptr);
+    });
+  }), dirPath, *cache);
+
+  KJ_EXPECT(dir->lookup("foo") == nullptr);
+  KJ_EXPECT(dir->lookup("foo") != nullptr, "cached a miss that the create should have cleared");
+
+  // Likewise, a file's attributes changing while we stat it.
+  bool changed = false;
+  auto file = newCachingNode(kj::refcounted<RacingNode>(
+      newLoopbackFuseNode(filePath, kj::maxValue), [&]() {
+    if (changed) return;
+    changed = true;
+    kj::Thread([&]() {
+      KJ_SYSCALL(chmod(filePath.cStr(), 0600));
+      KJ_EXPECT(otherDir->lookup("bar") == nullptr);
+    });
+  }), filePath, *cache);
+
+  KJ_EXPECT(file->getAttributes().attributes.permissions == 0644);
+  KJ_EXPECT(file->getAttributes().attributes.permissions == 0600,
+            "cached attributes that the chmod should have cleared");
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -20,10 +20,12 @@
 #include <capnp/serialize.h>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <stdlib.h>
 #include "fuse.h"
 #include "util.h"
@@ -48,6 +50,10 @@ protected:
     return delegate->lookup(name);
   }
 
+  uint64_t getNegativeLookupTtl() override {
+    return delegate->getNegativeLookupTtl();
+  }
+
   GetAttributesResults getAttributes() override {
     return delegate->getAttributes();
   }
@@ -68,6 +74,271 @@ protected:
   kj::Own<fuse::Node> delegate;
 };
 
+}  // namespace
+
+class LookupCache: public kj::Refcounted {
+  // Remembers, for the loopback layers of one union mount, which paths don't exist and what the
+  // attributes of the ones that do are. A build inside `spk dev` probes the same nonexistent
+  // paths over and over -- every search path entry for every header, module, and shared library
+  // -- and each probe otherwise costs an lstat() per layer.
+  //
+  // Entries are only recorded for paths whose parent directory is under an inotify watch, and
+  // pending inotify events are drained synchronously (via sync()) before every use, so the cache
+  // is always exactly as fresh as the kernel's view of the source tree. No event loop is needed,
+  // which matters since the FUSE driver may call us from any thread (under its big lock).
+
+public:
+  LookupCache() { reset(); }
+
+  void sync();
+  // Apply all pending inotify events. Call before every query.
+
+  bool watch(kj::StringPtr dir);
+  // Start watching `dir` (if not already watched). Returns false if the watch couldn't be
+  // established (e.g. the user's inotify watch limit is exhausted), in which case nothing about
+  // the directory's children may be cached.
+
+  bool isWatched(kj::StringPtr dir) { return dirs.count(dir) != 0; }
+
+  bool isMissing(kj::StringPtr path) { return missing.count(path) != 0; }
+  void addMissing(kj::String path);
+
+  kj::Maybe<const fuse::Node::GetAttributesResults&> findAttributes(kj::StringPtr path);
+  void addAttributes(kj::String path, const fuse::Node::GetAttributesResults& results);
+
+  uint64_t getGeneration() { return generation; }
+  // Changes whenever inotify events are consumed or watches are dropped. A caller that releases
+  // the FUSE driver's big lock between watching and looking must record this first, and may only
+  // add what it found if it hasn't changed since: otherwise another thread's sync() may have
+  // consumed the very event that would have invalidated the entry.
+
+private:
+  static constexpr size_t MAX_ENTRIES = 65536;
+  // Each table is simply cleared when it reaches this size.
+
+  kj::AutoCloseFd inotifyFd;
+
+  std::unordered_map<int, kj::Vector<kj::String>> watchMap;
+  // Maps watch descriptors to the paths through which we reached the directory. Usually there is
+  // exactly one, but two search path entries can overlap.
+
+  std::map<kj::StringPtr, int> dirs;
+  // Keys point into `watchMap`'s strings.
+
+  std::map<kj::StringPtr, kj::String> missing;
+  // Keys point at their own values.
+
+  struct AttributesEntry {
+    kj::String path;
+    fuse::Node::GetAttributesResults results;
+  };
+  std::map<kj::StringPtr, AttributesEntry> attributes;
+
+  uint64_t generation = 0;
+
+  void reset();
+  void invalidate(kj::StringPtr path);
+};
+
+void LookupCache::reset() {
+  // Forget everything, including all watches (by closing the inotify FD).
+
+  ++generation;
+  attributes.clear();
+  missing.clear();
+  dirs.clear();
+  watchMap.clear();
+
+  int fd;
+  KJ_SYSCALL(fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+  inotifyFd = kj::AutoCloseFd(fd);
+}
+
+void LookupCache::invalidate(kj::StringPtr path) {
+  missing.erase(path);
+  attributes.erase(path);
+}
+
+void LookupCache::sync() {
+  for (;;) {
+    alignas(uint64_t) kj::byte buffer[4096];
+
+    ssize_t n;
+    KJ_NONBLOCKING_SYSCALL(n = read(inotifyFd, buffer, sizeof(buffer)));
+    if (n < 0) return;  // would block
+    KJ_ASSERT(n > 0, "inotify EOF?");
+    ++generation;
+
+    kj::byte* pos = buffer;
+    while (n > 0) {
+      auto event = reinterpret_cast<struct inotify_event*>(pos);
+      size_t eventSize = sizeof(struct inotify_event) + event->len;
+      KJ_ASSERT(eventSize <= n, "inotify returned partial event?");
+      n -= eventSize;
+      pos += eventSize;
+
+      if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF) ||
+          ((event->mask & IN_ISDIR) && (event->mask & (IN_DELETE | IN_MOVE)))) {
+        // Either we lost events, or a whole directory went away or was renamed, which makes
+        // everything we know about paths beneath it stale. This is rare enough that starting over
+        // is the simplest correct answer.
+        reset();
+        return;
+      }
+
+      auto iter = watchMap.find(event->wd);
+      if (iter == watchMap.end()) {
+        // Trailing event for a watch we already dropped.
+        continue;
+      }
+
+      for (auto& alias: iter->second) {
+        // Any change inside a directory changes the directory's own mtime.
+        attributes.erase(alias);
+        if (event->len > 0) {
+          invalidate(kj::str(alias, '/', event->name));
+        }
+      }
+
+      if (event->mask & IN_IGNORED) {
+        for (auto& alias: iter->second) {
+          dirs.erase(alias);
+        }
+        watchMap.erase(iter);
+      }
+    }
+  }
+}
+
+bool LookupCache::watch(kj::StringPtr dir) {
+  if (isWatched(dir)) return true;
+
+  int wd = inotify_add_watch(inotifyFd, dir.cStr(),
+      IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVE | IN_DELETE_SELF | IN_MOVE_SELF |
+      IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK);
+  if (wd < 0) {
+    // Not a directory, vanished, or out of watches. In any case, just don't cache.
+    return false;
+  }
+
+  auto& aliases = watchMap[wd];
+  if (dirs.size() >= MAX_ENTRIES) {
+    // Too many directories to keep track of. Drop all the other watches rather than growing
+    // without bound.
+    for (auto& other: watchMap) {
+      if (other.first != wd) {
+        KJ_SYSCALL(inotify_rm_watch(inotifyFd, other.first));
+        for (auto& alias: other.second) {
+          dirs.erase(alias);
+        }
+        other.second.clear();
+      }
+    }
+    // The IN_IGNORED events for the removed watches will clean up `watchMap`. Meanwhile,
+    // nothing we know about their children is trustworthy anymore.
+    ++generation;
+    missing.clear();
+    attributes.clear();
+  }
+
+  aliases.add(kj::heapString(dir));
+  dirs.insert(std::make_pair(kj::StringPtr(aliases.back()), wd));
+  return true;
+}
+
+void LookupCache::addMissing(kj::String path) {
+  if (missing.size() >= MAX_ENTRIES) missing.clear();
+  kj::StringPtr key = path;
+  missing.insert(std::make_pair(key, kj::mv(path)));
+}
+
+kj::Maybe<const fuse::Node::GetAttributesResults&> LookupCache::findAttributes(
+    kj::StringPtr path) {
+  auto iter = attributes.find(path);
+  if (iter == attributes.end()) {
+    return nullptr;
+  } else {
+    return iter->second.results;
+  }
+}
+
+void LookupCache::addAttributes(
+    kj::String path, const fuse::Node::GetAttributesResults& results) {
+  if (attributes.size() >= MAX_ENTRIES) attributes.clear();
+  kj::StringPtr key = path;
+  attributes.insert(std::make_pair(key, AttributesEntry { kj::mv(path), results }));
+}
+
+namespace {
+
+class CachingNode final: public DelegatingNode {
+  // Wraps a loopback node, consulting and filling a LookupCache.
+
+public:
+  CachingNode(kj::Own<fuse::Node> delegate, kj::String path, kj::Own<LookupCache> cache)
+    : DelegatingNode(kj::mv(delegate)), path(kj::mv(path)), cache(kj::mv(cache)) {}
+
+protected:
+  kj::Maybe<LookupResults> lookup(kj::StringPtr name) override {
+    cache->sync();
+
+    auto childPath = kj::str(path, '/', name);
+    if (cache->isMissing(childPath)) {
+      return nullptr;
+    }
+
+    // Watch before looking, so that a file created in between is not missed. The loopback lookup
+    // may release the big lock, so remember where the cache was, too.
+    bool watched = cache->watch(path);
+    uint64_t generation = cache->getGeneration();
+
+    auto maybeResult = delegate->lookup(name);
+    KJ_IF_MAYBE(result, maybeResult) {
+      return LookupResults {
+        kj::refcounted<CachingNode>(kj::mv(result->node), kj::mv(childPath), kj::addRef(*cache)),
+        result->ttl
+      };
+    } else {
+      if (watched && cache->getGeneration() == generation) {
+        cache->addMissing(kj::mv(childPath));
+      }
+      return nullptr;
+    }
+  }
+
+  GetAttributesResults getAttributes() override {
+    cache->sync();
+
+    KJ_IF_MAYBE(cached, cache->findAttributes(path)) {
+      return *cached;
+    }
+
+    // Changes to the node itself are reported to its parent's watch, while changes to a
+    // directory's mtime (by adding or removing children) are reported to its own watch.
+    bool parentWatched = false;
+    KJ_IF_MAYBE(slashPos, path.findLast('/')) {
+      parentWatched = cache->isWatched(path.slice(0, *slashPos));
+    }
+    bool selfWatched = cache->isWatched(path);
+    uint64_t generation = cache->getGeneration();
+
+    auto result = delegate->getAttributes();
+
+    // Hard links may be modified through some other path that we aren't watching.
+    auto& attrs = result.attributes;
+    if (parentWatched && (attrs.type == Type::DIRECTORY ? selfWatched : attrs.linkCount == 1) &&
+        cache->getGeneration() == generation) {
+      cache->addAttributes(kj::heapString(path), result);
+    }
+
+    return result;
+  }
+
+private:
+  kj::String path;
+  kj::Own<LookupCache> cache;
+};
+
 class SimpleDirectory: public fuse::Directory, public kj::Refcounted {
   // Implementation of fuse::Directory that is easier to implement because it just calls a
   // method that returns the whole content as an array.
@@ -207,6 +478,15 @@ protected:
     }
   }
 
+  uint64_t getNegativeLookupTtl() override {
+    // A name is missing from the union only as long as it is missing from every layer.
+    uint64_t ttl = kj::maxValue;
+    for (auto& layer: layers) {
+      ttl = kj::min(ttl, layer->getNegativeLookupTtl());
+    }
+    return ttl;
+  }
+
   kj::Maybe<kj::Own<fuse::Directory>> openAsDirectory() override {
     // Call openAsDirectory() on all children and then return a UnionDirectory of the pipelined
     // results. No need to wait; if pipelined requests on the layers fail then we simply treat
@@ -424,6 +704,10 @@ protected:
     return nullptr;
   }
 
+  uint64_t getNegativeLookupTtl() override {
+    return kj::maxValue;
+  }
+
   GetAttributesResults getAttributes() override {
 
     auto result = GetAttributesResults {};
@@ -488,6 +772,10 @@ protected:
     return nullptr;
   }
 
+  uint64_t getNegativeLookupTtl() override {
+    return kj::maxValue;
+  }
+
   GetAttributesResults getAttributes() override {
     auto results = GetAttributesResults {};
     results.ttl = kj::maxValue;
@@ -551,6 +839,10 @@ protected:
     return nullptr;
   }
 
+  uint64_t getNegativeLookupTtl() override {
+    return kj::maxValue;
+  }
+
   GetAttributesResults getAttributes() override {
     auto result = GetAttributesResults {};
     result.ttl = kj::maxValue;
@@ -583,6 +875,15 @@ private:
 
 }  // namespace
 
+kj::Own<LookupCache> newLookupCache() {
+  return kj::refcounted<LookupCache>();
+}
+
+kj::Own<fuse::Node> newCachingNode(kj::Own<fuse::Node> delegate, kj::StringPtr path,
+                                   LookupCache& cache) {
+  return kj::refcounted<CachingNode>(kj::mv(delegate), kj::heapString(path), kj::addRef(cache));
+}
+
 kj::Own<fuse::Node> makeUnionFs(kj::StringPtr sourceDir, spk::SourceMap::Reader sourceMap,
                                spk::Manifest::Reader manifest,
                                spk::BridgeConfig::Reader bridgeConfig, kj::StringPtr bridgePath,
@@ -614,6 +915,8 @@ kj::Own<fuse::Node> makeUnionFs(kj::StringPtr sourceDir, spk::SourceMap::Reader
   // Empty /proc/cpuinfo will be overmounted by the supervisor.
   layers.add(kj::refcounted<SingletonNode>(kj::refcounted<SimpleDataNode>(nullptr), "proc/cpuinfo"));
 
+  auto lookupCache = newLookupCache();
+
   for (auto mapping: searchPath) {
     kj::StringPtr sourcePath = mapping.getSourcePath();
     kj::String ownSourcePath;
@@ -641,7 +944,8 @@ kj::Own<fuse::Node> makeUnionFs(kj::StringPtr sourceDir, spk::SourceMap::Reader
 
     // Create the filesystem node.
     // We set a low TTL here, but note that the spk tool overrides it anyway.
-    kj::Own<fuse::Node> node = newLoopbackFuseNode(sourcePath, 1 * kj::SECONDS);
+    kj::Own<fuse::Node> node = newCachingNode(
+        newLoopbackFuseNode(sourcePath, 1 * kj::SECONDS), sourcePath, *lookupCache);
 
     // If any contents are hidden, wrap in a hiding node.
     auto hides = mapping.getHidePaths();
@@ -36,6 +36,18 @@ kj::Own<fuse::Node> makeUnionFs(kj::StringPtr sourceDir, spk::SourceMap::Reader
 //
 // `sourceMap` must remain valid until the returned node is destroyed.
 
+class LookupCache;
+// Remembers which source tree paths are missing, and the attributes of those that exist, for
+// makeUnionFs(), invalidated through inotify. Not thread-safe: use under the FUSE driver's big
+// lock.
+
+kj::Own<LookupCache> newLookupCache();
+
+kj::Own<fuse::Node> newCachingNode(kj::Own<fuse::Node> delegate, kj::StringPtr path,
+                                   LookupCache& cache);
+// Wraps `delegate`, a loopback node for `path` on disk, so that lookups and attributes go through
+// `cache`. makeUnionFs() does this for every source map entry; exposed for testing.
+
 struct FileMapping {
   kj::Array<kj::String> sourcePaths;
   // All disk paths mapped to the virtual path. If the first turns out to be a file, then the
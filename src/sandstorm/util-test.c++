@@ -300,5 +300,173 @@ KJ_TEST("SubprocessSet") {
   promiseCat.wait(io.waitScope);
 }
 
+class CollectingByteStream final: public ByteStream::Server {
+public:
+  kj::Vector<byte> data;
+  kj::Maybe<uint64_t> expectedSize;
+  bool isDone = false;
+  uint writesInFlight = 0;
+  uint maxWritesInFlight = 0;
+  bool rejectExpectSize = false;
+
+protected:
+  kj::Promise<void> write(WriteContext context) override {
+    KJ_EXPECT(!isDone);
+    data.addAll(context.getParams().getData());
+    maxWritesInFlight = kj::max(maxWritesInFlight, ++writesInFlight);
+    // Take several turns to return, so that a pipelining pump will have sent more writes by then.
+    return yieldTurns(10).then([this]() { --writesInFlight; });
+  }
+
+  kj::Promise<void> done(DoneContext context) override {
+    KJ_EXPECT(writesInFlight == 0);
+    isDone = true;
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> expectSize(ExpectSizeContext context) override {
+    if (rejectExpectSize) {
+      return KJ_EXCEPTION(UNIMPLEMENTED, "expectSize() not implemented");
+    }
+    expectedSize = context.getParams().getSize();
+    return kj::READY_NOW;
+  }
+
+private:
+  static kj::Promise<void> yieldTurns(uint n) {
+    if (n == 0) return kj::READY_NOW;
+    return kj::evalLater([n]() { return yieldTurns(n - 1); });
+  }
+};
+
+KJ_TEST("pump") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto input = kj::heapArray<byte>(1u << 20);
+  for (size_t i: kj::indices(input)) {
+    input[i] = i * 7;
+  }
+
+  {
+    auto server = kj::heap<CollectingByteStream>();
+    auto& serverRef = *server;
+    ByteStream::Client client = kj::mv(server);
+
+    kj::ArrayInputStream in(input);
+    pump(in, client).wait(waitScope);
+
+    KJ_EXPECT(serverRef.isDone);
+    KJ_EXPECT(serverRef.expectedSize == nullptr);
+    KJ_EXPECT(serverRef.data.asPtr() == input.asPtr());
+    KJ_EXPECT(serverRef.maxWritesInFlight > 1);
+  }
+
+  {
+    auto server = kj::heap<CollectingByteStream>();
+    auto& serverRef = *server;
+    ByteStream::Client client = kj::mv(server);
+
+    PumpOptions options;
+    options.expectedSize = input.size();
+    options.windowSize = 1;  // no pipelining
+    kj::ArrayInputStream in(input);
+    pump(in, client, options).wait(waitScope);
+
+    KJ_EXPECT(serverRef.isDone);
+    KJ_EXPECT(KJ_ASSERT_NONNULL(serverRef.expectedSize) == input.size());
+    KJ_EXPECT(serverRef.data.asPtr() == input.asPtr());
+    KJ_EXPECT(serverRef.maxWritesInFlight == 1);
+  }
+
+  {
+    // expectSize() is only a hint; the pump must succeed even if the receiver rejects it.
+    auto server = kj::heap<CollectingByteStream>();
+    auto& serverRef = *server;
+    serverRef.rejectExpectSize = true;
+    ByteStream::Client client = kj::mv(server);
+
+    PumpOptions options;
+    options.expectedSize = input.size();
+    kj::ArrayInputStream in(input);
+    pump(in, client, options).wait(waitScope);
+
+    KJ_EXPECT(serverRef.isDone);
+    KJ_EXPECT(serverRef.expectedSize == nullptr);
+    KJ_EXPECT(serverRef.data.asPtr() == input.asPtr());
+  }
+}
+
+kj::Promise<kj::String> readAllAsync(kj::AsyncInputStream& input, kj::Vector<char>&& buffer) {
+  buffer.resize(buffer.size() + 4096);
+  auto slice = buffer.asPtr().slice(buffer.size() - 4096, buffer.size());
+  return input.tryRead(slice.begin(), 1, slice.size())
+      .then([&input,KJ_MVCAP(buffer)](size_t n) mutable -> kj::Promise<kj::String> {
+    buffer.resize(buffer.size() - 4096 + n);
+    if (n == 0) {
+      buffer.add('\0');
+      return kj::String(buffer.releaseAsArray());
+    }
+    return readAllAsync(input, kj::mv(buffer));
+  });
+}
+
+KJ_TEST("HttpBodyWriter") {
+  auto io = kj::setupAsyncIo();
+
+  {
+    auto pipe = io.provider->newOneWayPipe();
+    auto result = readAllAsync(*pipe.in, kj::Vector<char>());
+
+    HttpBodyWriter writer(*pipe.out);
+    writer.setChunked(true);
+    writer.writeRaw(kj::StringPtr("head\r\n\r\n").asBytes());
+    auto promise = writer.writeBody(kj::StringPtr("hello").asBytes());
+    writer.writeBody(nullptr);
+    writer.writeBody(kj::StringPtr(", world!").asBytes());
+    promise.wait(io.waitScope);
+    writer.writeBody(kj::StringPtr("again").asBytes());
+    writer.finish().wait(io.waitScope);
+    pipe.out = nullptr;
+
+    KJ_EXPECT(result.wait(io.waitScope) ==
+        "head\r\n\r\n5\r\nhello\r\n8\r\n, world!\r\n5\r\nagain\r\n0\r\n\r\n");
+  }
+
+  {
+    auto pipe = io.provider->newOneWayPipe();
+    auto result = readAllAsync(*pipe.in, kj::Vector<char>());
+
+    HttpBodyWriter writer(*pipe.out);
+    writer.writeRaw(kj::StringPtr("head\r\n\r\n").asBytes());
+    writer.writeBody(kj::StringPtr("hello").asBytes());
+    writer.writeBody(kj::StringPtr(", world!").asBytes());
+    writer.finish().wait(io.waitScope);
+    pipe.out = nullptr;
+
+    KJ_EXPECT(result.wait(io.waitScope) == "head\r\n\r\nhello, world!");
+  }
+}
+
+KJ_TEST("HttpHeadBuilder") {
+  {
+    HttpHeadBuilder builder(4);  // force reallocation
+    builder.addLine("GET ", "/foo", " HTTP/1.1");
+    builder.add("Accept: ").add("text/html").add(", ").add("text/plain; q=", 0.5).endLine();
+    builder.addLines(kj::StringPtr("X-Foo: bar\r\n"));
+    KJ_EXPECT(kj::str(builder.getLines()) ==
+        "GET /foo HTTP/1.1\r\nAccept: text/html, text/plain; q=0.5\r\nX-Foo: bar\r\n");
+
+    auto message = builder.finish(kj::StringPtr("body").asBytes());
+    KJ_EXPECT(kj::str(message.asChars()) ==
+        "GET /foo HTTP/1.1\r\nAccept: text/html, text/plain; q=0.5\r\nX-Foo: bar\r\n\r\nbody");
+  }
+
+  {
+    HttpHeadBuilder builder;
+    KJ_EXPECT_THROW_MESSAGE("newline", builder.addLine("X-Foo: bar\nX-Injected: baz"));
+  }
+}
+
 }  // namespace
 }  // namespace sandstorm
@@ -19,6 +19,7 @@
 #include <kj/vector.h>
 #include <kj/async-unix.h>
 #include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -30,6 +31,7 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
+#include <time.h>
 
 namespace sandstorm {
 
@@ -143,49 +145,253 @@ kj::Maybe<kj::String> readLine(kj::BufferedInputStream& input) {
   }
 }
 
-kj::Promise<void> pump(kj::AsyncInputStream& input, ByteStream::Client stream) {
-  auto req = stream.writeRequest(capnp::MessageSize { 2100, 0 });
-  auto orphanage = capnp::Orphanage::getForMessageContaining(
-      kj::implicitCast<ByteStream::WriteParams::Builder>(req));
-  auto orphan = orphanage.newOrphan<capnp::Data>(8192);
-  auto buffer = orphan.get();
+namespace {
+
+template <typename Input>
+class ByteStreamPump final: private kj::TaskSet::ErrorHandler {
+  // Implements pump(). `Input` is either kj::AsyncInputStream or kj::InputStream.
+
+public:
+  ByteStreamPump(Input& input, ByteStream::Client&& stream, PumpOptions options)
+      : input(input), stream(kj::mv(stream)), options(options), writes(*this) {
+    KJ_IF_MAYBE(size, options.expectedSize) {
+      auto req = this->stream.expectSizeRequest(capnp::MessageSize {4, 0});
+      req.setSize(*size);
+      // expectSize() is only a hint (see util.capnp), so a receiver that fails or doesn't
+      // implement it must not abort the pump.
+      writes.add(req.send().ignoreResult().catch_([](kj::Exception&&) {}));
+    }
+  }
+
+  kj::Promise<void> run() {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    failed = kj::mv(paf.fulfiller);
+    return readLoop().exclusiveJoin(kj::mv(paf.promise));
+  }
+
+private:
+  Input& input;
+  ByteStream::Client stream;
+  PumpOptions options;
+
+  uint64_t bytesRead = 0;
+  size_t bytesInFlight = 0;
+  size_t lastReadSize = 0;
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> windowOpen;
+  // Fulfilled when a write returns, if readLoop() is waiting for room in the window.
+
+  kj::Own<kj::PromiseFulfiller<void>> failed;
+  // Rejected if any write fails, aborting run().
 
-  return input.tryRead(buffer.begin(), 1, buffer.size())
-      .then([&input,KJ_MVCAP(stream),KJ_MVCAP(req),KJ_MVCAP(orphan)](size_t n) mutable
-            -> kj::Promise<void> {
-    if (n == 0) {
-      return stream.doneRequest(capnp::MessageSize {4, 0}).send().then([](auto&&) {});
+  kj::TaskSet writes;
+
+  kj::Promise<void> readLoop() {
+    if (bytesInFlight >= options.windowSize) {
+      // Window is full. Wait for a write to return.
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      windowOpen = kj::mv(paf.fulfiller);
+      return paf.promise.then([this]() { return readLoop(); });
     }
 
-    orphan.truncate(n);
-    req.adoptData(kj::mv(orphan));
+    size_t size = chooseChunkSize();
+    auto req = stream.writeRequest(capnp::MessageSize { size / sizeof(capnp::word) + 8, 0 });
+    auto orphanage = capnp::Orphanage::getForMessageContaining(
+        kj::implicitCast<ByteStream::WriteParams::Builder>(req));
+    auto orphan = orphanage.newOrphan<capnp::Data>(size);
+    auto buffer = orphan.get();
+
+    return tryRead(input, buffer.begin(), buffer.size())
+        .then([this,KJ_MVCAP(req),KJ_MVCAP(orphan)](size_t n) mutable -> kj::Promise<void> {
+      if (n == 0) {
+        return finish();
+      }
 
-    // TODO(perf): Parallelize writes.
-    return req.send().then([&input,KJ_MVCAP(stream)](auto&&) mutable {
-      return pump(input, kj::mv(stream));
+      orphan.truncate(n);
+      req.adoptData(kj::mv(orphan));
+
+      bytesRead += n;
+      bytesInFlight += n;
+      lastReadSize = n;
+      writes.add(req.send().then([this,n](auto&&) {
+        bytesInFlight -= n;
+        KJ_IF_MAYBE(f, windowOpen) {
+          f->get()->fulfill();
+          windowOpen = nullptr;
+        }
+      }));
+
+      return readLoop();
     });
-  });
+  }
+
+  size_t chooseChunkSize() {
+    KJ_IF_MAYBE(size, options.expectedSize) {
+      // We know how much is left, so there's no need to guess. (If we think nothing is left, we
+      // still need to read to observe EOF.)
+      if (*size > bytesRead) {
+        return kj::min(options.maxChunkSize, *size - bytesRead);
+      } else {
+        return options.minChunkSize;
+      }
+    }
+
+    // Like HttpParser::allocateNextWrite() in sandstorm-http-bridge, allocate twice as much space
+    // as we managed to fill last time, within bounds.
+    return kj::max(options.minChunkSize, kj::min(options.maxChunkSize, lastReadSize * 2));
+  }
+
+  kj::Promise<void> finish() {
+    // EOF. Wait for outstanding writes, then signal completion.
+
+    if (bytesInFlight > 0) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      windowOpen = kj::mv(paf.fulfiller);
+      return paf.promise.then([this]() { return finish(); });
+    }
+
+    return stream.doneRequest(capnp::MessageSize {4, 0}).send().ignoreResult();
+  }
+
+  static kj::Promise<size_t> tryRead(kj::AsyncInputStream& input, byte* buffer, size_t size) {
+    return input.tryRead(buffer, 1, size);
+  }
+
+  static kj::Promise<size_t> tryRead(kj::InputStream& input, byte* buffer, size_t size) {
+    return input.tryRead(buffer, 1, size);
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    failed->reject(kj::mv(exception));
+  }
+};
+
+}  // namespace
+
+kj::Promise<void> pump(kj::AsyncInputStream& input, ByteStream::Client stream,
+                       PumpOptions options) {
+  auto pump = kj::heap<ByteStreamPump<kj::AsyncInputStream>>(input, kj::mv(stream), options);
+  auto promise = pump->run();
+  return promise.attach(kj::mv(pump));
 }
 
-kj::Promise<void> pump(kj::InputStream& input, ByteStream::Client stream) {
-  auto req = stream.writeRequest(capnp::MessageSize { 2100, 0 });
-  auto orphanage = capnp::Orphanage::getForMessageContaining(
-      kj::implicitCast<ByteStream::WriteParams::Builder>(req));
-  auto orphan = orphanage.newOrphan<capnp::Data>(8192);
-  auto buffer = orphan.get();
+kj::Promise<void> pump(kj::InputStream& input, ByteStream::Client stream,
+                       PumpOptions options) {
+  auto pump = kj::heap<ByteStreamPump<kj::InputStream>>(input, kj::mv(stream), options);
+  auto promise = pump->run();
+  return promise.attach(kj::mv(pump));
+}
+
+// -------------------------------------------------------------------
 
-  size_t n = input.tryRead(buffer.begin(), 1, buffer.size());
-  if (n == 0) {
-    return stream.doneRequest(capnp::MessageSize {4, 0}).send().then([](auto&&) {});
+HttpHeadBuilder& HttpHeadBuilder::endLine() {
+  for (char c: buffer.slice(lineStart, size)) {
+    KJ_ASSERT(c != '\n', "HTTP header contained newline; blocking to prevent injection.");
   }
+  char* pos = reserve(2);
+  pos[0] = '\r';
+  pos[1] = '\n';
+  size += 2;
+  lineStart = size;
+  return *this;
+}
+
+HttpHeadBuilder& HttpHeadBuilder::addLines(kj::ArrayPtr<const char> lines) {
+  KJ_ASSERT(lineStart == size, "addLines() in middle of line");
+  memcpy(reserve(lines.size()), lines.begin(), lines.size());
+  size += lines.size();
+  lineStart = size;
+  return *this;
+}
+
+kj::ArrayPtr<const byte> HttpHeadBuilder::finish(kj::ArrayPtr<const byte> body) {
+  endLine();
+  if (body.size() > 0) {
+    memcpy(reserve(body.size()), body.begin(), body.size());
+    size += body.size();
+  }
+  return buffer.slice(0, size).asBytes();
+}
 
-  orphan.truncate(n);
-  req.adoptData(kj::mv(orphan));
+char* HttpHeadBuilder::reserve(size_t n) {
+  if (size + n > buffer.size()) {
+    auto newBuffer = kj::heapArray<char>(kj::max(buffer.size() * 2, size + n));
+    memcpy(newBuffer.begin(), buffer.begin(), size);
+    buffer = kj::mv(newBuffer);
+  }
+  return buffer.begin() + size;
+}
 
-  // TODO(perf): Parallelize writes.
-  return req.send().then([&input,KJ_MVCAP(stream)](auto&&) mutable {
-    return pump(input, kj::mv(stream));
-  });
+// -------------------------------------------------------------------
+
+kj::Promise<void> HttpBodyWriter::writeRaw(kj::ArrayPtr<const byte> data) {
+  return enqueue(data, false);
+}
+
+kj::Promise<void> HttpBodyWriter::writeBody(kj::ArrayPtr<const byte> data) {
+  return enqueue(data, true);
+}
+
+kj::Promise<void> HttpBodyWriter::finish() {
+  static const char END_CHUNK[] = "0\r\n\r\n";
+  return enqueue(chunked ? kj::StringPtr(END_CHUNK).asBytes() : nullptr, false);
+}
+
+kj::Promise<void> HttpBodyWriter::enqueue(kj::ArrayPtr<const byte> data, bool isBody) {
+  queue.add(Piece { data, isBody });
+
+  KJ_IF_MAYBE(q, queuedWrite) {
+    // A write is already scheduled to run after the current one; piggyback on it.
+    return q->addBranch();
+  }
+
+  auto fork = lastWrite.then([this]() { return writeQueued(); }).fork();
+  lastWrite = fork.addBranch();
+  auto result = fork.addBranch();
+  queuedWrite = kj::mv(fork);
+  return kj::mv(result);
+}
+
+kj::Promise<void> HttpBodyWriter::writeQueued() {
+  static constexpr size_t MAX_CHUNK_HEADER = 19;  // 16 hex digits, CRLF, NUL
+  static const char CRLF[] = "\r\n";
+
+  queuedWrite = nullptr;
+
+  if (chunked) {
+    size_t needed = 0;
+    for (auto& piece: queue) {
+      if (piece.isBody) needed += MAX_CHUNK_HEADER;
+    }
+    if (chunkHeaders.size() < needed) {
+      chunkHeaders = kj::heapArray<char>(needed);
+    }
+  }
+
+  pieces.clear();
+  char* pos = chunkHeaders.begin();
+  for (auto& piece: queue) {
+    if (piece.data.size() == 0) {
+      // Note that an empty chunk would terminate the body.
+      continue;
+    }
+
+    if (piece.isBody && chunked) {
+      int n = snprintf(pos, MAX_CHUNK_HEADER, "%zx\r\n", piece.data.size());
+      pieces.add(kj::arrayPtr(pos, n).asBytes());
+      pos += n;
+      pieces.add(piece.data);
+      pieces.add(kj::StringPtr(CRLF).asBytes());
+    } else {
+      pieces.add(piece.data);
+    }
+  }
+  queue.clear();
+
+  if (pieces.size() == 0) {
+    return kj::READY_NOW;
+  }
+  return output.write(pieces.asPtr());
 }
 
 kj::ArrayPtr<const char> trimArray(kj::ArrayPtr<const char> slice) {
@@ -229,6 +435,12 @@ kj::Maybe<uint64_t> parseUInt64(kj::StringPtr s, int base) {
   return result;
 }
 
+uint64_t monotonicNanoseconds() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 kj::AutoCloseFd openTemporary(kj::StringPtr near) {
   // TODO(someday):  Use O_TMPFILE?  New in Linux 3.11.
 
@@ -996,7 +1208,21 @@ void Subprocess::waitForSuccess() {
 }
 
 int Subprocess::waitForExit() {
-  int status = waitForExitOrSignal();
+  return checkExitStatus(waitForExitOrSignal());
+}
+
+kj::Promise<void> Subprocess::onSuccess(kj::UnixEventPort& eventPort) {
+  // onChildExit() clears the Maybe once it has reaped the child, so it must stay put until then.
+  auto childPid = kj::heap<kj::Maybe<pid_t>>(getPid());
+  auto promise = eventPort.onChildExit(*childPid);
+  return promise.attach(kj::mv(childPid)).then([this](int status) {
+    notifyExited(status);
+    int code = checkExitStatus(status);
+    KJ_ASSERT(code == 0, "child process failed", name, code);
+  });
+}
+
+int Subprocess::checkExitStatus(int status) {
   if (WIFEXITED(status)) {
     return WEXITSTATUS(status);
   } else if (WIFSIGNALED(status)) {
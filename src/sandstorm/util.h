@@ -105,9 +105,132 @@ private:
 
 kj::Maybe<kj::String> readLine(kj::BufferedInputStream& input);
 
-kj::Promise<void> pump(kj::AsyncInputStream& input, ByteStream::Client stream);
-kj::Promise<void> pump(kj::InputStream& input, ByteStream::Client stream);
-// Read from `input`, write to `output`, until EOF.
+struct PumpOptions {
+  // Tuning knobs for pump(), below.
+
+  size_t windowSize = 512u << 10;
+  // pump() keeps reading and issuing ByteStream.write() calls without waiting for earlier calls
+  // to return until this many bytes are outstanding. This keeps throughput from being bound by
+  // RPC round trip time.
+
+  size_t minChunkSize = 8192;
+  size_t maxChunkSize = 128u << 10;
+  // Bounds on the size of each write. Each write's buffer starts out twice as large as what the
+  // previous read managed to fill, within these bounds.
+
+  kj::Maybe<uint64_t> expectedSize;
+  // If known, the number of bytes `input` will produce. pump() will pass this to
+  // ByteStream.expectSize() and size its writes to fit exactly, rather than guessing.
+};
+
+kj::Promise<void> pump(kj::AsyncInputStream& input, ByteStream::Client stream,
+                       PumpOptions options = PumpOptions());
+kj::Promise<void> pump(kj::InputStream& input, ByteStream::Client stream,
+                       PumpOptions options = PumpOptions());
+// Read from `input`, write to `output`, until EOF. `input` must remain valid until the returned
+// promise completes.
+
+class HttpHeadBuilder {
+  // Serializes an HTTP message head, and optionally a body, directly into a single growable
+  // buffer, rather than allocating a string per header line and then concatenating them.
+
+public:
+  explicit HttpHeadBuilder(size_t expectedSize = 1024)
+      : buffer(kj::heapArray<char>(expectedSize)) {}
+  HttpHeadBuilder(HttpHeadBuilder&&) = default;
+  HttpHeadBuilder& operator=(HttpHeadBuilder&&) = default;
+
+  template <typename... Params>
+  HttpHeadBuilder& add(Params&&... params) {
+    // Append to the current line. Accepts anything kj::str() does.
+    appendPieces(kj::toCharSequence(kj::fwd<Params>(params))...);
+    return *this;
+  }
+
+  HttpHeadBuilder& endLine();
+  // Terminate the current line. Throws if the line contains a newline, to block header injection.
+
+  template <typename... Params>
+  HttpHeadBuilder& addLine(Params&&... params) {
+    add(kj::fwd<Params>(params)...);
+    return endLine();
+  }
+
+  HttpHeadBuilder& addLines(kj::ArrayPtr<const char> lines);
+  // Append complete lines previously obtained from getLines() of another builder. These have
+  // already been checked.
+
+  kj::ArrayPtr<const char> getLines() const { return buffer.slice(0, size); }
+
+  kj::ArrayPtr<const byte> finish(kj::ArrayPtr<const byte> body = nullptr);
+  // Terminate the head with a blank line and append `body`. Returns the whole message, which
+  // remains owned by the builder.
+
+private:
+  kj::Array<char> buffer;
+  size_t size = 0;
+  size_t lineStart = 0;
+
+  char* reserve(size_t n);
+
+  void appendPieces() {}
+  template <typename First, typename... Rest>
+  void appendPieces(First&& first, Rest&&... rest) {
+    char* pos = reserve(first.size());
+    for (char c: first) *pos++ = c;
+    size = pos - buffer.begin();
+    appendPieces(kj::fwd<Rest>(rest)...);
+  }
+};
+
+class HttpBodyWriter {
+  // Writes an HTTP/1.1 message body to an AsyncOutputStream, optionally with chunked
+  // transfer-encoding. Everything queued while an earlier write is still in progress is coalesced
+  // into a single vectored write, so a body arriving as many small ByteStream.write() calls
+  // doesn't cost a syscall per call -- or three, when each needs chunk framing.
+
+public:
+  explicit HttpBodyWriter(kj::AsyncOutputStream& output): output(output) {}
+  KJ_DISALLOW_COPY(HttpBodyWriter);
+
+  void setChunked(bool chunked) { this->chunked = chunked; }
+  // Whether writeBody() should frame its data as chunks. Set before the first writeBody().
+
+  kj::Promise<void> writeRaw(kj::ArrayPtr<const byte> data);
+  // Queue bytes to be written exactly as given, e.g. the message head.
+
+  kj::Promise<void> writeBody(kj::ArrayPtr<const byte> data);
+  // Queue body bytes.
+
+  kj::Promise<void> finish();
+  // Queue the end of the body. The promise resolves once everything has been written.
+  //
+  // For all of the above, `data` must remain valid until the returned promise resolves. The
+  // returned promises may be dropped without canceling the write; writes always happen in order
+  // and a failure fails all subsequent writes.
+
+private:
+  struct Piece {
+    kj::ArrayPtr<const byte> data;
+    bool isBody;
+  };
+
+  kj::AsyncOutputStream& output;
+  bool chunked = false;
+
+  kj::Vector<Piece> queue;
+  kj::Maybe<kj::ForkedPromise<void>> queuedWrite;
+  // Resolves when `queue` has been written. Null if `queue` is empty.
+
+  kj::Promise<void> lastWrite = kj::READY_NOW;
+
+  kj::Vector<kj::ArrayPtr<const byte>> pieces;
+  kj::Array<char> chunkHeaders;
+  // Storage for the write in progress, reused from one write to the next.
+
+  kj::Promise<void> enqueue(kj::ArrayPtr<const byte> data, bool isBody);
+  kj::Promise<void> writeQueued();
+};
 
 class StructyMessage {
   // Helper for constructing a message to be passed to the kernel composed of a bunch of structs
@@ -162,6 +285,9 @@ kj::Maybe<uint64_t> parseUInt64(kj::StringPtr s, int base);
 // Try to parse an integer with strtoul(), return null if parsing fails or doesn't consume all
 // input.
 
+uint64_t monotonicNanoseconds();
+// Reads CLOCK_MONOTONIC, e.g. to time a benchmark.
+
 kj::AutoCloseFd openTemporary(kj::StringPtr near);
 // Creates a temporary file in the same directory as the file specified by "near", immediately
 // unlinks it, and then returns the file descriptor,  which will be open for both read and write.
@@ -362,6 +488,12 @@ public:
   // Waits for the child to exit or be killed by a signal. Returns an exit status that can be
   // interpreted by WIFEXITED(), WEXITSTATUS(), etc. as described in the wait(2) man page.
 
+  kj::Promise<void> onSuccess(kj::UnixEventPort& eventPort);
+  // Like waitForSuccess(), but waits asynchronously using UnixEventPort::onChildExit(), so
+  // kj::UnixEventPort::captureChildExit() must have been called at startup. Unlike SubprocessSet,
+  // this only reaps this one child, so it can be mixed with synchronous waits on other children.
+  // The Subprocess must outlive the promise.
+
   pid_t getPid() {
     KJ_IREQUIRE(pid != 0, "already exited");
     return pid;
@@ -396,6 +528,9 @@ private:
   pid_t pid = 0;  // 0 = not running
   kj::Maybe<SubprocessSet&> subprocessSet;
 
+  int checkExitStatus(int status);
+  // Interprets a wait status, throwing if the child was killed by a signal.
+
   static void forceFdAbove(int& fd, int minValue);
 
   friend class SubprocessSet;
@@ -0,0 +1,148 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "zip.h"
+#include "util.h"
+#include "test-util.h"
+#include <kj/test.h>
+
+namespace sandstorm {
+namespace {
+
+class CollectingOutputStream final: public kj::OutputStream {
+public:
+  void write(const void* buffer, size_t size) override {
+    auto bytes = reinterpret_cast<const kj::byte*>(buffer);
+    data.addAll(bytes, bytes + size);
+  }
+
+  kj::Vector<kj::byte> data;
+};
+
+kj::Array<kj::byte> makeContent(size_t size) {
+  // Half random bytes and half repetitive text, so that some blocks compress and some don't.
+  auto result = kj::heapArray<kj::byte>(size);
+  uint64_t state = 88172645463325252ull;
+  for (size_t i = 0; i < size; i++) {
+    if ((i >> 16) % 2 == 0) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      result[i] = state;
+    } else {
+      result[i] = "hello zip "[i % 10];
+    }
+  }
+  return result;
+}
+
+KJ_TEST("ZipWriter output can be read by ZipReader") {
+  TempDir dir;
+  auto content = makeContent(3 << 20);  // several blocks
+  auto contentPath = kj::str(dir.path, "/content");
+  kj::FdOutputStream(raiiOpen(contentPath, O_WRONLY | O_CREAT | O_TRUNC))
+      .write(content.begin(), content.size());
+
+  struct stat dirStats;
+  KJ_SYSCALL(stat(dir.path.cStr(), &dirStats));
+  struct stat fileStats;
+  KJ_SYSCALL(stat(contentPath.cStr(), &fileStats));
+  fileStats.st_mode = S_IFREG | 0640;
+  struct stat linkStats = fileStats;
+  linkStats.st_mode = S_IFLNK | 0777;
+
+  auto zipPath = kj::str(dir.path, "/test.zip");
+  {
+    kj::FdOutputStream out(raiiOpen(zipPath, O_WRONLY | O_CREAT | O_TRUNC));
+    ZipWriter zip(out, 3);
+    zip.addDirectory("data", dirStats);
+    zip.addFile("data/big", raiiOpen(contentPath, O_RDONLY), fileStats);
+    zip.addFile("data/empty", raiiOpen("/dev/null", O_RDONLY), fileStats);
+    zip.addSymlink("data/link", "big", linkStats);
+    zip.finish();
+  }
+
+  ZipReader zip(raiiOpen(zipPath, O_RDONLY));
+  auto entries = zip.getEntries();
+  KJ_ASSERT(entries.size() == 4);
+  KJ_EXPECT(entries[0].name == "data/");
+  KJ_EXPECT(entries[1].name == "data/big");
+  KJ_EXPECT(entries[2].name == "data/empty");
+  KJ_EXPECT(entries[3].name == "data/link");
+
+  for (auto& entry: entries.slice(1, entries.size())) {
+    KJ_EXPECT(entry.modificationTime == fileStats.st_mtime, entry.name);
+  }
+
+  auto mode = entries[1].getUnixMode();
+  KJ_IF_MAYBE(m, mode) {
+    KJ_EXPECT(*m == (S_IFREG | 0640), *m);
+  } else {
+    KJ_FAIL_EXPECT("no unix mode");
+  }
+
+  {
+    CollectingOutputStream out;
+    zip.read(entries[1], out);
+    KJ_EXPECT(out.data.asPtr() == content.asPtr());
+  }
+  {
+    CollectingOutputStream out;
+    zip.read(entries[2], out);
+    KJ_EXPECT(out.data.size() == 0);
+  }
+  {
+    CollectingOutputStream out;
+    zip.read(entries[3], out);
+    KJ_EXPECT(out.data.asPtr() == kj::StringPtr("big").asBytes());
+  }
+}
+
+KJ_TEST("ZipReader rejects corrupt data") {
+  TempDir dir;
+  auto zipPath = kj::str(dir.path, "/test.zip");
+  auto content = makeContent(100000);
+  auto contentPath = kj::str(dir.path, "/content");
+  kj::FdOutputStream(raiiOpen(contentPath, O_WRONLY | O_CREAT | O_TRUNC))
+      .write(content.begin(), content.size());
+  struct stat stats;
+  KJ_SYSCALL(stat(contentPath.cStr(), &stats));
+
+  CollectingOutputStream archive;
+  {
+    ZipWriter zip(archive);
+    zip.addFile("content", raiiOpen(contentPath, O_RDONLY), stats);
+    zip.finish();
+  }
+
+  // Flip a bit in the middle of the compressed data, which the checksum must catch.
+  archive.data[archive.data.size() / 2] ^= 0x10;
+  kj::FdOutputStream(raiiOpen(zipPath, O_WRONLY | O_CREAT | O_TRUNC))
+      .write(archive.data.begin(), archive.data.size());
+
+  ZipReader zip(raiiOpen(zipPath, O_RDONLY));
+  KJ_ASSERT(zip.getEntries().size() == 1);
+  CollectingOutputStream out;
+  KJ_EXPECT(kj::runCatchingExceptions([&]() { zip.read(zip.getEntries()[0], out); }) != nullptr);
+
+  // Truncated archives have no central directory.
+  KJ_SYSCALL(truncate(zipPath.cStr(), archive.data.size() - 10));
+  KJ_EXPECT(kj::runCatchingExceptions([&]() { ZipReader(raiiOpen(zipPath, O_RDONLY)); })
+      != nullptr);
+}
+
+}  // namespace
+}  // namespace sandstorm
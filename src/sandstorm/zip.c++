@@ -0,0 +1,717 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "zip.h"
+#include <kj/debug.h>
+#include <zlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+namespace sandstorm {
+
+// See PKWARE's APPNOTE.TXT for the format.
+
+static constexpr uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+static constexpr uint32_t DESCRIPTOR_SIGNATURE = 0x08074b50;
+static constexpr uint32_t CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+static constexpr uint32_t END_SIGNATURE = 0x06054b50;
+static constexpr uint32_t ZIP64_END_SIGNATURE = 0x06064b50;
+static constexpr uint32_t ZIP64_LOCATOR_SIGNATURE = 0x07064b50;
+
+static constexpr size_t LOCAL_HEADER_SIZE = 30;
+static constexpr size_t CENTRAL_HEADER_SIZE = 46;
+static constexpr size_t END_SIZE = 22;
+static constexpr size_t ZIP64_END_SIZE = 56;
+static constexpr size_t ZIP64_LOCATOR_SIZE = 20;
+
+static constexpr uint16_t ZIP64_EXTRA_ID = 0x0001;
+static constexpr uint16_t TIMESTAMP_EXTRA_ID = 0x5455;  // "UT", as written by Info-ZIP
+static constexpr uint16_t TIMESTAMP_EXTRA_SIZE = 5;
+
+static constexpr uint16_t VERSION_MADE_BY = (3 << 8) | 30;  // Unix, spec version 3.0
+static constexpr uint16_t VERSION_DEFAULT = 20;
+static constexpr uint16_t VERSION_ZIP64 = 45;
+
+static constexpr uint16_t FLAG_DESCRIPTOR = 0x0008;  // sizes and CRC follow the data
+static constexpr uint16_t METHOD_STORED = 0;
+static constexpr uint16_t METHOD_DEFLATED = 8;
+
+static constexpr size_t BLOCK_SIZE = 1u << 20;
+// Files are read, and deflated, in blocks of this size.
+
+static constexpr size_t DICTIONARY_SIZE = 32768;
+// Each block of a file is deflated using the end of the previous block as a preset dictionary,
+// so that splitting files up costs very little compression.
+
+static constexpr uint64_t ZIP64_THRESHOLD = 1ull << 31;
+// Files at least this big get Zip64 local headers, in case they grow past 4GiB while we read
+// them. (We can't go back and change the header once it's written.)
+
+static constexpr size_t READ_SIZE = 1u << 20;
+static constexpr size_t INFLATE_BUFFER_SIZE = 256u << 10;
+
+namespace {
+
+void put16(kj::Vector<kj::byte>& out, uint16_t value) {
+  out.add(kj::byte(value));
+  out.add(kj::byte(value >> 8));
+}
+
+void put32(kj::Vector<kj::byte>& out, uint32_t value) {
+  put16(out, value);
+  put16(out, value >> 16);
+}
+
+void put64(kj::Vector<kj::byte>& out, uint64_t value) {
+  put32(out, value);
+  put32(out, value >> 32);
+}
+
+uint16_t get16(const kj::byte* in) {
+  return uint16_t(in[0]) | (uint16_t(in[1]) << 8);
+}
+
+uint32_t get32(const kj::byte* in) {
+  return uint32_t(get16(in)) | (uint32_t(get16(in + 2)) << 16);
+}
+
+uint64_t get64(const kj::byte* in) {
+  return uint64_t(get32(in)) | (uint64_t(get32(in + 4)) << 32);
+}
+
+void putTimestampExtra(kj::Vector<kj::byte>& out, int64_t time) {
+  // The DOS time in the header only has two-second resolution and no time zone, so like Info-ZIP,
+  // we add the Unix modification time too.
+  put16(out, TIMESTAMP_EXTRA_ID);
+  put16(out, TIMESTAMP_EXTRA_SIZE);
+  out.add(1);  // flags: modification time present
+  put32(out, kj::max(kj::min(time, int64_t(INT32_MAX)), int64_t(INT32_MIN)));
+}
+
+void toDosTime(int64_t time, uint16_t& dosTime, uint16_t& dosDate) {
+  time_t t = time;
+  struct tm tm;
+  if (gmtime_r(&t, &tm) == nullptr || tm.tm_year < 80) {
+    // Can't be represented. Use the earliest time that can.
+    dosTime = 0;
+    dosDate = (1 << 5) | 1;
+  } else if (tm.tm_year > 207) {
+    dosTime = (23 << 11) | (59 << 5) | 29;
+    dosDate = (127 << 9) | (12 << 5) | 31;
+  } else {
+    dosTime = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    dosDate = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+  }
+}
+
+int64_t fromDosTime(uint16_t dosTime, uint16_t dosDate) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = (dosDate >> 9) + 80;
+  tm.tm_mon = ((dosDate >> 5) & 15) - 1;
+  tm.tm_mday = dosDate & 31;
+  tm.tm_hour = dosTime >> 11;
+  tm.tm_min = (dosTime >> 5) & 63;
+  tm.tm_sec = (dosTime & 31) * 2;
+  return timegm(&tm);
+}
+
+size_t readFully(int fd, kj::ArrayPtr<kj::byte> buffer) {
+  size_t total = 0;
+  while (total < buffer.size()) {
+    ssize_t n;
+    KJ_SYSCALL(n = read(fd, buffer.begin() + total, buffer.size() - total));
+    if (n == 0) break;
+    total += n;
+  }
+  return total;
+}
+
+}  // namespace
+
+// =======================================================================================
+
+ZipWriter::ZipWriter(kj::OutputStream& out, uint threadCount): out(out) {
+  if (threadCount > 1) {
+    int fd;
+    KJ_SYSCALL(fd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE));
+    jobEvent = kj::AutoCloseFd(fd);
+    KJ_SYSCALL(fd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE));
+    doneEvent = kj::AutoCloseFd(fd);
+
+    for (uint i = 0; i < threadCount; i++) {
+      workers.add(kj::heap<kj::Thread>([this]() { workerLoop(); }));
+    }
+  }
+}
+
+ZipWriter::~ZipWriter() noexcept(false) {
+  if (workers.size() > 0) {
+    queue.lockExclusive()->shuttingDown = true;
+    uint64_t count = workers.size();
+    KJ_SYSCALL(write(jobEvent, &count, sizeof(count)));
+    workers.resize(0);  // joins
+  }
+}
+
+void ZipWriter::addDirectory(kj::StringPtr name, const struct stat& stats) {
+  auto block = kj::heap<Block>();
+  block->entryIndex = addEntry(name, stats, false);
+  block->first = true;
+  block->last = true;
+  block->compress = false;
+  addBlock(kj::mv(block));
+}
+
+void ZipWriter::addSymlink(kj::StringPtr name, kj::StringPtr target, const struct stat& stats) {
+  auto block = kj::heap<Block>();
+  block->entryIndex = addEntry(name, stats, false);
+  block->first = true;
+  block->last = true;
+  block->compress = false;
+  block->input = kj::heapArray(target.asBytes());
+  block->inputSize = target.size();
+  addBlock(kj::mv(block));
+}
+
+void ZipWriter::addFile(kj::StringPtr name, int fd, const struct stat& stats) {
+  uint64_t expectedSize = stats.st_size;
+  uint index = addEntry(name, stats, expectedSize >= ZIP64_THRESHOLD);
+
+  // Only a hint, so ignore errors.
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  uint64_t bytesRead = 0;
+  kj::Array<kj::byte> dictionary;
+  for (bool first = true;; first = false) {
+    // Size the buffer to hold one more byte than the rest of the file, if that's less than a
+    // block, so that we see EOF without another read.
+    size_t capacity = BLOCK_SIZE;
+    if (expectedSize >= bytesRead && expectedSize - bytesRead < BLOCK_SIZE) {
+      capacity = expectedSize - bytesRead + 1;
+    }
+
+    auto block = kj::heap<Block>();
+    block->entryIndex = index;
+    block->first = first;
+    block->compress = true;
+    block->input = kj::heapArray<kj::byte>(capacity);
+    block->inputSize = readFully(fd, block->input);
+    block->last = block->inputSize < capacity;
+    block->dictionary = kj::mv(dictionary);
+    bytesRead += block->inputSize;
+
+    bool last = block->last;
+    if (!last) {
+      size_t dictionarySize = kj::min(block->inputSize, DICTIONARY_SIZE);
+      dictionary = kj::heapArray<kj::byte>(
+          block->input.begin() + block->inputSize - dictionarySize, dictionarySize);
+    }
+    addBlock(kj::mv(block));
+    if (last) break;
+  }
+}
+
+void ZipWriter::finish() {
+  writeReadyBlocks(0);
+
+  uint64_t directoryOffset = offset;
+  kj::Vector<kj::byte> buffer;
+  for (auto& entry: entries) {
+    bool bigUncompressedSize = entry.uncompressedSize >= 0xffffffff;
+    bool bigCompressedSize = entry.compressedSize >= 0xffffffff;
+    bool bigOffset = entry.headerOffset >= 0xffffffff;
+    uint16_t zip64Size = (bigUncompressedSize + bigCompressedSize + bigOffset) * 8;
+    uint16_t extraSize = 4 + TIMESTAMP_EXTRA_SIZE + (zip64Size > 0 ? 4 + zip64Size : 0);
+
+    uint16_t dosTime, dosDate;
+    toDosTime(entry.modificationTime, dosTime, dosDate);
+
+    put32(buffer, CENTRAL_HEADER_SIGNATURE);
+    put16(buffer, VERSION_MADE_BY);
+    put16(buffer, entry.zip64 || zip64Size > 0 ? VERSION_ZIP64 : VERSION_DEFAULT);
+    put16(buffer, entry.hasDescriptor ? FLAG_DESCRIPTOR : 0);
+    put16(buffer, entry.method);
+    put16(buffer, dosTime);
+    put16(buffer, dosDate);
+    put32(buffer, entry.crc);
+    put32(buffer, bigCompressedSize ? 0xffffffff : entry.compressedSize);
+    put32(buffer, bigUncompressedSize ? 0xffffffff : entry.uncompressedSize);
+    put16(buffer, entry.name.size());
+    put16(buffer, extraSize);
+    put16(buffer, 0);  // comment length
+    put16(buffer, 0);  // disk number
+    put16(buffer, 0);  // internal attributes
+    // Like Info-ZIP, put the Unix mode in the high half of the external attributes, and set the
+    // MS-DOS directory bit for directories.
+    put32(buffer, (uint32_t(entry.mode) << 16) | (S_ISDIR(entry.mode) ? 0x10 : 0));
+    put32(buffer, bigOffset ? 0xffffffff : entry.headerOffset);
+    buffer.addAll(entry.name.asBytes());
+    putTimestampExtra(buffer, entry.modificationTime);
+    if (zip64Size > 0) {
+      put16(buffer, ZIP64_EXTRA_ID);
+      put16(buffer, zip64Size);
+      if (bigUncompressedSize) put64(buffer, entry.uncompressedSize);
+      if (bigCompressedSize) put64(buffer, entry.compressedSize);
+      if (bigOffset) put64(buffer, entry.headerOffset);
+    }
+
+    if (buffer.size() >= READ_SIZE) {
+      writeRaw(buffer.asPtr());
+      buffer.resize(0);
+    }
+  }
+  writeRaw(buffer.asPtr());
+  buffer.resize(0);
+
+  uint64_t directorySize = offset - directoryOffset;
+  uint64_t count = entries.size();
+  if (count >= 0xffff || directorySize >= 0xffffffff || directoryOffset >= 0xffffffff) {
+    uint64_t zip64EndOffset = offset;
+    put32(buffer, ZIP64_END_SIGNATURE);
+    put64(buffer, ZIP64_END_SIZE - 12);  // size of the rest of the record
+    put16(buffer, VERSION_MADE_BY);
+    put16(buffer, VERSION_ZIP64);
+    put32(buffer, 0);  // disk number
+    put32(buffer, 0);  // disk with central directory
+    put64(buffer, count);
+    put64(buffer, count);
+    put64(buffer, directorySize);
+    put64(buffer, directoryOffset);
+
+    put32(buffer, ZIP64_LOCATOR_SIGNATURE);
+    put32(buffer, 0);  // disk with Zip64 end record
+    put64(buffer, zip64EndOffset);
+    put32(buffer, 1);  // number of disks
+  }
+
+  put32(buffer, END_SIGNATURE);
+  put16(buffer, 0);  // disk number
+  put16(buffer, 0);  // disk with central directory
+  put16(buffer, kj::min(count, uint64_t(0xffff)));
+  put16(buffer, kj::min(count, uint64_t(0xffff)));
+  put32(buffer, kj::min(directorySize, uint64_t(0xffffffff)));
+  put32(buffer, kj::min(directoryOffset, uint64_t(0xffffffff)));
+  put16(buffer, 0);  // comment length
+  writeRaw(buffer.asPtr());
+}
+
+uint ZipWriter::addEntry(kj::StringPtr name, const struct stat& stats, bool zip64) {
+  KJ_REQUIRE(name.size() > 0 && name.size() < 0xffff, "bad name for zip entry", name);
+
+  Entry entry;
+  entry.name = S_ISDIR(stats.st_mode) ? kj::str(name, '/') : kj::heapString(name);
+  entry.mode = stats.st_mode;
+  entry.modificationTime = stats.st_mtime;
+  entry.zip64 = zip64;
+  entries.add(kj::mv(entry));
+  return entries.size() - 1;
+}
+
+void ZipWriter::addBlock(kj::Own<Block> block) {
+  Block& ref = *block;
+  unwritten.push_back(kj::mv(block));
+
+  if (workers.size() > 0 && ref.compress) {
+    queue.lockExclusive()->pending.push_back(&ref);
+    uint64_t one = 1;
+    KJ_SYSCALL(write(jobEvent, &one, sizeof(one)));
+  } else {
+    compressBlock(ref);
+    auto lock = queue.lockExclusive();
+    ref.done = true;
+  }
+
+  // Keep a couple of blocks queued up for each thread, but don't let the queue grow without bound
+  // if we're reading faster than we can compress.
+  writeReadyBlocks(workers.size() * 2 + 1);
+}
+
+void ZipWriter::writeReadyBlocks(size_t maxUnwritten) {
+  // Writes out finished blocks from the front of `unwritten`. If more than `maxUnwritten` would
+  // be left, waits for more blocks to finish.
+
+  while (!unwritten.empty()) {
+    Block& block = *unwritten.front();
+    bool mustWait = unwritten.size() > maxUnwritten;
+    bool ready;
+    Block* job = nullptr;
+    {
+      auto lock = queue.lockExclusive();
+      KJ_IF_MAYBE(exception, lock->error) {
+        kj::throwFatalException(kj::cp(*exception));
+      }
+      ready = block.done;
+      if (!ready && mustWait && !lock->pending.empty()) {
+        // Rather than sit idle, compress a block ourselves.
+        job = lock->pending.front();
+        lock->pending.pop_front();
+      }
+    }
+
+    if (ready) {
+      writeBlock(block);
+      unwritten.pop_front();
+    } else if (!mustWait) {
+      return;
+    } else if (job != nullptr) {
+      compressBlock(*job);
+      auto lock = queue.lockExclusive();
+      job->done = true;
+    } else {
+      uint64_t count;
+      ssize_t n;
+      KJ_SYSCALL(n = read(doneEvent, &count, sizeof(count)));
+      KJ_ASSERT(n == sizeof(count));
+    }
+  }
+}
+
+void ZipWriter::writeBlock(Block& block) {
+  Entry& entry = entries[block.entryIndex];
+
+  // A file that fits in one block is stored rather than deflated if deflating doesn't help, as
+  // Info-ZIP does. Once we've written the header of a bigger file, we're committed.
+  bool stored = !block.compress ||
+      (block.first && block.last && block.output.size() >= block.inputSize);
+  kj::ArrayPtr<const kj::byte> data = block.output.asPtr();
+  if (stored) data = block.input.slice(0, block.inputSize);
+
+  if (block.first) {
+    entry.method = stored ? METHOD_STORED : METHOD_DEFLATED;
+    entry.hasDescriptor = !block.last;
+    entry.crc = block.crc;
+    entry.compressedSize = data.size();
+    entry.uncompressedSize = block.inputSize;
+    entry.headerOffset = offset;
+
+    // If there's more to come, the sizes and CRC go in a data descriptor after the data.
+    uint32_t crc = entry.hasDescriptor ? 0 : entry.crc;
+    uint64_t compressedSize = entry.hasDescriptor ? 0 : entry.compressedSize;
+    uint64_t uncompressedSize = entry.hasDescriptor ? 0 : entry.uncompressedSize;
+    uint16_t dosTime, dosDate;
+    toDosTime(entry.modificationTime, dosTime, dosDate);
+
+    kj::Vector<kj::byte> header(LOCAL_HEADER_SIZE + entry.name.size() + 32);
+    put32(header, LOCAL_HEADER_SIGNATURE);
+    put16(header, entry.zip64 ? VERSION_ZIP64 : VERSION_DEFAULT);
+    put16(header, entry.hasDescriptor ? FLAG_DESCRIPTOR : 0);
+    put16(header, entry.method);
+    put16(header, dosTime);
+    put16(header, dosDate);
+    put32(header, crc);
+    put32(header, entry.zip64 ? 0xffffffff : compressedSize);
+    put32(header, entry.zip64 ? 0xffffffff : uncompressedSize);
+    put16(header, entry.name.size());
+    put16(header, 4 + TIMESTAMP_EXTRA_SIZE + (entry.zip64 ? 20 : 0));
+    header.addAll(entry.name.asBytes());
+    putTimestampExtra(header, entry.modificationTime);
+    if (entry.zip64) {
+      put16(header, ZIP64_EXTRA_ID);
+      put16(header, 16);
+      put64(header, uncompressedSize);
+      put64(header, compressedSize);
+    }
+    writeRaw(header.asPtr());
+  } else {
+    entry.crc = crc32_combine(entry.crc, block.crc, block.inputSize);
+    entry.compressedSize += data.size();
+    entry.uncompressedSize += block.inputSize;
+  }
+
+  writeRaw(data);
+
+  if (block.last && entry.hasDescriptor) {
+    kj::Vector<kj::byte> descriptor(24);
+    put32(descriptor, DESCRIPTOR_SIGNATURE);
+    put32(descriptor, entry.crc);
+    if (entry.zip64) {
+      put64(descriptor, entry.compressedSize);
+      put64(descriptor, entry.uncompressedSize);
+    } else {
+      KJ_REQUIRE(entry.uncompressedSize < 0xffffffff && entry.compressedSize < 0xffffffff,
+                 "file grew past 4GiB while being archived", entry.name);
+      put32(descriptor, entry.compressedSize);
+      put32(descriptor, entry.uncompressedSize);
+    }
+    writeRaw(descriptor.asPtr());
+  }
+}
+
+void ZipWriter::workerLoop() {
+  for (;;) {
+    uint64_t count;
+    ssize_t n;
+    KJ_SYSCALL(n = read(jobEvent, &count, sizeof(count)));
+    KJ_ASSERT(n == sizeof(count));
+
+    Block* block;
+    {
+      auto lock = queue.lockExclusive();
+      if (lock->shuttingDown) return;
+      if (lock->pending.empty()) continue;  // writeReadyBlocks() took it
+      block = lock->pending.front();
+      lock->pending.pop_front();
+    }
+
+    auto exception = kj::runCatchingExceptions([&]() { compressBlock(*block); });
+
+    {
+      auto lock = queue.lockExclusive();
+      KJ_IF_MAYBE(e, exception) {
+        if (lock->error == nullptr) lock->error = kj::mv(*e);
+      }
+      block->done = true;
+    }
+
+    uint64_t one = 1;
+    KJ_SYSCALL(write(doneEvent, &one, sizeof(one)));
+  }
+}
+
+void ZipWriter::compressBlock(Block& block) {
+  block.crc = crc32(crc32(0, nullptr, 0), block.input.begin(), block.inputSize);
+  if (!block.compress) return;
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  KJ_ASSERT(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                         Z_DEFAULT_STRATEGY) == Z_OK);
+  KJ_DEFER(deflateEnd(&stream));
+
+  if (block.dictionary.size() > 0) {
+    KJ_ASSERT(deflateSetDictionary(&stream, block.dictionary.begin(),
+                                   block.dictionary.size()) == Z_OK);
+  }
+
+  // Every block but the last ends with a sync flush, which leaves the output at a byte boundary
+  // without ending the deflate stream, so that the blocks can be concatenated.
+  int flush = block.last ? Z_FINISH : Z_SYNC_FLUSH;
+  block.output.resize(deflateBound(&stream, block.inputSize) + 16);
+  stream.next_in = block.input.begin();
+  stream.avail_in = block.inputSize;
+  for (;;) {
+    stream.next_out = block.output.begin() + stream.total_out;
+    stream.avail_out = block.output.size() - stream.total_out;
+    int result = deflate(&stream, flush);
+    KJ_ASSERT(result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR,
+              "deflate() failed", result);
+    if (block.last ? result == Z_STREAM_END : stream.avail_out > 0) break;
+    block.output.resize(block.output.size() * 2);
+  }
+  block.output.resize(stream.total_out);
+}
+
+void ZipWriter::writeRaw(kj::ArrayPtr<const kj::byte> data) {
+  out.write(data.begin(), data.size());
+  offset += data.size();
+}
+
+// =======================================================================================
+
+ZipReader::ZipReader(kj::AutoCloseFd fdParam): fd(kj::mv(fdParam)) {
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+  fileSize = stats.st_size;
+
+  // The end of central directory record is followed only by a comment of at most 64k.
+  KJ_REQUIRE(fileSize >= END_SIZE, "not a zip file");
+  size_t tailSize = kj::min(fileSize, uint64_t(END_SIZE + 0xffff));
+  uint64_t tailOffset = fileSize - tailSize;
+  auto tail = kj::heapArray<kj::byte>(tailSize);
+  readAt(tail.begin(), tailSize, tailOffset);
+
+  size_t endPos = tailSize - END_SIZE;
+  while (get32(tail.begin() + endPos) != END_SIGNATURE) {
+    KJ_REQUIRE(endPos > 0, "not a zip file");
+    --endPos;
+  }
+  const kj::byte* end = tail.begin() + endPos;
+  uint64_t count = get16(end + 10);
+  uint64_t directorySize = get32(end + 12);
+  uint64_t directoryOffset = get32(end + 16);
+
+  if (count == 0xffff || directorySize == 0xffffffff || directoryOffset == 0xffffffff) {
+    // Probably Zip64, in which case there's a locator right before the end record, pointing at
+    // the Zip64 end record.
+    uint64_t endOffset = tailOffset + endPos;
+    kj::byte locator[ZIP64_LOCATOR_SIZE];
+    if (endOffset >= ZIP64_LOCATOR_SIZE) {
+      readAt(locator, ZIP64_LOCATOR_SIZE, endOffset - ZIP64_LOCATOR_SIZE);
+      if (get32(locator) == ZIP64_LOCATOR_SIGNATURE) {
+        uint64_t zip64EndOffset = get64(locator + 8);
+        KJ_REQUIRE(zip64EndOffset <= fileSize - ZIP64_END_SIZE, "invalid zip file");
+        kj::byte zip64End[ZIP64_END_SIZE];
+        readAt(zip64End, ZIP64_END_SIZE, zip64EndOffset);
+        KJ_REQUIRE(get32(zip64End) == ZIP64_END_SIGNATURE, "invalid zip file");
+        count = get64(zip64End + 32);
+        directorySize = get64(zip64End + 40);
+        directoryOffset = get64(zip64End + 48);
+      }
+    }
+  }
+
+  KJ_REQUIRE(directoryOffset <= fileSize && directorySize <= fileSize - directoryOffset,
+             "invalid zip file");
+  KJ_REQUIRE(count <= directorySize / CENTRAL_HEADER_SIZE, "invalid zip file");
+  auto directory = kj::heapArray<kj::byte>(directorySize);
+  readAt(directory.begin(), directorySize, directoryOffset);
+
+  auto builder = kj::heapArrayBuilder<Entry>(count);
+  size_t pos = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    KJ_REQUIRE(directorySize - pos >= CENTRAL_HEADER_SIZE, "invalid zip file");
+    const kj::byte* header = directory.begin() + pos;
+    KJ_REQUIRE(get32(header) == CENTRAL_HEADER_SIGNATURE, "invalid zip file");
+    size_t nameSize = get16(header + 28);
+    size_t extraSize = get16(header + 30);
+    size_t commentSize = get16(header + 32);
+    size_t headerSize = CENTRAL_HEADER_SIZE + nameSize + extraSize + commentSize;
+    KJ_REQUIRE(directorySize - pos >= headerSize, "invalid zip file");
+
+    Entry entry;
+    entry.versionMadeBy = get16(header + 4);
+    entry.method = get16(header + 10);
+    entry.modificationTime = fromDosTime(get16(header + 12), get16(header + 14));
+    entry.crc = get32(header + 16);
+    entry.compressedSize = get32(header + 20);
+    entry.uncompressedSize = get32(header + 24);
+    entry.externalAttributes = get32(header + 38);
+    entry.headerOffset = get32(header + 42);
+    entry.name = kj::heapString(
+        reinterpret_cast<const char*>(header + CENTRAL_HEADER_SIZE), nameSize);
+
+    const kj::byte* extra = header + CENTRAL_HEADER_SIZE + nameSize;
+    const kj::byte* extraEnd = extra + extraSize;
+    while (extraEnd - extra >= 4) {
+      uint16_t id = get16(extra);
+      uint16_t size = get16(extra + 2);
+      const kj::byte* field = extra + 4;
+      const kj::byte* fieldEnd = field + size;
+      if (fieldEnd > extraEnd) break;
+
+      if (id == ZIP64_EXTRA_ID) {
+        // Holds the real values of whichever fields didn't fit, in this order.
+        for (uint64_t* value: { &entry.uncompressedSize, &entry.compressedSize,
+                                &entry.headerOffset }) {
+          if (*value == 0xffffffff) {
+            KJ_REQUIRE(fieldEnd - field >= 8, "invalid zip file");
+            *value = get64(field);
+            field += 8;
+          }
+        }
+      } else if (id == TIMESTAMP_EXTRA_ID && size >= 5 && (field[0] & 1)) {
+        entry.modificationTime = int32_t(get32(field + 1));
+      }
+
+      extra = fieldEnd;
+    }
+
+    builder.add(kj::mv(entry));
+    pos += headerSize;
+  }
+  entries = builder.finish();
+}
+
+kj::Maybe<mode_t> ZipReader::Entry::getUnixMode() const {
+  if ((versionMadeBy >> 8) == 3 && (externalAttributes >> 16) != 0) {
+    return mode_t(externalAttributes >> 16);
+  } else {
+    return nullptr;
+  }
+}
+
+void ZipReader::read(const Entry& entry, kj::OutputStream& out) const {
+  KJ_REQUIRE(entry.headerOffset <= fileSize &&
+             fileSize - entry.headerOffset >= LOCAL_HEADER_SIZE, "invalid zip file", entry.name);
+  kj::byte header[LOCAL_HEADER_SIZE];
+  readAt(header, LOCAL_HEADER_SIZE, entry.headerOffset);
+  KJ_REQUIRE(get32(header) == LOCAL_HEADER_SIGNATURE, "invalid zip file", entry.name);
+
+  // The local header's name and extra fields may differ in length from the central directory's.
+  uint64_t position = entry.headerOffset + LOCAL_HEADER_SIZE +
+      get16(header + 26) + get16(header + 28);
+  KJ_REQUIRE(position <= fileSize && entry.compressedSize <= fileSize - position,
+             "invalid zip file", entry.name);
+  uint64_t remaining = entry.compressedSize;
+
+  auto input = kj::heapArray<kj::byte>(kj::min(remaining, uint64_t(READ_SIZE)));
+  auto readMore = [&]() {
+    size_t n = kj::min(remaining, uint64_t(input.size()));
+    readAt(input.begin(), n, position);
+    position += n;
+    remaining -= n;
+    return input.slice(0, n);
+  };
+
+  uLong crc = crc32(0, nullptr, 0);
+  uint64_t total = 0;
+  auto emit = [&](kj::ArrayPtr<const kj::byte> data) {
+    total += data.size();
+    KJ_REQUIRE(total <= entry.uncompressedSize, "zip entry is bigger than it claims", entry.name);
+    crc = crc32(crc, data.begin(), data.size());
+    out.write(data.begin(), data.size());
+  };
+
+  if (entry.method == METHOD_STORED) {
+    while (remaining > 0) {
+      emit(readMore());
+    }
+  } else if (entry.method == METHOD_DEFLATED) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    KJ_ASSERT(inflateInit2(&stream, -MAX_WBITS) == Z_OK);
+    KJ_DEFER(inflateEnd(&stream));
+
+    auto output = kj::heapArray<kj::byte>(INFLATE_BUFFER_SIZE);
+    for (;;) {
+      if (stream.avail_in == 0) {
+        KJ_REQUIRE(remaining > 0, "zip entry is truncated", entry.name);
+        auto data = readMore();
+        stream.next_in = data.begin();
+        stream.avail_in = data.size();
+      }
+      stream.next_out = output.begin();
+      stream.avail_out = output.size();
+      int result = inflate(&stream, Z_NO_FLUSH);
+      KJ_REQUIRE(result == Z_OK || result == Z_STREAM_END, "zip entry is corrupt", entry.name);
+      emit(output.slice(0, output.size() - stream.avail_out));
+      if (result == Z_STREAM_END) break;
+    }
+  } else {
+    KJ_FAIL_REQUIRE("unsupported zip compression method", entry.method, entry.name);
+  }
+
+  KJ_REQUIRE(total == entry.uncompressedSize && crc == entry.crc,
+             "zip entry failed checksum", entry.name);
+}
+
+void ZipReader::readAt(void* buffer, size_t size, uint64_t position) const {
+  kj::byte* pos = reinterpret_cast<kj::byte*>(buffer);
+  while (size > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = pread(fd, pos, size, position));
+    KJ_REQUIRE(n > 0, "zip file is truncated");
+    pos += n;
+    size -= n;
+    position += n;
+  }
+}
+
+}  // namespace sandstorm
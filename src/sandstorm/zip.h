@@ -0,0 +1,147 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_ZIP_H_
+#define SANDSTORM_ZIP_H_
+
+#include <kj/io.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
+#include <kj/vector.h>
+#include <deque>
+#include <sys/stat.h>
+
+namespace sandstorm {
+
+class ZipWriter {
+  // Writes a zip archive to a stream in a single pass, in the same format as Info-ZIP's `zip -y`
+  // (which grain backups used to shell out to). File contents are read in large blocks and
+  // deflated on a pool of threads. Like pigz, we deflate each block of a large file separately
+  // (flushing to a byte boundary in between), so that even a grain consisting of one big database
+  // file keeps every thread busy.
+  //
+  // Not thread-safe: all calls must come from the same thread.
+
+public:
+  explicit ZipWriter(kj::OutputStream& out, uint threadCount = 1);
+  ~ZipWriter() noexcept(false);
+  KJ_DISALLOW_COPY(ZipWriter);
+
+  void addDirectory(kj::StringPtr name, const struct stat& stats);
+  void addSymlink(kj::StringPtr name, kj::StringPtr target, const struct stat& stats);
+  void addFile(kj::StringPtr name, int fd, const struct stat& stats);
+  // Adds an entry. `name` is its path within the archive, without a trailing slash. `stats`
+  // supplies the permissions and modification time. addFile() reads `fd` until EOF.
+
+  void finish();
+  // Writes the central directory. Call once everything has been added.
+
+private:
+  struct Entry {
+    kj::String name;
+    mode_t mode;
+    int64_t modificationTime;
+    bool zip64;              // sizes in the local header are in a Zip64 extra field
+    bool hasDescriptor = false;
+    uint16_t method = 0;
+    uint32_t crc = 0;
+    uint64_t compressedSize = 0;
+    uint64_t uncompressedSize = 0;
+    uint64_t headerOffset = 0;
+  };
+
+  struct Block {
+    uint entryIndex;
+    bool first;
+    bool last;
+    bool compress;
+    kj::Array<kj::byte> input;
+    size_t inputSize = 0;
+    kj::Array<kj::byte> dictionary;  // end of the previous block of the same file
+
+    // Filled in by compressBlock().
+    uint32_t crc = 0;
+    kj::Vector<kj::byte> output;
+    bool done = false;  // protected by `queue`'s lock
+  };
+
+  struct Queue {
+    std::deque<Block*> pending;  // blocks waiting for a worker
+    bool shuttingDown = false;
+    kj::Maybe<kj::Exception> error;
+  };
+
+  kj::OutputStream& out;
+  uint64_t offset = 0;  // bytes written so far
+  kj::Vector<Entry> entries;
+
+  std::deque<kj::Own<Block>> unwritten;
+  // Blocks which have been queued but not written yet, in archive order.
+
+  kj::MutexGuarded<Queue> queue;
+  kj::AutoCloseFd jobEvent;   // eventfd semaphore; incremented once per queued block
+  kj::AutoCloseFd doneEvent;  // eventfd semaphore; incremented once per compressed block
+  kj::Vector<kj::Own<kj::Thread>> workers;
+
+  uint addEntry(kj::StringPtr name, const struct stat& stats, bool zip64);
+  void addBlock(kj::Own<Block> block);
+  void writeReadyBlocks(size_t maxUnwritten);
+  void writeBlock(Block& block);
+  void workerLoop();
+  static void compressBlock(Block& block);
+  void writeRaw(kj::ArrayPtr<const kj::byte> data);
+};
+
+class ZipReader {
+  // Reads a zip archive from a file, using its central directory. Understands the subset of the
+  // format produced by ZipWriter and by Info-ZIP's `zip`, including Zip64.
+
+public:
+  explicit ZipReader(kj::AutoCloseFd fd);
+  KJ_DISALLOW_COPY(ZipReader);
+
+  struct Entry {
+    kj::String name;
+    uint16_t versionMadeBy;
+    uint16_t method;
+    uint32_t crc;
+    uint64_t compressedSize;
+    uint64_t uncompressedSize;
+    uint64_t headerOffset;
+    uint32_t externalAttributes;
+    int64_t modificationTime;  // seconds since the epoch
+
+    kj::Maybe<mode_t> getUnixMode() const;
+    // File type and permission bits, if the archive was created on Unix.
+  };
+
+  kj::ArrayPtr<const Entry> getEntries() const { return entries; }
+
+  void read(const Entry& entry, kj::OutputStream& out) const;
+  // Decompresses the entry's content to `out`, throwing if it doesn't match its checksum. May be
+  // called from several threads at once.
+
+private:
+  kj::AutoCloseFd fd;
+  uint64_t fileSize;
+  kj::Array<Entry> entries;
+
+  void readAt(void* buffer, size_t size, uint64_t position) const;
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_ZIP_H_